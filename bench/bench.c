@@ -0,0 +1,595 @@
+#define _GNU_SOURCE // memfd_create
+
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#include "buffer.h"
+#include "corpus.h"
+#include "grim.h"
+#include "pack.h"
+#include "render.h"
+#include "resample.h"
+#include "thread.h"
+#include "util.h"
+#include "write_ppm.h"
+#if HAVE_JPEG
+#include "write_jpg.h"
+#endif
+#include "write_png.h"
+#include "write_qoi.h"
+#include "write_raw.h"
+
+static const char usage[] =
+	"Usage: grim-bench [options...] [encode|pack|render...]\n"
+	"\n"
+	"Run the benchmarks, all of them by default, and print the results as\n"
+	"JSON.\n"
+	"\n"
+	"  -h              Show help message and quit.\n"
+	"  -s <sizes>      Image sizes among 1080p, 4k and 8k. Defaults to all.\n"
+	"  -c <kinds>      Corpus images among ui, text, gradient, photo,\n"
+	"                  translucent and mixed. Defaults to all.\n"
+	"  -f <formats>    Formats among png, jpeg, ppm, qoi and raw. Defaults\n"
+	"                  to all.\n"
+	"  -t <threads>    Thread counts. Defaults to 1 and the number of CPUs.\n"
+	"  -n <n>          Iterations per measurement. Defaults to 3.\n"
+	"  -o <path>       Write the results to a file instead of stdout.\n"
+	"\n"
+	"Lists are comma-separated.\n";
+
+struct image_size {
+	const char *name;
+	int width, height;
+};
+
+static const struct image_size image_sizes[] = {
+	{ "1080p", 1920, 1080 },
+	{ "4k", 3840, 2160 },
+	{ "8k", 7680, 4320 },
+};
+
+struct encoder {
+	enum grim_filetype filetype;
+	const char *format;
+	// Compression level or quality, if the format has one
+	int level;
+	bool has_level;
+};
+
+static const struct encoder encoders[] = {
+	{ GRIM_FILETYPE_PNG, "png", GRIM_PNG_LEVEL_FAST, true },
+	{ GRIM_FILETYPE_PNG, "png", 0, true },
+	{ GRIM_FILETYPE_PNG, "png", 1, true },
+	{ GRIM_FILETYPE_PNG, "png", 2, true },
+	{ GRIM_FILETYPE_PNG, "png", 3, true },
+	{ GRIM_FILETYPE_PNG, "png", 4, true },
+	{ GRIM_FILETYPE_PNG, "png", 5, true },
+	{ GRIM_FILETYPE_PNG, "png", 6, true },
+	{ GRIM_FILETYPE_PNG, "png", 7, true },
+	{ GRIM_FILETYPE_PNG, "png", 8, true },
+	{ GRIM_FILETYPE_PNG, "png", 9, true },
+#if HAVE_JPEG
+	{ GRIM_FILETYPE_JPEG, "jpeg", 50, true },
+	{ GRIM_FILETYPE_JPEG, "jpeg", 80, true },
+	{ GRIM_FILETYPE_JPEG, "jpeg", 95, true },
+#endif
+	{ GRIM_FILETYPE_PPM, "ppm", 0, false },
+	{ GRIM_FILETYPE_QOI, "qoi", 0, false },
+	{ GRIM_FILETYPE_RAW, "raw", 0, false },
+};
+
+#define MAX_THREAD_COUNTS 16
+
+struct bench {
+	const char *sizes, *kinds, *formats;
+	int thread_counts[MAX_THREAD_COUNTS];
+	int n_thread_counts;
+	int iterations;
+
+	FILE *out;
+	bool has_results;
+};
+
+struct measure {
+	double ms_per_frame, min_ms;
+	// -1 when unknown
+	long peak_rss_kib, extra_rss_kib;
+};
+
+static long read_status_kib(const char *field) {
+	FILE *f = fopen("/proc/self/status", "r");
+	if (f == NULL) {
+		return -1;
+	}
+	long value = -1;
+	size_t len = strlen(field);
+	char line[256];
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (strncmp(line, field, len) == 0 && line[len] == ':') {
+			value = strtol(line + len + 1, NULL, 10);
+			break;
+		}
+	}
+	fclose(f);
+	return value;
+}
+
+/**
+ * Reset the peak RSS to the current one, see proc(5). Returns the current
+ * RSS, or -1 if the peak can't be reset.
+ */
+static long reset_peak_rss(void) {
+#ifdef __GLIBC__
+	// Give back what the previous measurement left in the heap
+	malloc_trim(0);
+#endif
+	FILE *f = fopen("/proc/self/clear_refs", "w");
+	if (f == NULL) {
+		return -1;
+	}
+	bool ok = fputs("5", f) >= 0;
+	ok = fclose(f) == 0 && ok;
+	return ok ? read_status_kib("VmRSS") : -1;
+}
+
+static void finish_measure(struct measure *m, double *times, int n,
+		long rss_before) {
+	m->ms_per_frame = sort_median(times, n);
+	m->min_ms = times[0];
+
+	m->peak_rss_kib = rss_before >= 0 ? read_status_kib("VmHWM") : -1;
+	if (m->peak_rss_kib < 0) {
+		// Peak of the whole process
+		struct rusage usage;
+		getrusage(RUSAGE_SELF, &usage);
+		m->peak_rss_kib = usage.ru_maxrss;
+	}
+	m->extra_rss_kib = rss_before >= 0 ?
+		m->peak_rss_kib - rss_before : -1;
+}
+
+static void print_long(FILE *out, const char *key, long value) {
+	if (value < 0) {
+		fprintf(out, ", \"%s\": null", key);
+	} else {
+		fprintf(out, ", \"%s\": %ld", key, value);
+	}
+}
+
+static void begin_result(struct bench *bench, const char *name) {
+	fprintf(bench->out, "%s\n\t\t{\"bench\": \"%s\"",
+		bench->has_results ? "," : "", name);
+	bench->has_results = true;
+}
+
+static void end_result(struct bench *bench, const struct measure *m,
+		double bytes) {
+	fprintf(bench->out, ", \"iterations\": %d, \"ms_per_frame\": %.3f, "
+		"\"min_ms\": %.3f, \"mb_per_s\": %.1f", bench->iterations,
+		m->ms_per_frame, m->min_ms, bytes / 1e3 / m->ms_per_frame);
+	print_long(bench->out, "peak_rss_kib", m->peak_rss_kib);
+	print_long(bench->out, "extra_rss_kib", m->extra_rss_kib);
+	fprintf(bench->out, "}");
+	fflush(bench->out);
+}
+
+/**
+ * Open a file to encode to, which doesn't count towards the RSS.
+ */
+static FILE *open_sink(void) {
+#if HAVE_MEMFD
+	int fd = memfd_create("grim-bench", MFD_CLOEXEC);
+	if (fd >= 0) {
+		FILE *f = fdopen(fd, "w+");
+		if (f != NULL) {
+			return f;
+		}
+		close(fd);
+	}
+#endif
+	return tmpfile();
+}
+
+static bool rewind_sink(FILE *sink) {
+	if (fflush(sink) != 0 || ftruncate(fileno(sink), 0) != 0) {
+		return false;
+	}
+	rewind(sink);
+	return true;
+}
+
+static int encode(const struct encoder *encoder, pixman_image_t *image,
+		FILE *sink, struct grim_thread_pool *pool) {
+	switch (encoder->filetype) {
+	case GRIM_FILETYPE_PNG:
+		return write_to_png_stream(image, sink, encoder->level, pool, NULL);
+	case GRIM_FILETYPE_PPM:
+		return write_to_ppm_stream(image, sink, NULL);
+	case GRIM_FILETYPE_JPEG:
+#if HAVE_JPEG
+		return write_to_jpeg_stream(image, sink, encoder->level,
+			GRIM_JPEG_DCT_ISLOW, GRIM_JPEG_SUBSAMPLING_420, pool, NULL);
+#else
+		abort();
+#endif
+	case GRIM_FILETYPE_QOI:
+		return write_to_qoi_stream(image, sink, pool, NULL);
+	case GRIM_FILETYPE_RAW:
+		return write_to_raw_stream(image, sink, NULL, false, NULL);
+	}
+	abort();
+}
+
+static bool bench_encoder(struct bench *bench, const struct encoder *encoder,
+		pixman_image_t *image, const char *size, const char *kind,
+		struct grim_thread_pool *pool, FILE *sink) {
+	double times[bench->iterations];
+	long rss_before = reset_peak_rss();
+	for (int i = 0; i < bench->iterations; i++) {
+		if (!rewind_sink(sink)) {
+			perror("failed to rewind output");
+			return false;
+		}
+		double start = get_time_ms();
+		if (encode(encoder, image, sink, pool) != 0 || fflush(sink) != 0) {
+			fprintf(stderr, "failed to encode %s image\n", encoder->format);
+			return false;
+		}
+		times[i] = get_time_ms() - start;
+	}
+	struct measure m;
+	finish_measure(&m, times, bench->iterations, rss_before);
+
+	struct stat st;
+	if (fstat(fileno(sink), &st) != 0) {
+		perror("fstat");
+		return false;
+	}
+
+	int width = pixman_image_get_width(image);
+	int height = pixman_image_get_height(image);
+	begin_result(bench, "encode");
+	fprintf(bench->out, ", \"size\": \"%s\", \"width\": %d, \"height\": %d, "
+		"\"corpus\": \"%s\", \"format\": \"%s\"", size, width, height, kind,
+		encoder->format);
+	if (encoder->filetype == GRIM_FILETYPE_PNG &&
+			encoder->level == GRIM_PNG_LEVEL_FAST) {
+		fprintf(bench->out, ", \"level\": \"fast\"");
+	} else if (encoder->has_level) {
+		fprintf(bench->out, ", \"level\": %d", encoder->level);
+	} else {
+		fprintf(bench->out, ", \"level\": null");
+	}
+	fprintf(bench->out, ", \"threads\": %d, \"output_bytes\": %lld",
+		get_thread_pool_size(pool), (long long)st.st_size);
+	end_result(bench, &m, (double)width * height * 4);
+	return true;
+}
+
+static bool run_encode(struct bench *bench, const struct image_size *size,
+		enum corpus_kind kind, pixman_image_t *image) {
+	FILE *sink = open_sink();
+	if (sink == NULL) {
+		perror("failed to open output");
+		return false;
+	}
+	bool ok = true;
+	for (int t = 0; ok && t < bench->n_thread_counts; t++) {
+		struct grim_thread_pool *pool =
+			create_thread_pool(bench->thread_counts[t]);
+		if (pool == NULL) {
+			ok = false;
+			break;
+		}
+		for (size_t i = 0; ok && i < sizeof(encoders) / sizeof(encoders[0]);
+				i++) {
+			const struct encoder *encoder = &encoders[i];
+			if (!is_in_list(bench->formats, encoder->format)) {
+				continue;
+			}
+			// Only some writers use the pool
+			if (t > 0 && (encoder->filetype == GRIM_FILETYPE_PPM ||
+					encoder->filetype == GRIM_FILETYPE_RAW)) {
+				continue;
+			}
+			ok = bench_encoder(bench, encoder, image, size->name,
+				get_corpus_kind_name(kind), pool, sink);
+		}
+		destroy_thread_pool(pool);
+	}
+	fclose(sink);
+	return ok;
+}
+
+static void run_pack(struct bench *bench, const struct image_size *size,
+		enum corpus_kind kind, pixman_image_t *image) {
+	int width = pixman_image_get_width(image);
+	int height = pixman_image_get_height(image);
+	int stride = pixman_image_get_stride(image);
+	const unsigned char *data =
+		(const unsigned char *)pixman_image_get_data(image);
+	uint8_t *row_out = malloc((size_t)width * 4);
+	if (row_out == NULL) {
+		return;
+	}
+
+	for (int mode = 0; mode < 2; mode++) {
+		bool fully_opaque = mode == 0;
+		double times[bench->iterations];
+		long rss_before = reset_peak_rss();
+		for (int i = 0; i < bench->iterations; i++) {
+			double start = get_time_ms();
+			for (int y = 0; y < height; y++) {
+				pack_row32(row_out,
+					(const uint32_t *)(data + (size_t)y * stride), width,
+					fully_opaque);
+			}
+			times[i] = get_time_ms() - start;
+		}
+		struct measure m;
+		finish_measure(&m, times, bench->iterations, rss_before);
+
+		begin_result(bench, "pack");
+		fprintf(bench->out, ", \"size\": \"%s\", \"width\": %d, "
+			"\"height\": %d, \"corpus\": \"%s\", \"mode\": \"%s\", "
+			"\"ns_per_row\": %.1f", size->name, width, height,
+			get_corpus_kind_name(kind), fully_opaque ? "rgb" : "rgba",
+			m.ms_per_frame * 1e6 / height);
+		end_result(bench, &m, (double)width * height * 4);
+	}
+	free(row_out);
+}
+
+/**
+ * Render two outputs side by side, each with one half of the image, as
+ * grim would after capturing them.
+ */
+static bool run_render(struct bench *bench, const struct image_size *size,
+		enum corpus_kind kind, pixman_image_t *image) {
+	int width = pixman_image_get_width(image);
+	int height = pixman_image_get_height(image);
+	int stride = pixman_image_get_stride(image);
+	unsigned char *data = (unsigned char *)pixman_image_get_data(image);
+	enum wl_shm_format format =
+		pixman_image_get_format(image) == PIXMAN_a8r8g8b8 ?
+		WL_SHM_FORMAT_ARGB8888 : WL_SHM_FORMAT_XRGB8888;
+
+	struct grim_state state = {0};
+	wl_list_init(&state.outputs);
+	// Make render() composite even when it could wrap a buffer
+	state.copy_image = true;
+	state.resample_cache = create_resample_cache();
+	if (state.resample_cache == NULL) {
+		return false;
+	}
+
+	struct grim_buffer buffers[2];
+	struct grim_output outputs[2];
+	for (int i = 0; i < 2; i++) {
+		int x = i * (width / 2);
+		int output_width = i == 0 ? width / 2 : width - width / 2;
+		buffers[i] = (struct grim_buffer){
+			.data = data + (size_t)x * 4,
+			.width = output_width,
+			.height = height,
+			.stride = stride,
+			.format = format,
+		};
+		struct grim_box box = { x, 0, output_width, height };
+		outputs[i] = (struct grim_output){
+			.state = &state,
+			.geometry = box,
+			.transform = WL_OUTPUT_TRANSFORM_NORMAL,
+			.scale = 1,
+			.logical_geometry = box,
+			.logical_scale = 1,
+			.capture_geometry = box,
+			.buffer = &buffers[i],
+		};
+		pixman_region32_init(&outputs[i].damage);
+		wl_list_insert(state.outputs.prev, &outputs[i].link);
+	}
+
+	// Copying, and downscaling with each filter of the resampler, at an
+	// integer ratio and at another one
+	const struct {
+		double scale;
+		enum grim_resample_filter filter;
+	} modes[] = {
+		{ 1, GRIM_RESAMPLE_LANCZOS },
+		{ 0.5, GRIM_RESAMPLE_NEAREST },
+		{ 0.5, GRIM_RESAMPLE_BOX },
+		{ 0.5, GRIM_RESAMPLE_BILINEAR },
+		{ 0.5, GRIM_RESAMPLE_LANCZOS },
+		{ 0.4, GRIM_RESAMPLE_BOX },
+		{ 0.4, GRIM_RESAMPLE_LANCZOS },
+	};
+	struct grim_box geometry = { 0, 0, width, height };
+	bool ok = true;
+	for (int t = 0; ok && t < bench->n_thread_counts; t++) {
+		state.thread_pool = create_thread_pool(bench->thread_counts[t]);
+		if (state.thread_pool == NULL) {
+			ok = false;
+			break;
+		}
+		for (size_t s = 0; ok && s < sizeof(modes) / sizeof(modes[0]); s++) {
+			double scale = modes[s].scale;
+			state.resample_filter = modes[s].filter;
+			double times[bench->iterations];
+			long rss_before = reset_peak_rss();
+			for (int i = 0; i < bench->iterations; i++) {
+				double start = get_time_ms();
+				pixman_image_t *result = render(&state, &geometry, scale);
+				times[i] = get_time_ms() - start;
+				if (result == NULL) {
+					fprintf(stderr, "failed to render\n");
+					ok = false;
+					break;
+				}
+				pixman_image_unref(result);
+			}
+			if (!ok) {
+				break;
+			}
+			struct measure m;
+			finish_measure(&m, times, bench->iterations, rss_before);
+
+			begin_result(bench, "render");
+			fprintf(bench->out, ", \"size\": \"%s\", \"width\": %d, "
+				"\"height\": %d, \"corpus\": \"%s\", \"outputs\": 2, "
+				"\"scale\": %g, \"filter\": \"%s\", \"threads\": %d",
+				size->name, width, height, get_corpus_kind_name(kind), scale,
+				get_resample_filter_name(modes[s].filter),
+				get_thread_pool_size(state.thread_pool));
+			end_result(bench, &m, (double)width * height * 4);
+		}
+		destroy_thread_pool(state.thread_pool);
+	}
+
+	for (int i = 0; i < 2; i++) {
+		pixman_region32_fini(&outputs[i].damage);
+	}
+	destroy_resample_cache(state.resample_cache);
+	return ok;
+}
+
+static bool parse_thread_counts(struct bench *bench, char *list) {
+	bench->n_thread_counts = 0;
+	for (char *item = strtok(list, ","); item != NULL;
+			item = strtok(NULL, ",")) {
+		char *end;
+		long n = strtol(item, &end, 10);
+		if (*end != '\0' || n < 1 || n > 1024 ||
+				bench->n_thread_counts == MAX_THREAD_COUNTS) {
+			fprintf(stderr, "invalid thread count: %s\n", item);
+			return false;
+		}
+		bench->thread_counts[bench->n_thread_counts++] = n;
+	}
+	return bench->n_thread_counts > 0;
+}
+
+int main(int argc, char *argv[]) {
+	struct bench bench = {
+		.iterations = 3,
+		.out = stdout,
+	};
+	bench.thread_counts[bench.n_thread_counts++] = 1;
+	if (get_default_thread_count() > 1) {
+		bench.thread_counts[bench.n_thread_counts++] =
+			get_default_thread_count();
+	}
+
+	const char *output_path = NULL;
+	int opt;
+	while ((opt = getopt(argc, argv, "hs:c:f:t:n:o:")) != -1) {
+		switch (opt) {
+		case 'h':
+			printf("%s", usage);
+			return EXIT_SUCCESS;
+		case 's':
+			bench.sizes = optarg;
+			break;
+		case 'c':
+			bench.kinds = optarg;
+			break;
+		case 'f':
+			bench.formats = optarg;
+			break;
+		case 't':
+			if (!parse_thread_counts(&bench, optarg)) {
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'n':
+			bench.iterations = atoi(optarg);
+			if (bench.iterations < 1) {
+				fprintf(stderr, "invalid iteration count\n");
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'o':
+			output_path = optarg;
+			break;
+		default:
+			fprintf(stderr, "%s", usage);
+			return EXIT_FAILURE;
+		}
+	}
+
+	bool run[3] = { true, true, true };
+	if (optind < argc) {
+		memset(run, 0, sizeof(run));
+		for (int i = optind; i < argc; i++) {
+			if (strcmp(argv[i], "encode") == 0) {
+				run[0] = true;
+			} else if (strcmp(argv[i], "pack") == 0) {
+				run[1] = true;
+			} else if (strcmp(argv[i], "render") == 0) {
+				run[2] = true;
+			} else {
+				fprintf(stderr, "unknown benchmark: %s\n", argv[i]);
+				return EXIT_FAILURE;
+			}
+		}
+	}
+
+	if (output_path != NULL) {
+		bench.out = fopen(output_path, "w");
+		if (bench.out == NULL) {
+			perror("failed to open output file");
+			return EXIT_FAILURE;
+		}
+	}
+
+	fprintf(bench.out, "{\n\t\"cpus\": %d,\n\t\"results\": [",
+		get_default_thread_count());
+	bool ok = true;
+	for (size_t s = 0; ok && s < sizeof(image_sizes) / sizeof(image_sizes[0]);
+			s++) {
+		const struct image_size *size = &image_sizes[s];
+		if (!is_in_list(bench.sizes, size->name)) {
+			continue;
+		}
+		for (int k = 0; ok && k < CORPUS_KIND_COUNT; k++) {
+			if (!is_in_list(bench.kinds, get_corpus_kind_name(k))) {
+				continue;
+			}
+			pixman_image_t *image =
+				generate_corpus_image(k, size->width, size->height);
+			if (image == NULL) {
+				fprintf(stderr, "failed to generate image\n");
+				ok = false;
+				break;
+			}
+			if (run[0]) {
+				ok = run_encode(&bench, size, k, image);
+			}
+			if (ok && run[1]) {
+				run_pack(&bench, size, k, image);
+			}
+			if (ok && run[2]) {
+				ok = run_render(&bench, size, k, image);
+			}
+			pixman_image_unref(image);
+		}
+	}
+	fprintf(bench.out, "\n\t]\n}\n");
+
+	if (output_path != NULL && fclose(bench.out) != 0) {
+		perror("failed to write output file");
+		ok = false;
+	}
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,699 @@
+#define _GNU_SOURCE // wait4
+
+#include <errno.h>
+#include <math.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <wayland-server-core.h>
+
+#include "decode.h"
+#include "mock-compositor.h"
+#include "util.h"
+
+static const char usage[] =
+	"Usage: grim-capture-bench [options...] <grim>\n"
+	"\n"
+	"Run grim against a mock compositor for each layout, check the captures\n"
+	"against the expected images and print the timings as JSON.\n"
+	"\n"
+	"  -h              Show help message and quit.\n"
+	"  -l <layouts>    Layouts among single, dual, triple, hidpi, fractional,\n"
+	"                  mixed-scale, transformed, 8k, region, region-output,\n"
+	"                  window and interval. Defaults to all.\n"
+	"  -L <layout>     Add a layout, see mock-compositor.h for the syntax.\n"
+	"  -f <formats>    Formats passed to grim -t. Defaults to png. Only png,\n"
+	"                  ppm and raw captures are checked.\n"
+	"  -m <modes>      Modes passed to grim --shm, or dmabuf for --dmabuf.\n"
+	"                  Defaults to default.\n"
+	"  -d <ms>         Delay before the compositor reads frames back.\n"
+	"  -n <n>          Captures per measurement. Defaults to 5.\n"
+	"  -o <path>       Write the results to a file instead of stdout.\n"
+	"\n"
+	"Lists are comma-separated. Exits with an error if a capture fails or\n"
+	"doesn't match.\n";
+
+struct layout_preset {
+	const char *name;
+	const char *spec;
+	// Region passed to grim -g, if not empty
+	int32_t x, y, width, height;
+	// Output passed to grim -o, if not NULL
+	const char *output;
+	// Screenshots taken with grim --interval, if not 0
+	int interval_count;
+};
+
+static const struct layout_preset presets[] = {
+	{ .name = "single", .spec = "1920x1080+0+0" },
+	{ .name = "dual", .spec = "1920x1080+0+0;1920x1080+1920+0" },
+	{
+		.name = "triple",
+		.spec = "1920x1080+0+240;2560x1440+1920+0;"
+			"1920x1080+4480+0:transform=90",
+	},
+	{ .name = "hidpi", .spec = "3840x2160+0+0:scale=2" },
+	{ .name = "fractional", .spec = "2880x1800+0+0:scale=1.5" },
+	{
+		.name = "mixed-scale",
+		.spec = "2560x1440+0+0;3840x2160+2560+0:scale=2",
+	},
+	{
+		.name = "transformed",
+		.spec = "1920x1080+0+0:transform=270:y-invert;"
+			"1920x1080+1080+0:transform=flipped-180;"
+			"1920x1080+3000+0:transform=flipped-90:y-invert",
+	},
+	{ .name = "8k", .spec = "7680x4320+0+0" },
+	{
+		.name = "region",
+		.spec = "1920x1080+0+0;1920x1080+1920+0",
+		.x = 1700, .y = 300, .width = 500, .height = 400,
+	},
+	{
+		// Only the part of the region on the second output
+		.name = "region-output",
+		.spec = "1920x1080+0+0;1920x1080+1920+0",
+		.x = 1700, .y = 300, .width = 500, .height = 400,
+		.output = "MOCK-2",
+	},
+	{ .name = "window", .spec = "window=1280x720:y-invert" },
+	{
+		// The second output's frames are still pending when the first one
+		// is redrawn
+		.name = "interval",
+		.spec = "1920x1080+0+0;1920x1080+1920+0:hold-damage=150",
+		.interval_count = 4,
+	},
+};
+
+struct capture_bench {
+	const char *formats, *shm_modes;
+	int readback_delay_ms;
+	int iterations;
+	const char *grim_path;
+	char *tmp_dir;
+
+	FILE *out;
+	bool has_results;
+};
+
+struct layout {
+	const char *name;
+	struct mock_layout mock;
+	// Region of the layout covered by the capture
+	int32_t x, y, width, height;
+	// Region passed to grim -g, if use_region
+	int32_t region_x, region_y, region_width, region_height;
+	bool use_region, use_window;
+	const char *output;
+	int interval_count;
+	// Image pixels per logical pixel
+	double scale;
+	// Whether all outputs are captured at their own scale, in which case
+	// the image is expected to match pixel for pixel
+	bool exact;
+};
+
+struct child {
+	pid_t pid;
+	bool exited;
+	int status;
+	struct rusage usage;
+	double exit_time;
+};
+
+struct capture {
+	double total_ms, connect_ms, capture_ms, copy_to_ready_ms;
+	double readback_faults, client_faults;
+	// grim falls back to shm when it can't use /dev/udmabuf
+	int dmabuf_frames;
+	long long output_bytes;
+	int32_t width, height;
+	// -1 if not checked
+	int matches;
+};
+
+static double get_output_logical_scale(
+		const struct mock_output_config *output) {
+	int32_t logical_width, logical_height;
+	get_mock_output_logical_size(output, &logical_width, &logical_height);
+	int32_t width = output->transform & 1 ? output->height : output->width;
+	return (double)width / logical_width;
+}
+
+static bool intersects(const struct layout *layout,
+		const struct mock_output_config *output) {
+	int32_t width, height;
+	get_mock_output_logical_size(output, &width, &height);
+	return output->x < layout->x + layout->width &&
+		layout->x < output->x + width &&
+		output->y < layout->y + layout->height &&
+		layout->y < output->y + height;
+}
+
+/**
+ * Work out what grim should capture, the same way it does.
+ */
+static bool init_layout(struct layout *layout, const char *name,
+		const char *spec, const struct layout_preset *preset) {
+	*layout = (struct layout){
+		.name = name,
+		.output = preset != NULL ? preset->output : NULL,
+		.interval_count = preset != NULL ? preset->interval_count : 0,
+	};
+	if (!parse_mock_layout(spec, &layout->mock)) {
+		return false;
+	}
+	struct mock_layout *mock = &layout->mock;
+
+	if (mock->n_outputs == 0) {
+		layout->use_window = true;
+		layout->width = mock->windows[0].width;
+		layout->height = mock->windows[0].height;
+		layout->scale = 1;
+		layout->exact = true;
+		return true;
+	}
+
+	if (preset != NULL && preset->width > 0) {
+		layout->use_region = true;
+		layout->region_x = preset->x;
+		layout->region_y = preset->y;
+		layout->region_width = preset->width;
+		layout->region_height = preset->height;
+		layout->x = preset->x;
+		layout->y = preset->y;
+		layout->width = preset->width;
+		layout->height = preset->height;
+	} else {
+		int32_t x1 = INT32_MAX, y1 = INT32_MAX;
+		int32_t x2 = INT32_MIN, y2 = INT32_MIN;
+		for (int i = 0; i < mock->n_outputs; i++) {
+			const struct mock_output_config *output = &mock->outputs[i];
+			int32_t width, height;
+			get_mock_output_logical_size(output, &width, &height);
+			x1 = output->x < x1 ? output->x : x1;
+			y1 = output->y < y1 ? output->y : y1;
+			x2 = output->x + width > x2 ? output->x + width : x2;
+			y2 = output->y + height > y2 ? output->y + height : y2;
+		}
+		layout->x = x1;
+		layout->y = y1;
+		layout->width = x2 - x1;
+		layout->height = y2 - y1;
+	}
+
+	if (layout->output != NULL) {
+		const struct mock_output_config *output = NULL;
+		for (int i = 0; i < mock->n_outputs; i++) {
+			if (strcmp(mock->outputs[i].name, layout->output) == 0) {
+				output = &mock->outputs[i];
+			}
+		}
+		if (output == NULL || !intersects(layout, output)) {
+			fprintf(stderr, "%s: output %s isn't captured\n", name,
+				layout->output);
+			return false;
+		}
+		// The region is cut down to the output
+		int32_t width, height;
+		get_mock_output_logical_size(output, &width, &height);
+		int32_t x1 = output->x > layout->x ? output->x : layout->x;
+		int32_t y1 = output->y > layout->y ? output->y : layout->y;
+		int32_t x2 = output->x + width < layout->x + layout->width ?
+			output->x + width : layout->x + layout->width;
+		int32_t y2 = output->y + height < layout->y + layout->height ?
+			output->y + height : layout->y + layout->height;
+		layout->x = x1;
+		layout->y = y1;
+		layout->width = x2 - x1;
+		layout->height = y2 - y1;
+	}
+
+	layout->scale = 1;
+	for (int i = 0; i < mock->n_outputs; i++) {
+		double scale = get_output_logical_scale(&mock->outputs[i]);
+		if (intersects(layout, &mock->outputs[i]) && scale > layout->scale) {
+			layout->scale = scale;
+		}
+	}
+	layout->exact = true;
+	for (int i = 0; i < mock->n_outputs; i++) {
+		const struct mock_output_config *output = &mock->outputs[i];
+		double x = (output->x - layout->x) * layout->scale;
+		double y = (output->y - layout->y) * layout->scale;
+		if (intersects(layout, output) &&
+				(fabs(get_output_logical_scale(output) - layout->scale) > 1e-9 ||
+				x != round(x) || y != round(y))) {
+			layout->exact = false;
+		}
+	}
+	return true;
+}
+
+/**
+ * Compare the capture with the content of the layout. Returns the number of
+ * mismatching pixels.
+ */
+static long check_capture(const struct layout *layout,
+		const struct decoded_image *image) {
+	int32_t width = layout->width * layout->scale;
+	int32_t height = layout->height * layout->scale;
+	if (image->width != width || image->height != height) {
+		fprintf(stderr, "%s: expected a %dx%d image, got %dx%d\n",
+			layout->name, width, height, image->width, image->height);
+		return (long)width * height;
+	}
+
+	// Resampled pixels near the edges of outputs are skipped
+	int tolerance = layout->exact ? 1 : 4;
+	double margin = layout->exact ? 0 : 3;
+
+	const struct mock_layout *mock = &layout->mock;
+	long n_mismatches = 0;
+	for (int32_t y = 0; y < height; y++) {
+		for (int32_t x = 0; x < width; x++) {
+			double lx = layout->x + (x + 0.5) / layout->scale;
+			double ly = layout->y + (y + 0.5) / layout->scale;
+
+			bool covered = layout->use_window;
+			bool near_edge = false;
+			for (int i = 0; i < mock->n_outputs; i++) {
+				const struct mock_output_config *output = &mock->outputs[i];
+				int32_t output_width, output_height;
+				get_mock_output_logical_size(output, &output_width,
+					&output_height);
+				double dx = fmin(lx - output->x, output->x + output_width - lx);
+				double dy = fmin(ly - output->y, output->y + output_height - ly);
+				if (dx > -margin && dy > -margin &&
+						(dx < margin || dy < margin)) {
+					near_edge = true;
+				}
+				if (dx > 0 && dy > 0) {
+					covered = true;
+				}
+			}
+			if (near_edge) {
+				continue;
+			}
+
+			const uint8_t *p = &image->data[((size_t)y * width + x) * 4];
+			bool ok;
+			if (covered) {
+				uint32_t color = get_mock_color(lx, ly);
+				ok = p[3] == 0xff &&
+					abs(p[0] - (int)(color >> 16 & 0xff)) <= tolerance &&
+					abs(p[1] - (int)(color >> 8 & 0xff)) <= tolerance &&
+					abs(p[2] - (int)(color & 0xff)) <= tolerance;
+			} else if (image->has_alpha) {
+				ok = p[3] == 0;
+			} else {
+				ok = p[0] == 0 && p[1] == 0 && p[2] == 0;
+			}
+			if (!ok && n_mismatches++ == 0) {
+				fprintf(stderr, "%s: first mismatch at %d,%d: "
+					"#%02x%02x%02x%02x\n", layout->name, x, y,
+					p[0], p[1], p[2], p[3]);
+			}
+		}
+	}
+	return n_mismatches;
+}
+
+static int handle_sigchld(int signal_number, void *data) {
+	struct child *child = data;
+	if (!child->exited &&
+			wait4(child->pid, &child->status, WNOHANG, &child->usage) > 0) {
+		child->exited = true;
+		child->exit_time = get_time_ms();
+	}
+	return 0;
+}
+
+static int handle_timeout(void *data) {
+	struct child *child = data;
+	fprintf(stderr, "grim timed out\n");
+	kill(child->pid, SIGKILL);
+	return 0;
+}
+
+/**
+ * Path of the n-th file grim writes for the layout, numbered like grim does
+ * with --interval.
+ */
+static void get_capture_path(const struct capture_bench *bench,
+		const struct layout *layout, const char *format, int n,
+		char *path, size_t size) {
+	if (layout->interval_count > 0) {
+		snprintf(path, size, "%s/capture-%05d.%s", bench->tmp_dir, n, format);
+	} else {
+		snprintf(path, size, "%s/capture.%s", bench->tmp_dir, format);
+	}
+}
+
+static bool run_grim(struct capture_bench *bench,
+		struct mock_compositor *mock, struct child *child,
+		const struct layout *layout, const char *format, const char *shm_mode,
+		const char *path, struct capture *capture) {
+	char region[64], handle[16], count[16];
+	const char *argv[16];
+	int argc = 0;
+	argv[argc++] = bench->grim_path;
+	argv[argc++] = "-t";
+	argv[argc++] = format;
+	if (strcmp(shm_mode, "dmabuf") == 0) {
+		argv[argc++] = "--dmabuf";
+	} else {
+		argv[argc++] = "--shm";
+		argv[argc++] = shm_mode;
+	}
+	if (layout->use_window) {
+		snprintf(handle, sizeof(handle), "%x", MOCK_WINDOW_HANDLE);
+		argv[argc++] = "-w";
+		argv[argc++] = handle;
+	} else if (layout->use_region) {
+		snprintf(region, sizeof(region), "%d,%d %dx%d", layout->region_x,
+			layout->region_y, layout->region_width, layout->region_height);
+		argv[argc++] = "-g";
+		argv[argc++] = region;
+	}
+	if (layout->output != NULL) {
+		argv[argc++] = "-o";
+		argv[argc++] = layout->output;
+	}
+	if (layout->interval_count > 0) {
+		snprintf(count, sizeof(count), "%d", layout->interval_count);
+		argv[argc++] = "--interval";
+		argv[argc++] = "0.1";
+		argv[argc++] = "--count";
+		argv[argc++] = count;
+	}
+	argv[argc++] = path;
+	argv[argc++] = NULL;
+
+	reset_mock_compositor_stats(mock);
+	*child = (struct child){0};
+	double start_time = get_time_ms();
+	child->pid = fork();
+	if (child->pid < 0) {
+		perror("fork");
+		return false;
+	} else if (child->pid == 0) {
+		sigset_t mask;
+		sigemptyset(&mask);
+		sigprocmask(SIG_SETMASK, &mask, NULL);
+		setenv("WAYLAND_DISPLAY", get_mock_compositor_socket(mock), true);
+		execv(argv[0], (char *const *)argv);
+		perror("failed to run grim");
+		_exit(127);
+	}
+
+	struct wl_event_source *timeout = wl_event_loop_add_timer(
+		get_mock_compositor_event_loop(mock), handle_timeout, child);
+	if (timeout != NULL) {
+		wl_event_source_timer_update(timeout, 30000);
+	}
+	bool ok = true;
+	while (ok && !child->exited) {
+		ok = dispatch_mock_compositor(mock, -1);
+	}
+	if (timeout != NULL) {
+		wl_event_source_remove(timeout);
+	}
+	// Let the compositor notice the client is gone
+	struct mock_stats *stats = get_mock_compositor_stats(mock);
+	for (int i = 0; ok && stats->n_clients > 0 && i < 100; i++) {
+		ok = dispatch_mock_compositor(mock, 10);
+	}
+	if (!ok) {
+		return false;
+	}
+
+	if (!WIFEXITED(child->status) || WEXITSTATUS(child->status) != 0) {
+		fprintf(stderr, "%s: grim failed\n", layout->name);
+		return false;
+	}
+	if (stats->n_failed > 0 || stats->n_frames == 0) {
+		fprintf(stderr, "%s: %d frames failed\n", layout->name,
+			stats->n_failed);
+		return false;
+	}
+
+	*capture = (struct capture){
+		.total_ms = child->exit_time - start_time,
+		.connect_ms = stats->connect_time - start_time,
+		.capture_ms = stats->last_ready_time - stats->first_capture_time,
+		.copy_to_ready_ms = stats->copy_to_ready_ms / stats->n_frames,
+		.readback_faults = stats->readback_faults,
+		.client_faults = child->usage.ru_minflt,
+		.dmabuf_frames = stats->n_dmabuf_frames,
+		.matches = -1,
+	};
+	char first_path[256];
+	get_capture_path(bench, layout, format, 0, first_path,
+		sizeof(first_path));
+	struct stat st;
+	if (stat(first_path, &st) != 0) {
+		perror("failed to stat capture");
+		return false;
+	}
+	capture->output_bytes = st.st_size;
+	return true;
+}
+
+static bool bench_layout(struct capture_bench *bench,
+		struct mock_compositor *mock, struct child *child,
+		const struct layout *layout, const char *format,
+		const char *shm_mode) {
+	char path[256];
+	snprintf(path, sizeof(path), "%s/capture.%s", bench->tmp_dir, format);
+	int n_files = layout->interval_count > 0 ? layout->interval_count : 1;
+
+	int n = bench->iterations;
+	double total[n], connect[n], capture_ms[n], copy_to_ready[n];
+	double readback_faults[n], client_faults[n];
+	struct capture capture = {0};
+	bool ok = true;
+	for (int i = 0; ok && i < n; i++) {
+		ok = run_grim(bench, mock, child, layout, format, shm_mode, path,
+			&capture);
+		// Captures don't change from one iteration to the next, nor from
+		// one screenshot of an interval to the next
+		for (int j = 0; ok && i == 0 && j < n_files &&
+				can_decode_format(format); j++) {
+			char file_path[256];
+			get_capture_path(bench, layout, format, j, file_path,
+				sizeof(file_path));
+			struct decoded_image image;
+			ok = decode_image_file(file_path, format, &image);
+			if (ok) {
+				capture.width = image.width;
+				capture.height = image.height;
+				capture.matches = check_capture(layout, &image) == 0;
+				ok = capture.matches;
+				finish_decoded_image(&image);
+			}
+		}
+		for (int j = 0; j < n_files; j++) {
+			char file_path[256];
+			get_capture_path(bench, layout, format, j, file_path,
+				sizeof(file_path));
+			unlink(file_path);
+		}
+		total[i] = capture.total_ms;
+		connect[i] = capture.connect_ms;
+		capture_ms[i] = capture.capture_ms;
+		copy_to_ready[i] = capture.copy_to_ready_ms;
+		readback_faults[i] = capture.readback_faults;
+		client_faults[i] = capture.client_faults;
+	}
+	if (!ok) {
+		fprintf(stderr, "%s: capture to %s with --shm %s failed\n",
+			layout->name, format, shm_mode);
+		return false;
+	}
+
+	FILE *out = bench->out;
+	fprintf(out, "%s\n\t\t{\"bench\": \"capture\", \"layout\": \"%s\", "
+		"\"outputs\": %d, \"format\": \"%s\", \"shm\": \"%s\", "
+		"\"readback_delay_ms\": %d, \"iterations\": %d",
+		bench->has_results ? "," : "", layout->name, layout->mock.n_outputs,
+		format, shm_mode, bench->readback_delay_ms, n);
+	double ms_per_capture = sort_median(total, n);
+	fprintf(out, ", \"ms_per_capture\": %.3f, \"min_ms\": %.3f, "
+		"\"connect_ms\": %.3f, \"capture_ms\": %.3f, "
+		"\"copy_to_ready_ms\": %.3f, \"readback_faults\": %.0f, "
+		"\"client_faults\": %.0f, \"dmabuf_frames\": %d, "
+		"\"output_bytes\": %lld",
+		ms_per_capture, total[0], sort_median(connect, n),
+		sort_median(capture_ms, n), sort_median(copy_to_ready, n),
+		sort_median(readback_faults, n), sort_median(client_faults, n),
+		capture.dmabuf_frames, capture.output_bytes);
+	if (capture.matches >= 0) {
+		fprintf(out, ", \"width\": %d, \"height\": %d, \"checked\": true",
+			capture.width, capture.height);
+	} else {
+		fprintf(out, ", \"checked\": false");
+	}
+	fprintf(out, "}");
+	fflush(out);
+	bench->has_results = true;
+	return true;
+}
+
+static bool run_layout(struct capture_bench *bench,
+		const struct layout *layout) {
+	struct mock_compositor *mock =
+		create_mock_compositor(&layout->mock, bench->readback_delay_ms);
+	if (mock == NULL) {
+		return false;
+	}
+	struct child child = {0};
+	struct wl_event_source *sigchld = wl_event_loop_add_signal(
+		get_mock_compositor_event_loop(mock), SIGCHLD, handle_sigchld, &child);
+	if (sigchld == NULL) {
+		destroy_mock_compositor(mock);
+		return false;
+	}
+
+	bool ok = true;
+	const char *formats = bench->formats;
+	while (ok && *formats != '\0') {
+		size_t len = strcspn(formats, ",");
+		char format[16];
+		snprintf(format, sizeof(format), "%.*s", (int)len, formats);
+		formats += len + (formats[len] == ',');
+
+		const char *modes = bench->shm_modes;
+		while (ok && *modes != '\0') {
+			size_t len = strcspn(modes, ",");
+			char mode[16];
+			snprintf(mode, sizeof(mode), "%.*s", (int)len, modes);
+			modes += len + (modes[len] == ',');
+			ok = bench_layout(bench, mock, &child, layout, format, mode);
+		}
+	}
+
+	wl_event_source_remove(sigchld);
+	destroy_mock_compositor(mock);
+	return ok;
+}
+
+int main(int argc, char *argv[]) {
+	struct capture_bench bench = {
+		.formats = "png",
+		.shm_modes = "default",
+		.iterations = 5,
+		.out = stdout,
+	};
+	const char *layouts = NULL;
+	const char *custom_layouts[8];
+	int n_custom_layouts = 0;
+	const char *output_path = NULL;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "hl:L:f:m:d:n:o:")) != -1) {
+		switch (opt) {
+		case 'h':
+			printf("%s", usage);
+			return EXIT_SUCCESS;
+		case 'l':
+			layouts = optarg;
+			break;
+		case 'L':
+			if (n_custom_layouts ==
+					sizeof(custom_layouts) / sizeof(custom_layouts[0])) {
+				fprintf(stderr, "too many layouts\n");
+				return EXIT_FAILURE;
+			}
+			custom_layouts[n_custom_layouts++] = optarg;
+			if (layouts == NULL) {
+				// Only run the given layouts
+				layouts = "";
+			}
+			break;
+		case 'f':
+			bench.formats = optarg;
+			break;
+		case 'm':
+			bench.shm_modes = optarg;
+			break;
+		case 'd':
+			bench.readback_delay_ms = atoi(optarg);
+			break;
+		case 'n':
+			bench.iterations = atoi(optarg);
+			if (bench.iterations < 1) {
+				fprintf(stderr, "invalid iteration count\n");
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'o':
+			output_path = optarg;
+			break;
+		default:
+			fprintf(stderr, "%s", usage);
+			return EXIT_FAILURE;
+		}
+	}
+	if (optind != argc - 1) {
+		fprintf(stderr, "%s", usage);
+		return EXIT_FAILURE;
+	}
+	bench.grim_path = argv[optind];
+
+	char tmp_template[] = "/tmp/grim-capture-XXXXXX";
+	bench.tmp_dir = mkdtemp(tmp_template);
+	if (bench.tmp_dir == NULL) {
+		perror("failed to create temporary directory");
+		return EXIT_FAILURE;
+	}
+	// The compositor's socket goes there
+	const char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+	if (runtime_dir == NULL || access(runtime_dir, W_OK) != 0) {
+		setenv("XDG_RUNTIME_DIR", bench.tmp_dir, true);
+	}
+
+	if (output_path != NULL) {
+		bench.out = fopen(output_path, "w");
+		if (bench.out == NULL) {
+			perror("failed to open output file");
+			rmdir(bench.tmp_dir);
+			return EXIT_FAILURE;
+		}
+	}
+
+	fprintf(bench.out, "{\n\t\"results\": [");
+	bool ok = true;
+	struct layout layout;
+	for (size_t i = 0; i < sizeof(presets) / sizeof(presets[0]); i++) {
+		const struct layout_preset *preset = &presets[i];
+		if (!is_in_list(layouts, preset->name)) {
+			continue;
+		}
+		if (!init_layout(&layout, preset->name, preset->spec, preset) ||
+				!run_layout(&bench, &layout)) {
+			ok = false;
+		}
+	}
+	for (int i = 0; i < n_custom_layouts; i++) {
+		if (!init_layout(&layout, custom_layouts[i], custom_layouts[i], NULL) ||
+				!run_layout(&bench, &layout)) {
+			ok = false;
+		}
+	}
+	fprintf(bench.out, "\n\t]\n}\n");
+
+	if (output_path != NULL && fclose(bench.out) != 0) {
+		perror("failed to write output file");
+		ok = false;
+	}
+	rmdir(bench.tmp_dir);
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
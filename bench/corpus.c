@@ -0,0 +1,629 @@
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "corpus.h"
+
+/*
+ * The images are drawn with a fixed-seed generator, at a UI scale following
+ * the height, so that a 4K image looks like a 1080p one on a HiDPI screen.
+ */
+
+#define GLYPH_WIDTH 5
+#define GLYPH_HEIGHT 7
+#define GLYPH_COUNT 64
+
+struct canvas {
+	uint32_t *data;
+	int width, height;
+	int stride; // in pixels
+	double scale;
+	uint64_t rng;
+	uint8_t glyphs[GLYPH_COUNT][GLYPH_HEIGHT];
+};
+
+static const char *const corpus_kind_names[] = {
+	[CORPUS_UI] = "ui",
+	[CORPUS_TEXT] = "text",
+	[CORPUS_GRADIENT] = "gradient",
+	[CORPUS_PHOTO] = "photo",
+	[CORPUS_TRANSLUCENT] = "translucent",
+	[CORPUS_MIXED] = "mixed",
+};
+
+const char *get_corpus_kind_name(enum corpus_kind kind) {
+	return corpus_kind_names[kind];
+}
+
+static uint64_t next_random(uint64_t *state) {
+	// splitmix64
+	uint64_t z = (*state += 0x9e3779b97f4a7c15);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+	return z ^ (z >> 31);
+}
+
+// In [min, max)
+static int random_range(struct canvas *c, int min, int max) {
+	if (max <= min) {
+		return min;
+	}
+	return min + (int)(next_random(&c->rng) % (uint64_t)(max - min));
+}
+
+static bool random_chance(struct canvas *c, int percent) {
+	return random_range(c, 0, 100) < percent;
+}
+
+static uint32_t rgb(int r, int g, int b) {
+	return 0xff000000 | (uint32_t)r << 16 | (uint32_t)g << 8 | (uint32_t)b;
+}
+
+static uint32_t random_color(struct canvas *c, int min, int max) {
+	return rgb(random_range(c, min, max), random_range(c, min, max),
+		random_range(c, min, max));
+}
+
+// Premultiplied
+static uint32_t with_alpha(uint32_t color, int alpha) {
+	uint32_t out = (uint32_t)alpha << 24;
+	for (int shift = 0; shift < 24; shift += 8) {
+		uint32_t v = (color >> shift) & 0xff;
+		out |= (v * alpha + 127) / 255 << shift;
+	}
+	return out;
+}
+
+// t from 0 (all a) to 256 (all b), on premultiplied colors
+static uint32_t mix(uint32_t a, uint32_t b, int t) {
+	uint32_t out = 0;
+	for (int shift = 0; shift < 32; shift += 8) {
+		int va = (a >> shift) & 0xff;
+		int vb = (b >> shift) & 0xff;
+		out |= (uint32_t)(va + ((vb - va) * t >> 8)) << shift;
+	}
+	return out;
+}
+
+static int px(struct canvas *c, double size) {
+	int v = (int)(size * c->scale + 0.5);
+	return v > 0 ? v : 1;
+}
+
+static bool clip_rect(struct canvas *c, int *x, int *y, int *w, int *h) {
+	if (*x < 0) {
+		*w += *x;
+		*x = 0;
+	}
+	if (*y < 0) {
+		*h += *y;
+		*y = 0;
+	}
+	if (*x + *w > c->width) {
+		*w = c->width - *x;
+	}
+	if (*y + *h > c->height) {
+		*h = c->height - *y;
+	}
+	return *w > 0 && *h > 0;
+}
+
+static void fill_rect(struct canvas *c, int x, int y, int w, int h,
+		uint32_t color) {
+	if (!clip_rect(c, &x, &y, &w, &h)) {
+		return;
+	}
+	for (int j = y; j < y + h; j++) {
+		uint32_t *row = c->data + (size_t)j * c->stride;
+		for (int i = x; i < x + w; i++) {
+			row[i] = color;
+		}
+	}
+}
+
+static void stroke_rect(struct canvas *c, int x, int y, int w, int h,
+		int width, uint32_t color) {
+	fill_rect(c, x, y, w, width, color);
+	fill_rect(c, x, y + h - width, w, width, color);
+	fill_rect(c, x, y, width, h, color);
+	fill_rect(c, x + w - width, y, width, h, color);
+}
+
+static void fill_gradient(struct canvas *c, int x, int y, int w, int h,
+		uint32_t from, uint32_t to, bool vertical) {
+	int x0 = x, y0 = y;
+	if (!clip_rect(c, &x, &y, &w, &h)) {
+		return;
+	}
+	int len = vertical ? h + (y - y0) : w + (x - x0);
+	for (int j = y; j < y + h; j++) {
+		uint32_t *row = c->data + (size_t)j * c->stride;
+		for (int i = x; i < x + w; i++) {
+			int pos = vertical ? j - y0 : i - x0;
+			row[i] = mix(from, to, len > 1 ? pos * 256 / (len - 1) : 0);
+		}
+	}
+}
+
+// Lighten towards color, fading out at radius
+static void add_glow(struct canvas *c, int cx, int cy, int radius,
+		uint32_t color) {
+	int x = cx - radius, y = cy - radius, w = 2 * radius, h = 2 * radius;
+	if (!clip_rect(c, &x, &y, &w, &h)) {
+		return;
+	}
+	for (int j = y; j < y + h; j++) {
+		uint32_t *row = c->data + (size_t)j * c->stride;
+		for (int i = x; i < x + w; i++) {
+			double d = sqrt((double)(i - cx) * (i - cx) +
+				(double)(j - cy) * (j - cy)) / radius;
+			if (d < 1) {
+				row[i] = mix(row[i], color, (int)((1 - d) * (1 - d) * 160));
+			}
+		}
+	}
+}
+
+/**
+ * Smooth noise, made of value noise octaves plus some per-pixel grain.
+ */
+static void fill_photo(struct canvas *c, int x, int y, int w, int h) {
+	if (!clip_rect(c, &x, &y, &w, &h)) {
+		return;
+	}
+
+	const double cell_sizes[] = { 240, 40, 7 };
+	const double weights[] = { 0.6, 0.28, 0.12 };
+	enum { N_OCTAVES = 3 };
+	int cells[N_OCTAVES], grid_width[N_OCTAVES];
+	float *grids[N_OCTAVES];
+	for (int o = 0; o < N_OCTAVES; o++) {
+		cells[o] = px(c, cell_sizes[o]);
+		grid_width[o] = w / cells[o] + 2;
+		int grid_height = h / cells[o] + 2;
+		size_t n = (size_t)grid_width[o] * grid_height * 3;
+		grids[o] = malloc(n * sizeof(float));
+		for (size_t i = 0; i < n; i++) {
+			grids[o][i] = (next_random(&c->rng) >> 40) / (float)(1 << 24);
+		}
+	}
+	// Color cast of the whole picture
+	float tint[3];
+	for (int ch = 0; ch < 3; ch++) {
+		tint[ch] = 0.6f + random_range(c, 0, 60) / 100.0f;
+	}
+
+	float *values = malloc((size_t)w * 3 * sizeof(float));
+	for (int j = 0; j < h; j++) {
+		memset(values, 0, (size_t)w * 3 * sizeof(float));
+		for (int o = 0; o < N_OCTAVES; o++) {
+			int gy = j / cells[o];
+			float fy = (float)(j % cells[o]) / cells[o];
+			fy = fy * fy * (3 - 2 * fy);
+			const float *g0 = grids[o] + (size_t)gy * grid_width[o] * 3;
+			const float *g1 = g0 + (size_t)grid_width[o] * 3;
+			for (int i = 0; i < w; i++) {
+				int gx = i / cells[o];
+				float fx = (float)(i % cells[o]) / cells[o];
+				fx = fx * fx * (3 - 2 * fx);
+				for (int ch = 0; ch < 3; ch++) {
+					int k = gx * 3 + ch;
+					float top = g0[k] + (g0[k + 3] - g0[k]) * fx;
+					float bottom = g1[k] + (g1[k + 3] - g1[k]) * fx;
+					values[i * 3 + ch] +=
+						(top + (bottom - top) * fy) * weights[o];
+				}
+			}
+		}
+
+		uint32_t *row = c->data + (size_t)(y + j) * c->stride + x;
+		for (int i = 0; i < w; i++) {
+			int grain = (int)(next_random(&c->rng) % 13) - 6;
+			int v[3];
+			for (int ch = 0; ch < 3; ch++) {
+				v[ch] = (int)(values[i * 3 + ch] * tint[ch] * 255) + grain;
+				v[ch] = v[ch] < 0 ? 0 : v[ch] > 255 ? 255 : v[ch];
+			}
+			row[i] = rgb(v[0], v[1], v[2]);
+		}
+	}
+
+	free(values);
+	for (int o = 0; o < N_OCTAVES; o++) {
+		free(grids[o]);
+	}
+}
+
+/**
+ * Make glyphs out of a few strokes each, like a segment display, so that
+ * text has the structure of real text without needing a font.
+ */
+static void init_glyphs(struct canvas *c) {
+	for (int g = 0; g < GLYPH_COUNT; g++) {
+		uint8_t *rows = c->glyphs[g];
+		memset(rows, 0, GLYPH_HEIGHT);
+		// Ascenders for some glyphs, x-height for the others
+		int top = random_chance(c, 30) ? 0 : 2;
+		int n_strokes = random_range(c, 2, 5);
+		for (int s = 0; s < n_strokes; s++) {
+			switch (random_range(c, 0, 7)) {
+			case 0: // left stem
+				for (int r = top; r < GLYPH_HEIGHT; r++) {
+					rows[r] |= 0x10;
+				}
+				break;
+			case 1: // right stem
+				for (int r = 2; r < GLYPH_HEIGHT; r++) {
+					rows[r] |= 0x01;
+				}
+				break;
+			case 2: // middle stem
+				for (int r = top; r < GLYPH_HEIGHT; r++) {
+					rows[r] |= 0x04;
+				}
+				break;
+			case 3: // top bar
+				rows[2] |= 0x0e;
+				break;
+			case 4: // middle bar
+				rows[4] |= 0x1f;
+				break;
+			case 5: // bottom bar
+				rows[GLYPH_HEIGHT - 1] |= 0x0e;
+				break;
+			case 6: // diagonal
+				for (int r = 2; r < GLYPH_HEIGHT; r++) {
+					rows[r] |= 0x10 >> (r - 2);
+				}
+				break;
+			}
+		}
+	}
+}
+
+static void draw_glyph(struct canvas *c, int x, int y, int glyph, int unit,
+		uint32_t fg) {
+	const uint8_t *rows = c->glyphs[glyph];
+	for (int r = 0; r < GLYPH_HEIGHT; r++) {
+		for (int col = 0; col < GLYPH_WIDTH; col++) {
+			if (!(rows[r] & (0x10 >> col))) {
+				continue;
+			}
+			int bx = x + col * unit, by = y + r * unit;
+			fill_rect(c, bx, by, unit, unit, fg);
+			// Antialiased right edge
+			bool right = col + 1 < GLYPH_WIDTH &&
+				(rows[r] & (0x10 >> (col + 1)));
+			if (!right && bx + unit < c->width && by >= 0) {
+				for (int k = 0; k < unit && by + k < c->height; k++) {
+					uint32_t *p = c->data + (size_t)(by + k) * c->stride +
+						bx + unit;
+					*p = mix(*p, fg, 96);
+				}
+			}
+		}
+	}
+}
+
+/**
+ * Fill a box with lines of words. With colors, some words get one of them,
+ * like with syntax highlighting.
+ */
+static void draw_text(struct canvas *c, int x, int y, int w, int h,
+		uint32_t fg, uint32_t bg, const uint32_t *colors, int n_colors,
+		bool code) {
+	fill_rect(c, x, y, w, h, bg);
+	int unit = px(c, 1);
+	int advance = (GLYPH_WIDTH + 1) * unit;
+	int line_height = (GLYPH_HEIGHT + 5) * unit;
+	int margin = px(c, 8);
+
+	for (int ly = y + margin; ly + line_height <= y + h - margin;
+			ly += line_height) {
+		if (random_chance(c, 12)) {
+			continue; // blank line
+		}
+		int indent = code ? random_range(c, 0, 4) * 4 * advance : 0;
+		int line_end = x + margin + (w - 2 * margin) *
+			random_range(c, code ? 20 : 60, 101) / 100;
+		int lx = x + margin + indent;
+		while (lx < line_end) {
+			int n = random_range(c, 1, 10);
+			if (lx + n * advance > x + w - margin) {
+				break;
+			}
+			uint32_t color = fg;
+			if (n_colors > 0 && random_chance(c, 35)) {
+				color = colors[random_range(c, 0, n_colors)];
+			}
+			for (int i = 0; i < n; i++) {
+				draw_glyph(c, lx, ly, random_range(c, 0, GLYPH_COUNT),
+					unit, color);
+				lx += advance;
+			}
+			lx += advance;
+		}
+	}
+}
+
+/**
+ * An application window: a title bar, a toolbar, a sidebar with a list, and
+ * content, which is text unless a picture is asked for.
+ */
+static void draw_window(struct canvas *c, int x, int y, int w, int h,
+		bool dark, bool picture) {
+	uint32_t frame = dark ? rgb(45, 45, 48) : rgb(222, 222, 222);
+	uint32_t surface = dark ? rgb(30, 30, 30) : rgb(250, 250, 250);
+	uint32_t text = dark ? rgb(212, 212, 212) : rgb(33, 33, 33);
+	uint32_t accent = rgb(53, 132, 228);
+
+	fill_rect(c, x, y, w, h, surface);
+	stroke_rect(c, x, y, w, h, px(c, 1), dark ? rgb(70, 70, 70) :
+		rgb(190, 190, 190));
+
+	// Title bar, with a title and buttons
+	int title_height = px(c, 32);
+	fill_rect(c, x + px(c, 1), y + px(c, 1), w - 2 * px(c, 1), title_height,
+		frame);
+	draw_text(c, x + w / 3, y + px(c, 4), w / 3, title_height - px(c, 4),
+		text, frame, NULL, 0, false);
+	for (int i = 0; i < 3; i++) {
+		int size = px(c, 14);
+		fill_rect(c, x + w - (i + 1) * px(c, 24), y + px(c, 9), size, size,
+			i == 0 ? rgb(224, 27, 36) : mix(frame, text, 80));
+	}
+
+	// Toolbar
+	int toolbar_y = y + px(c, 1) + title_height;
+	int toolbar_height = px(c, 40);
+	fill_rect(c, x + px(c, 1), toolbar_y, w - 2 * px(c, 1), toolbar_height,
+		mix(frame, surface, 128));
+	for (int i = 0; i < 6 && (i + 1) * px(c, 40) < w; i++) {
+		int bx = x + px(c, 8) + i * px(c, 40);
+		fill_rect(c, bx, toolbar_y + px(c, 6), px(c, 32), px(c, 28),
+			mix(frame, text, 30));
+		fill_rect(c, bx + px(c, 10), toolbar_y + px(c, 14), px(c, 12),
+			px(c, 12), random_color(c, 60, 220));
+	}
+
+	// Sidebar with a list, one item of which is selected
+	int body_y = toolbar_y + toolbar_height;
+	int body_height = y + h - px(c, 1) - body_y;
+	int sidebar_width = w / 5;
+	int item_height = px(c, 28);
+	int selected = random_range(c, 0, 10);
+	for (int i = 0; (i + 1) * item_height <= body_height; i++) {
+		uint32_t bg = i == selected ? accent :
+			i % 2 == 0 ? frame : mix(frame, surface, 128);
+		draw_text(c, x + px(c, 1), body_y + i * item_height, sidebar_width,
+			item_height, i == selected ? rgb(255, 255, 255) : text, bg,
+			NULL, 0, false);
+	}
+
+	// Content, with a scroll bar
+	int content_x = x + px(c, 1) + sidebar_width;
+	int content_width = x + w - px(c, 1) - content_x - px(c, 12);
+	if (picture) {
+		fill_rect(c, content_x, body_y, content_width, body_height,
+			rgb(20, 20, 20));
+		fill_photo(c, content_x + px(c, 16), body_y + px(c, 16),
+			content_width - 2 * px(c, 16), body_height - 2 * px(c, 16));
+	} else {
+		static const uint32_t links[] = { 0xff1a5fb4 };
+		draw_text(c, content_x, body_y, content_width, body_height, text,
+			surface, links, 1, false);
+	}
+	fill_rect(c, content_x + content_width, body_y, px(c, 12), body_height,
+		frame);
+	fill_rect(c, content_x + content_width + px(c, 3), body_y + px(c, 20),
+		px(c, 6), body_height / 4, mix(frame, text, 100));
+}
+
+static void draw_terminal(struct canvas *c, int x, int y, int w, int h) {
+	static const uint32_t colors[] = {
+		0xffc01c28, 0xff2ec27e, 0xfff5c211, 0xff3584e4, 0xffc061cb,
+		0xff33c7de,
+	};
+	int title_height = px(c, 28);
+	fill_rect(c, x, y, w, title_height, rgb(48, 48, 48));
+	draw_text(c, x, y + title_height, w, h - title_height, rgb(208, 207, 204),
+		rgb(23, 20, 33), colors, sizeof(colors) / sizeof(colors[0]), true);
+}
+
+/**
+ * Draw the soft shadow of a window with rounded corners, on a transparent
+ * background.
+ */
+static void draw_shadow(struct canvas *c, int x, int y, int w, int h,
+		int radius) {
+	int sx = x - radius, sy = y - radius, sw = w + 2 * radius,
+		sh = h + 2 * radius;
+	if (!clip_rect(c, &sx, &sy, &sw, &sh)) {
+		return;
+	}
+	for (int j = sy; j < sy + sh; j++) {
+		uint32_t *row = c->data + (size_t)j * c->stride;
+		int dy = j < y ? y - j : j >= y + h ? j - (y + h - 1) : 0;
+		for (int i = sx; i < sx + sw; i++) {
+			int dx = i < x ? x - i : i >= x + w ? i - (x + w - 1) : 0;
+			double d = sqrt((double)dx * dx + (double)dy * dy) / radius;
+			if (d < 1) {
+				int alpha = (int)(0x70 * (1 - d) * (1 - d));
+				uint32_t shadow = (uint32_t)alpha << 24;
+				// Over what is already there
+				row[i] = shadow + mix(row[i], 0, alpha);
+			}
+		}
+	}
+}
+
+/**
+ * Cut rounded corners out of a window drawn at x, y, blending its edge with
+ * what was there before.
+ */
+static void round_corners(struct canvas *c, const uint32_t *before, int x,
+		int y, int w, int h, int radius) {
+	for (int corner = 0; corner < 4; corner++) {
+		int cx = corner % 2 == 0 ? x + radius : x + w - radius;
+		int cy = corner / 2 == 0 ? y + radius : y + h - radius;
+		int x0 = corner % 2 == 0 ? x : x + w - radius;
+		int y0 = corner / 2 == 0 ? y : y + h - radius;
+		for (int j = y0; j < y0 + radius; j++) {
+			for (int i = x0; i < x0 + radius; i++) {
+				if (i < 0 || j < 0 || i >= c->width || j >= c->height) {
+					continue;
+				}
+				double d = hypot(i + 0.5 - cx, j + 0.5 - cy);
+				double coverage = radius - d + 0.5;
+				if (coverage >= 1) {
+					continue;
+				}
+				size_t k = (size_t)j * c->stride + i;
+				int t = coverage <= 0 ? 0 : (int)(coverage * 256);
+				c->data[k] = mix(before[k], c->data[k], t);
+			}
+		}
+	}
+}
+
+static void draw_wallpaper(struct canvas *c) {
+	fill_gradient(c, 0, 0, c->width, c->height, random_color(c, 20, 90),
+		random_color(c, 90, 200), random_chance(c, 50));
+	for (int i = 0; i < 3; i++) {
+		add_glow(c, random_range(c, 0, c->width),
+			random_range(c, 0, c->height),
+			random_range(c, c->height / 4, c->height),
+			random_color(c, 120, 256));
+	}
+}
+
+static void draw_gradients(struct canvas *c) {
+	draw_wallpaper(c);
+	// A few more bands, like a desktop background with shapes
+	for (int i = 0; i < 4; i++) {
+		int w = random_range(c, c->width / 4, c->width / 2);
+		int h = random_range(c, c->height / 4, c->height / 2);
+		fill_gradient(c, random_range(c, 0, c->width - w),
+			random_range(c, 0, c->height - h), w, h,
+			random_color(c, 30, 220), random_color(c, 30, 220),
+			random_chance(c, 50));
+	}
+}
+
+static void draw_ui(struct canvas *c) {
+	fill_rect(c, 0, 0, c->width, c->height, rgb(36, 31, 49));
+	for (int i = 0; i < 4; i++) {
+		int w = random_range(c, c->width / 3, c->width * 3 / 4);
+		int h = random_range(c, c->height / 3, c->height * 3 / 4);
+		draw_window(c, random_range(c, 0, c->width - w),
+			random_range(c, 0, c->height - h), w, h, i % 2 == 1, false);
+	}
+}
+
+static void draw_text_screen(struct canvas *c) {
+	static const uint32_t links[] = { 0xff1a5fb4, 0xff613583 };
+	int half = c->width / 2;
+	draw_text(c, 0, 0, half, c->height, rgb(33, 33, 33),
+		rgb(255, 255, 255), links, 2, false);
+	draw_terminal(c, half, 0, c->width - half, c->height);
+}
+
+static void draw_translucent(struct canvas *c) {
+	memset(c->data, 0, (size_t)c->stride * c->height * 4);
+	size_t size = (size_t)c->stride * c->height;
+	uint32_t *before = malloc(size * 4);
+	for (int i = 0; i < 3; i++) {
+		int w = random_range(c, c->width / 3, c->width * 2 / 3);
+		int h = random_range(c, c->height / 3, c->height * 2 / 3);
+		int x = random_range(c, px(c, 48), c->width - w - px(c, 48));
+		int y = random_range(c, px(c, 48), c->height - h - px(c, 48));
+		int radius = px(c, 10);
+		draw_shadow(c, x, y, w, h, px(c, 40));
+		memcpy(before, c->data, size * 4);
+		draw_window(c, x, y, w, h, i == 1, false);
+		round_corners(c, before, x, y, w, h, radius);
+	}
+	free(before);
+
+	// Semi-transparent panel over everything
+	int panel_height = px(c, 36);
+	uint32_t panel = with_alpha(rgb(20, 20, 20), 0xc0);
+	for (int j = 0; j < panel_height && j < c->height; j++) {
+		uint32_t *row = c->data + (size_t)j * c->stride;
+		for (int i = 0; i < c->width; i++) {
+			row[i] = panel + mix(row[i], 0, 0xc0);
+		}
+	}
+}
+
+static void draw_desktop(struct canvas *c) {
+	draw_wallpaper(c);
+
+	int panel_height = px(c, 36);
+	draw_text(c, 0, 0, c->width, panel_height, rgb(255, 255, 255),
+		rgb(0, 0, 0), NULL, 0, false);
+
+	int w = c->width, h = c->height - panel_height;
+	int top = panel_height;
+	draw_window(c, w / 20, top + h / 12, w / 2, h * 2 / 3, false, false);
+	draw_window(c, w * 2 / 5, top + h / 4, w / 2, h * 2 / 3, true, true);
+	draw_terminal(c, w / 8, top + h / 2, w * 2 / 5, h * 2 / 5);
+
+	// Dock
+	int icon = px(c, 48), gap = px(c, 12);
+	int n_icons = 10;
+	int dock_width = n_icons * (icon + gap) + gap;
+	int dock_x = (w - dock_width) / 2, dock_y = c->height - icon - 3 * gap;
+	fill_rect(c, dock_x, dock_y, dock_width, icon + 2 * gap,
+		rgb(50, 50, 58));
+	for (int i = 0; i < n_icons; i++) {
+		fill_gradient(c, dock_x + gap + i * (icon + gap), dock_y + gap,
+			icon, icon, random_color(c, 60, 255), random_color(c, 0, 160),
+			true);
+	}
+}
+
+pixman_image_t *generate_corpus_image(enum corpus_kind kind, int width,
+		int height) {
+	pixman_format_code_t format = kind == CORPUS_TRANSLUCENT ?
+		PIXMAN_a8r8g8b8 : PIXMAN_x8r8g8b8;
+	pixman_image_t *image = pixman_image_create_bits(format, width, height,
+		NULL, 0);
+	if (image == NULL) {
+		return NULL;
+	}
+
+	struct canvas c = {
+		.data = pixman_image_get_data(image),
+		.width = width,
+		.height = height,
+		.stride = pixman_image_get_stride(image) / 4,
+		.scale = height / 1080.0,
+		.rng = 0x6772696d + kind, // "grim"
+	};
+	init_glyphs(&c);
+
+	switch (kind) {
+	case CORPUS_UI:
+		draw_ui(&c);
+		break;
+	case CORPUS_TEXT:
+		draw_text_screen(&c);
+		break;
+	case CORPUS_GRADIENT:
+		draw_gradients(&c);
+		break;
+	case CORPUS_PHOTO:
+		fill_photo(&c, 0, 0, width, height);
+		break;
+	case CORPUS_TRANSLUCENT:
+		draw_translucent(&c);
+		break;
+	case CORPUS_MIXED:
+		draw_desktop(&c);
+		break;
+	}
+	return image;
+}
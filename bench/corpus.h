@@ -0,0 +1,32 @@
+#ifndef _CORPUS_H
+#define _CORPUS_H
+
+#include <pixman.h>
+
+enum corpus_kind {
+	// Windows made of flat panels, borders, buttons and lists
+	CORPUS_UI,
+	// A document and a terminal full of text
+	CORPUS_TEXT,
+	// Wallpaper-like smooth gradients
+	CORPUS_GRADIENT,
+	// Noisy, photo-like content
+	CORPUS_PHOTO,
+	// Windows with shadows and rounded corners on a transparent background
+	CORPUS_TRANSLUCENT,
+	// A desktop mixing all of the above
+	CORPUS_MIXED,
+};
+
+#define CORPUS_KIND_COUNT (CORPUS_MIXED + 1)
+
+const char *get_corpus_kind_name(enum corpus_kind kind);
+
+/**
+ * Generate a screenshot-like image. The same arguments always give the same
+ * image. It is x8r8g8b8, except for CORPUS_TRANSLUCENT which is a8r8g8b8.
+ */
+pixman_image_t *generate_corpus_image(enum corpus_kind kind, int width,
+	int height);
+
+#endif
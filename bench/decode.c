@@ -0,0 +1,141 @@
+#include <png.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "decode.h"
+#include "write_raw.h"
+
+bool can_decode_format(const char *format) {
+	return strcmp(format, "png") == 0 || strcmp(format, "ppm") == 0 ||
+		strcmp(format, "raw") == 0;
+}
+
+static bool alloc_image(struct decoded_image *image, int32_t width,
+		int32_t height) {
+	if (width <= 0 || height <= 0 || width > 1 << 16 || height > 1 << 16) {
+		return false;
+	}
+	image->width = width;
+	image->height = height;
+	image->data = malloc((size_t)width * height * 4);
+	return image->data != NULL;
+}
+
+static bool decode_png(const char *path, struct decoded_image *image) {
+	png_image png = { .version = PNG_IMAGE_VERSION };
+	if (!png_image_begin_read_from_file(&png, path)) {
+		fprintf(stderr, "failed to read %s: %s\n", path, png.message);
+		return false;
+	}
+	image->has_alpha = png.format & PNG_FORMAT_FLAG_ALPHA;
+	png.format = PNG_FORMAT_RGBA;
+	if (!alloc_image(image, png.width, png.height)) {
+		png_image_free(&png);
+		return false;
+	}
+	if (!png_image_finish_read(&png, NULL, image->data, 0, NULL)) {
+		fprintf(stderr, "failed to decode %s: %s\n", path, png.message);
+		return false;
+	}
+	return true;
+}
+
+static bool decode_ppm(FILE *f, struct decoded_image *image) {
+	int width, height, maxval;
+	if (fscanf(f, "P6 %d %d %d", &width, &height, &maxval) != 3 ||
+			maxval != 255 || fgetc(f) == EOF ||
+			!alloc_image(image, width, height)) {
+		return false;
+	}
+	image->has_alpha = false;
+	size_t n_pixels = (size_t)width * height;
+	if (fread(image->data, 3, n_pixels, f) != n_pixels) {
+		return false;
+	}
+	// Expand in place, from the end
+	for (size_t i = n_pixels; i-- > 0;) {
+		memmove(&image->data[4 * i], &image->data[3 * i], 3);
+		image->data[4 * i + 3] = 0xff;
+	}
+	return true;
+}
+
+static bool decode_raw(FILE *f, struct decoded_image *image) {
+	unsigned char header[GRIM_RAW_HEADER_SIZE];
+	if (fread(header, sizeof(header), 1, f) != 1) {
+		return false;
+	}
+	uint32_t fields[GRIM_RAW_HEADER_SIZE / 4];
+	for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+		fields[i] = header[4 * i] | header[4 * i + 1] << 8 |
+			header[4 * i + 2] << 16 | (uint32_t)header[4 * i + 3] << 24;
+	}
+	uint32_t format = fields[GRIM_RAW_FIELD_FORMAT];
+	uint32_t stride = fields[GRIM_RAW_FIELD_STRIDE];
+	if (fields[GRIM_RAW_FIELD_MAGIC] != GRIM_RAW_MAGIC ||
+			fields[GRIM_RAW_FIELD_HEADER_SIZE] != GRIM_RAW_HEADER_SIZE ||
+			(format != WL_SHM_FORMAT_ARGB8888 &&
+				format != WL_SHM_FORMAT_XRGB8888) ||
+			!alloc_image(image, fields[GRIM_RAW_FIELD_WIDTH],
+				fields[GRIM_RAW_FIELD_HEIGHT]) ||
+			stride < (uint32_t)image->width * 4) {
+		return false;
+	}
+	image->has_alpha = format == WL_SHM_FORMAT_ARGB8888;
+
+	unsigned char *row = malloc(stride);
+	if (row == NULL) {
+		return false;
+	}
+	bool ok = true;
+	for (int32_t y = 0; ok && y < image->height; y++) {
+		ok = fread(row, stride, 1, f) == 1;
+		uint8_t *out = &image->data[(size_t)y * image->width * 4];
+		for (int32_t x = 0; ok && x < image->width; x++) {
+			// Little-endian B, G, R, A
+			const unsigned char *p = &row[4 * x];
+			uint8_t alpha = image->has_alpha ? p[3] : 0xff;
+			for (int i = 0; i < 3; i++) {
+				out[4 * x + i] = alpha == 0 ? 0 :
+					(p[2 - i] * 255 + alpha / 2) / alpha;
+			}
+			out[4 * x + 3] = alpha;
+		}
+	}
+	free(row);
+	return ok;
+}
+
+bool decode_image_file(const char *path, const char *format,
+		struct decoded_image *image) {
+	*image = (struct decoded_image){0};
+	bool ok = false;
+	if (strcmp(format, "png") == 0) {
+		ok = decode_png(path, image);
+	} else {
+		FILE *f = fopen(path, "rb");
+		if (f == NULL) {
+			perror("failed to open capture");
+			return false;
+		}
+		if (strcmp(format, "ppm") == 0) {
+			ok = decode_ppm(f, image);
+		} else if (strcmp(format, "raw") == 0) {
+			ok = decode_raw(f, image);
+		}
+		fclose(f);
+		if (!ok) {
+			fprintf(stderr, "failed to decode %s\n", path);
+		}
+	}
+	if (!ok) {
+		finish_decoded_image(image);
+	}
+	return ok;
+}
+
+void finish_decoded_image(struct decoded_image *image) {
+	free(image->data);
+	image->data = NULL;
+}
@@ -0,0 +1,22 @@
+#ifndef _DECODE_H
+#define _DECODE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct decoded_image {
+	int32_t width, height;
+	// RGBA rows without padding, with straight alpha
+	uint8_t *data;
+	bool has_alpha;
+};
+
+/**
+ * Whether files written by grim -t format can be decoded.
+ */
+bool can_decode_format(const char *format);
+bool decode_image_file(const char *path, const char *format,
+	struct decoded_image *image);
+void finish_decoded_image(struct decoded_image *image);
+
+#endif
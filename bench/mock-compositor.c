@@ -0,0 +1,1166 @@
+#define _GNU_SOURCE // RUSAGE_THREAD
+
+#include <errno.h>
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+#include <wayland-server-core.h>
+#include <wayland-server-protocol.h>
+
+#include "mock-compositor.h"
+#include "util.h"
+
+#include "hyprland-toplevel-export-v1-server-protocol.h"
+#include "linux-dmabuf-unstable-v1-server-protocol.h"
+#include "wlr-screencopy-unstable-v1-server-protocol.h"
+#include "xdg-output-unstable-v1-server-protocol.h"
+
+struct mock_image {
+	// In buffer orientation, top-down whatever y_invert says
+	uint32_t *pixels;
+	int32_t width, height;
+	bool y_invert;
+};
+
+struct mock_output {
+	struct mock_compositor *mock;
+	struct mock_output_config config;
+	struct wl_global *global;
+	struct mock_image image;
+	int32_t logical_width, logical_height;
+};
+
+struct mock_compositor {
+	struct wl_display *display;
+	struct wl_event_loop *loop;
+	const char *socket;
+	int readback_delay_ms;
+
+	struct mock_output outputs[MOCK_MAX_OUTPUTS];
+	int n_outputs;
+	struct mock_image windows[MOCK_MAX_WINDOWS];
+	int n_windows;
+
+	struct wl_listener client_created;
+	struct mock_stats stats;
+};
+
+struct mock_client {
+	struct mock_compositor *mock;
+	struct wl_listener destroy;
+};
+
+// DRM formats share their codes with wl_shm, except for these two
+#define DRM_FORMAT_XRGB8888 0x34325258 // XR24
+#define DRM_FORMAT_MOD_LINEAR ((uint64_t)0)
+
+/**
+ * Single-plane linear DMA-BUF, imported by mapping it as if it were in system
+ * memory, which is how udmabuf exports it.
+ */
+struct mock_dmabuf {
+	void *data;
+	size_t size;
+	int32_t width, height, stride;
+	uint32_t format; // DRM format
+};
+
+struct mock_dmabuf_params {
+	int fd;
+	uint32_t offset, stride;
+	uint64_t modifier;
+	bool used;
+};
+
+// Pixels of a client buffer, whether shm or DMA-BUF
+struct mock_buffer_view {
+	struct wl_shm_buffer *shm_buffer;
+	unsigned char *data;
+	int32_t width, height, stride;
+	uint32_t format; // enum wl_shm_format
+};
+
+struct mock_frame {
+	struct mock_compositor *mock;
+	struct wl_resource *resource;
+	// hyprland_toplevel_export_frame_v1 rather than zwlr_screencopy_frame_v1
+	bool toplevel;
+
+	const struct mock_image *image;
+	// Part of the image to capture
+	int32_t x, y, width, height;
+
+	int hold_damage_ms;
+
+	struct wl_resource *buffer;
+	struct wl_listener buffer_destroy;
+	bool with_damage;
+	double copy_time;
+	struct wl_event_source *timer;
+};
+
+static const char *const transform_names[] = {
+	[WL_OUTPUT_TRANSFORM_NORMAL] = "normal",
+	[WL_OUTPUT_TRANSFORM_90] = "90",
+	[WL_OUTPUT_TRANSFORM_180] = "180",
+	[WL_OUTPUT_TRANSFORM_270] = "270",
+	[WL_OUTPUT_TRANSFORM_FLIPPED] = "flipped",
+	[WL_OUTPUT_TRANSFORM_FLIPPED_90] = "flipped-90",
+	[WL_OUTPUT_TRANSFORM_FLIPPED_180] = "flipped-180",
+	[WL_OUTPUT_TRANSFORM_FLIPPED_270] = "flipped-270",
+};
+
+static bool parse_layout_item(char *item, struct mock_layout *layout) {
+	char *saveptr;
+	char *geometry = strtok_r(item, ":", &saveptr);
+	if (geometry == NULL) {
+		return false;
+	}
+
+	struct mock_output_config *output = NULL;
+	bool *y_invert;
+	int32_t width, height;
+	int n = -1;
+	if (strncmp(geometry, "window=", strlen("window=")) == 0) {
+		if (layout->n_windows == MOCK_MAX_WINDOWS) {
+			fprintf(stderr, "too many windows\n");
+			return false;
+		}
+		geometry += strlen("window=");
+		sscanf(geometry, "%" SCNd32 "x%" SCNd32 "%n", &width, &height, &n);
+		struct mock_window_config *window =
+			&layout->windows[layout->n_windows++];
+		window->width = width;
+		window->height = height;
+		y_invert = &window->y_invert;
+	} else {
+		if (layout->n_outputs == MOCK_MAX_OUTPUTS) {
+			fprintf(stderr, "too many outputs\n");
+			return false;
+		}
+		int32_t x, y;
+		sscanf(geometry, "%" SCNd32 "x%" SCNd32 "+%" SCNd32 "+%" SCNd32 "%n",
+			&width, &height, &x, &y, &n);
+		output = &layout->outputs[layout->n_outputs++];
+		snprintf(output->name, sizeof(output->name), "MOCK-%d",
+			layout->n_outputs);
+		output->x = x;
+		output->y = y;
+		output->width = width;
+		output->height = height;
+		output->scale = 1;
+		y_invert = &output->y_invert;
+	}
+	if (n < 0 || geometry[n] != '\0' || width <= 0 || height <= 0) {
+		fprintf(stderr, "invalid layout geometry: %s\n", geometry);
+		return false;
+	}
+
+	char *option;
+	while ((option = strtok_r(NULL, ":", &saveptr)) != NULL) {
+		bool ok = false;
+		if (strcmp(option, "y-invert") == 0) {
+			*y_invert = true;
+			ok = true;
+		} else if (output != NULL &&
+				strncmp(option, "scale=", strlen("scale=")) == 0) {
+			char *end;
+			output->scale = strtod(option + strlen("scale="), &end);
+			ok = *end == '\0' && output->scale >= 1 && output->scale <= 8;
+		} else if (output != NULL &&
+				strncmp(option, "hold-damage=", strlen("hold-damage=")) == 0) {
+			char *end;
+			long ms = strtol(option + strlen("hold-damage="), &end, 10);
+			ok = *end == '\0' && ms > 0 && ms <= 60000;
+			output->hold_damage_ms = ms;
+		} else if (output != NULL &&
+				strncmp(option, "transform=", strlen("transform=")) == 0) {
+			const char *name = option + strlen("transform=");
+			for (size_t i = 0; i < sizeof(transform_names) /
+					sizeof(transform_names[0]); i++) {
+				if (strcmp(name, transform_names[i]) == 0) {
+					output->transform = i;
+					ok = true;
+				}
+			}
+		}
+		if (!ok) {
+			fprintf(stderr, "invalid layout option: %s\n", option);
+			return false;
+		}
+	}
+	return true;
+}
+
+bool parse_mock_layout(const char *spec, struct mock_layout *layout) {
+	*layout = (struct mock_layout){0};
+	char *items = strdup(spec);
+	if (items == NULL) {
+		return false;
+	}
+	bool ok = true;
+	char *saveptr;
+	for (char *item = strtok_r(items, ";", &saveptr); ok && item != NULL;
+			item = strtok_r(NULL, ";", &saveptr)) {
+		char *item_copy = strdup(item);
+		ok = item_copy != NULL && parse_layout_item(item_copy, layout);
+		free(item_copy);
+	}
+	free(items);
+	if (ok && layout->n_outputs == 0 && layout->n_windows == 0) {
+		fprintf(stderr, "empty layout\n");
+		ok = false;
+	}
+	return ok;
+}
+
+void get_mock_output_logical_size(const struct mock_output_config *output,
+		int32_t *width, int32_t *height) {
+	*width = round(output->width / output->scale);
+	*height = round(output->height / output->scale);
+	if (output->transform & WL_OUTPUT_TRANSFORM_90) {
+		int32_t tmp = *width;
+		*width = *height;
+		*height = tmp;
+	}
+}
+
+static uint8_t triangle(double t) {
+	double v = fmod(fabs(t), 512);
+	v = v < 256 ? v : 511 - v;
+	return v > 0 ? v : 0;
+}
+
+uint32_t get_mock_color(double x, double y) {
+	return 0xff000000 | (uint32_t)triangle(x) << 16 |
+		(uint32_t)triangle(y) << 8 | triangle(x + y);
+}
+
+// Cosine and sine of the rotation
+static void get_rotation(uint32_t transform, int *c, int *s) {
+	static const int cosines[] = { 1, 0, -1, 0 };
+	static const int sines[] = { 0, 1, 0, -1 };
+	*c = cosines[transform & 3];
+	*s = sines[transform & 3];
+}
+
+/*
+ * Buffer pixels are mapped to the layout the same way as grim does, see
+ * get_output_transform() in render.c.
+ */
+
+static void get_raw_size(const struct mock_output *output, double *width,
+		double *height) {
+	*width = output->config.width;
+	*height = output->config.height;
+	if (output->config.transform & WL_OUTPUT_TRANSFORM_90) {
+		*width = output->config.height;
+		*height = output->config.width;
+	}
+}
+
+// From the buffer to the output, in logical coordinates
+static void buffer_to_logical(const struct mock_output *output, double bx,
+		double by, double *lx, double *ly) {
+	const struct mock_output_config *config = &output->config;
+	double raw_width, raw_height;
+	get_raw_size(output, &raw_width, &raw_height);
+	int c, s;
+	get_rotation(config->transform, &c, &s);
+
+	double x = (bx - config->width / 2.0) * output->logical_width / raw_width;
+	double y = (by - config->height / 2.0) * output->logical_height /
+		raw_height;
+	double rx = c * x - s * y;
+	double ry = s * x + c * y;
+	if (config->transform & WL_OUTPUT_TRANSFORM_FLIPPED) {
+		rx = -rx;
+	}
+	*lx = rx + output->logical_width / 2.0;
+	*ly = ry + output->logical_height / 2.0;
+}
+
+static void logical_to_buffer(const struct mock_output *output, double lx,
+		double ly, double *bx, double *by) {
+	const struct mock_output_config *config = &output->config;
+	double raw_width, raw_height;
+	get_raw_size(output, &raw_width, &raw_height);
+	int c, s;
+	get_rotation(config->transform, &c, &s);
+
+	double x = lx - output->logical_width / 2.0;
+	double y = ly - output->logical_height / 2.0;
+	if (config->transform & WL_OUTPUT_TRANSFORM_FLIPPED) {
+		x = -x;
+	}
+	double rx = c * x + s * y;
+	double ry = -s * x + c * y;
+	*bx = rx * raw_width / output->logical_width + config->width / 2.0;
+	*by = ry * raw_height / output->logical_height + config->height / 2.0;
+}
+
+static bool init_image(struct mock_image *image, int32_t width,
+		int32_t height, bool y_invert) {
+	image->pixels = malloc((size_t)width * height * sizeof(uint32_t));
+	if (image->pixels == NULL) {
+		fprintf(stderr, "failed to allocate frame\n");
+		return false;
+	}
+	image->width = width;
+	image->height = height;
+	image->y_invert = y_invert;
+	return true;
+}
+
+static bool render_output(struct mock_output *output) {
+	const struct mock_output_config *config = &output->config;
+	struct mock_image *image = &output->image;
+	if (!init_image(image, config->width, config->height, config->y_invert)) {
+		return false;
+	}
+	for (int32_t y = 0; y < image->height; y++) {
+		for (int32_t x = 0; x < image->width; x++) {
+			double lx, ly;
+			buffer_to_logical(output, x + 0.5, y + 0.5, &lx, &ly);
+			image->pixels[(size_t)y * image->width + x] =
+				get_mock_color(config->x + lx, config->y + ly);
+		}
+	}
+	return true;
+}
+
+static bool render_window(struct mock_image *image,
+		const struct mock_window_config *config) {
+	if (!init_image(image, config->width, config->height, config->y_invert)) {
+		return false;
+	}
+	for (int32_t y = 0; y < image->height; y++) {
+		for (int32_t x = 0; x < image->width; x++) {
+			image->pixels[(size_t)y * image->width + x] =
+				get_mock_color(x + 0.5, y + 0.5);
+		}
+	}
+	return true;
+}
+
+static void dmabuf_buffer_handle_destroy(struct wl_client *client,
+		struct wl_resource *resource) {
+	wl_resource_destroy(resource);
+}
+
+static const struct wl_buffer_interface dmabuf_buffer_impl = {
+	.destroy = dmabuf_buffer_handle_destroy,
+};
+
+static void dmabuf_buffer_handle_resource_destroy(
+		struct wl_resource *resource) {
+	struct mock_dmabuf *dmabuf = wl_resource_get_user_data(resource);
+	munmap(dmabuf->data, dmabuf->size);
+	free(dmabuf);
+}
+
+/**
+ * Get at the pixels of a buffer, which must be released with
+ * end_buffer_view().
+ */
+static bool begin_buffer_view(struct wl_resource *resource,
+		struct mock_buffer_view *view) {
+	struct wl_shm_buffer *shm_buffer = wl_shm_buffer_get(resource);
+	if (shm_buffer != NULL) {
+		wl_shm_buffer_begin_access(shm_buffer);
+		*view = (struct mock_buffer_view){
+			.shm_buffer = shm_buffer,
+			.data = wl_shm_buffer_get_data(shm_buffer),
+			.width = wl_shm_buffer_get_width(shm_buffer),
+			.height = wl_shm_buffer_get_height(shm_buffer),
+			.stride = wl_shm_buffer_get_stride(shm_buffer),
+			.format = wl_shm_buffer_get_format(shm_buffer),
+		};
+		return true;
+	}
+	if (wl_resource_instance_of(resource, &wl_buffer_interface,
+			&dmabuf_buffer_impl)) {
+		struct mock_dmabuf *dmabuf = wl_resource_get_user_data(resource);
+		*view = (struct mock_buffer_view){
+			.data = dmabuf->data,
+			.width = dmabuf->width,
+			.height = dmabuf->height,
+			.stride = dmabuf->stride,
+			.format = dmabuf->format == DRM_FORMAT_XRGB8888 ?
+				WL_SHM_FORMAT_XRGB8888 : dmabuf->format,
+		};
+		return true;
+	}
+	return false;
+}
+
+static void end_buffer_view(struct mock_buffer_view *view) {
+	if (view->shm_buffer != NULL) {
+		wl_shm_buffer_end_access(view->shm_buffer);
+	}
+}
+
+static void dmabuf_params_handle_destroy(struct wl_client *client,
+		struct wl_resource *resource) {
+	wl_resource_destroy(resource);
+}
+
+static void dmabuf_params_handle_resource_destroy(
+		struct wl_resource *resource) {
+	struct mock_dmabuf_params *params = wl_resource_get_user_data(resource);
+	if (params->fd >= 0) {
+		close(params->fd);
+	}
+	free(params);
+}
+
+static void dmabuf_params_handle_add(struct wl_client *client,
+		struct wl_resource *resource, int32_t fd, uint32_t plane_idx,
+		uint32_t offset, uint32_t stride, uint32_t modifier_hi,
+		uint32_t modifier_lo) {
+	struct mock_dmabuf_params *params = wl_resource_get_user_data(resource);
+	if (params->used) {
+		close(fd);
+		wl_resource_post_error(resource,
+			ZWP_LINUX_BUFFER_PARAMS_V1_ERROR_ALREADY_USED,
+			"params already used");
+		return;
+	}
+	if (plane_idx != 0) {
+		close(fd);
+		wl_resource_post_error(resource,
+			ZWP_LINUX_BUFFER_PARAMS_V1_ERROR_PLANE_IDX,
+			"only single-plane formats are supported");
+		return;
+	}
+	if (params->fd >= 0) {
+		close(fd);
+		wl_resource_post_error(resource,
+			ZWP_LINUX_BUFFER_PARAMS_V1_ERROR_PLANE_SET, "plane already set");
+		return;
+	}
+	params->fd = fd;
+	params->offset = offset;
+	params->stride = stride;
+	params->modifier = (uint64_t)modifier_hi << 32 | modifier_lo;
+}
+
+/**
+ * Import the buffer, or return NULL if it isn't something a compositor
+ * without a GPU could read.
+ */
+static struct wl_resource *import_dmabuf(struct wl_client *client,
+		struct wl_resource *params_resource, uint32_t id, int32_t width,
+		int32_t height, uint32_t format) {
+	struct mock_dmabuf_params *params =
+		wl_resource_get_user_data(params_resource);
+	if (params->used) {
+		wl_resource_post_error(params_resource,
+			ZWP_LINUX_BUFFER_PARAMS_V1_ERROR_ALREADY_USED,
+			"params already used");
+		return NULL;
+	}
+	params->used = true;
+	if (params->fd < 0) {
+		wl_resource_post_error(params_resource,
+			ZWP_LINUX_BUFFER_PARAMS_V1_ERROR_INCOMPLETE, "no plane set");
+		return NULL;
+	}
+	if (format != DRM_FORMAT_XRGB8888 ||
+			params->modifier != DRM_FORMAT_MOD_LINEAR ||
+			width <= 0 || height <= 0 ||
+			params->stride < (uint32_t)width * 4) {
+		return NULL;
+	}
+
+	struct mock_dmabuf *dmabuf = calloc(1, sizeof(*dmabuf));
+	if (dmabuf == NULL) {
+		return NULL;
+	}
+	// Mappings must start on a page boundary
+	if (params->offset % sysconf(_SC_PAGESIZE) != 0) {
+		free(dmabuf);
+		return NULL;
+	}
+	dmabuf->size = (size_t)params->stride * height;
+	dmabuf->data = mmap(NULL, dmabuf->size, PROT_READ | PROT_WRITE,
+		MAP_SHARED, params->fd, params->offset);
+	if (dmabuf->data == MAP_FAILED) {
+		free(dmabuf);
+		return NULL;
+	}
+	dmabuf->width = width;
+	dmabuf->height = height;
+	dmabuf->stride = params->stride;
+	dmabuf->format = format;
+
+	struct wl_resource *resource = wl_resource_create(client,
+		&wl_buffer_interface, 1, id);
+	if (resource == NULL) {
+		munmap(dmabuf->data, dmabuf->size);
+		free(dmabuf);
+		wl_client_post_no_memory(client);
+		return NULL;
+	}
+	wl_resource_set_implementation(resource, &dmabuf_buffer_impl, dmabuf,
+		dmabuf_buffer_handle_resource_destroy);
+	return resource;
+}
+
+static void dmabuf_params_handle_create(struct wl_client *client,
+		struct wl_resource *resource, int32_t width, int32_t height,
+		uint32_t format, uint32_t flags) {
+	struct wl_resource *buffer =
+		import_dmabuf(client, resource, 0, width, height, format);
+	if (buffer != NULL) {
+		zwp_linux_buffer_params_v1_send_created(resource, buffer);
+	} else {
+		zwp_linux_buffer_params_v1_send_failed(resource);
+	}
+}
+
+static void dmabuf_params_handle_create_immed(struct wl_client *client,
+		struct wl_resource *resource, uint32_t buffer_id, int32_t width,
+		int32_t height, uint32_t format, uint32_t flags) {
+	if (import_dmabuf(client, resource, buffer_id, width, height,
+			format) == NULL) {
+		wl_resource_post_error(resource,
+			ZWP_LINUX_BUFFER_PARAMS_V1_ERROR_INVALID_WL_BUFFER,
+			"failed to import DMA-BUF");
+	}
+}
+
+static const struct zwp_linux_buffer_params_v1_interface dmabuf_params_impl = {
+	.destroy = dmabuf_params_handle_destroy,
+	.add = dmabuf_params_handle_add,
+	.create = dmabuf_params_handle_create,
+	.create_immed = dmabuf_params_handle_create_immed,
+};
+
+static void linux_dmabuf_handle_destroy(struct wl_client *client,
+		struct wl_resource *resource) {
+	wl_resource_destroy(resource);
+}
+
+static void linux_dmabuf_handle_create_params(struct wl_client *client,
+		struct wl_resource *resource, uint32_t id) {
+	struct mock_dmabuf_params *params = calloc(1, sizeof(*params));
+	if (params == NULL) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	params->fd = -1;
+	struct wl_resource *params_resource = wl_resource_create(client,
+		&zwp_linux_buffer_params_v1_interface,
+		wl_resource_get_version(resource), id);
+	if (params_resource == NULL) {
+		free(params);
+		wl_client_post_no_memory(client);
+		return;
+	}
+	wl_resource_set_implementation(params_resource, &dmabuf_params_impl,
+		params, dmabuf_params_handle_resource_destroy);
+}
+
+static const struct zwp_linux_dmabuf_v1_interface linux_dmabuf_impl = {
+	.destroy = linux_dmabuf_handle_destroy,
+	.create_params = linux_dmabuf_handle_create_params,
+};
+
+static void send_frame_failed(struct mock_frame *frame) {
+	if (frame->toplevel) {
+		hyprland_toplevel_export_frame_v1_send_failed(frame->resource);
+	} else {
+		zwlr_screencopy_frame_v1_send_failed(frame->resource);
+	}
+	++frame->mock->stats.n_failed;
+}
+
+static void forget_frame_buffer(struct mock_frame *frame) {
+	if (frame->timer != NULL) {
+		wl_event_source_remove(frame->timer);
+		frame->timer = NULL;
+	}
+	if (frame->buffer != NULL) {
+		wl_list_remove(&frame->buffer_destroy.link);
+		frame->buffer = NULL;
+	}
+}
+
+/**
+ * Write the frame to the client's buffer, as a compositor reading back its
+ * framebuffer would.
+ */
+static void read_back(struct mock_frame *frame) {
+	struct mock_compositor *mock = frame->mock;
+	const struct mock_image *image = frame->image;
+	struct mock_buffer_view view;
+	begin_buffer_view(frame->buffer, &view);
+
+	struct rusage before, after;
+	getrusage(RUSAGE_THREAD, &before);
+	for (int32_t y = 0; y < frame->height; y++) {
+		int32_t src_y = frame->y +
+			(image->y_invert ? frame->height - 1 - y : y);
+		memcpy(view.data + (size_t)y * view.stride,
+			image->pixels + (size_t)src_y * image->width + frame->x,
+			(size_t)frame->width * sizeof(uint32_t));
+	}
+	getrusage(RUSAGE_THREAD, &after);
+	mock->stats.readback_faults += after.ru_minflt - before.ru_minflt;
+	if (view.shm_buffer == NULL) {
+		++mock->stats.n_dmabuf_frames;
+	}
+	end_buffer_view(&view);
+
+	forget_frame_buffer(frame);
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	uint64_t sec = now.tv_sec;
+	if (frame->toplevel) {
+		if (frame->with_damage) {
+			hyprland_toplevel_export_frame_v1_send_damage(frame->resource,
+				0, 0, frame->width, frame->height);
+		}
+		hyprland_toplevel_export_frame_v1_send_flags(frame->resource,
+			image->y_invert ?
+			HYPRLAND_TOPLEVEL_EXPORT_FRAME_V1_FLAGS_Y_INVERT : 0);
+		hyprland_toplevel_export_frame_v1_send_ready(frame->resource,
+			sec >> 32, sec & 0xffffffff, now.tv_nsec);
+	} else {
+		zwlr_screencopy_frame_v1_send_flags(frame->resource,
+			image->y_invert ? ZWLR_SCREENCOPY_FRAME_V1_FLAGS_Y_INVERT : 0);
+		if (frame->with_damage) {
+			zwlr_screencopy_frame_v1_send_damage(frame->resource,
+				0, 0, frame->width, frame->height);
+		}
+		zwlr_screencopy_frame_v1_send_ready(frame->resource,
+			sec >> 32, sec & 0xffffffff, now.tv_nsec);
+	}
+
+	double ready_time = get_time_ms();
+	++mock->stats.n_frames;
+	mock->stats.copy_to_ready_ms += ready_time - frame->copy_time;
+	mock->stats.last_ready_time = ready_time;
+}
+
+/**
+ * Fill the client's buffer with a color no layout shows, as if the frame was
+ * halfway through being written.
+ */
+static void scribble(struct mock_frame *frame) {
+	struct mock_buffer_view view;
+	begin_buffer_view(frame->buffer, &view);
+	for (int32_t y = 0; y < frame->height; y++) {
+		uint32_t *row = (uint32_t *)(view.data + (size_t)y * view.stride);
+		for (int32_t x = 0; x < frame->width; x++) {
+			row[x] = 0xffff00ff;
+		}
+	}
+	end_buffer_view(&view);
+}
+
+static int handle_readback_timer(void *data) {
+	struct mock_frame *frame = data;
+	read_back(frame);
+	return 0;
+}
+
+static void handle_buffer_destroy(struct wl_listener *listener, void *data) {
+	struct mock_frame *frame = wl_container_of(listener, frame, buffer_destroy);
+	forget_frame_buffer(frame);
+	send_frame_failed(frame);
+}
+
+static void frame_copy(struct mock_frame *frame,
+		struct wl_resource *buffer_resource, bool with_damage) {
+	struct mock_compositor *mock = frame->mock;
+	if (frame->buffer != NULL || frame->copy_time != 0) {
+		wl_resource_post_error(frame->resource, frame->toplevel ?
+			HYPRLAND_TOPLEVEL_EXPORT_FRAME_V1_ERROR_ALREADY_USED :
+			ZWLR_SCREENCOPY_FRAME_V1_ERROR_ALREADY_USED,
+			"frame already used");
+		return;
+	}
+
+	struct mock_buffer_view view;
+	bool valid = begin_buffer_view(buffer_resource, &view);
+	if (valid) {
+		valid = view.format == WL_SHM_FORMAT_XRGB8888 &&
+			view.width == frame->width && view.height == frame->height &&
+			view.stride == frame->width * 4;
+		end_buffer_view(&view);
+	}
+	if (!valid) {
+		wl_resource_post_error(frame->resource, frame->toplevel ?
+			HYPRLAND_TOPLEVEL_EXPORT_FRAME_V1_ERROR_INVALID_BUFFER :
+			ZWLR_SCREENCOPY_FRAME_V1_ERROR_INVALID_BUFFER,
+			"invalid buffer");
+		return;
+	}
+
+	frame->buffer = buffer_resource;
+	frame->buffer_destroy.notify = handle_buffer_destroy;
+	wl_resource_add_destroy_listener(buffer_resource, &frame->buffer_destroy);
+	frame->with_damage = with_damage;
+	frame->copy_time = get_time_ms();
+
+	int delay_ms = mock->readback_delay_ms;
+	if (with_damage && frame->hold_damage_ms > 0) {
+		// The client must leave the buffer alone until the frame is ready,
+		// which may well be after its next screenshot
+		scribble(frame);
+		delay_ms = frame->hold_damage_ms;
+	}
+	if (delay_ms > 0) {
+		frame->timer = wl_event_loop_add_timer(mock->loop,
+			handle_readback_timer, frame);
+		if (frame->timer != NULL) {
+			wl_event_source_timer_update(frame->timer, delay_ms);
+			return;
+		}
+	}
+	read_back(frame);
+}
+
+static void frame_handle_destroy(struct wl_client *client,
+		struct wl_resource *resource) {
+	wl_resource_destroy(resource);
+}
+
+static void frame_handle_resource_destroy(struct wl_resource *resource) {
+	struct mock_frame *frame = wl_resource_get_user_data(resource);
+	forget_frame_buffer(frame);
+	free(frame);
+}
+
+static void screencopy_frame_handle_copy(struct wl_client *client,
+		struct wl_resource *resource, struct wl_resource *buffer) {
+	frame_copy(wl_resource_get_user_data(resource), buffer, false);
+}
+
+static void screencopy_frame_handle_copy_with_damage(struct wl_client *client,
+		struct wl_resource *resource, struct wl_resource *buffer) {
+	frame_copy(wl_resource_get_user_data(resource), buffer, true);
+}
+
+static const struct zwlr_screencopy_frame_v1_interface screencopy_frame_impl = {
+	.copy = screencopy_frame_handle_copy,
+	.destroy = frame_handle_destroy,
+	.copy_with_damage = screencopy_frame_handle_copy_with_damage,
+};
+
+static void toplevel_export_frame_handle_copy(struct wl_client *client,
+		struct wl_resource *resource, struct wl_resource *buffer,
+		int32_t ignore_damage) {
+	frame_copy(wl_resource_get_user_data(resource), buffer, !ignore_damage);
+}
+
+static const struct hyprland_toplevel_export_frame_v1_interface toplevel_export_frame_impl = {
+	.copy = toplevel_export_frame_handle_copy,
+	.destroy = frame_handle_destroy,
+};
+
+/**
+ * Start a frame capturing the given part of image, or failing right away if
+ * image is NULL or the part is empty.
+ */
+static void create_frame(struct mock_compositor *mock,
+		struct wl_client *client, uint32_t version, uint32_t id,
+		bool toplevel, const struct mock_image *image, int hold_damage_ms,
+		int32_t x, int32_t y, int32_t width, int32_t height) {
+	struct mock_frame *frame = calloc(1, sizeof(*frame));
+	if (frame == NULL) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	frame->resource = wl_resource_create(client, toplevel ?
+		&hyprland_toplevel_export_frame_v1_interface :
+		&zwlr_screencopy_frame_v1_interface, version, id);
+	if (frame->resource == NULL) {
+		free(frame);
+		wl_client_post_no_memory(client);
+		return;
+	}
+	wl_resource_set_implementation(frame->resource, toplevel ?
+		(const void *)&toplevel_export_frame_impl :
+		(const void *)&screencopy_frame_impl,
+		frame, frame_handle_resource_destroy);
+	frame->mock = mock;
+	frame->toplevel = toplevel;
+	frame->image = image;
+	frame->hold_damage_ms = hold_damage_ms;
+	frame->x = x;
+	frame->y = y;
+	frame->width = width;
+	frame->height = height;
+
+	if (mock->stats.first_capture_time == 0) {
+		mock->stats.first_capture_time = get_time_ms();
+	}
+	if (image == NULL || width <= 0 || height <= 0) {
+		send_frame_failed(frame);
+		return;
+	}
+
+	uint32_t stride = width * 4;
+	if (toplevel) {
+		hyprland_toplevel_export_frame_v1_send_buffer(frame->resource,
+			WL_SHM_FORMAT_XRGB8888, width, height, stride);
+		hyprland_toplevel_export_frame_v1_send_linux_dmabuf(frame->resource,
+			DRM_FORMAT_XRGB8888, width, height);
+		hyprland_toplevel_export_frame_v1_send_buffer_done(frame->resource);
+	} else {
+		zwlr_screencopy_frame_v1_send_buffer(frame->resource,
+			WL_SHM_FORMAT_XRGB8888, width, height, stride);
+		if (version >= ZWLR_SCREENCOPY_FRAME_V1_BUFFER_DONE_SINCE_VERSION) {
+			zwlr_screencopy_frame_v1_send_linux_dmabuf(frame->resource,
+				DRM_FORMAT_XRGB8888, width, height);
+			zwlr_screencopy_frame_v1_send_buffer_done(frame->resource);
+		}
+	}
+}
+
+static void manager_handle_destroy(struct wl_client *client,
+		struct wl_resource *resource) {
+	wl_resource_destroy(resource);
+}
+
+static void screencopy_manager_handle_capture_output(struct wl_client *client,
+		struct wl_resource *resource, uint32_t id, int32_t overlay_cursor,
+		struct wl_resource *output_resource) {
+	struct mock_output *output = wl_resource_get_user_data(output_resource);
+	create_frame(output->mock, client, wl_resource_get_version(resource), id,
+		false, &output->image, output->config.hold_damage_ms, 0, 0,
+		output->image.width, output->image.height);
+}
+
+static void screencopy_manager_handle_capture_output_region(
+		struct wl_client *client, struct wl_resource *resource, uint32_t id,
+		int32_t overlay_cursor, struct wl_resource *output_resource,
+		int32_t x, int32_t y, int32_t width, int32_t height) {
+	struct mock_output *output = wl_resource_get_user_data(output_resource);
+
+	// Round outwards to whole buffer pixels
+	double x1, y1, x2, y2;
+	logical_to_buffer(output, x, y, &x1, &y1);
+	logical_to_buffer(output, (double)x + width, (double)y + height,
+		&x2, &y2);
+	int32_t bx1 = floor(fmax(fmin(x1, x2) + 1e-6, 0));
+	int32_t by1 = floor(fmax(fmin(y1, y2) + 1e-6, 0));
+	int32_t bx2 = ceil(fmin(fmax(x1, x2) - 1e-6, output->image.width));
+	int32_t by2 = ceil(fmin(fmax(y1, y2) - 1e-6, output->image.height));
+
+	create_frame(output->mock, client, wl_resource_get_version(resource), id,
+		false, &output->image, output->config.hold_damage_ms, bx1, by1,
+		bx2 - bx1, by2 - by1);
+}
+
+static const struct zwlr_screencopy_manager_v1_interface screencopy_manager_impl = {
+	.capture_output = screencopy_manager_handle_capture_output,
+	.capture_output_region = screencopy_manager_handle_capture_output_region,
+	.destroy = manager_handle_destroy,
+};
+
+static void toplevel_export_manager_handle_capture_toplevel(
+		struct wl_client *client, struct wl_resource *resource, uint32_t id,
+		int32_t overlay_cursor, uint32_t handle) {
+	struct mock_compositor *mock = wl_resource_get_user_data(resource);
+	const struct mock_image *image = NULL;
+	if (handle >= MOCK_WINDOW_HANDLE &&
+			handle - MOCK_WINDOW_HANDLE < (uint32_t)mock->n_windows) {
+		image = &mock->windows[handle - MOCK_WINDOW_HANDLE];
+	}
+	create_frame(mock, client, wl_resource_get_version(resource), id, true,
+		image, 0, 0, 0, image ? image->width : 0, image ? image->height : 0);
+}
+
+static void toplevel_export_manager_handle_capture_toplevel_with_wlr_toplevel_handle(
+		struct wl_client *client, struct wl_resource *resource, uint32_t id,
+		int32_t overlay_cursor, struct wl_resource *handle) {
+	// No foreign toplevel handles are ever handed out
+	create_frame(wl_resource_get_user_data(resource), client,
+		wl_resource_get_version(resource), id, true, NULL, 0, 0, 0, 0, 0);
+}
+
+static const struct hyprland_toplevel_export_manager_v1_interface toplevel_export_manager_impl = {
+	.capture_toplevel = toplevel_export_manager_handle_capture_toplevel,
+	.destroy = manager_handle_destroy,
+	.capture_toplevel_with_wlr_toplevel_handle =
+		toplevel_export_manager_handle_capture_toplevel_with_wlr_toplevel_handle,
+};
+
+static void xdg_output_handle_destroy(struct wl_client *client,
+		struct wl_resource *resource) {
+	wl_resource_destroy(resource);
+}
+
+static const struct zxdg_output_v1_interface xdg_output_impl = {
+	.destroy = xdg_output_handle_destroy,
+};
+
+static void xdg_output_manager_handle_get_xdg_output(struct wl_client *client,
+		struct wl_resource *resource, uint32_t id,
+		struct wl_resource *output_resource) {
+	struct mock_output *output = wl_resource_get_user_data(output_resource);
+	uint32_t version = wl_resource_get_version(resource);
+	struct wl_resource *xdg_output = wl_resource_create(client,
+		&zxdg_output_v1_interface, version, id);
+	if (xdg_output == NULL) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	wl_resource_set_implementation(xdg_output, &xdg_output_impl, output, NULL);
+
+	zxdg_output_v1_send_logical_position(xdg_output, output->config.x,
+		output->config.y);
+	zxdg_output_v1_send_logical_size(xdg_output, output->logical_width,
+		output->logical_height);
+	if (version >= ZXDG_OUTPUT_V1_NAME_SINCE_VERSION) {
+		zxdg_output_v1_send_name(xdg_output, output->config.name);
+	}
+	if (version >= 3) {
+		wl_output_send_done(output_resource);
+	} else {
+		zxdg_output_v1_send_done(xdg_output);
+	}
+}
+
+static const struct zxdg_output_manager_v1_interface xdg_output_manager_impl = {
+	.destroy = manager_handle_destroy,
+	.get_xdg_output = xdg_output_manager_handle_get_xdg_output,
+};
+
+static void output_handle_release(struct wl_client *client,
+		struct wl_resource *resource) {
+	wl_resource_destroy(resource);
+}
+
+static const struct wl_output_interface output_impl = {
+	.release = output_handle_release,
+};
+
+static void output_bind(struct wl_client *client, void *data,
+		uint32_t version, uint32_t id) {
+	struct mock_output *output = data;
+	const struct mock_output_config *config = &output->config;
+	struct wl_resource *resource = wl_resource_create(client,
+		&wl_output_interface, version, id);
+	if (resource == NULL) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	wl_resource_set_implementation(resource, &output_impl, output, NULL);
+
+	wl_output_send_geometry(resource, config->x, config->y, 0, 0,
+		WL_OUTPUT_SUBPIXEL_UNKNOWN, "grim", "mock", config->transform);
+	wl_output_send_mode(resource,
+		WL_OUTPUT_MODE_CURRENT | WL_OUTPUT_MODE_PREFERRED,
+		config->width, config->height, 60000);
+	if (version >= WL_OUTPUT_SCALE_SINCE_VERSION) {
+		wl_output_send_scale(resource, ceil(config->scale));
+	}
+	if (version >= WL_OUTPUT_NAME_SINCE_VERSION) {
+		wl_output_send_name(resource, config->name);
+	}
+	if (version >= WL_OUTPUT_DONE_SINCE_VERSION) {
+		wl_output_send_done(resource);
+	}
+}
+
+static void bind_manager(struct wl_client *client, void *data,
+		uint32_t version, uint32_t id, const struct wl_interface *interface,
+		const void *impl) {
+	struct wl_resource *resource = wl_resource_create(client, interface,
+		version, id);
+	if (resource == NULL) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	wl_resource_set_implementation(resource, impl, data, NULL);
+}
+
+static void xdg_output_manager_bind(struct wl_client *client, void *data,
+		uint32_t version, uint32_t id) {
+	bind_manager(client, data, version, id,
+		&zxdg_output_manager_v1_interface, &xdg_output_manager_impl);
+}
+
+static void screencopy_manager_bind(struct wl_client *client, void *data,
+		uint32_t version, uint32_t id) {
+	bind_manager(client, data, version, id,
+		&zwlr_screencopy_manager_v1_interface, &screencopy_manager_impl);
+}
+
+static void toplevel_export_manager_bind(struct wl_client *client, void *data,
+		uint32_t version, uint32_t id) {
+	bind_manager(client, data, version, id,
+		&hyprland_toplevel_export_manager_v1_interface,
+		&toplevel_export_manager_impl);
+}
+
+static void linux_dmabuf_bind(struct wl_client *client, void *data,
+		uint32_t version, uint32_t id) {
+	struct wl_resource *resource = wl_resource_create(client,
+		&zwp_linux_dmabuf_v1_interface, version, id);
+	if (resource == NULL) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	wl_resource_set_implementation(resource, &linux_dmabuf_impl, data, NULL);
+
+	if (version >= ZWP_LINUX_DMABUF_V1_MODIFIER_SINCE_VERSION) {
+		zwp_linux_dmabuf_v1_send_modifier(resource, DRM_FORMAT_XRGB8888,
+			DRM_FORMAT_MOD_LINEAR >> 32, DRM_FORMAT_MOD_LINEAR & 0xffffffff);
+	} else {
+		zwp_linux_dmabuf_v1_send_format(resource, DRM_FORMAT_XRGB8888);
+	}
+}
+
+static void handle_client_destroy(struct wl_listener *listener, void *data) {
+	struct mock_client *client = wl_container_of(listener, client, destroy);
+	--client->mock->stats.n_clients;
+	wl_list_remove(&client->destroy.link);
+	free(client);
+}
+
+static void handle_client_created(struct wl_listener *listener, void *data) {
+	struct mock_compositor *mock =
+		wl_container_of(listener, mock, client_created);
+	struct wl_client *wl_client = data;
+
+	struct mock_client *client = calloc(1, sizeof(*client));
+	if (client == NULL) {
+		wl_client_post_no_memory(wl_client);
+		return;
+	}
+	client->mock = mock;
+	client->destroy.notify = handle_client_destroy;
+	wl_client_add_destroy_listener(wl_client, &client->destroy);
+
+	++mock->stats.n_clients;
+	if (mock->stats.connect_time == 0) {
+		mock->stats.connect_time = get_time_ms();
+	}
+}
+
+struct mock_compositor *create_mock_compositor(
+		const struct mock_layout *layout, int readback_delay_ms) {
+	struct mock_compositor *mock = calloc(1, sizeof(*mock));
+	if (mock == NULL) {
+		return NULL;
+	}
+	mock->readback_delay_ms = readback_delay_ms;
+
+	mock->display = wl_display_create();
+	if (mock->display == NULL) {
+		fprintf(stderr, "failed to create display\n");
+		goto error;
+	}
+	mock->loop = wl_display_get_event_loop(mock->display);
+	mock->client_created.notify = handle_client_created;
+	wl_display_add_client_created_listener(mock->display,
+		&mock->client_created);
+
+	mock->socket = wl_display_add_socket_auto(mock->display);
+	if (mock->socket == NULL) {
+		fprintf(stderr, "failed to create Wayland socket\n");
+		goto error;
+	}
+	if (wl_display_init_shm(mock->display) != 0) {
+		fprintf(stderr, "failed to create wl_shm\n");
+		goto error;
+	}
+
+	for (int i = 0; i < layout->n_outputs; i++) {
+		struct mock_output *output = &mock->outputs[mock->n_outputs++];
+		output->mock = mock;
+		output->config = layout->outputs[i];
+		get_mock_output_logical_size(&output->config,
+			&output->logical_width, &output->logical_height);
+		if (!render_output(output)) {
+			goto error;
+		}
+		output->global = wl_global_create(mock->display, &wl_output_interface,
+			4, output, output_bind);
+		if (output->global == NULL) {
+			goto error;
+		}
+	}
+	for (int i = 0; i < layout->n_windows; i++) {
+		if (!render_window(&mock->windows[mock->n_windows++],
+				&layout->windows[i])) {
+			goto error;
+		}
+	}
+
+	if (wl_global_create(mock->display, &zxdg_output_manager_v1_interface,
+				3, mock, xdg_output_manager_bind) == NULL ||
+			wl_global_create(mock->display,
+				&zwlr_screencopy_manager_v1_interface, 3, mock,
+				screencopy_manager_bind) == NULL ||
+			wl_global_create(mock->display,
+				&hyprland_toplevel_export_manager_v1_interface, 2, mock,
+				toplevel_export_manager_bind) == NULL ||
+			wl_global_create(mock->display, &zwp_linux_dmabuf_v1_interface,
+				3, mock, linux_dmabuf_bind) == NULL) {
+		fprintf(stderr, "failed to create globals\n");
+		goto error;
+	}
+	return mock;
+
+error:
+	destroy_mock_compositor(mock);
+	return NULL;
+}
+
+void destroy_mock_compositor(struct mock_compositor *mock) {
+	if (mock->display != NULL) {
+		wl_list_remove(&mock->client_created.link);
+		wl_display_destroy(mock->display);
+	}
+	for (int i = 0; i < mock->n_outputs; i++) {
+		free(mock->outputs[i].image.pixels);
+	}
+	for (int i = 0; i < mock->n_windows; i++) {
+		free(mock->windows[i].pixels);
+	}
+	free(mock);
+}
+
+const char *get_mock_compositor_socket(struct mock_compositor *mock) {
+	return mock->socket;
+}
+
+struct wl_event_loop *get_mock_compositor_event_loop(
+		struct mock_compositor *mock) {
+	return mock->loop;
+}
+
+bool dispatch_mock_compositor(struct mock_compositor *mock, int timeout_ms) {
+	wl_display_flush_clients(mock->display);
+	if (wl_event_loop_dispatch(mock->loop, timeout_ms) != 0 &&
+			errno != EINTR) {
+		perror("failed to dispatch events");
+		return false;
+	}
+	wl_display_flush_clients(mock->display);
+	return true;
+}
+
+struct mock_stats *get_mock_compositor_stats(struct mock_compositor *mock) {
+	return &mock->stats;
+}
+
+void reset_mock_compositor_stats(struct mock_compositor *mock) {
+	mock->stats = (struct mock_stats){
+		.n_clients = mock->stats.n_clients,
+	};
+}
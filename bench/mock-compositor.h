@@ -0,0 +1,97 @@
+#ifndef _MOCK_COMPOSITOR_H
+#define _MOCK_COMPOSITOR_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <wayland-server-core.h>
+
+#define MOCK_MAX_OUTPUTS 8
+#define MOCK_MAX_WINDOWS 8
+// Handle of the first window, as passed to grim -w in hexadecimal
+#define MOCK_WINDOW_HANDLE 0x1000
+
+struct mock_output_config {
+	char name[32];
+	// Logical position in the layout
+	int32_t x, y;
+	// Mode, in buffer pixels
+	int32_t width, height;
+	// May be fractional, in which case wl_output gets it rounded up
+	double scale;
+	uint32_t transform; // enum wl_output_transform
+	// Frames are read back bottom-up
+	bool y_invert;
+	// Frames copied with damage are scribbled over right away, and only
+	// read back after this long, see frame_copy()
+	int hold_damage_ms;
+};
+
+struct mock_window_config {
+	int32_t width, height;
+	bool y_invert;
+};
+
+struct mock_layout {
+	struct mock_output_config outputs[MOCK_MAX_OUTPUTS];
+	int n_outputs;
+	struct mock_window_config windows[MOCK_MAX_WINDOWS];
+	int n_windows;
+};
+
+/**
+ * Parse a layout made of ';'-separated outputs and windows:
+ *
+ *   <width>x<height>+<x>+<y>[:scale=<scale>][:transform=<transform>][:y-invert]
+ *       [:hold-damage=<ms>]
+ *   window=<width>x<height>[:y-invert]
+ *
+ * Outputs are named MOCK-1, MOCK-2 and so on.
+ */
+bool parse_mock_layout(const char *spec, struct mock_layout *layout);
+/**
+ * Size of the output in the layout, as announced through xdg-output.
+ */
+void get_mock_output_logical_size(const struct mock_output_config *output,
+	int32_t *width, int32_t *height);
+/**
+ * Content shown at a point of the layout, in logical coordinates. Windows
+ * show the same content, from their top-left corner. Colors vary slowly, so
+ * that resampled captures stay close to it.
+ */
+uint32_t get_mock_color(double x, double y);
+
+struct mock_stats {
+	// Clients currently connected
+	int n_clients;
+	// Timestamps in ms, see get_time_ms(), or 0 if it didn't happen
+	double connect_time, first_capture_time, last_ready_time;
+	int n_frames, n_failed;
+	// Frames written to a DMA-BUF rather than to shared memory
+	int n_dmabuf_frames;
+	// From the copy request to the ready event, summed over frames
+	double copy_to_ready_ms;
+	// Minor page faults taken while writing frames to the client's buffers
+	long readback_faults;
+};
+
+struct mock_compositor;
+
+/**
+ * Create a compositor listening on a new socket in $XDG_RUNTIME_DIR, which
+ * reads frames back readback_delay_ms after being asked to.
+ */
+struct mock_compositor *create_mock_compositor(
+	const struct mock_layout *layout, int readback_delay_ms);
+void destroy_mock_compositor(struct mock_compositor *mock);
+const char *get_mock_compositor_socket(struct mock_compositor *mock);
+struct wl_event_loop *get_mock_compositor_event_loop(
+	struct mock_compositor *mock);
+/**
+ * Serve clients for up to timeout_ms, or until something happens if
+ * negative.
+ */
+bool dispatch_mock_compositor(struct mock_compositor *mock, int timeout_ms);
+struct mock_stats *get_mock_compositor_stats(struct mock_compositor *mock);
+void reset_mock_compositor_stats(struct mock_compositor *mock);
+
+#endif
@@ -0,0 +1,40 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "util.h"
+
+bool is_in_list(const char *list, const char *name) {
+	if (list == NULL) {
+		return true;
+	}
+	size_t len = strlen(name);
+	const char *p = list;
+	while (true) {
+		const char *end = strchr(p, ',');
+		size_t item_len = end ? (size_t)(end - p) : strlen(p);
+		if (item_len == len && strncmp(p, name, len) == 0) {
+			return true;
+		}
+		if (end == NULL) {
+			return false;
+		}
+		p = end + 1;
+	}
+}
+
+double get_time_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+	double x = *(const double *)a, y = *(const double *)b;
+	return x < y ? -1 : x > y;
+}
+
+double sort_median(double *values, int n) {
+	qsort(values, n, sizeof(values[0]), compare_doubles);
+	return values[n / 2];
+}
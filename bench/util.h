@@ -0,0 +1,17 @@
+#ifndef _BENCH_UTIL_H
+#define _BENCH_UTIL_H
+
+#include <stdbool.h>
+
+/**
+ * Whether name is in the comma-separated list. A NULL list has everything.
+ */
+bool is_in_list(const char *list, const char *name);
+// CLOCK_MONOTONIC, in milliseconds
+double get_time_ms(void);
+/**
+ * Sort the values and return the median.
+ */
+double sort_median(double *values, int n);
+
+#endif
@@ -55,3 +55,39 @@ bool intersect_box(struct grim_box *a, struct grim_box *b) {
 	};
 	return !is_empty_box(&box);
 }
+
+void extend_box(struct grim_box *box, struct grim_box *other) {
+	if (is_empty_box(other)) {
+		return;
+	}
+	if (is_empty_box(box)) {
+		*box = *other;
+		return;
+	}
+
+	int32_t x1 = box->x < other->x ? box->x : other->x;
+	int32_t y1 = box->y < other->y ? box->y : other->y;
+	int32_t x2 = box->x + box->width > other->x + other->width ?
+		box->x + box->width : other->x + other->width;
+	int32_t y2 = box->y + box->height > other->y + other->height ?
+		box->y + box->height : other->y + other->height;
+	box->x = x1;
+	box->y = y1;
+	box->width = x2 - x1;
+	box->height = y2 - y1;
+}
+
+void clip_box(struct grim_box *box, struct grim_box *other) {
+	int32_t x1 = box->x > other->x ? box->x : other->x;
+	int32_t y1 = box->y > other->y ? box->y : other->y;
+	int32_t x2 = box->x + box->width < other->x + other->width ?
+		box->x + box->width : other->x + other->width;
+	int32_t y2 = box->y + box->height < other->y + other->height ?
+		box->y + box->height : other->y + other->height;
+	*box = (struct grim_box){
+		.x = x1,
+		.y = y1,
+		.width = x2 > x1 ? x2 - x1 : 0,
+		.height = y2 > y1 ? y2 - y1 : 0,
+	};
+}
@@ -1,14 +1,35 @@
+#define _GNU_SOURCE // memfd_create, MAP_POPULATE
+
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <time.h>
 #include <unistd.h>
+#if HAVE_UDMABUF
+#include <linux/dma-buf.h>
+#include <linux/udmabuf.h>
+#include <sys/ioctl.h>
+#endif
 
 #include "buffer.h"
 
+#include "linux-dmabuf-unstable-v1-protocol.h"
+
+// Keep slots page-aligned so that reused memory doesn't share pages
+#define SLOT_ALIGN 4096
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+#define FOURCC(a, b, c, d) ((uint32_t)(a) | ((uint32_t)(b) << 8) | \
+	((uint32_t)(c) << 16) | ((uint32_t)(d) << 24))
+#define FOURCC_ARGB8888 FOURCC('A', 'R', '2', '4')
+#define FOURCC_XRGB8888 FOURCC('X', 'R', '2', '4')
+#define MODIFIER_LINEAR 0
+
 static void randname(char *buf) {
 	struct timespec ts;
 	clock_gettime(CLOCK_REALTIME, &ts);
@@ -38,58 +59,505 @@ static int anonymous_shm_open(void) {
 	return -1;
 }
 
-static int create_shm_file(off_t size) {
-	int fd = anonymous_shm_open();
-	if (fd < 0) {
-		return fd;
+static void prefault(void *data, size_t size) {
+#ifdef MADV_POPULATE_WRITE
+	if (madvise(data, size, MADV_POPULATE_WRITE) == 0) {
+		return;
+	}
+#endif
+	volatile char *bytes = data;
+	for (size_t i = 0; i < size; i += SLOT_ALIGN) {
+		bytes[i] = 0;
 	}
+}
 
-	if (ftruncate(fd, size) < 0) {
-		close(fd);
+static int create_shm_file(enum grim_shm_mode mode) {
+#if HAVE_MEMFD
+	unsigned int flags = MFD_CLOEXEC | MFD_ALLOW_SEALING;
+	if (mode == GRIM_SHM_HUGETLB) {
+		flags |= MFD_HUGETLB;
+	}
+	int fd = memfd_create("grim", flags);
+	if (fd >= 0) {
+		// The pool only ever grows, promise the compositor it won't shrink
+		fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_SEAL);
+		return fd;
+	}
+	if (mode == GRIM_SHM_HUGETLB || errno != ENOSYS) {
 		return -1;
 	}
+#endif
+	return anonymous_shm_open();
+}
 
-	return fd;
+struct grim_buffer_pool *create_buffer_pool(struct wl_shm *shm,
+		enum grim_shm_mode mode) {
+	struct grim_buffer_pool *pool = calloc(1, sizeof(struct grim_buffer_pool));
+	if (pool == NULL) {
+		return NULL;
+	}
+	pool->shm = shm;
+	pool->mode = mode;
+	pool->align = mode == GRIM_SHM_HUGETLB ? HUGE_PAGE_SIZE : SLOT_ALIGN;
+	pool->fd = -1;
+	pool->udmabuf_fd = -1;
+	wl_list_init(&pool->buffers);
+	return pool;
 }
 
-struct grim_buffer *create_buffer(struct wl_shm *shm, enum wl_shm_format format,
-		int32_t width, int32_t height, int32_t stride) {
-	size_t size = stride * height;
+static void destroy_buffer(struct grim_buffer *buffer) {
+	wl_list_remove(&buffer->link);
+	if (buffer->params != NULL) {
+		zwp_linux_buffer_params_v1_destroy(buffer->params);
+	}
+	if (buffer->wl_buffer != NULL) {
+		wl_buffer_destroy(buffer->wl_buffer);
+	}
+	if (buffer->dmabuf) {
+		end_buffer_read(buffer);
+		munmap(buffer->data, buffer->capacity);
+		close(buffer->dmabuf_fd);
+		close(buffer->memfd);
+	}
+	free(buffer);
+}
 
-	int fd = create_shm_file(size);
-	if (fd == -1) {
-		return NULL;
+void destroy_buffer_pool(struct grim_buffer_pool *pool) {
+	if (pool == NULL) {
+		return;
+	}
+
+	struct grim_buffer *buffer, *tmp;
+	wl_list_for_each_safe(buffer, tmp, &pool->buffers, link) {
+		destroy_buffer(buffer);
+	}
+
+	if (pool->wl_pool != NULL) {
+		wl_shm_pool_destroy(pool->wl_pool);
+	}
+	if (pool->data != NULL) {
+		munmap(pool->data, pool->size);
+	}
+	trim_buffer_pool(pool);
+	free(pool->old_mappings);
+	if (pool->fd >= 0) {
+		close(pool->fd);
+	}
+	if (pool->udmabuf_fd >= 0) {
+		close(pool->udmabuf_fd);
+	}
+	free(pool);
+}
+
+static bool grow_pool(struct grim_buffer_pool *pool, size_t size) {
+	if (size > INT32_MAX) {
+		return false;
+	}
+
+	if (pool->fd < 0) {
+		pool->fd = create_shm_file(pool->mode);
+		if (pool->fd < 0) {
+			return false;
+		}
+	}
+
+	if (pool->data != NULL) {
+		struct grim_pool_mapping *old_mappings = realloc(pool->old_mappings,
+			(pool->n_old_mappings + 1) * sizeof(*old_mappings));
+		if (old_mappings == NULL) {
+			return false;
+		}
+		pool->old_mappings = old_mappings;
+	}
+
+	if (ftruncate(pool->fd, size) < 0) {
+		return false;
+	}
+
+	int flags = MAP_SHARED;
+	if (pool->mode == GRIM_SHM_PREFAULT || pool->mode == GRIM_SHM_HUGETLB) {
+		// Allocate the new pages now rather than on the compositor's first
+		// write, so that neither side takes a major fault per page later
+		if (posix_fallocate(pool->fd, pool->size, size - pool->size) != 0) {
+			return false;
+		}
+#ifdef MAP_POPULATE
+		flags |= MAP_POPULATE;
+#endif
 	}
 
-	void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, pool->fd, 0);
 	if (data == MAP_FAILED) {
-		close(fd);
-		return NULL;
+		return false;
+	}
+	if (pool->mode == GRIM_SHM_THP) {
+		// shmem only hands out huge pages when they are faulted in through a
+		// mapping that asked for them, so populate the new pages from ours
+#ifdef MADV_HUGEPAGE
+		madvise(data, size, MADV_HUGEPAGE);
+#endif
+		prefault((char *)data + pool->size, size - pool->size);
 	}
+	if (pool->data != NULL) {
+		// Both map the same file, so the old mapping keeps seeing what the
+		// compositor writes until trim_buffer_pool()
+		pool->old_mappings[pool->n_old_mappings++] =
+			(struct grim_pool_mapping){ pool->data, pool->size };
+	}
+	pool->data = data;
+	pool->size = size;
 
-	struct wl_shm_pool *pool = wl_shm_create_pool(shm, fd, size);
-	struct wl_buffer *wl_buffer =
-		wl_shm_pool_create_buffer(pool, 0, width, height, stride, format);
-	wl_shm_pool_destroy(pool);
+	struct grim_buffer *buffer;
+	wl_list_for_each(buffer, &pool->buffers, link) {
+		if (!buffer->dmabuf) {
+			buffer->data = (char *)pool->data + buffer->offset;
+		}
+	}
 
-	close(fd);
+	if (pool->wl_pool == NULL) {
+		pool->wl_pool = wl_shm_create_pool(pool->shm, pool->fd, size);
+	} else {
+		wl_shm_pool_resize(pool->wl_pool, size);
+	}
+	return true;
+}
 
-	struct grim_buffer *buffer = calloc(1, sizeof(struct grim_buffer));
-	buffer->wl_buffer = wl_buffer;
-	buffer->data = data;
+static struct grim_buffer *find_free_slot(struct grim_buffer_pool *pool,
+		enum wl_shm_format format, int32_t width, int32_t height,
+		int32_t stride) {
+	size_t size = (size_t)stride * height;
+
+	struct grim_buffer *best = NULL;
+	struct grim_buffer *buffer;
+	wl_list_for_each(buffer, &pool->buffers, link) {
+		if (buffer->busy || buffer->dmabuf) {
+			continue;
+		}
+		if (buffer->format == format && buffer->width == width &&
+				buffer->height == height && buffer->stride == stride) {
+			return buffer;
+		}
+		if (buffer->capacity >= size &&
+				(best == NULL || buffer->capacity < best->capacity)) {
+			best = buffer;
+		}
+	}
+	return best;
+}
+
+struct grim_buffer *create_buffer(struct grim_buffer_pool *pool,
+		enum wl_shm_format format, int32_t width, int32_t height,
+		int32_t stride) {
+	size_t size = (size_t)stride * height;
+
+	struct grim_buffer *buffer =
+		find_free_slot(pool, format, width, height, stride);
+	if (buffer != NULL && buffer->wl_buffer != NULL &&
+			buffer->format == format && buffer->width == width &&
+			buffer->height == height && buffer->stride == stride) {
+		++pool->hits;
+		buffer->busy = true;
+		return buffer;
+	}
+	++pool->misses;
+
+	if (buffer == NULL) {
+		// Nothing to recycle, append a new slot to the pool
+		size_t capacity = (size + pool->align - 1) / pool->align * pool->align;
+		size_t offset = pool->size;
+		if (capacity > SIZE_MAX - offset) {
+			return NULL;
+		}
+		if (!grow_pool(pool, offset + capacity)) {
+			if (pool->mode != GRIM_SHM_HUGETLB || pool->wl_pool != NULL) {
+				return NULL;
+			}
+
+			// Most systems don't reserve any huge pages
+			fprintf(stderr, "warning: huge pages unavailable, "
+				"falling back to prefaulted pages\n");
+			if (pool->fd >= 0) {
+				close(pool->fd);
+				pool->fd = -1;
+			}
+			pool->size = 0;
+			pool->mode = GRIM_SHM_PREFAULT;
+			pool->align = SLOT_ALIGN;
+			capacity = (size + pool->align - 1) / pool->align * pool->align;
+			if (!grow_pool(pool, capacity)) {
+				return NULL;
+			}
+		}
+
+		buffer = calloc(1, sizeof(struct grim_buffer));
+		if (buffer == NULL) {
+			return NULL;
+		}
+		buffer->pool = pool;
+		buffer->offset = offset;
+		buffer->capacity = capacity;
+		buffer->data = (char *)pool->data + offset;
+		wl_list_insert(pool->buffers.prev, &buffer->link);
+	} else if (buffer->wl_buffer != NULL) {
+		wl_buffer_destroy(buffer->wl_buffer);
+		buffer->wl_buffer = NULL;
+	}
+
+	buffer->wl_buffer = wl_shm_pool_create_buffer(pool->wl_pool,
+		buffer->offset, width, height, stride, format);
 	buffer->width = width;
 	buffer->height = height;
 	buffer->stride = stride;
 	buffer->size = size;
 	buffer->format = format;
+	buffer->busy = true;
 	return buffer;
 }
 
-void destroy_buffer(struct grim_buffer *buffer) {
+void release_buffer(struct grim_buffer *buffer) {
 	if (buffer == NULL) {
 		return;
 	}
-	munmap(buffer->data, buffer->size);
-	wl_buffer_destroy(buffer->wl_buffer);
+	end_buffer_read(buffer);
+	buffer->busy = false;
+	// An import still in progress only leaves a buffer for later
+	buffer->imported = NULL;
+	buffer->imported_data = NULL;
+}
+
+void trim_buffer_pool(struct grim_buffer_pool *pool) {
+	if (pool == NULL) {
+		return;
+	}
+	for (size_t i = 0; i < pool->n_old_mappings; i++) {
+		munmap(pool->old_mappings[i].data, pool->old_mappings[i].size);
+	}
+	pool->n_old_mappings = 0;
+}
+
+struct grim_buffer *find_buffer(struct grim_buffer_pool *pool,
+		const void *data) {
+	if (pool == NULL) {
+		return NULL;
+	}
+	const unsigned char *bytes = data;
+	struct grim_buffer *buffer;
+	wl_list_for_each(buffer, &pool->buffers, link) {
+		const unsigned char *start = buffer->data;
+		if (buffer->busy && bytes >= start &&
+				bytes < start + (size_t)buffer->stride * buffer->height) {
+			return buffer;
+		}
+	}
+	return NULL;
+}
+
+bool enable_dmabuf_buffers(struct grim_buffer_pool *pool,
+		struct zwp_linux_dmabuf_v1 *linux_dmabuf) {
+#if HAVE_UDMABUF
+	if (pool->udmabuf_fd < 0) {
+		pool->udmabuf_fd = open("/dev/udmabuf", O_RDWR | O_CLOEXEC);
+		if (pool->udmabuf_fd < 0) {
+			fprintf(stderr, "failed to open /dev/udmabuf: %s\n",
+				strerror(errno));
+			return false;
+		}
+	}
+	pool->linux_dmabuf = linux_dmabuf;
+	return true;
+#else
+	return false;
+#endif
+}
+
+#if HAVE_UDMABUF
+/**
+ * Find the wl_shm format with the same layout as a DRM format, among the 32
+ * bits per pixel ones render() knows about.
+ */
+static bool get_dmabuf_shm_format(uint32_t fourcc, enum wl_shm_format *format) {
+	switch (fourcc) {
+	case FOURCC_ARGB8888:
+		*format = WL_SHM_FORMAT_ARGB8888;
+		return true;
+	case FOURCC_XRGB8888:
+		*format = WL_SHM_FORMAT_XRGB8888;
+		return true;
+	// Other wl_shm formats share their code with the DRM format
+	case WL_SHM_FORMAT_ABGR8888:
+	case WL_SHM_FORMAT_XBGR8888:
+	case WL_SHM_FORMAT_BGRA8888:
+	case WL_SHM_FORMAT_BGRX8888:
+	case WL_SHM_FORMAT_RGBA8888:
+	case WL_SHM_FORMAT_RGBX8888:
+	case WL_SHM_FORMAT_ARGB2101010:
+	case WL_SHM_FORMAT_ABGR2101010:
+	case WL_SHM_FORMAT_XRGB2101010:
+	case WL_SHM_FORMAT_XBGR2101010:
+		*format = fourcc;
+		return true;
+	default:
+		return false;
+	}
+}
+
+static void params_handle_created(void *data,
+		struct zwp_linux_buffer_params_v1 *params,
+		struct wl_buffer *wl_buffer) {
+	struct grim_buffer *buffer = data;
+	zwp_linux_buffer_params_v1_destroy(params);
+	buffer->params = NULL;
+	buffer->wl_buffer = wl_buffer;
+
+	void (*imported)(void *data, bool success) = buffer->imported;
+	buffer->imported = NULL;
+	if (imported != NULL) {
+		imported(buffer->imported_data, true);
+	}
+}
+
+static void params_handle_failed(void *data,
+		struct zwp_linux_buffer_params_v1 *params) {
+	struct grim_buffer *buffer = data;
+	// Importing system memory depends on the compositor's GPU driver, so
+	// other buffers wouldn't fare any better
+	fprintf(stderr, "warning: compositor failed to import DMA-BUF, "
+		"falling back to wl_shm\n");
+	buffer->pool->linux_dmabuf = NULL;
+
+	void (*imported)(void *data, bool success) = buffer->imported;
+	void *imported_data = buffer->imported_data;
+	if (imported != NULL) {
+		imported(imported_data, false);
+	}
+	destroy_buffer(buffer);
+}
+
+static const struct zwp_linux_buffer_params_v1_listener params_listener = {
+	.created = params_handle_created,
+	.failed = params_handle_failed,
+};
+
+static void sync_dmabuf(struct grim_buffer *buffer, uint64_t flags) {
+	struct dma_buf_sync sync = { .flags = flags | DMA_BUF_SYNC_READ };
+	while (ioctl(buffer->dmabuf_fd, DMA_BUF_IOCTL_SYNC, &sync) < 0 &&
+			(errno == EINTR || errno == EAGAIN)) {
+		// Retry
+	}
+}
+#endif
+
+struct grim_buffer *create_dmabuf_buffer(struct grim_buffer_pool *pool,
+		uint32_t fourcc, int32_t width, int32_t height,
+		void (*imported)(void *data, bool success), void *data) {
+#if HAVE_UDMABUF
+	enum wl_shm_format format;
+	if (pool->linux_dmabuf == NULL ||
+			!get_dmabuf_shm_format(fourcc, &format) ||
+			width <= 0 || height <= 0 || width > INT32_MAX / 4) {
+		return NULL;
+	}
+	int32_t stride = width * 4;
+	size_t size = (size_t)stride * height;
+
+	struct grim_buffer *buffer;
+	wl_list_for_each(buffer, &pool->buffers, link) {
+		if (buffer->dmabuf && !buffer->busy && buffer->wl_buffer != NULL &&
+				buffer->fourcc == fourcc && buffer->width == width &&
+				buffer->height == height) {
+			++pool->hits;
+			buffer->busy = true;
+			return buffer;
+		}
+	}
+	++pool->misses;
+
+	// udmabuf only takes whole pages, out of a memfd which can't shrink
+	size_t capacity = (size + SLOT_ALIGN - 1) / SLOT_ALIGN * SLOT_ALIGN;
+	buffer = calloc(1, sizeof(struct grim_buffer));
+	if (buffer == NULL) {
+		return NULL;
+	}
+	buffer->memfd = memfd_create("grim-dmabuf",
+		MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (buffer->memfd < 0) {
+		fprintf(stderr, "memfd_create failed: %s\n", strerror(errno));
+		free(buffer);
+		return NULL;
+	}
+	buffer->dmabuf_fd = -1;
+	if (ftruncate(buffer->memfd, capacity) < 0 ||
+			fcntl(buffer->memfd, F_ADD_SEALS, F_SEAL_SHRINK) < 0) {
+		fprintf(stderr, "failed to set up memfd: %s\n", strerror(errno));
+		goto error;
+	}
+	struct udmabuf_create create = {
+		.memfd = buffer->memfd,
+		.flags = UDMABUF_FLAGS_CLOEXEC,
+		.offset = 0,
+		.size = capacity,
+	};
+	buffer->dmabuf_fd = ioctl(pool->udmabuf_fd, UDMABUF_CREATE, &create);
+	if (buffer->dmabuf_fd < 0) {
+		fprintf(stderr, "failed to create udmabuf: %s\n", strerror(errno));
+		goto error;
+	}
+	buffer->data = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_SHARED,
+		buffer->memfd, 0);
+	if (buffer->data == MAP_FAILED) {
+		fprintf(stderr, "mmap failed: %s\n", strerror(errno));
+		goto error;
+	}
+
+	buffer->pool = pool;
+	buffer->dmabuf = true;
+	buffer->fourcc = fourcc;
+	buffer->capacity = capacity;
+	buffer->width = width;
+	buffer->height = height;
+	buffer->stride = stride;
+	buffer->size = size;
+	buffer->format = format;
+	buffer->busy = true;
+	buffer->imported = imported;
+	buffer->imported_data = data;
+	wl_list_insert(pool->buffers.prev, &buffer->link);
+
+	buffer->params = zwp_linux_dmabuf_v1_create_params(pool->linux_dmabuf);
+	zwp_linux_buffer_params_v1_add_listener(buffer->params, &params_listener,
+		buffer);
+	zwp_linux_buffer_params_v1_add(buffer->params, buffer->dmabuf_fd, 0, 0,
+		stride, (uint64_t)MODIFIER_LINEAR >> 32,
+		MODIFIER_LINEAR & 0xffffffff);
+	zwp_linux_buffer_params_v1_create(buffer->params, width, height, fourcc, 0);
+	return buffer;
+
+error:
+	if (buffer->dmabuf_fd >= 0) {
+		close(buffer->dmabuf_fd);
+	}
+	close(buffer->memfd);
 	free(buffer);
+	return NULL;
+#else
+	return NULL;
+#endif
+}
+
+void begin_buffer_read(struct grim_buffer *buffer) {
+#if HAVE_UDMABUF
+	if (buffer != NULL && buffer->dmabuf && !buffer->reading) {
+		sync_dmabuf(buffer, DMA_BUF_SYNC_START);
+		buffer->reading = true;
+	}
+#endif
+}
+
+void end_buffer_read(struct grim_buffer *buffer) {
+#if HAVE_UDMABUF
+	if (buffer != NULL && buffer->reading) {
+		sync_dmabuf(buffer, DMA_BUF_SYNC_END);
+		buffer->reading = false;
+	}
+#endif
 }
@@ -6,7 +6,7 @@ _grim() {
 	PREV="${COMP_WORDS[COMP_CWORD-1]}"
 
 	if [[ "$PREV" == "-t" ]]; then
-		COMPREPLY=($(compgen -W "png ppm jpeg" -- "$CUR"))
+		COMPREPLY=($(compgen -W "png ppm jpeg qoi raw" -- "$CUR"))
 		return
 	elif [[ "$PREV" == "-o" ]]; then
 		local OUTPUTS
@@ -15,10 +15,25 @@ _grim() {
 
 		COMPREPLY=($(compgen -W "$OUTPUTS" -- "$CUR"))
 		return
+	elif [[ "$PREV" == "--shm" ]]; then
+		COMPREPLY=($(compgen -W "default prefault thp hugetlb" -- "$CUR"))
+		return
+	elif [[ "$PREV" == "--filter" ]]; then
+		COMPREPLY=($(compgen -W "nearest box bilinear lanczos" -- "$CUR"))
+		return
+	elif [[ "$PREV" == "--jpeg-dct" ]]; then
+		COMPREPLY=($(compgen -W "islow ifast float" -- "$CUR"))
+		return
+	elif [[ "$PREV" == "--jpeg-subsampling" ]]; then
+		COMPREPLY=($(compgen -W "420 422 444" -- "$CUR"))
+		return
+	elif [[ "$PREV" == "--socket" || "$PREV" == "--atlas" || "$PREV" == "--variant" ]]; then
+		_filedir
+		return
 	fi
 
 	if [[ "$CUR" == -* ]]; then
-		COMPREPLY=($(compgen -W "-h -s -g -t -q -o -c" -- "$CUR"))
+		COMPREPLY=($(compgen -W "-h -s -g -t -q -o -c --daemon --client --socket --shm --dmabuf --interval --count --threads --filter --jpeg-dct --jpeg-subsampling --timings --atlas --variant --app-id --title --active" -- "$CUR"))
 		return
 	fi
 
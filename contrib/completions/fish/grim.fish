@@ -6,10 +6,29 @@ function complete_outputs
     end
 end
 
-complete -c grim -s t --exclusive --arguments 'png ppm jpeg' -d 'Output image format'
+complete -c grim -s t --exclusive --arguments 'png ppm jpeg qoi raw' -d 'Output image format'
 complete -c grim -s q --exclusive -d 'Output jpeg quality (default 80)'
+complete -c grim -s l --exclusive --arguments '0 1 2 3 4 5 6 7 8 9 fast' -d 'Output png compression level (default 6)'
 complete -c grim -s g --exclusive -d 'Region to capture: <x>,<y> <w>x<h>'
 complete -c grim -s s --exclusive -d 'Output image scale factor'
 complete -c grim -s c -d 'Include cursors in the screenshot'
 complete -c grim -s h -d 'Show help and exit'
 complete -c grim -s o --exclusive --arguments '(complete_outputs)' -d 'Output name to capture'
+complete -c grim -l daemon -d 'Serve captures requested with --client'
+complete -c grim -l client -d 'Ask a running grim daemon for the screenshot'
+complete -c grim -l socket --require-parameter --force-files -d 'Daemon socket path'
+complete -c grim -l shm --exclusive --arguments 'default prefault thp hugetlb' -d 'Capture buffer allocation'
+complete -c grim -l dmabuf -d 'Capture into DMA-BUFs when offered'
+complete -c grim -l interval --exclusive -d 'Take a screenshot every n seconds'
+complete -c grim -l count --exclusive -d 'Number of screenshots with --interval'
+complete -c grim -l threads --exclusive -d 'Number of threads processing the image'
+complete -c grim -l filter --exclusive --arguments 'nearest box bilinear lanczos' -d 'Filter used to scale outputs down'
+complete -c grim -l jpeg-dct --exclusive --arguments 'islow ifast float' -d 'Output jpeg DCT method'
+complete -c grim -l jpeg-subsampling --exclusive --arguments '420 422 444' -d 'Output jpeg chroma subsampling'
+complete -c grim -s w --exclusive --arguments 'all' -d 'Window addresses to capture'
+complete -c grim -l atlas --require-parameter --force-files -d 'Pack windows into one image, with a JSON index'
+complete -c grim -l app-id --exclusive -d 'Capture the windows with this app ID'
+complete -c grim -l title --exclusive -d 'Capture the windows whose title matches a regex'
+complete -c grim -l active -d 'Capture the active window'
+complete -c grim -l variant --require-parameter -d 'Also write a reduced copy of the image'
+complete -c grim -l timings -d 'Report how long each step took as JSON'
@@ -0,0 +1,413 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "daemon.h"
+
+#define REQUEST_VERSION 1
+#define MAX_REQUEST_SIZE 65536
+
+/**
+ * Sent by the client together with the file descriptors below, and followed
+ * by size bytes holding argc NUL-terminated arguments. The daemon answers
+ * with the int32_t exit status of the capture.
+ */
+struct request_header {
+	uint32_t version;
+	uint32_t argc;
+	uint32_t size;
+};
+
+enum {
+	REQUEST_FD_IN,
+	REQUEST_FD_OUT,
+	REQUEST_FD_ERR,
+	REQUEST_N_FDS,
+};
+
+static volatile sig_atomic_t stopped = 0;
+
+static void handle_stop_signal(int sig) {
+	stopped = 1;
+}
+
+char *get_daemon_socket_path(void) {
+	const char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+	if (runtime_dir == NULL || runtime_dir[0] == '\0') {
+		return NULL;
+	}
+
+	// One daemon per compositor
+	const char *display = getenv("WAYLAND_DISPLAY");
+	if (display == NULL || display[0] == '\0') {
+		display = "wayland-0";
+	}
+	const char *slash = strrchr(display, '/');
+	if (slash != NULL) {
+		display = slash + 1;
+	}
+
+	int len = snprintf(NULL, 0, "%s/grim-%s.sock", runtime_dir, display);
+	if (len < 0) {
+		return NULL;
+	}
+	char *path = malloc(len + 1);
+	if (path == NULL) {
+		return NULL;
+	}
+	snprintf(path, len + 1, "%s/grim-%s.sock", runtime_dir, display);
+	return path;
+}
+
+static bool set_socket_addr(struct sockaddr_un *addr, const char *path) {
+	*addr = (struct sockaddr_un){ .sun_family = AF_UNIX };
+	if (strlen(path) >= sizeof(addr->sun_path)) {
+		fprintf(stderr, "socket path '%s' is too long\n", path);
+		return false;
+	}
+	strcpy(addr->sun_path, path);
+	return true;
+}
+
+static int connect_socket(const char *path) {
+	struct sockaddr_un addr;
+	if (!set_socket_addr(&addr, path)) {
+		return -1;
+	}
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		return -1;
+	}
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static bool read_full(int fd, void *data, size_t size) {
+	char *ptr = data;
+	while (size > 0) {
+		ssize_t n = read(fd, ptr, size);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		} else if (n <= 0) {
+			return false;
+		}
+		ptr += n;
+		size -= n;
+	}
+	return true;
+}
+
+static bool write_full(int fd, const void *data, size_t size) {
+	const char *ptr = data;
+	while (size > 0) {
+		ssize_t n = write(fd, ptr, size);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		} else if (n < 0) {
+			return false;
+		}
+		ptr += n;
+		size -= n;
+	}
+	return true;
+}
+
+int send_daemon_request(const char *socket_path, int argc, char *argv[],
+		int out_fd) {
+	int sock = connect_socket(socket_path);
+	if (sock < 0) {
+		return -1;
+	}
+
+	size_t size = 0;
+	for (int i = 0; i < argc; i++) {
+		size += strlen(argv[i]) + 1;
+	}
+	if (size > MAX_REQUEST_SIZE) {
+		fprintf(stderr, "command line is too long for the daemon\n");
+		close(sock);
+		return EXIT_FAILURE;
+	}
+
+	struct request_header header = {
+		.version = REQUEST_VERSION,
+		.argc = argc,
+		.size = size,
+	};
+	int fds[REQUEST_N_FDS] = {
+		[REQUEST_FD_IN] = STDIN_FILENO,
+		[REQUEST_FD_OUT] = out_fd,
+		[REQUEST_FD_ERR] = STDERR_FILENO,
+	};
+
+	union {
+		struct cmsghdr header;
+		char data[CMSG_SPACE(sizeof(fds))];
+	} control = {0};
+	struct iovec iov = {
+		.iov_base = &header,
+		.iov_len = sizeof(header),
+	};
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.data,
+		.msg_controllen = sizeof(control.data),
+	};
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	bool ok = sendmsg(sock, &msg, 0) == sizeof(header);
+	for (int i = 0; ok && i < argc; i++) {
+		ok = write_full(sock, argv[i], strlen(argv[i]) + 1);
+	}
+
+	int32_t status;
+	if (!ok || !read_full(sock, &status, sizeof(status))) {
+		fprintf(stderr, "lost connection to the grim daemon\n");
+		close(sock);
+		return EXIT_FAILURE;
+	}
+
+	close(sock);
+	return status;
+}
+
+static int receive_request(int sock, struct request_header *header,
+		int fds[static REQUEST_N_FDS]) {
+	union {
+		struct cmsghdr header;
+		char data[CMSG_SPACE(sizeof(int) * REQUEST_N_FDS)];
+	} control = {0};
+	struct iovec iov = {
+		.iov_base = header,
+		.iov_len = sizeof(*header),
+	};
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.data,
+		.msg_controllen = sizeof(control.data),
+	};
+	ssize_t n = recvmsg(sock, &msg, 0);
+	if (n != sizeof(*header)) {
+		return -1;
+	}
+
+	int n_fds = 0;
+	for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+			cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+			n_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			memcpy(fds, CMSG_DATA(cmsg), n_fds * sizeof(int));
+		}
+	}
+	if (n_fds != REQUEST_N_FDS || (msg.msg_flags & MSG_CTRUNC) != 0) {
+		for (int i = 0; i < n_fds; i++) {
+			close(fds[i]);
+		}
+		return -1;
+	}
+
+	for (int i = 0; i < REQUEST_N_FDS; i++) {
+		fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+	}
+	return 0;
+}
+
+static int32_t handle_request(struct grim_state *state, int sock,
+		grim_request_handler handler) {
+	struct request_header header;
+	int fds[REQUEST_N_FDS];
+	if (receive_request(sock, &header, fds) != 0) {
+		return EXIT_FAILURE;
+	}
+
+	int32_t status = EXIT_FAILURE;
+	char *data = NULL;
+	char **argv = NULL;
+	if (header.version != REQUEST_VERSION || header.size == 0 ||
+			header.size > MAX_REQUEST_SIZE || header.argc == 0 ||
+			header.argc > header.size) {
+		goto out;
+	}
+
+	data = malloc(header.size);
+	argv = calloc(header.argc + 1, sizeof(char *));
+	if (data == NULL || argv == NULL ||
+			!read_full(sock, data, header.size) ||
+			data[header.size - 1] != '\0') {
+		goto out;
+	}
+
+	uint32_t argc = 0;
+	for (char *arg = data; arg < data + header.size;
+			arg += strlen(arg) + 1) {
+		if (argc == header.argc) {
+			goto out;
+		}
+		argv[argc++] = arg;
+	}
+	if (argc != header.argc) {
+		goto out;
+	}
+
+	FILE *in = fdopen(fds[REQUEST_FD_IN], "r");
+	if (in != NULL) {
+		fds[REQUEST_FD_IN] = -1;
+	}
+	FILE *out = fdopen(fds[REQUEST_FD_OUT], "w");
+	if (out != NULL) {
+		fds[REQUEST_FD_OUT] = -1;
+	}
+	if (in == NULL || out == NULL) {
+		if (in != NULL) {
+			fclose(in);
+		}
+		if (out != NULL) {
+			fclose(out);
+		}
+		goto out;
+	}
+
+	// Let the client see what went wrong
+	fflush(stderr);
+	int saved_stderr = dup(STDERR_FILENO);
+	dup2(fds[REQUEST_FD_ERR], STDERR_FILENO);
+
+	status = handler(state, argc, argv, in, out);
+
+	fflush(stderr);
+	if (saved_stderr >= 0) {
+		dup2(saved_stderr, STDERR_FILENO);
+		close(saved_stderr);
+	}
+
+	fclose(in);
+	fclose(out);
+
+out:
+	for (int i = 0; i < REQUEST_N_FDS; i++) {
+		if (fds[i] >= 0) {
+			close(fds[i]);
+		}
+	}
+	free(argv);
+	free(data);
+	return status;
+}
+
+int run_daemon(struct grim_state *state, const char *socket_path,
+		grim_request_handler handler) {
+	// Don't steal the socket from a daemon that is still alive
+	int sock = connect_socket(socket_path);
+	if (sock >= 0) {
+		close(sock);
+		fprintf(stderr, "a grim daemon is already listening on '%s'\n",
+			socket_path);
+		return EXIT_FAILURE;
+	}
+
+	struct sockaddr_un addr;
+	if (!set_socket_addr(&addr, socket_path)) {
+		return EXIT_FAILURE;
+	}
+	unlink(socket_path);
+
+	int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listen_fd < 0) {
+		perror("socket");
+		return EXIT_FAILURE;
+	}
+	fcntl(listen_fd, F_SETFD, FD_CLOEXEC);
+	if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+			listen(listen_fd, 16) < 0) {
+		fprintf(stderr, "failed to listen on '%s': %s\n", socket_path,
+			strerror(errno));
+		close(listen_fd);
+		return EXIT_FAILURE;
+	}
+
+	struct sigaction sa = { .sa_handler = handle_stop_signal };
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	// Clients going away in the middle of a capture must not kill us
+	signal(SIGPIPE, SIG_IGN);
+
+	int ret = EXIT_SUCCESS;
+	struct pollfd pollfds[] = {
+		{ .fd = wl_display_get_fd(state->display), .events = POLLIN },
+		{ .fd = listen_fd, .events = POLLIN },
+	};
+	while (!stopped) {
+		// Keep the output list up to date between requests
+		while (wl_display_prepare_read(state->display) != 0) {
+			wl_display_dispatch_pending(state->display);
+		}
+		wl_display_flush(state->display);
+
+		if (poll(pollfds, sizeof(pollfds) / sizeof(pollfds[0]), -1) < 0) {
+			wl_display_cancel_read(state->display);
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("poll");
+			ret = EXIT_FAILURE;
+			break;
+		}
+
+		if (pollfds[0].revents != 0) {
+			if (wl_display_read_events(state->display) < 0) {
+				fprintf(stderr, "lost connection to the compositor\n");
+				ret = EXIT_FAILURE;
+				break;
+			}
+		} else {
+			wl_display_cancel_read(state->display);
+		}
+		if (wl_display_dispatch_pending(state->display) < 0) {
+			fprintf(stderr, "lost connection to the compositor\n");
+			ret = EXIT_FAILURE;
+			break;
+		}
+
+		if (pollfds[1].revents & POLLIN) {
+			int client = accept(listen_fd, NULL, NULL);
+			if (client < 0) {
+				continue;
+			}
+			fcntl(client, F_SETFD, FD_CLOEXEC);
+
+			// Don't let a stuck client hold up everyone else
+			struct timeval timeout = { .tv_sec = 5 };
+			setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+				sizeof(timeout));
+
+			int32_t status = handle_request(state, client, handler);
+			write_full(client, &status, sizeof(status));
+			close(client);
+		}
+	}
+
+	close(listen_fd);
+	unlink(socket_path);
+	return ret;
+}
@@ -12,5 +12,13 @@ struct grim_box {
 bool parse_box(struct grim_box *box, const char *str);
 bool is_empty_box(struct grim_box *box);
 bool intersect_box(struct grim_box *a, struct grim_box *b);
+/**
+ * Grow box to cover other as well. An empty box becomes other.
+ */
+void extend_box(struct grim_box *box, struct grim_box *other);
+/**
+ * Shrink box to the part of it inside other, which may leave it empty.
+ */
+void clip_box(struct grim_box *box, struct grim_box *other);
 
 #endif
@@ -1,18 +1,129 @@
 #ifndef _BUFFER_H
 #define _BUFFER_H
 
+#include <stdbool.h>
 #include <wayland-client.h>
 
+struct grim_buffer_pool;
+struct zwp_linux_buffer_params_v1;
+struct zwp_linux_dmabuf_v1;
+
+/**
+ * How the memory behind the buffers is set up. By default pages are faulted
+ * in one at a time while the compositor writes to them.
+ */
+enum grim_shm_mode {
+	GRIM_SHM_DEFAULT,
+	// Allocate and map all pages before handing buffers to the compositor
+	GRIM_SHM_PREFAULT,
+	// Like GRIM_SHM_PREFAULT, asking for transparent huge pages
+	GRIM_SHM_THP,
+	// Use pages from the hugetlbfs reserve, see memfd_create(2)
+	GRIM_SHM_HUGETLB,
+};
+
 struct grim_buffer {
+	struct grim_buffer_pool *pool;
+	struct wl_list link; // grim_buffer_pool.buffers
+
 	struct wl_buffer *wl_buffer;
 	void *data;
 	int32_t width, height, stride;
 	size_t size;
 	enum wl_shm_format format;
+
+	// Slot of the pool backing this buffer
+	size_t offset, capacity;
+	bool busy;
+
+	// DMA-BUFs have a memfd of their own rather than a slot of the pool, see
+	// create_dmabuf_buffer()
+	bool dmabuf;
+	uint32_t fourcc;
+	int memfd, dmabuf_fd;
+	// Between begin_buffer_read() and end_buffer_read()
+	bool reading;
+	// Import still in progress, wl_buffer is NULL until it's done
+	struct zwp_linux_buffer_params_v1 *params;
+	void (*imported)(void *data, bool success);
+	void *imported_data;
+};
+
+/**
+ * A mapping of the pool replaced by a larger one, see trim_buffer_pool().
+ */
+struct grim_pool_mapping {
+	void *data;
+	size_t size;
 };
 
-struct grim_buffer *create_buffer(struct wl_shm *shm, enum wl_shm_format format,
-	int32_t width, int32_t height, int32_t stride);
-void destroy_buffer(struct grim_buffer *buffer);
+/**
+ * All buffers are carved out of a single wl_shm_pool which only ever grows.
+ * Released buffers are kept around and handed out again when a capture asks
+ * for the same format and size.
+ */
+struct grim_buffer_pool {
+	struct wl_shm *shm;
+	struct wl_shm_pool *wl_pool;
+	enum grim_shm_mode mode;
+	size_t align;
+	int fd;
+	void *data;
+	size_t size;
+	// Growing the pool moves every buffer's data to the new mapping, while
+	// readers may still hold pointers into the old ones
+	struct grim_pool_mapping *old_mappings;
+	size_t n_old_mappings;
+
+	struct wl_list buffers; // grim_buffer.link
+
+	// Set by enable_dmabuf_buffers(), and cleared again once the compositor
+	// fails to import one
+	struct zwp_linux_dmabuf_v1 *linux_dmabuf;
+	int udmabuf_fd;
+
+	// Requests served by an existing wl_buffer, and the others
+	size_t hits, misses;
+};
+
+struct grim_buffer_pool *create_buffer_pool(struct wl_shm *shm,
+	enum grim_shm_mode mode);
+void destroy_buffer_pool(struct grim_buffer_pool *pool);
+
+struct grim_buffer *create_buffer(struct grim_buffer_pool *pool,
+	enum wl_shm_format format, int32_t width, int32_t height, int32_t stride);
+void release_buffer(struct grim_buffer *buffer);
+/**
+ * Unmap what the pool used before it last grew. Only call this once nothing
+ * reads the data of buffers handed out before then, e.g. between captures.
+ */
+void trim_buffer_pool(struct grim_buffer_pool *pool);
+/**
+ * Find the busy buffer which data points into, if any.
+ */
+struct grim_buffer *find_buffer(struct grim_buffer_pool *pool,
+	const void *data);
+
+/**
+ * Let create_dmabuf_buffer() turn memfds into DMA-BUFs through /dev/udmabuf.
+ */
+bool enable_dmabuf_buffers(struct grim_buffer_pool *pool,
+	struct zwp_linux_dmabuf_v1 *linux_dmabuf);
+/**
+ * Hand out a linear DMA-BUF with the given DRM format, or NULL if DMA-BUFs
+ * are disabled or the format isn't supported. Unless the buffer was used
+ * before, its wl_buffer is NULL until the compositor is done importing it,
+ * which imported is told about. On failure the buffer is destroyed right
+ * after imported returns, and no more DMA-BUFs are handed out.
+ */
+struct grim_buffer *create_dmabuf_buffer(struct grim_buffer_pool *pool,
+	uint32_t fourcc, int32_t width, int32_t height,
+	void (*imported)(void *data, bool success), void *data);
+/**
+ * Make what the compositor wrote to a DMA-BUF visible to the CPU, until the
+ * buffer is handed back to the compositor. Does nothing for shm buffers.
+ */
+void begin_buffer_read(struct grim_buffer *buffer);
+void end_buffer_read(struct grim_buffer *buffer);
 
 #endif
@@ -0,0 +1,22 @@
+#ifndef _DAEMON_H
+#define _DAEMON_H
+
+#include <stdio.h>
+
+#include "grim.h"
+
+/**
+ * Called for each capture request received by the daemon, with the client's
+ * command line. in is the client's standard input and out the stream the
+ * image must be written to. Returns the client's exit status.
+ */
+typedef int (*grim_request_handler)(struct grim_state *state, int argc,
+	char *argv[], FILE *in, FILE *out);
+
+char *get_daemon_socket_path(void);
+int run_daemon(struct grim_state *state, const char *socket_path,
+	grim_request_handler handler);
+int send_daemon_request(const char *socket_path, int argc, char *argv[],
+	int out_fd);
+
+#endif
@@ -1,39 +1,84 @@
 #ifndef _GRIM_H
 #define _GRIM_H
 
+#include <pixman.h>
 #include <wayland-client.h>
 
 #include "box.h"
+#include "resample.h"
 
 enum grim_filetype {
 	GRIM_FILETYPE_PNG,
 	GRIM_FILETYPE_PPM,
 	GRIM_FILETYPE_JPEG,
+	GRIM_FILETYPE_QOI,
+	GRIM_FILETYPE_RAW,
 };
 
+enum grim_jpeg_dct {
+	GRIM_JPEG_DCT_ISLOW,
+	GRIM_JPEG_DCT_IFAST,
+	GRIM_JPEG_DCT_FLOAT,
+};
+
+enum grim_jpeg_subsampling {
+	GRIM_JPEG_SUBSAMPLING_420,
+	GRIM_JPEG_SUBSAMPLING_422,
+	GRIM_JPEG_SUBSAMPLING_444,
+};
+
+struct grim_buffer_pool;
+struct grim_thread_pool;
+struct grim_trace;
+
 struct grim_state {
 	struct wl_display *display;
 	struct wl_registry *registry;
 	struct wl_shm *shm;
+	struct grim_buffer_pool *buffer_pool;
+	struct grim_thread_pool *thread_pool;
+	// Weights of the resampler, see render.c
+	struct grim_resample_cache *resample_cache;
+	// Used when downscaling outputs
+	enum grim_resample_filter resample_filter;
+	// Rendering started while frames are still coming in, see render.h
+	struct grim_render_job *render_job;
+	// Only set with --timings
+	struct grim_trace *trace;
 	struct zxdg_output_manager_v1 *xdg_output_manager;
 	struct wl_list outputs;
 
 	bool use_win;
-
-	union {
-		struct zwlr_screencopy_manager_v1 *screencopy_manager;
-		struct hyprland_toplevel_export_manager_v1 *toplevel_export_manager;
-	};
-
-	size_t n_done;
+	// Only copy frames once they are damaged, see --interval
+	bool use_damage;
+	// Don't let render() return images backed by capture buffers
+	bool copy_image;
+	// Capture buffers won't be written to again once the image is written,
+	// see write_to_raw_stream()
+	bool final_capture;
+
+	struct zwlr_screencopy_manager_v1 *screencopy_manager;
+	struct hyprland_toplevel_export_manager_v1 *toplevel_export_manager;
+	// Only bound with --dmabuf
+	struct zwp_linux_dmabuf_v1 *linux_dmabuf;
+	bool use_dmabuf;
+
+	// Only bound when windows are looked up, see init_toplevels()
+	struct zwlr_foreign_toplevel_manager_v1 *toplevel_manager;
+	uint32_t toplevel_manager_name, toplevel_manager_version;
+	struct wl_list toplevels; // grim_toplevel.link
+
+	size_t n_done, n_failed;
 };
 
 struct grim_buffer;
+struct grim_toplevel;
 
 struct grim_output {
 	struct grim_state *state;
 	struct wl_output *wl_output;
 	struct zxdg_output_v1 *xdg_output;
+	uint32_t global_name;
 	struct wl_list link;
 
 	struct grim_box geometry;
@@ -44,7 +89,22 @@ struct grim_output {
 	double logical_scale; // guessed from the logical size
 	char *name;
 
+	// Region of the layout covered by the buffer, in layout coordinates
+	struct grim_box capture_geometry;
+
+	// Buffer types the compositor offered for the current frame
+	struct {
+		bool shm, dmabuf;
+		uint32_t shm_format; // enum wl_shm_format
+		uint32_t shm_width, shm_height, shm_stride;
+		uint32_t dmabuf_format; // DRM format
+		uint32_t dmabuf_width, dmabuf_height;
+	} offer;
+
 	struct grim_buffer *buffer;
+	// Part of the buffer which changed since the last render, in buffer
+	// coordinates
+	pixman_region32_t damage;
 
 	union {
 		struct zwlr_screencopy_frame_v1 *screencopy_frame;
@@ -56,6 +116,10 @@ struct grim_output {
 		uint32_t toplevel_export_frame_flags; // enum hyprland_toplevel_export_frame_v1_flags
 	};
 
+	// Window captured through a fake output, by address or by toplevel
+	uint32_t window_handle;
+	struct grim_toplevel *toplevel;
+
 };
 
 #endif
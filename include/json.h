@@ -0,0 +1,11 @@
+#ifndef _JSON_H
+#define _JSON_H
+
+#include <stdio.h>
+
+/**
+ * Write str as a quoted JSON string, or null if it is NULL.
+ */
+void write_json_string(FILE *stream, const char *str);
+
+#endif
@@ -11,5 +11,7 @@ void apply_output_transform(enum wl_output_transform transform,
 double get_output_rotation(enum wl_output_transform transform);
 int get_output_flipped(enum wl_output_transform transform);
 void guess_output_logical_geometry(struct grim_output *output);
+bool get_output_capture_region(struct grim_output *output,
+	struct grim_box *geometry, double scale, struct grim_box *region);
 
 #endif
@@ -0,0 +1,30 @@
+#ifndef _PACK_H
+#define _PACK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Convert a row of native-endian premultiplied ARGB pixels to RGB bytes, or
+ * to straight-alpha RGBA bytes unless fully_opaque is set. Uses the fastest
+ * implementation the CPU supports.
+ */
+void pack_row32(uint8_t *restrict row_out, const uint32_t *restrict row_in,
+	size_t width, bool fully_opaque);
+
+typedef void (*grim_pack_row_func)(uint8_t *restrict row_out,
+	const uint32_t *restrict row_in, size_t width, bool fully_opaque);
+
+struct grim_pack_impl {
+	const char *name;
+	grim_pack_row_func pack_row;
+};
+
+/**
+ * Get the implementations of pack_row32() the CPU supports, starting with the
+ * scalar one, so that tests can check them against each other.
+ */
+const struct grim_pack_impl *get_pack_impls(size_t *n_impls);
+
+#endif
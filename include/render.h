@@ -5,7 +5,87 @@
 
 #include "grim.h"
 
+// Granularity at which damage is tracked in the common image
+#define RENDER_TILE_SIZE 64
+
+/**
+ * Composite the captured outputs into an image covering geometry. Unless
+ * state->copy_image is set, the image may point into a capture buffer, in
+ * which case it must be released before the buffer. The image is
+ * x8r8g8b8 when none of its pixels can be translucent, and a8r8g8b8 when
+ * that can't be ruled out.
+ */
 pixman_image_t *render(struct grim_state *state, struct grim_box *geometry,
 	double scale);
+/**
+ * Whether render() would know the image to be opaque, see above.
+ */
+bool is_render_opaque(struct grim_state *state, struct grim_box *geometry,
+	double scale);
+/**
+ * Bring an image previously returned by render() up to date, redrawing only
+ * the tiles covered by the outputs' damage. Outputs whose frame is still
+ * pending keep their previous pixels. Returns the number of redrawn tiles, or
+ * -1 on error.
+ */
+int render_damage(struct grim_state *state, struct grim_box *geometry,
+	double scale, pixman_image_t *common_image);
+/**
+ * How the output's buffer is resampled and blended into the image. resampled
+ * is set when the buffer goes through state->resample_filter rather than
+ * through filter.
+ */
+void get_render_output_method(struct grim_state *state,
+	struct grim_output *output, struct grim_box *geometry, double scale,
+	pixman_filter_t *filter, pixman_op_t *op, bool *resampled);
+/**
+ * Scale an image returned by render() down to width x height, in the same
+ * format, with state->resample_filter and using all threads of the pool.
+ * Returns a new reference to image when its size already matches.
+ */
+pixman_image_t *render_downscaled(struct grim_state *state,
+	pixman_image_t *image, int32_t width, int32_t height);
+
+struct grim_render_job;
+
+/**
+ * Start rendering while frames are still being captured: the parts of the
+ * image covered by an output are composited on the thread pool as soon as
+ * its frame is ready and the buffers of all outputs are known, and the image
+ * is handed out row by row. Returns NULL when render() is a better fit.
+ */
+struct grim_render_job *start_render_job(struct grim_state *state,
+	struct grim_box *geometry, double scale);
+/**
+ * Tell the job that the output's buffer for the frame is known.
+ */
+void render_job_output_buffer(struct grim_render_job *job,
+	struct grim_output *output);
+void render_job_output_ready(struct grim_render_job *job,
+	struct grim_output *output);
+/**
+ * Forget about an output going away in the middle of the job, which then
+ * fails.
+ */
+void render_job_remove_output(struct grim_render_job *job,
+	struct grim_output *output);
+/**
+ * Get the image to encode, once the buffers of all outputs are known and it
+ * can be told whether it is opaque, like with render(). The job keeps a
+ * reference.
+ */
+pixman_image_t *get_render_job_image(struct grim_render_job *job);
+/**
+ * Wait until the first y rows of the job's image are final. Returns false if
+ * they never will be because the job failed. Returns true right away when job
+ * is NULL.
+ */
+bool wait_render_job_rows(struct grim_render_job *job, int32_t y);
+/**
+ * Wait for all queued compositing to be done, and release anyone waiting for
+ * rows. Returns false if part of the image couldn't be rendered.
+ */
+bool finish_render_job(struct grim_render_job *job);
+void destroy_render_job(struct grim_render_job *job);
 
 #endif
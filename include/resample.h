@@ -0,0 +1,70 @@
+#ifndef _RESAMPLE_H
+#define _RESAMPLE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+enum grim_resample_filter {
+	GRIM_RESAMPLE_NEAREST,
+	GRIM_RESAMPLE_BOX,
+	GRIM_RESAMPLE_BILINEAR,
+	GRIM_RESAMPLE_LANCZOS,
+};
+
+const char *get_resample_filter_name(enum grim_resample_filter filter);
+bool parse_resample_filter(const char *str,
+	enum grim_resample_filter *filter);
+
+/**
+ * How pixels are taken from the source along one axis of the destination:
+ * pixel d of the destination covers [d, d + 1), which lands on
+ * [(d - offset) / scale, (d + 1 - offset) / scale) in the source. scale is
+ * negative when the axis is flipped.
+ */
+struct grim_resample_axis {
+	enum grim_resample_filter filter;
+	int32_t src_size, dst_size;
+	double scale, offset;
+};
+
+struct grim_resample_weights;
+struct grim_resample_cache;
+
+/**
+ * The cache keeps the weights of recently used axes, so that the bands of an
+ * image and the following screenshots don't compute them again.
+ */
+struct grim_resample_cache *create_resample_cache(void);
+void destroy_resample_cache(struct grim_resample_cache *cache);
+/**
+ * Get the weights for an axis, to be released once done with them. Safe to
+ * call from several threads. cache may be NULL, in which case the weights
+ * are computed every time. Returns NULL on allocation failure.
+ */
+struct grim_resample_weights *get_resample_weights(
+	struct grim_resample_cache *cache, const struct grim_resample_axis *axis);
+void release_resample_weights(struct grim_resample_cache *cache,
+	struct grim_resample_weights *weights);
+
+struct grim_resample_src {
+	const unsigned char *data;
+	// Offsets in bytes between neighbouring pixels along the x and y axes of
+	// the destination, so that rotated buffers are read in place
+	ptrdiff_t x_step, y_step;
+	// Set for x8r8g8b8 and alike, whose alpha byte is ignored
+	bool opaque;
+};
+
+/**
+ * Resample the width x height pixels at x, y in the destination, in the
+ * coordinates of the weights, from src. dst points to the first of them.
+ * Pixels are native-endian premultiplied ARGB, and the result is opaque when
+ * src is. Safe to call from several threads on different pixels.
+ */
+bool resample_image(const struct grim_resample_src *src,
+	const struct grim_resample_weights *x_weights,
+	const struct grim_resample_weights *y_weights, uint32_t *dst,
+	int dst_stride, int32_t x, int32_t y, int32_t width, int32_t height);
+
+#endif
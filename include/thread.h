@@ -0,0 +1,48 @@
+#ifndef _THREAD_H
+#define _THREAD_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+typedef void (*grim_task_func)(void *data);
+
+struct grim_thread_pool;
+
+/**
+ * Create a pool running tasks on n_threads threads, the calling thread
+ * included. With a single thread, tasks run in task_group_wait().
+ */
+struct grim_thread_pool *create_thread_pool(int n_threads);
+void destroy_thread_pool(struct grim_thread_pool *pool);
+int get_thread_pool_size(struct grim_thread_pool *pool);
+int get_default_thread_count(void);
+
+/**
+ * A batch of tasks, waited for together. Several threads may each run their
+ * own groups on the same pool.
+ */
+struct grim_task_group {
+	struct grim_thread_pool *pool;
+	// Tasks queued or running, protected by the pool's lock
+	size_t n_pending;
+	pthread_cond_t done_cond;
+};
+
+void init_task_group(struct grim_task_group *group,
+	struct grim_thread_pool *pool);
+/**
+ * Wait for the remaining tasks of the group, then release it.
+ */
+void finish_task_group(struct grim_task_group *group);
+/**
+ * Queue a task. It may start running right away on another thread.
+ */
+void task_group_add(struct grim_task_group *group, grim_task_func func,
+	void *data);
+/**
+ * Help running the group's queued tasks and return once all of them are
+ * done. Tasks may be added to the group again afterwards.
+ */
+void task_group_wait(struct grim_task_group *group);
+
+#endif
@@ -0,0 +1,24 @@
+#ifndef _TOPLEVEL_H
+#define _TOPLEVEL_H
+
+#include <stdbool.h>
+
+#include "grim.h"
+
+struct grim_toplevel {
+	struct grim_state *state;
+	struct zwlr_foreign_toplevel_handle_v1 *handle;
+	struct wl_list link; // grim_state.toplevels
+
+	char *title, *app_id;
+	bool activated;
+};
+
+/**
+ * Start following the compositor's toplevels, unless already done. Returns
+ * false if wlr-foreign-toplevel-management-unstable-v1 isn't supported.
+ */
+bool init_toplevels(struct grim_state *state);
+void finish_toplevels(struct grim_state *state);
+
+#endif
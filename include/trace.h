@@ -0,0 +1,69 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <pixman.h>
+#include <stdio.h>
+
+#include "grim.h"
+
+/*
+ * Everything taking a trace does nothing when it is NULL, which is the case
+ * unless --timings is given.
+ */
+
+enum grim_trace_phase {
+	GRIM_TRACE_CONNECT, // wl_display_connect()
+	GRIM_TRACE_REGISTRY, // registry roundtrip
+	GRIM_TRACE_XDG_OUTPUT, // xdg-output roundtrip
+	GRIM_TRACE_CAPTURE, // from the first frame request to the last frame
+	GRIM_TRACE_RENDER,
+	GRIM_TRACE_ENCODE,
+	GRIM_TRACE_CLOSE, // flushing and closing the output file
+	GRIM_TRACE_N_PHASES,
+};
+
+enum grim_trace_frame_event {
+	GRIM_TRACE_FRAME_REQUEST,
+	GRIM_TRACE_FRAME_BUFFER, // the buffer parameters are known
+	GRIM_TRACE_FRAME_COPY,
+	GRIM_TRACE_FRAME_READY,
+	GRIM_TRACE_N_FRAME_EVENTS,
+};
+
+struct grim_trace;
+
+struct grim_trace *create_trace(void);
+void destroy_trace(struct grim_trace *trace);
+
+/**
+ * Record the time a phase starts or ends. Phases may overlap, and each of
+ * them may be timed from a different thread.
+ */
+void trace_phase_start(struct grim_trace *trace, enum grim_trace_phase phase);
+void trace_phase_end(struct grim_trace *trace, enum grim_trace_phase phase);
+/**
+ * Record the time the compositor got to some point of the output's frame.
+ * Only called from the thread dispatching compositor events.
+ */
+void trace_frame_event(struct grim_trace *trace, struct grim_output *output,
+	enum grim_trace_frame_event event);
+/**
+ * Record the image handed to the encoder. bytes_allocated is 0 when it points
+ * into a capture buffer.
+ */
+void trace_image(struct grim_trace *trace, pixman_image_t *image,
+	size_t bytes_allocated, struct grim_box *geometry, double scale);
+/**
+ * Record the size of the encoded image, -1 if unknown.
+ */
+void trace_encoded(struct grim_trace *trace, const char *filetype,
+	long long bytes_written);
+
+/**
+ * Write the report as a single JSON object, once the image is written and
+ * before the outputs are released.
+ */
+void write_trace(struct grim_trace *trace, struct grim_state *state,
+	FILE *stream);
+
+#endif
@@ -4,6 +4,15 @@
 #include <pixman.h>
 #include <stdio.h>
 
-int write_to_jpeg_stream(pixman_image_t *image, FILE *stream, int quality);
+#include "grim.h"
+#include "render.h"
+
+/**
+ * Write image as a JPEG file. With more than one thread in pool, large images
+ * are compressed in strips on all of them, separated by restart markers.
+ */
+int write_to_jpeg_stream(pixman_image_t *image, FILE *stream, int quality,
+	enum grim_jpeg_dct dct, enum grim_jpeg_subsampling subsampling,
+	struct grim_thread_pool *pool, struct grim_render_job *job);
 
 #endif
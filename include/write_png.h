@@ -4,6 +4,18 @@
 #include <pixman.h>
 #include <stdio.h>
 
-int write_to_png_stream(pixman_image_t *image, FILE *stream, int comp_level);
+#include "render.h"
+
+// Compression level favouring speed over size
+#define GRIM_PNG_LEVEL_FAST -1
+
+struct grim_thread_pool;
+
+/**
+ * Write image as a PNG file. With more than one thread in pool, large images
+ * are compressed in strips on all of them.
+ */
+int write_to_png_stream(pixman_image_t *image, FILE *stream, int comp_level,
+	struct grim_thread_pool *pool, struct grim_render_job *job);
 
 #endif
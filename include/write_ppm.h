@@ -4,6 +4,9 @@
 #include <pixman.h>
 #include <stdio.h>
 
-int write_to_ppm_stream(pixman_image_t *image, FILE *stream);
+#include "render.h"
+
+int write_to_ppm_stream(pixman_image_t *image, FILE *stream,
+	struct grim_render_job *job);
 
 #endif
@@ -0,0 +1,18 @@
+#ifndef _WRITE_QOI_H
+#define _WRITE_QOI_H
+
+#include <pixman.h>
+#include <stdio.h>
+
+#include "render.h"
+
+struct grim_thread_pool;
+
+/**
+ * Write image as a QOI file. With more than one thread in pool, large images
+ * are encoded in strips on all of them.
+ */
+int write_to_qoi_stream(pixman_image_t *image, FILE *stream,
+	struct grim_thread_pool *pool, struct grim_render_job *job);
+
+#endif
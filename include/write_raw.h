@@ -0,0 +1,45 @@
+#ifndef _WRITE_RAW_H
+#define _WRITE_RAW_H
+
+#include <pixman.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "render.h"
+
+/*
+ * Raw files start with a header made of these little-endian 32-bit fields,
+ * followed by height rows of stride bytes each, in the given wl_shm format.
+ */
+#define GRIM_RAW_MAGIC 0x57415247 // "GRAW"
+#define GRIM_RAW_HEADER_SIZE 32
+
+enum grim_raw_header_field {
+	GRIM_RAW_FIELD_MAGIC,
+	GRIM_RAW_FIELD_HEADER_SIZE,
+	GRIM_RAW_FIELD_WIDTH,
+	GRIM_RAW_FIELD_HEIGHT,
+	GRIM_RAW_FIELD_STRIDE,
+	GRIM_RAW_FIELD_FORMAT, // enum wl_shm_format
+	GRIM_RAW_FIELD_FLAGS, // enum grim_raw_flags
+	GRIM_RAW_FIELD_RESERVED,
+};
+
+enum grim_raw_flags {
+	// Color channels are premultiplied by the alpha channel
+	GRIM_RAW_PREMULTIPLIED = 1 << 0,
+};
+
+struct grim_buffer_pool;
+
+/**
+ * Write image as a raw file. Images pointing into a capture buffer of
+ * buffer_pool are written from the shared memory without being copied. If
+ * splice is set, the buffer's pages may be handed to a pipe as they are, so
+ * they must not be written to again.
+ */
+int write_to_raw_stream(pixman_image_t *image, FILE *stream,
+	struct grim_buffer_pool *buffer_pool, bool splice,
+	struct grim_render_job *job);
+
+#endif
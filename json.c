@@ -0,0 +1,19 @@
+#include "json.h"
+
+void write_json_string(FILE *stream, const char *str) {
+	if (str == NULL) {
+		fprintf(stream, "null");
+		return;
+	}
+	fputc('"', stream);
+	for (const char *c = str; *c != '\0'; c++) {
+		if (*c == '"' || *c == '\\') {
+			fprintf(stream, "\\%c", *c);
+		} else if ((unsigned char)*c < 0x20) {
+			fprintf(stream, "\\u%04x", *c);
+		} else {
+			fputc(*c, stream);
+		}
+	}
+	fputc('"', stream);
+}
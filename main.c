@@ -1,51 +1,218 @@
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <getopt.h>
 #include <limits.h>
+#include <math.h>
 #include <pixman.h>
+#include <poll.h>
+#include <pthread.h>
+#include <regex.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
 #include <wordexp.h>
 
 #include "buffer.h"
+#include "daemon.h"
 #include "grim.h"
+#include "json.h"
 #include "output-layout.h"
 #include "render.h"
+#include "resample.h"
+#include "thread.h"
+#include "toplevel.h"
+#include "trace.h"
 #include "write_ppm.h"
 #if HAVE_JPEG
 #include "write_jpg.h"
 #endif
 #include "write_png.h"
+#include "write_qoi.h"
+#include "write_raw.h"
 
 #include "wlr-screencopy-unstable-v1-protocol.h"
 #include "xdg-output-unstable-v1-protocol.h"
 #include "hyprland-toplevel-export-v1-protocol.h"
+#include "wlr-foreign-toplevel-management-unstable-v1-protocol.h"
+#include "linux-dmabuf-unstable-v1-protocol.h"
+
+/**
+ * Make sure the output has a buffer with the given parameters, keeping the
+ * previous one if it matches.
+ */
+static bool prepare_buffer(struct grim_output *output, uint32_t format,
+		uint32_t width, uint32_t height, uint32_t stride) {
+	struct grim_buffer *buffer = output->buffer;
+	if (buffer != NULL && !buffer->dmabuf && buffer->format == format &&
+			buffer->width == (int32_t)width &&
+			buffer->height == (int32_t)height &&
+			buffer->stride == (int32_t)stride) {
+		return true;
+	}
 
-static void toplevel_export_frame_handle_buffer(void *data,
-		struct hyprland_toplevel_export_frame_v1 *frame, uint32_t format, uint32_t width,
-		uint32_t height, uint32_t stride) {
-	struct grim_output *output = data;
-
+	release_buffer(buffer);
 	output->buffer =
-		create_buffer(output->state->shm, format, width, height, stride);
+		create_buffer(output->state->buffer_pool, format, width, height,
+			stride);
 	if (output->buffer == NULL) {
 		fprintf(stderr, "failed to create buffer\n");
-		exit(EXIT_FAILURE);
+		++output->state->n_failed;
+		return false;
+	}
+
+	// Nothing drawn from the previous buffer can be trusted anymore
+	pixman_region32_union_rect(&output->damage, &output->damage,
+		0, 0, width, height);
+	return true;
+}
+
+static void handle_dmabuf_imported(void *data, bool success);
+
+/**
+ * Same as prepare_buffer() with the offered DMA-BUF, returning false when shm
+ * has to do instead. The new buffer can't be used before it is imported.
+ */
+static bool prepare_dmabuf_buffer(struct grim_output *output) {
+	uint32_t format = output->offer.dmabuf_format;
+	uint32_t width = output->offer.dmabuf_width;
+	uint32_t height = output->offer.dmabuf_height;
+	struct grim_buffer *buffer = output->buffer;
+	if (buffer != NULL && buffer->dmabuf && buffer->fourcc == format &&
+			buffer->width == (int32_t)width &&
+			buffer->height == (int32_t)height) {
+		return true;
+	}
+
+	struct grim_buffer *dmabuf = create_dmabuf_buffer(
+		output->state->buffer_pool, format, width, height,
+		handle_dmabuf_imported, output);
+	if (dmabuf == NULL) {
+		return false;
+	}
+	release_buffer(buffer);
+	output->buffer = dmabuf;
+	pixman_region32_union_rect(&output->damage, &output->damage,
+		0, 0, width, height);
+	return true;
+}
+
+static void screencopy_frame_copy(struct grim_output *output) {
+	struct zwlr_screencopy_frame_v1 *frame = output->screencopy_frame;
+	struct grim_buffer *buffer = output->buffer;
+	if (!output->state->use_damage) {
+		zwlr_screencopy_frame_v1_copy(frame, buffer->wl_buffer);
+	} else if (zwlr_screencopy_frame_v1_get_version(frame) >= 2) {
+		zwlr_screencopy_frame_v1_copy_with_damage(frame, buffer->wl_buffer);
+	} else {
+		// No damage tracking, assume everything changed
+		zwlr_screencopy_frame_v1_copy(frame, buffer->wl_buffer);
+		pixman_region32_union_rect(&output->damage, &output->damage,
+			0, 0, buffer->width, buffer->height);
+	}
+}
+
+/**
+ * Hand the output's buffer over to the compositor for the frame.
+ */
+static void frame_copy(struct grim_output *output) {
+	struct grim_state *state = output->state;
+	end_buffer_read(output->buffer);
+	if (state->render_job != NULL) {
+		render_job_output_buffer(state->render_job, output);
+	}
+
+	trace_frame_event(state->trace, output, GRIM_TRACE_FRAME_COPY);
+	if (output->wl_output == NULL) {
+		hyprland_toplevel_export_frame_v1_copy(output->toplevel_export_frame,
+			output->buffer->wl_buffer, !state->use_damage);
+	} else {
+		screencopy_frame_copy(output);
+	}
+}
+
+/**
+ * Pick a buffer among the types offered for the frame, and copy the frame
+ * into it as soon as it's usable. DMA-BUFs spare the compositor reading its
+ * framebuffer back into shared memory.
+ */
+static void start_frame_copy(struct grim_output *output) {
+	if (output->offer.dmabuf &&
+			output->state->buffer_pool->linux_dmabuf != NULL &&
+			prepare_dmabuf_buffer(output)) {
+		if (output->buffer->wl_buffer != NULL) {
+			frame_copy(output);
+		}
+		return;
+	}
+
+	if (!output->offer.shm) {
+		fprintf(stderr, "compositor offered no usable buffer type\n");
+		++output->state->n_failed;
+		return;
 	}
+	if (prepare_buffer(output, output->offer.shm_format,
+			output->offer.shm_width, output->offer.shm_height,
+			output->offer.shm_stride)) {
+		frame_copy(output);
+	}
+}
+
+static void handle_dmabuf_imported(void *data, bool success) {
+	struct grim_output *output = data;
+	if (success) {
+		frame_copy(output);
+		return;
+	}
+
+	// The buffer is destroyed on return, and DMA-BUFs are disabled
+	output->buffer = NULL;
+	start_frame_copy(output);
+}
+
+static void offer_shm(struct grim_output *output, uint32_t format,
+		uint32_t width, uint32_t height, uint32_t stride) {
+	trace_frame_event(output->state->trace, output, GRIM_TRACE_FRAME_BUFFER);
+	output->offer.shm = true;
+	output->offer.shm_format = format;
+	output->offer.shm_width = width;
+	output->offer.shm_height = height;
+	output->offer.shm_stride = stride;
+}
+
+static void offer_dmabuf(struct grim_output *output, uint32_t format,
+		uint32_t width, uint32_t height) {
+	output->offer.dmabuf = true;
+	output->offer.dmabuf_format = format;
+	output->offer.dmabuf_width = width;
+	output->offer.dmabuf_height = height;
+}
+
+static void toplevel_export_frame_handle_buffer(void *data,
+		struct hyprland_toplevel_export_frame_v1 *frame, uint32_t format, uint32_t width,
+		uint32_t height, uint32_t stride) {
+	struct grim_output *output = data;
+	offer_shm(output, format, width, height, stride);
 
 	output->geometry.width = width;
 	output->geometry.height = height;
 
 	guess_output_logical_geometry(output);
+	output->capture_geometry = output->logical_geometry;
 }
 
 static void toplevel_export_frame_handle_damage(void *data,
 		struct hyprland_toplevel_export_frame_v1 *frame, uint32_t x, uint32_t y,
 		uint32_t width, uint32_t height) {
-	// No-op
+	struct grim_output *output = data;
+	pixman_region32_union_rect(&output->damage, &output->damage,
+		x, y, width, height);
 }
 
 static void toplevel_export_frame_handle_flags(void *data,
@@ -58,25 +225,29 @@ static void toplevel_export_frame_handle_ready(void *data,
 		struct hyprland_toplevel_export_frame_v1 *frame, uint32_t tv_sec_hi,
 		uint32_t tv_sec_lo, uint32_t tv_nsec) {
 	struct grim_output *output = data;
+	trace_frame_event(output->state->trace, output, GRIM_TRACE_FRAME_READY);
+	hyprland_toplevel_export_frame_v1_destroy(frame);
+	output->toplevel_export_frame = NULL;
+	begin_buffer_read(output->buffer);
 	++output->state->n_done;
 }
 
 static void toplevel_export_frame_handle_failed(void *data,
 		struct hyprland_toplevel_export_frame_v1 *frame) {
+	struct grim_output *output = data;
 	fprintf(stderr, "failed to copy window\n");
-	exit(EXIT_FAILURE);
+	++output->state->n_failed;
 }
 
 static void toplevel_export_frame_handle_linux_dmabuf(void *data,
 		struct hyprland_toplevel_export_frame_v1 *frame, uint32_t format,
 		uint32_t width, uint32_t height) {
-	// No-op
+	offer_dmabuf(data, format, width, height);
 }
 
 static void toplevel_export_frame_handle_buffer_done(void *data,
 		struct hyprland_toplevel_export_frame_v1 *frame) {
-	struct grim_output *output = data;
-	hyprland_toplevel_export_frame_v1_copy(frame, output->buffer->wl_buffer, 1);
+	start_frame_copy(data);
 }
 
 static const struct hyprland_toplevel_export_frame_v1_listener toplevel_export_frame_listener = {
@@ -93,15 +264,12 @@ static void screencopy_frame_handle_buffer(void *data,
 		struct zwlr_screencopy_frame_v1 *frame, uint32_t format, uint32_t width,
 		uint32_t height, uint32_t stride) {
 	struct grim_output *output = data;
+	offer_shm(output, format, width, height, stride);
 
-	output->buffer =
-		create_buffer(output->state->shm, format, width, height, stride);
-	if (output->buffer == NULL) {
-		fprintf(stderr, "failed to create buffer\n");
-		exit(EXIT_FAILURE);
+	// Starting from version 3, wait for all buffer types to be announced
+	if (zwlr_screencopy_frame_v1_get_version(frame) < 3) {
+		start_frame_copy(output);
 	}
-
-	zwlr_screencopy_frame_v1_copy(frame, output->buffer->wl_buffer);
 }
 
 static void screencopy_frame_handle_flags(void *data,
@@ -114,14 +282,40 @@ static void screencopy_frame_handle_ready(void *data,
 		struct zwlr_screencopy_frame_v1 *frame, uint32_t tv_sec_hi,
 		uint32_t tv_sec_lo, uint32_t tv_nsec) {
 	struct grim_output *output = data;
+	trace_frame_event(output->state->trace, output, GRIM_TRACE_FRAME_READY);
+	zwlr_screencopy_frame_v1_destroy(frame);
+	output->screencopy_frame = NULL;
+	begin_buffer_read(output->buffer);
 	++output->state->n_done;
+	if (output->state->render_job != NULL) {
+		render_job_output_ready(output->state->render_job, output);
+	}
 }
 
 static void screencopy_frame_handle_failed(void *data,
 		struct zwlr_screencopy_frame_v1 *frame) {
 	struct grim_output *output = data;
 	fprintf(stderr, "failed to copy output %s\n", output->name);
-	exit(EXIT_FAILURE);
+	++output->state->n_failed;
+}
+
+static void screencopy_frame_handle_damage(void *data,
+		struct zwlr_screencopy_frame_v1 *frame, uint32_t x, uint32_t y,
+		uint32_t width, uint32_t height) {
+	struct grim_output *output = data;
+	pixman_region32_union_rect(&output->damage, &output->damage,
+		x, y, width, height);
+}
+
+static void screencopy_frame_handle_linux_dmabuf(void *data,
+		struct zwlr_screencopy_frame_v1 *frame, uint32_t format,
+		uint32_t width, uint32_t height) {
+	offer_dmabuf(data, format, width, height);
+}
+
+static void screencopy_frame_handle_buffer_done(void *data,
+		struct zwlr_screencopy_frame_v1 *frame) {
+	start_frame_copy(data);
 }
 
 static const struct zwlr_screencopy_frame_v1_listener screencopy_frame_listener = {
@@ -129,6 +323,9 @@ static const struct zwlr_screencopy_frame_v1_listener screencopy_frame_listener
 	.flags = screencopy_frame_handle_flags,
 	.ready = screencopy_frame_handle_ready,
 	.failed = screencopy_frame_handle_failed,
+	.damage = screencopy_frame_handle_damage,
+	.linux_dmabuf = screencopy_frame_handle_linux_dmabuf,
+	.buffer_done = screencopy_frame_handle_buffer_done,
 };
 
 
@@ -162,6 +359,7 @@ static void xdg_output_handle_done(void *data,
 static void xdg_output_handle_name(void *data,
 		struct zxdg_output_v1 *xdg_output, const char *name) {
 	struct grim_output *output = data;
+	free(output->name);
 	output->name = strdup(name);
 }
 
@@ -218,17 +416,54 @@ static const struct wl_output_listener output_listener = {
 };
 
 
+static void add_xdg_output(struct grim_output *output) {
+	output->xdg_output = zxdg_output_manager_v1_get_xdg_output(
+		output->state->xdg_output_manager, output->wl_output);
+	zxdg_output_v1_add_listener(output->xdg_output,
+		&xdg_output_listener, output);
+}
+
+static void destroy_output(struct grim_output *output) {
+	wl_list_remove(&output->link);
+	free(output->name);
+	pixman_region32_fini(&output->damage);
+	if (output->screencopy_frame != NULL) {
+		zwlr_screencopy_frame_v1_destroy(output->screencopy_frame);
+	}
+	release_buffer(output->buffer);
+	if (output->xdg_output != NULL) {
+		zxdg_output_v1_destroy(output->xdg_output);
+	}
+	if (output->wl_output != NULL) {
+		wl_output_release(output->wl_output);
+	}
+	free(output);
+}
+
 static void handle_global(void *data, struct wl_registry *registry,
 		uint32_t name, const char *interface, uint32_t version) {
 	struct grim_state *state = data;
 
 	if (strcmp(interface, wl_shm_interface.name) == 0) {
 		state->shm = wl_registry_bind(registry, name, &wl_shm_interface, 1);
-	} else if (state->use_win) {
-		if (strcmp(interface, hyprland_toplevel_export_manager_v1_interface.name) == 0) {
-			state->toplevel_export_manager = wl_registry_bind(registry, name,
-				&hyprland_toplevel_export_manager_v1_interface, 2);
+	} else if (strcmp(interface, hyprland_toplevel_export_manager_v1_interface.name) == 0) {
+		uint32_t bind_version = (version > 2) ? 2 : version;
+		state->toplevel_export_manager = wl_registry_bind(registry, name,
+			&hyprland_toplevel_export_manager_v1_interface, bind_version);
+	} else if (strcmp(interface, zwlr_foreign_toplevel_manager_v1_interface.name) == 0) {
+		// Binding it has the compositor send all toplevels, so wait
+		// until they are needed
+		state->toplevel_manager_name = name;
+		state->toplevel_manager_version = version;
+	} else if (strcmp(interface, zwp_linux_dmabuf_v1_interface.name) == 0) {
+		// It announces every format and modifier it supports when bound
+		if (state->use_dmabuf) {
+			uint32_t bind_version = (version > 3) ? 3 : version;
+			state->linux_dmabuf = wl_registry_bind(registry, name,
+				&zwp_linux_dmabuf_v1_interface, bind_version);
 		}
+	} else if (state->use_win) {
+		// Outputs aren't needed to capture a single window
 	} else if (strcmp(interface, zxdg_output_manager_v1_interface.name) == 0) {
 		uint32_t bind_version = (version > 2) ? 2 : version;
 		state->xdg_output_manager = wl_registry_bind(registry, name,
@@ -237,19 +472,42 @@ static void handle_global(void *data, struct wl_registry *registry,
 		struct grim_output *output = calloc(1, sizeof(struct grim_output));
 		output->state = state;
 		output->scale = 1;
+		output->global_name = name;
+		pixman_region32_init(&output->damage);
 		output->wl_output =  wl_registry_bind(registry, name,
 			&wl_output_interface, 3);
 		wl_output_add_listener(output->wl_output, &output_listener, output);
 		wl_list_insert(&state->outputs, &output->link);
+		// Outputs announced before the manager are handled in connect_state()
+		if (state->xdg_output_manager != NULL) {
+			add_xdg_output(output);
+		}
 	} else if (strcmp(interface, zwlr_screencopy_manager_v1_interface.name) == 0) {
+		uint32_t bind_version = (version > 3) ? 3 : version;
 		state->screencopy_manager = wl_registry_bind(registry, name,
-			&zwlr_screencopy_manager_v1_interface, 1);
+			&zwlr_screencopy_manager_v1_interface, bind_version);
 	}
 }
 
 static void handle_global_remove(void *data, struct wl_registry *registry,
 		uint32_t name) {
-	// who cares
+	struct grim_state *state = data;
+
+	// Only matters to long-lived connections, see --daemon
+	struct grim_output *output;
+	wl_list_for_each(output, &state->outputs, link) {
+		if (output->wl_output != NULL && output->global_name == name) {
+			if (output->screencopy_frame != NULL) {
+				// Its frame will never be ready
+				++state->n_failed;
+			}
+			if (state->render_job != NULL) {
+				render_job_remove_output(state->render_job, output);
+			}
+			destroy_output(output);
+			return;
+		}
+	}
 }
 
 static const struct wl_registry_listener registry_listener = {
@@ -257,31 +515,36 @@ static const struct wl_registry_listener registry_listener = {
 	.global_remove = handle_global_remove,
 };
 
-static bool default_filename(char *filename, size_t n, int filetype) {
-	time_t time_epoch = time(NULL);
-	struct tm *time = localtime(&time_epoch);
-	if (time == NULL) {
-		perror("localtime");
-		return false;
-	}
-
-	char *format_str;
-	const char *ext = NULL;
+static const char *get_filetype_name(enum grim_filetype filetype) {
 	switch (filetype) {
 	case GRIM_FILETYPE_PNG:
-		ext = "png";
-		break;
+		return "png";
 	case GRIM_FILETYPE_PPM:
-		ext = "ppm";
-		break;
+		return "ppm";
 	case GRIM_FILETYPE_JPEG:
 #if HAVE_JPEG
-		ext = "jpeg";
-		break;
+		return "jpeg";
 #else
 		abort();
 #endif
+	case GRIM_FILETYPE_QOI:
+		return "qoi";
+	case GRIM_FILETYPE_RAW:
+		return "raw";
 	}
+	return NULL;
+}
+
+static bool default_filename(char *filename, size_t n, int filetype) {
+	time_t time_epoch = time(NULL);
+	struct tm *time = localtime(&time_epoch);
+	if (time == NULL) {
+		perror("localtime");
+		return false;
+	}
+
+	char *format_str;
+	const char *ext = get_filetype_name(filetype);
 	assert(ext != NULL);
 	char tmpstr[32];
 	sprintf(tmpstr, "%%Y%%m%%d_%%Hh%%Mm%%Ss_grim.%s", ext);
@@ -383,56 +646,417 @@ static const char usage[] =
 	"Usage: grim [options...] [output-file]\n"
 	"\n"
 	"  -h              Show help message and quit.\n"
-	"  -w <address>    Set individual window to screenshot. (Hyprland only).\n"
+	"  -w <addresses>  Set the comma-separated window addresses to screenshot,\n"
+	"                  or all. (Hyprland only).\n"
 	"  -s <factor>     Set the output image scale factor. Defaults to the\n"
 	"                  greatest output scale factor.\n"
 	"  -g <geometry>   Set the region to capture.\n"
-	"  -t png|ppm|jpeg Set the output filetype. Defaults to png.\n"
+	"  -t png|ppm|jpeg|qoi|raw\n"
+	"                  Set the output filetype. Defaults to png.\n"
 	"  -q <quality>    Set the JPEG filetype quality 0-100. Defaults to 80.\n"
-	"  -l <level>      Set the PNG filetype compression level 0-9. Defaults to 6.\n"
-	"  -o <output>     Set the output name to capture.\n"
-	"  -c              Include cursors in the screenshot.\n";
+	"  -l <level>      Set the PNG filetype compression level 0-9 or fast.\n"
+	"                  Defaults to 6.\n"
+	"  -o <outputs>    Set the comma-separated output names to capture.\n"
+	"  -c              Include cursors in the screenshot.\n"
+	"  --daemon        Stay connected to the compositor and serve captures\n"
+	"                  requested with --client.\n"
+	"  --client        Ask a running grim daemon to take the screenshot.\n"
+	"  --socket <path> Set the socket used by --daemon and --client.\n"
+	"  --shm <mode>    Set how capture buffers are allocated: default,\n"
+	"                  prefault, thp or hugetlb.\n"
+	"  --dmabuf        Capture into DMA-BUFs when the compositor offers them.\n"
+	"  --interval <s>  Take a screenshot every <s> seconds, numbering the\n"
+	"                  output files.\n"
+	"  --count <n>     Stop after <n> screenshots with --interval.\n"
+	"  --threads <n>   Set the number of threads used to process the image.\n"
+	"                  Defaults to the number of CPUs.\n"
+	"  --filter <filter>\n"
+	"                  Set the filter used to scale outputs down: nearest,\n"
+	"                  box, bilinear or lanczos. Defaults to lanczos.\n"
+	"  --jpeg-dct <method>\n"
+	"                  Set the JPEG DCT method: islow, ifast or float.\n"
+	"                  Defaults to islow.\n"
+	"  --jpeg-subsampling <mode>\n"
+	"                  Set the JPEG chroma subsampling: 420, 422 or 444.\n"
+	"                  Defaults to 420.\n"
+	"  --app-id <id>   Screenshot the windows with this app ID.\n"
+	"  --title <regex> Screenshot the windows whose title matches.\n"
+	"  --active        Screenshot the active window.\n"
+	"  --atlas <path>  Write several windows to a single image, with a JSON\n"
+	"                  index of their positions to <path>.\n"
+	"  --variant <spec>\n"
+	"                  Also write a smaller copy of the image, see grim(1).\n"
+	"                  May be given several times.\n"
+	"  --timings[=<path>]\n"
+	"                  Report how long each step took as JSON, to stderr or\n"
+	"                  to <path>.\n";
+
+enum {
+	OPT_DAEMON = 256,
+	OPT_CLIENT,
+	OPT_SOCKET,
+	OPT_SHM,
+	OPT_DMABUF,
+	OPT_INTERVAL,
+	OPT_COUNT,
+	OPT_THREADS,
+	OPT_JPEG_DCT,
+	OPT_JPEG_SUBSAMPLING,
+	OPT_TIMINGS,
+	OPT_ATLAS,
+	OPT_APP_ID,
+	OPT_TITLE,
+	OPT_ACTIVE,
+	OPT_VARIANT,
+	OPT_FILTER,
+};
 
-int main(int argc, char *argv[]) {
-	bool use_win = false;
-	int win_handle = 0;
-	double scale = 1.0;
-	bool use_greatest_scale = true;
-	struct grim_box *geometry = NULL;
-	char *geometry_output = NULL;
-	enum grim_filetype output_filetype = GRIM_FILETYPE_PNG;
-	int jpeg_quality = 80;
-	int png_level = 6; // current default png/zlib compression level
-	bool with_cursor = false;
+static const struct option long_options[] = {
+	{"daemon", no_argument, NULL, OPT_DAEMON},
+	{"client", no_argument, NULL, OPT_CLIENT},
+	{"socket", required_argument, NULL, OPT_SOCKET},
+	{"shm", required_argument, NULL, OPT_SHM},
+	{"dmabuf", no_argument, NULL, OPT_DMABUF},
+	{"interval", required_argument, NULL, OPT_INTERVAL},
+	{"count", required_argument, NULL, OPT_COUNT},
+	{"threads", required_argument, NULL, OPT_THREADS},
+	{"jpeg-dct", required_argument, NULL, OPT_JPEG_DCT},
+	{"jpeg-subsampling", required_argument, NULL, OPT_JPEG_SUBSAMPLING},
+	{"timings", optional_argument, NULL, OPT_TIMINGS},
+	{"atlas", required_argument, NULL, OPT_ATLAS},
+	{"app-id", required_argument, NULL, OPT_APP_ID},
+	{"title", required_argument, NULL, OPT_TITLE},
+	{"active", no_argument, NULL, OPT_ACTIVE},
+	{"variant", required_argument, NULL, OPT_VARIANT},
+	{"filter", required_argument, NULL, OPT_FILTER},
+	{0},
+};
+
+/**
+ * Reduced copy of the image written along with it, see --variant.
+ */
+struct grim_variant {
+	// Each of them caps the size, the image is never scaled up
+	double scale;
+	int32_t width, height;
+	char *path;
+	// Same as the image unless set
+	bool has_filetype, has_jpeg_quality, has_png_level;
+	enum grim_filetype filetype;
+	int jpeg_quality, png_level;
+};
+
+struct grim_options {
+	bool help;
+	bool use_win;
+	// Windows to capture by address, unless use_toplevels is set
+	uint32_t *win_handles;
+	size_t n_win_handles;
+	// Windows are picked among the toplevels: all of them with -w all, or
+	// the ones matching all of --app-id, --title and --active
+	bool use_toplevels;
+	char *app_id;
+	bool use_title_regex;
+	regex_t title_regex;
+	bool active_window;
+	char *atlas_path; // JSON index of --atlas
+	double scale;
+	bool use_greatest_scale;
+	struct grim_box *geometry;
+	char *geometry_output;
+	enum grim_filetype filetype;
+	int jpeg_quality;
+	enum grim_jpeg_dct jpeg_dct;
+	enum grim_jpeg_subsampling jpeg_subsampling;
+	int png_level;
+	bool with_cursor;
+	const char *output_filename;
+	bool geometry_stdin;
+
+	bool daemon;
+	bool client;
+	char *socket_path;
+
+	enum grim_shm_mode shm_mode;
+	bool dmabuf;
+
+	double interval; // in seconds, 0 for a single screenshot
+	unsigned int count; // 0 for no limit
+
+	int n_threads;
+	enum grim_resample_filter resample_filter;
+
+	bool timings;
+	char *timings_path; // NULL for stderr
+
+	struct grim_variant *variants;
+	size_t n_variants;
+};
+
+static void finish_options(struct grim_options *opts) {
+	free(opts->geometry);
+	free(opts->geometry_output);
+	free(opts->socket_path);
+	free(opts->timings_path);
+	free(opts->win_handles);
+	free(opts->atlas_path);
+	free(opts->app_id);
+	if (opts->use_title_regex) {
+		regfree(&opts->title_regex);
+	}
+	for (size_t i = 0; i < opts->n_variants; i++) {
+		free(opts->variants[i].path);
+	}
+	free(opts->variants);
+}
+
+/**
+ * Parse a comma-separated list of hexadecimal window addresses.
+ */
+static bool parse_window_handles(struct grim_options *opts, const char *str) {
+	size_t n = 1;
+	for (const char *c = str; *c != '\0'; c++) {
+		if (*c == ',') {
+			++n;
+		}
+	}
+	uint32_t *handles = calloc(n, sizeof(*handles));
+	if (handles == NULL) {
+		return false;
+	}
+
+	const char *next = str;
+	for (size_t i = 0; i < n; i++) {
+		char *endptr = NULL;
+		errno = 0;
+		// The protocol only takes the low 32 bits of the address
+		handles[i] = strtoull(next, &endptr, 16);
+		if (endptr == next || errno ||
+				(*endptr != ',' && *endptr != '\0')) {
+			free(handles);
+			return false;
+		}
+		next = endptr + 1;
+	}
+
+	free(opts->win_handles);
+	opts->win_handles = handles;
+	opts->n_win_handles = n;
+	return true;
+}
+
+/**
+ * Whether windows are captured through write_windows(), which writes several
+ * of them to one file each or to an atlas. Toplevels always are, since how
+ * many of them match is only known once they are enumerated.
+ */
+static bool is_window_batch(struct grim_options *opts) {
+	return opts->use_win && (opts->use_toplevels || opts->n_win_handles > 1);
+}
+
+static bool parse_filetype(const char *str, enum grim_filetype *filetype) {
+	if (strcmp(str, "png") == 0) {
+		*filetype = GRIM_FILETYPE_PNG;
+	} else if (strcmp(str, "ppm") == 0) {
+		*filetype = GRIM_FILETYPE_PPM;
+	} else if (strcmp(str, "jpeg") == 0) {
+#if HAVE_JPEG
+		*filetype = GRIM_FILETYPE_JPEG;
+#else
+		fprintf(stderr, "jpeg support disabled\n");
+		return false;
+#endif
+	} else if (strcmp(str, "qoi") == 0) {
+		*filetype = GRIM_FILETYPE_QOI;
+	} else if (strcmp(str, "raw") == 0) {
+		*filetype = GRIM_FILETYPE_RAW;
+	} else {
+		fprintf(stderr, "invalid filetype\n");
+		return false;
+	}
+	return true;
+}
+
+static bool parse_jpeg_quality(const char *str, int *quality) {
+	char *endptr = NULL;
+	errno = 0;
+	*quality = strtol(str, &endptr, 10);
+	if (*endptr != '\0' || errno) {
+		fprintf(stderr, "quality must be a integer\n");
+		return false;
+	}
+	if (*quality < 0 || *quality > 100) {
+		fprintf(stderr, "quality valid values are between 0-100\n");
+		return false;
+	}
+	return true;
+}
+
+static bool parse_png_level(const char *str, int *level) {
+	if (strcmp(str, "fast") == 0) {
+		*level = GRIM_PNG_LEVEL_FAST;
+		return true;
+	}
+	char *endptr = NULL;
+	errno = 0;
+	*level = strtol(str, &endptr, 10);
+	if (*endptr != '\0' || errno) {
+		fprintf(stderr, "level must be a integer\n");
+		return false;
+	}
+	if (*level < 0 || *level > 9) {
+		fprintf(stderr, "compression level valid values are between 0-9\n");
+		return false;
+	}
+	return true;
+}
+
+static bool parse_variant_size(const char *str, int32_t *size) {
+	char *endptr = NULL;
+	errno = 0;
+	long value = strtol(str, &endptr, 10);
+	if (*endptr != '\0' || errno || value <= 0 || value > INT32_MAX) {
+		fprintf(stderr, "variant sizes must be positive integers\n");
+		return false;
+	}
+	*size = value;
+	return true;
+}
+
+/**
+ * Parse a --variant made of ':'-separated key=value pairs. The file comes
+ * last, so that its path may contain colons.
+ */
+static bool parse_variant(struct grim_options *opts, const char *str) {
+	struct grim_variant variant = {0};
+	char *spec = strdup(str);
+	if (spec == NULL) {
+		return false;
+	}
+
+	bool ok = true;
+	char *item = spec;
+	while (ok && item != NULL && variant.path == NULL) {
+		char *value = strchr(item, '=');
+		if (value == NULL) {
+			fprintf(stderr, "expected key=value in variant: %s\n", item);
+			ok = false;
+			break;
+		}
+		*value++ = '\0';
+		if (strcmp(item, "file") == 0) {
+			variant.path = strdup(value);
+			ok = variant.path != NULL && value[0] != '\0';
+			if (!ok) {
+				fprintf(stderr, "empty variant file\n");
+			}
+			break;
+		}
+
+		char *next = strchr(value, ':');
+		if (next != NULL) {
+			*next++ = '\0';
+		}
+		if (strcmp(item, "scale") == 0) {
+			char *endptr = NULL;
+			errno = 0;
+			variant.scale = strtod(value, &endptr);
+			ok = *endptr == '\0' && !errno && variant.scale > 0 &&
+				variant.scale <= 1;
+			if (!ok) {
+				fprintf(stderr, "variant scale must be in (0, 1]\n");
+			}
+		} else if (strcmp(item, "width") == 0) {
+			ok = parse_variant_size(value, &variant.width);
+		} else if (strcmp(item, "height") == 0) {
+			ok = parse_variant_size(value, &variant.height);
+		} else if (strcmp(item, "type") == 0) {
+			ok = parse_filetype(value, &variant.filetype);
+			variant.has_filetype = true;
+		} else if (strcmp(item, "quality") == 0) {
+			ok = parse_jpeg_quality(value, &variant.jpeg_quality);
+			variant.has_jpeg_quality = true;
+		} else if (strcmp(item, "level") == 0) {
+			ok = parse_png_level(value, &variant.png_level);
+			variant.has_png_level = true;
+		} else {
+			fprintf(stderr, "unknown variant key: %s\n", item);
+			ok = false;
+		}
+		item = next;
+	}
+	free(spec);
+	if (ok && variant.path == NULL) {
+		fprintf(stderr, "variant is missing file=<path>\n");
+		ok = false;
+	}
+	if (!ok) {
+		free(variant.path);
+		return false;
+	}
+
+	struct grim_variant *variants = realloc(opts->variants,
+		(opts->n_variants + 1) * sizeof(*variants));
+	if (variants == NULL) {
+		free(variant.path);
+		return false;
+	}
+	opts->variants = variants;
+	opts->variants[opts->n_variants++] = variant;
+	return true;
+}
+
+/**
+ * Parse the command line into opts. A geometry of "-" is read from in, or
+ * left for someone else to read when in is NULL.
+ */
+static bool parse_options(struct grim_options *opts, int argc, char *argv[],
+		FILE *in) {
+	*opts = (struct grim_options){
+		.scale = 1.0,
+		.use_greatest_scale = true,
+		.filetype = GRIM_FILETYPE_PNG,
+		.jpeg_quality = 80,
+		.png_level = 6, // current default png/zlib compression level
+		.n_threads = get_default_thread_count(),
+		.resample_filter = GRIM_RESAMPLE_LANCZOS,
+	};
+
+	optind = 0;
 	int opt;
-	while ((opt = getopt(argc, argv, "hw:s:g:t:q:l:o:c")) != -1) {
+	while ((opt = getopt_long(argc, argv, "hw:s:g:t:q:l:o:c",
+			long_options, NULL)) != -1) {
 		switch (opt) {
 		case 'h':
-			printf("%s", usage);
-			return EXIT_SUCCESS;
-		case 'w':;
-			char *endptr = NULL;
-			errno = 0;
-		    win_handle = strtol(optarg, &endptr, 16);
-			if (*endptr != '\0' || errno) {
-				fprintf(stderr, "expected hex window address\n");
-				return EXIT_FAILURE;
+			opts->help = true;
+			return true;
+		case 'w':
+			if (strcmp(optarg, "all") == 0) {
+				opts->use_toplevels = true;
+			} else if (!parse_window_handles(opts, optarg)) {
+				fprintf(stderr, "expected hex window addresses\n");
+				return false;
 			}
-			use_win = true;
+			opts->use_win = true;
 			break;
 		case 's':
-			use_greatest_scale = false;
-			scale = strtod(optarg, NULL);
+			opts->use_greatest_scale = false;
+			opts->scale = strtod(optarg, NULL);
 			break;
 		case 'g':;
 			char *geometry_str = NULL;
 			if (strcmp(optarg, "-") == 0) {
+				opts->geometry_stdin = true;
+				if (in == NULL) {
+					break;
+				}
+
 				size_t n = 0;
-				ssize_t nread = getline(&geometry_str, &n, stdin);
+				ssize_t nread = getline(&geometry_str, &n, in);
 				if (nread < 0) {
 					free(geometry_str);
 					fprintf(stderr, "failed to read a line from stdin\n");
-					return EXIT_FAILURE;
+					return false;
 				}
 
 				if (nread > 0 && geometry_str[nread - 1] == '\n') {
@@ -442,317 +1066,1906 @@ int main(int argc, char *argv[]) {
 				geometry_str = strdup(optarg);
 			}
 
-			free(geometry);
-			geometry = calloc(1, sizeof(struct grim_box));
-			if (!parse_box(geometry, geometry_str)) {
+			free(opts->geometry);
+			opts->geometry = calloc(1, sizeof(struct grim_box));
+			if (!parse_box(opts->geometry, geometry_str)) {
+				free(geometry_str);
 				fprintf(stderr, "invalid geometry\n");
-				return EXIT_FAILURE;
+				return false;
 			}
 
 			free(geometry_str);
 			break;
 		case 't':
-			if (strcmp(optarg, "png") == 0) {
-				output_filetype = GRIM_FILETYPE_PNG;
-			} else if (strcmp(optarg, "ppm") == 0) {
-				output_filetype = GRIM_FILETYPE_PPM;
-			} else if (strcmp(optarg, "jpeg") == 0) {
-#if HAVE_JPEG
-				output_filetype = GRIM_FILETYPE_JPEG;
-#else
-				fprintf(stderr, "jpeg support disabled\n");
-				return EXIT_FAILURE;
-#endif
-			} else {
-				fprintf(stderr, "invalid filetype\n");
-				return EXIT_FAILURE;
+			if (!parse_filetype(optarg, &opts->filetype)) {
+				return false;
 			}
 			break;
 		case 'q':
-			if (output_filetype != GRIM_FILETYPE_JPEG) {
+			if (opts->filetype != GRIM_FILETYPE_JPEG) {
 				fprintf(stderr, "quality is used only for jpeg files\n");
-				return EXIT_FAILURE;
-			} else {
-				char *endptr = NULL;
-				errno = 0;
-				jpeg_quality = strtol(optarg, &endptr, 10);
-				if (*endptr != '\0' || errno) {
-					fprintf(stderr, "quality must be a integer\n");
-					return EXIT_FAILURE;
-				}
-				if (jpeg_quality < 0 || jpeg_quality > 100) {
-					fprintf(stderr, "quality valid values are between 0-100\n");
-					return EXIT_FAILURE;
-				}
+				return false;
+			} else if (!parse_jpeg_quality(optarg, &opts->jpeg_quality)) {
+				return false;
 			}
 			break;
 		case 'l':
-			if (output_filetype != GRIM_FILETYPE_PNG) {
+			if (opts->filetype != GRIM_FILETYPE_PNG) {
 				fprintf(stderr, "compression level is used only for png files\n");
-				return EXIT_FAILURE;
-			} else {
-				char *endptr = NULL;
-				errno = 0;
-				png_level = strtol(optarg, &endptr, 10);
-				if (*endptr != '\0' || errno) {
-					fprintf(stderr, "level must be a integer\n");
-					return EXIT_FAILURE;
-				}
-				if (png_level < 0 || png_level > 9) {
-					fprintf(stderr, "compression level valid values are between 0-9\n");
-					return EXIT_FAILURE;
-				}
+				return false;
+			} else if (!parse_png_level(optarg, &opts->png_level)) {
+				return false;
 			}
 			break;
 		case 'o':
-			free(geometry_output);
-			geometry_output = strdup(optarg);
+			free(opts->geometry_output);
+			opts->geometry_output = strdup(optarg);
 			break;
 		case 'c':
-			with_cursor = true;
+			opts->with_cursor = true;
+			break;
+		case OPT_DAEMON:
+			opts->daemon = true;
+			break;
+		case OPT_CLIENT:
+			opts->client = true;
+			break;
+		case OPT_SOCKET:
+			free(opts->socket_path);
+			opts->socket_path = strdup(optarg);
+			break;
+		case OPT_SHM:
+			if (strcmp(optarg, "default") == 0) {
+				opts->shm_mode = GRIM_SHM_DEFAULT;
+			} else if (strcmp(optarg, "prefault") == 0) {
+				opts->shm_mode = GRIM_SHM_PREFAULT;
+			} else if (strcmp(optarg, "thp") == 0) {
+				opts->shm_mode = GRIM_SHM_THP;
+			} else if (strcmp(optarg, "hugetlb") == 0) {
+#if HAVE_MEMFD
+				opts->shm_mode = GRIM_SHM_HUGETLB;
+#else
+				fprintf(stderr, "hugetlb buffers aren't supported on this system\n");
+				return false;
+#endif
+			} else {
+				fprintf(stderr, "invalid shm mode\n");
+				return false;
+			}
+			break;
+		case OPT_DMABUF:
+#if HAVE_UDMABUF
+			opts->dmabuf = true;
+#else
+			fprintf(stderr, "DMA-BUF buffers aren't supported on this system\n");
+			return false;
+#endif
+			break;
+		case OPT_INTERVAL: {
+			char *endptr = NULL;
+			errno = 0;
+			opts->interval = strtod(optarg, &endptr);
+			if (*endptr != '\0' || errno || !(opts->interval > 0)) {
+				fprintf(stderr, "interval must be a positive number of seconds\n");
+				return false;
+			}
+			break;
+		}
+		case OPT_COUNT: {
+			char *endptr = NULL;
+			errno = 0;
+			long count = strtol(optarg, &endptr, 10);
+			if (*endptr != '\0' || errno || count <= 0 || count > UINT_MAX) {
+				fprintf(stderr, "count must be a positive integer\n");
+				return false;
+			}
+			opts->count = count;
+			break;
+		}
+		case OPT_THREADS: {
+			char *endptr = NULL;
+			errno = 0;
+			long n_threads = strtol(optarg, &endptr, 10);
+			if (*endptr != '\0' || errno || n_threads <= 0 ||
+					n_threads > INT_MAX) {
+				fprintf(stderr, "thread count must be a positive integer\n");
+				return false;
+			}
+			opts->n_threads = n_threads;
+			break;
+		}
+		case OPT_FILTER:
+			if (!parse_resample_filter(optarg, &opts->resample_filter)) {
+				fprintf(stderr, "invalid filter: %s\n", optarg);
+				return false;
+			}
+			break;
+		case OPT_JPEG_DCT:
+			if (opts->filetype != GRIM_FILETYPE_JPEG) {
+				fprintf(stderr, "dct method is used only for jpeg files\n");
+				return false;
+			} else if (strcmp(optarg, "islow") == 0) {
+				opts->jpeg_dct = GRIM_JPEG_DCT_ISLOW;
+			} else if (strcmp(optarg, "ifast") == 0) {
+				opts->jpeg_dct = GRIM_JPEG_DCT_IFAST;
+			} else if (strcmp(optarg, "float") == 0) {
+				opts->jpeg_dct = GRIM_JPEG_DCT_FLOAT;
+			} else {
+				fprintf(stderr, "invalid dct method\n");
+				return false;
+			}
+			break;
+		case OPT_JPEG_SUBSAMPLING:
+			if (opts->filetype != GRIM_FILETYPE_JPEG) {
+				fprintf(stderr, "chroma subsampling is used only for jpeg files\n");
+				return false;
+			} else if (strcmp(optarg, "420") == 0) {
+				opts->jpeg_subsampling = GRIM_JPEG_SUBSAMPLING_420;
+			} else if (strcmp(optarg, "422") == 0) {
+				opts->jpeg_subsampling = GRIM_JPEG_SUBSAMPLING_422;
+			} else if (strcmp(optarg, "444") == 0) {
+				opts->jpeg_subsampling = GRIM_JPEG_SUBSAMPLING_444;
+			} else {
+				fprintf(stderr, "invalid chroma subsampling\n");
+				return false;
+			}
+			break;
+		case OPT_APP_ID:
+			free(opts->app_id);
+			opts->app_id = strdup(optarg);
+			opts->use_win = opts->use_toplevels = true;
+			break;
+		case OPT_TITLE: {
+			if (opts->use_title_regex) {
+				regfree(&opts->title_regex);
+				opts->use_title_regex = false;
+			}
+			int err = regcomp(&opts->title_regex, optarg,
+				REG_EXTENDED | REG_NOSUB);
+			if (err != 0) {
+				char msg[256];
+				regerror(err, &opts->title_regex, msg, sizeof(msg));
+				regfree(&opts->title_regex);
+				fprintf(stderr, "invalid title regex: %s\n", msg);
+				return false;
+			}
+			opts->use_title_regex = true;
+			opts->use_win = opts->use_toplevels = true;
+			break;
+		}
+		case OPT_ACTIVE:
+			opts->active_window = true;
+			opts->use_win = opts->use_toplevels = true;
+			break;
+		case OPT_ATLAS:
+			free(opts->atlas_path);
+			opts->atlas_path = strdup(optarg);
+			break;
+		case OPT_VARIANT:
+			if (!parse_variant(opts, optarg)) {
+				return false;
+			}
+			break;
+		case OPT_TIMINGS:
+			opts->timings = true;
+			free(opts->timings_path);
+			opts->timings_path = optarg != NULL ? strdup(optarg) : NULL;
 			break;
 		default:
-			return EXIT_FAILURE;
+			return false;
 		}
 	}
 
-	if (use_win && (geometry || geometry_output)) {
-		fprintf(stderr, "-w is incompatible with -g and -o\n");
-		return EXIT_FAILURE;
+	if (opts->use_win && (opts->geometry || opts->geometry_output)) {
+		fprintf(stderr, "window capture is incompatible with -g and -o\n");
+		return false;
 	}
-
-	const char *output_filename;
-	char *output_filepath;
-	char tmp[64];
-	if (optind >= argc) {
-		if (!default_filename(tmp, sizeof(tmp), output_filetype)) {
-			fprintf(stderr, "failed to generate default filename\n");
-			return EXIT_FAILURE;
+	if (opts->use_toplevels && opts->win_handles != NULL) {
+		fprintf(stderr, "window addresses are incompatible with -w all, "
+			"--app-id, --title and --active\n");
+		return false;
+	}
+	if (opts->atlas_path != NULL && !opts->use_win) {
+		fprintf(stderr, "--atlas requires -w\n");
+		return false;
+	}
+	if (is_window_batch(opts) && opts->interval > 0) {
+		fprintf(stderr, "--interval can't capture several windows\n");
+		return false;
+	}
+	if (opts->daemon && opts->client) {
+		fprintf(stderr, "--daemon is incompatible with --client\n");
+		return false;
+	}
+	if (opts->interval > 0 && (opts->daemon || opts->client)) {
+		fprintf(stderr, "--interval is incompatible with --daemon and --client\n");
+		return false;
+	}
+	if (opts->timings && opts->interval > 0) {
+		fprintf(stderr, "--timings is incompatible with --interval\n");
+		return false;
+	}
+	if (opts->n_variants > 0 &&
+			(opts->interval > 0 || is_window_batch(opts))) {
+		fprintf(stderr, "--variant is incompatible with --interval and "
+			"several windows\n");
+		return false;
+	}
+	for (size_t i = 0; i < opts->n_variants; i++) {
+		struct grim_variant *variant = &opts->variants[i];
+		enum grim_filetype filetype = variant->has_filetype ?
+			variant->filetype : opts->filetype;
+		if (variant->has_jpeg_quality && filetype != GRIM_FILETYPE_JPEG) {
+			fprintf(stderr, "quality is used only for jpeg files\n");
+			return false;
 		}
-		output_filename = tmp;
-
-		char *output_dir = get_output_dir();
-		int len = snprintf(NULL, 0, "%s/%s", output_dir, output_filename);
-		if (len < 0) {
-			perror("snprintf failed");
-			return EXIT_FAILURE;
+		if (variant->has_png_level && filetype != GRIM_FILETYPE_PNG) {
+			fprintf(stderr, "compression level is used only for png files\n");
+			return false;
 		}
-		output_filepath = malloc(len + 1);
-		snprintf(output_filepath, len + 1, "%s/%s", output_dir, output_filename);
-		free(output_dir);
-	} else if (optind < argc - 1) {
+	}
+	if (opts->count > 0 && opts->interval == 0) {
+		fprintf(stderr, "--count requires --interval\n");
+		return false;
+	}
+
+	if (optind < argc - 1) {
 		printf("%s", usage);
-		return EXIT_FAILURE;
-	} else {
-		output_filename = argv[optind];
-		output_filepath = strdup(output_filename);
+		return false;
+	} else if (optind == argc - 1) {
+		opts->output_filename = argv[optind];
 	}
 
-	struct grim_state state = {0};
-	state.use_win = use_win;
-	wl_list_init(&state.outputs);
+	return true;
+}
+
+static bool connect_state(struct grim_state *state, bool use_win,
+		enum grim_shm_mode shm_mode, bool use_dmabuf, int n_threads,
+		struct grim_trace *trace) {
+	*state = (struct grim_state){0};
+	state->use_win = use_win;
+	state->use_dmabuf = use_dmabuf;
+	state->trace = trace;
+	wl_list_init(&state->outputs);
+	wl_list_init(&state->toplevels);
+
+	state->thread_pool = create_thread_pool(n_threads);
+	if (state->thread_pool == NULL) {
+		fprintf(stderr, "failed to create thread pool\n");
+		return false;
+	}
+	state->resample_cache = create_resample_cache();
+	if (state->resample_cache == NULL) {
+		fprintf(stderr, "failed to create resample cache\n");
+		return false;
+	}
 
-	state.display = wl_display_connect(NULL);
-	if (state.display == NULL) {
+	trace_phase_start(trace, GRIM_TRACE_CONNECT);
+	state->display = wl_display_connect(NULL);
+	trace_phase_end(trace, GRIM_TRACE_CONNECT);
+	if (state->display == NULL) {
 		fprintf(stderr, "failed to create display\n");
-		return EXIT_FAILURE;
+		return false;
 	}
 
-	state.registry = wl_display_get_registry(state.display);
-	wl_registry_add_listener(state.registry, &registry_listener, &state);
-	if (wl_display_roundtrip(state.display) < 0) {
+	trace_phase_start(trace, GRIM_TRACE_REGISTRY);
+	state->registry = wl_display_get_registry(state->display);
+	wl_registry_add_listener(state->registry, &registry_listener, state);
+	if (wl_display_roundtrip(state->display) < 0) {
 		fprintf(stderr, "wl_display_roundtrip() failed\n");
-		return EXIT_FAILURE;
+		return false;
 	}
+	trace_phase_end(trace, GRIM_TRACE_REGISTRY);
 
-	if (state.shm == NULL) {
+	if (state->shm == NULL) {
 		fprintf(stderr, "compositor doesn't support wl_shm\n");
-		return EXIT_FAILURE;
+		return false;
 	}
-	if (state.screencopy_manager == NULL) {
+	state->buffer_pool = create_buffer_pool(state->shm, shm_mode);
+	if (state->buffer_pool == NULL) {
+		fprintf(stderr, "failed to create buffer pool\n");
+		return false;
+	}
+	if (use_dmabuf && state->linux_dmabuf == NULL) {
+		fprintf(stderr, "warning: compositor doesn't support "
+			"zwp_linux_dmabuf_v1, falling back to wl_shm\n");
+	} else if (use_dmabuf && !enable_dmabuf_buffers(state->buffer_pool,
+			state->linux_dmabuf)) {
+		fprintf(stderr, "warning: falling back to wl_shm\n");
+	}
+	if (use_win) {
+		return true;
+	}
+	if (state->screencopy_manager == NULL) {
 		fprintf(stderr, "compositor doesn't support wlr-screencopy-unstable-v1\n");
-		return EXIT_FAILURE;
+		return false;
 	}
 
-	size_t n_pending = 0;
-	if (use_win) {
-		if (state.toplevel_export_manager == NULL) {
-			fprintf(stderr, "compositor doesn't support hyprland_toplevel_export_manager\n");
-			return EXIT_FAILURE;
+	if (wl_list_empty(&state->outputs)) {
+		fprintf(stderr, "no wl_output\n");
+		return false;
+	}
+
+	if (state->xdg_output_manager != NULL) {
+		trace_phase_start(trace, GRIM_TRACE_XDG_OUTPUT);
+		struct grim_output *output;
+		wl_list_for_each(output, &state->outputs, link) {
+			if (output->xdg_output == NULL) {
+				add_xdg_output(output);
+			}
 		}
 
-		struct grim_output *output = calloc(1, sizeof(struct grim_output));
-		output->state = &state;
-		output->scale = 1;
-		output->transform = WL_OUTPUT_TRANSFORM_NORMAL;
-		wl_list_insert(&state.outputs, &output->link);
+		if (wl_display_roundtrip(state->display) < 0) {
+			fprintf(stderr, "wl_display_roundtrip() failed\n");
+			return false;
+		}
+		trace_phase_end(trace, GRIM_TRACE_XDG_OUTPUT);
+	} else {
+		fprintf(stderr, "warning: zxdg_output_manager_v1 isn't available, "
+			"guessing the output layout\n");
+
+		struct grim_output *output;
+		wl_list_for_each(output, &state->outputs, link) {
+			guess_output_logical_geometry(output);
+		}
+	}
+
+	return true;
+}
 
-		output->toplevel_export_frame =
-			hyprland_toplevel_export_manager_v1_capture_toplevel(
-				state.toplevel_export_manager, with_cursor, win_handle);
+static void finish_state(struct grim_state *state) {
+	finish_toplevels(state);
+	struct grim_output *output;
+	struct grim_output *output_tmp;
+	wl_list_for_each_safe(output, output_tmp, &state->outputs, link) {
+		destroy_output(output);
+	}
+	destroy_buffer_pool(state->buffer_pool);
+	destroy_thread_pool(state->thread_pool);
+	destroy_resample_cache(state->resample_cache);
+	if (state->linux_dmabuf != NULL) {
+		zwp_linux_dmabuf_v1_destroy(state->linux_dmabuf);
+	}
+	if (state->toplevel_export_manager != NULL) {
+		hyprland_toplevel_export_manager_v1_destroy(state->toplevel_export_manager);
+	}
+	if (state->screencopy_manager != NULL) {
+		zwlr_screencopy_manager_v1_destroy(state->screencopy_manager);
+	}
+	if (state->xdg_output_manager != NULL) {
+		zxdg_output_manager_v1_destroy(state->xdg_output_manager);
+	}
+	if (state->shm != NULL) {
+		wl_shm_destroy(state->shm);
+	}
+	if (state->registry != NULL) {
+		wl_registry_destroy(state->registry);
+	}
+	if (state->display != NULL) {
+		wl_display_disconnect(state->display);
+	}
+}
 
+/**
+ * Drop everything a capture left behind so the state can be used for the
+ * next one.
+ */
+static void reset_capture(struct grim_state *state) {
+	struct grim_output *output;
+	struct grim_output *output_tmp;
+	wl_list_for_each_safe(output, output_tmp, &state->outputs, link) {
+		if (output->wl_output == NULL) {
+			// Fake output created for a window capture
+			if (output->toplevel_export_frame != NULL) {
+				hyprland_toplevel_export_frame_v1_destroy(
+					output->toplevel_export_frame);
+				output->toplevel_export_frame = NULL;
+			}
+			destroy_output(output);
+			continue;
+		}
+
+		if (output->screencopy_frame != NULL) {
+			zwlr_screencopy_frame_v1_destroy(output->screencopy_frame);
+			output->screencopy_frame = NULL;
+		}
+		output->screencopy_frame_flags = 0;
+		release_buffer(output->buffer);
+		output->buffer = NULL;
+		pixman_region32_clear(&output->damage);
+	}
+	state->use_damage = false;
+	state->copy_image = false;
+	state->n_done = 0;
+	state->n_failed = 0;
+	// Nothing reads the buffers of the capture anymore
+	trim_buffer_pool(state->buffer_pool);
+}
+
+/**
+ * Ask the compositor for a new frame of the output, covering the same part of
+ * it as capture_geometry.
+ */
+static void request_frame(struct grim_output *output,
+		struct grim_options *opts) {
+	struct grim_state *state = output->state;
+	trace_frame_event(state->trace, output, GRIM_TRACE_FRAME_REQUEST);
+	memset(&output->offer, 0, sizeof(output->offer));
+
+	if (output->wl_output == NULL) {
+		if (output->toplevel != NULL) {
+			output->toplevel_export_frame =
+				hyprland_toplevel_export_manager_v1_capture_toplevel_with_wlr_toplevel_handle(
+					state->toplevel_export_manager, opts->with_cursor,
+					output->toplevel->handle);
+		} else {
+			output->toplevel_export_frame =
+				hyprland_toplevel_export_manager_v1_capture_toplevel(
+					state->toplevel_export_manager, opts->with_cursor,
+					output->window_handle);
+		}
 		hyprland_toplevel_export_frame_v1_add_listener(
 			output->toplevel_export_frame, &toplevel_export_frame_listener, output);
+		return;
+	}
 
-		n_pending = 1;
+	struct grim_box *region = &output->capture_geometry;
+	struct grim_box *logical = &output->logical_geometry;
+	if (region->x != logical->x || region->y != logical->y ||
+			region->width != logical->width ||
+			region->height != logical->height) {
+		output->screencopy_frame =
+			zwlr_screencopy_manager_v1_capture_output_region(
+				state->screencopy_manager, opts->with_cursor,
+				output->wl_output,
+				region->x - logical->x, region->y - logical->y,
+				region->width, region->height);
 	} else {
-		if (wl_list_empty(&state.outputs)) {
-			fprintf(stderr, "no wl_output\n");
-			return EXIT_FAILURE;
+		output->screencopy_frame = zwlr_screencopy_manager_v1_capture_output(
+			state->screencopy_manager, opts->with_cursor, output->wl_output);
+	}
+	zwlr_screencopy_frame_v1_add_listener(output->screencopy_frame,
+		&screencopy_frame_listener, output);
+}
+
+/**
+ * Whether name is one of the comma-separated names of list.
+ */
+static bool is_in_name_list(const char *list, const char *name) {
+	size_t len = strlen(name);
+	const char *item = list;
+	while (true) {
+		const char *end = strchr(item, ',');
+		size_t item_len = end != NULL ? (size_t)(end - item) : strlen(item);
+		if (item_len == len && strncmp(item, name, len) == 0) {
+			return true;
 		}
+		if (end == NULL) {
+			return false;
+		}
+		item = end + 1;
+	}
+}
 
-		if (state.xdg_output_manager != NULL) {
-			struct grim_output *output;
-			wl_list_for_each(output, &state.outputs, link) {
-				output->xdg_output = zxdg_output_manager_v1_get_xdg_output(
-					state.xdg_output_manager, output->wl_output);
-				zxdg_output_v1_add_listener(output->xdg_output,
-					&xdg_output_listener, output);
-			}
+/**
+ * Get the region of the layout covered by the outputs named in the
+ * comma-separated list. Fails if one of the names is unknown.
+ */
+static bool get_named_outputs_extents(struct grim_state *state,
+		const char *names, struct grim_box *extents) {
+	*extents = (struct grim_box){0};
+	struct grim_output *output;
+	wl_list_for_each(output, &state->outputs, link) {
+		if (output->name != NULL && is_in_name_list(names, output->name)) {
+			extend_box(extents, &output->logical_geometry);
+		}
+	}
 
-			if (wl_display_roundtrip(state.display) < 0) {
-				fprintf(stderr, "wl_display_roundtrip() failed\n");
-				return EXIT_FAILURE;
+	bool ok = true;
+	const char *name = names;
+	while (true) {
+		const char *end = strchr(name, ',');
+		int name_len = end != NULL ? (int)(end - name) : (int)strlen(name);
+		bool found = false;
+		wl_list_for_each(output, &state->outputs, link) {
+			if (output->name != NULL &&
+					(int)strlen(output->name) == name_len &&
+					strncmp(output->name, name, name_len) == 0) {
+				found = true;
+				break;
 			}
-		} else {
-			fprintf(stderr, "warning: zxdg_output_manager_v1 isn't available, "
-				"guessing the output layout\n");
+		}
+		if (!found) {
+			fprintf(stderr, "unknown output '%.*s'\n", name_len, name);
+			ok = false;
+		}
+		if (end == NULL) {
+			break;
+		}
+		name = end + 1;
+	}
+	return ok;
+}
 
-			struct grim_output *output;
-			wl_list_for_each(output, &state.outputs, link) {
-				guess_output_logical_geometry(output);
-			}
+/**
+ * Whether the output should be captured: with -o, only the named outputs
+ * are, even if others overlap them.
+ */
+static bool is_output_wanted(struct grim_output *output,
+		struct grim_options *opts, struct grim_box *geometry) {
+	if (opts->geometry_output != NULL && (output->name == NULL ||
+			!is_in_name_list(opts->geometry_output, output->name))) {
+		return false;
+	}
+	return geometry == NULL ||
+		intersect_box(geometry, &output->logical_geometry);
+}
+
+/**
+ * Create a fake output for a window, and ask for its frame.
+ */
+static void add_window(struct grim_state *state, struct grim_options *opts,
+		uint32_t handle, struct grim_toplevel *toplevel) {
+	struct grim_output *output = calloc(1, sizeof(struct grim_output));
+	output->state = state;
+	output->scale = 1;
+	output->transform = WL_OUTPUT_TRANSFORM_NORMAL;
+	output->window_handle = handle;
+	output->toplevel = toplevel;
+	pixman_region32_init(&output->damage);
+	// Windows are kept in the order they were asked for
+	wl_list_insert(state->outputs.prev, &output->link);
+
+	request_frame(output, opts);
+}
+
+static bool is_toplevel_wanted(struct grim_toplevel *toplevel,
+		struct grim_options *opts) {
+	if (opts->active_window && !toplevel->activated) {
+		return false;
+	}
+	if (opts->app_id != NULL && (toplevel->app_id == NULL ||
+			strcmp(toplevel->app_id, opts->app_id) != 0)) {
+		return false;
+	}
+	if (opts->use_title_regex && (toplevel->title == NULL ||
+			regexec(&opts->title_regex, toplevel->title, 0, NULL, 0) != 0)) {
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Request frames for all windows of -w at once. Returns the number of frames
+ * to wait for, 0 on error.
+ */
+static size_t start_window_capture(struct grim_state *state,
+		struct grim_options *opts) {
+	if (state->toplevel_export_manager == NULL) {
+		fprintf(stderr, "compositor doesn't support hyprland_toplevel_export_manager\n");
+		return 0;
+	}
+
+	if (!opts->use_toplevels) {
+		for (size_t i = 0; i < opts->n_win_handles; i++) {
+			add_window(state, opts, opts->win_handles[i], NULL);
 		}
+		return opts->n_win_handles;
+	}
 
-		if (geometry_output != NULL) {
-			struct grim_output *output;
-			wl_list_for_each(output, &state.outputs, link) {
-				if (output->name != NULL &&
-						strcmp(output->name, geometry_output) == 0) {
-					geometry = calloc(1, sizeof(struct grim_box));
-					memcpy(geometry, &output->logical_geometry,
-						sizeof(struct grim_box));
-				}
-			}
+	if (hyprland_toplevel_export_manager_v1_get_version(
+			state->toplevel_export_manager) < 2) {
+		fprintf(stderr, "compositor can't capture windows by toplevel handle\n");
+		return 0;
+	}
+	if (!init_toplevels(state)) {
+		fprintf(stderr, "compositor doesn't support wlr-foreign-toplevel-management-unstable-v1\n");
+		return 0;
+	}
 
-			if (geometry == NULL) {
-				fprintf(stderr, "unknown output '%s'\n", geometry_output);
-				return EXIT_FAILURE;
+	size_t n_pending = 0;
+	struct grim_toplevel *toplevel;
+	wl_list_for_each(toplevel, &state->toplevels, link) {
+		if (!is_toplevel_wanted(toplevel, opts)) {
+			continue;
+		}
+		add_window(state, opts, 0, toplevel);
+		++n_pending;
+	}
+	if (n_pending == 0) {
+		fprintf(stderr, "no window to capture\n");
+	}
+	return n_pending;
+}
+
+/**
+ * Request frames for everything opts asks for. Returns the number of frames
+ * to wait for, 0 on error.
+ */
+static size_t start_capture(struct grim_state *state,
+		struct grim_options *opts, double *scale) {
+	state->use_win = opts->use_win;
+	state->resample_filter = opts->resample_filter;
+	*scale = opts->scale;
+	struct grim_box *geometry = opts->geometry;
+
+	size_t n_pending = 0;
+	if (opts->use_win) {
+		return start_window_capture(state, opts);
+	}
+
+	if (opts->geometry_output != NULL) {
+		struct grim_box extents = {0};
+		if (!get_named_outputs_extents(state, opts->geometry_output,
+				&extents)) {
+			return 0;
+		}
+		// -g then picks a region of the named outputs
+		if (geometry != NULL) {
+			clip_box(&extents, geometry);
+			if (is_empty_box(&extents)) {
+				fprintf(stderr, "supplied geometry did not intersect with "
+					"the named outputs\n");
+				return 0;
 			}
 		}
+		free(opts->geometry);
+		opts->geometry = calloc(1, sizeof(struct grim_box));
+		*opts->geometry = extents;
+		geometry = opts->geometry;
+	}
 
-		struct grim_output* output;
-		wl_list_for_each(output, &state.outputs, link) {
-			if (geometry != NULL &&
-					!intersect_box(geometry, &output->logical_geometry)) {
+	struct grim_output *output;
+	if (opts->use_greatest_scale) {
+		wl_list_for_each(output, &state->outputs, link) {
+			if (!is_output_wanted(output, opts, geometry)) {
 				continue;
 			}
-			if (use_greatest_scale && output->logical_scale > scale) {
-				scale = output->logical_scale;
+			if (output->logical_scale > *scale) {
+				*scale = output->logical_scale;
 			}
+		}
+	}
 
-			output->screencopy_frame = zwlr_screencopy_manager_v1_capture_output(
-				state.screencopy_manager, with_cursor, output->wl_output);
-			zwlr_screencopy_frame_v1_add_listener(output->screencopy_frame,
-				&screencopy_frame_listener, output);
+	wl_list_for_each(output, &state->outputs, link) {
+		if (!is_output_wanted(output, opts, geometry)) {
+			continue;
+		}
 
-			++n_pending;
+		// Only ask the compositor for the part of the output we need
+		if (geometry == NULL || !get_output_capture_region(output, geometry,
+				*scale, &output->capture_geometry)) {
+			output->capture_geometry = output->logical_geometry;
 		}
+		request_frame(output, opts);
+
+		++n_pending;
 	}
 
 	if (n_pending == 0) {
 		fprintf(stderr, "supplied geometry did not intersect with any outputs\n");
-		return EXIT_FAILURE;
 	}
+	return n_pending;
+}
+
+/**
+ * Region of the layout covered by the image, once all frames are in.
+ */
+static void get_capture_geometry(struct grim_state *state,
+		struct grim_options *opts, struct grim_box *geometry) {
+	if (opts->use_win) {
+		struct grim_output *output;
+		wl_list_for_each(output, &state->outputs, link) {
+			if (output->wl_output == NULL) {
+				*geometry = output->logical_geometry;
+				return;
+			}
+		}
+	} else if (opts->geometry != NULL) {
+		*geometry = *opts->geometry;
+	} else {
+		get_output_layout_extents(state, geometry);
+	}
+}
 
-	bool done = false;
-	while (!done && wl_display_dispatch(state.display) != -1) {
-		done = (state.n_done == n_pending);
+/**
+ * Wait up to timeout_ms, or forever if negative, for compositor events and
+ * dispatch them. Returns -1 if the connection to the compositor is lost.
+ */
+static int dispatch_events(struct wl_display *display, int timeout_ms) {
+	if (wl_display_prepare_read(display) != 0) {
+		// Let the caller look at what was already queued first
+		return wl_display_dispatch_pending(display) < 0 ? -1 : 0;
 	}
-	if (!done) {
-		fprintf(stderr, "failed to screenshoot all outputs\n");
-		return EXIT_FAILURE;
+	wl_display_flush(display);
+
+	struct pollfd pollfd = {
+		.fd = wl_display_get_fd(display),
+		.events = POLLIN,
+	};
+	int ret = poll(&pollfd, 1, timeout_ms);
+	if (ret <= 0) {
+		wl_display_cancel_read(display);
+		if (ret < 0 && errno != EINTR) {
+			perror("poll");
+			return -1;
+		}
+		return 0;
 	}
-
-	if (geometry == NULL) {
-		geometry = calloc(1, sizeof(struct grim_box));
-		get_output_layout_extents(&state, geometry);
+	if (wl_display_read_events(display) < 0 ||
+			wl_display_dispatch_pending(display) < 0) {
+		return -1;
 	}
+	return 0;
+}
 
-	pixman_image_t *image = render(&state, geometry, scale);
-	if (image == NULL) {
-		return EXIT_FAILURE;
+static bool wait_capture(struct grim_state *state, size_t n_pending) {
+	bool done = false;
+	while (!done && dispatch_events(state->display, -1) != -1) {
+		done = (state->n_done + state->n_failed == n_pending);
 	}
+	if (!done || state->n_failed > 0) {
+		fprintf(stderr, "failed to screenshoot all outputs\n");
+		return false;
+	}
+	return true;
+}
 
-	FILE *file;
-	if (strcmp(output_filename, "-") == 0) {
-		file = stdout;
-	} else {
-		file = fopen(output_filepath, "w");
-		if (!file) {
-			fprintf(stderr, "Failed to open file '%s' for writing: %s\n",
-				output_filepath, strerror(errno));
-			return EXIT_FAILURE;
-		}
+static pixman_image_t *capture(struct grim_state *state,
+		struct grim_options *opts, struct grim_box *geometry, double *scale) {
+	size_t n_pending = start_capture(state, opts, scale);
+	if (n_pending == 0 || !wait_capture(state, n_pending)) {
+		return NULL;
 	}
 
-	int ret = 0;
-	switch (output_filetype) {
+	get_capture_geometry(state, opts, geometry);
+	return render(state, geometry, *scale);
+}
+
+static int encode_image(struct grim_state *state, pixman_image_t *image,
+		struct grim_options *opts, FILE *file, struct grim_render_job *job) {
+	switch (opts->filetype) {
 	case GRIM_FILETYPE_PPM:
-		ret = write_to_ppm_stream(image, file);
-		break;
+		return write_to_ppm_stream(image, file, job);
 	case GRIM_FILETYPE_PNG:
-		ret = write_to_png_stream(image, file, png_level);
-		break;
+		return write_to_png_stream(image, file, opts->png_level,
+			state->thread_pool, job);
 	case GRIM_FILETYPE_JPEG:
 #if HAVE_JPEG
-		ret = write_to_jpeg_stream(image, file, jpeg_quality);
-		break;
+		return write_to_jpeg_stream(image, file, opts->jpeg_quality,
+			opts->jpeg_dct, opts->jpeg_subsampling, state->thread_pool, job);
 #else
 		abort();
 #endif
+	case GRIM_FILETYPE_QOI:
+		return write_to_qoi_stream(image, file, state->thread_pool, job);
+	case GRIM_FILETYPE_RAW:
+		return write_to_raw_stream(image, file, state->buffer_pool,
+			state->final_capture, job);
+	}
+	abort();
+}
+
+static int write_image(struct grim_state *state, pixman_image_t *image,
+		struct grim_options *opts, FILE *file, struct grim_render_job *job) {
+	struct grim_trace *trace = state->trace;
+	if (trace == NULL) {
+		return encode_image(state, image, opts, file, job);
+	}
+
+	// Pipes can't tell how much went through them
+	off_t start = ftello(file);
+	trace_phase_start(trace, GRIM_TRACE_ENCODE);
+	int ret = encode_image(state, image, opts, file, job);
+	trace_phase_end(trace, GRIM_TRACE_ENCODE);
+	off_t end = ftello(file);
+	trace_encoded(trace, get_filetype_name(opts->filetype),
+		start >= 0 && end >= 0 ? end - start : -1);
+	return ret;
+}
+
+/**
+ * Tell the trace about the image to be encoded, and whether it had to be
+ * allocated.
+ */
+static void trace_render_image(struct grim_state *state,
+		pixman_image_t *image, struct grim_box *geometry, double scale) {
+	if (state->trace == NULL) {
+		return;
+	}
+	size_t bytes = 0;
+	if (find_buffer(state->buffer_pool,
+			pixman_image_get_data(image)) == NULL) {
+		bytes = (size_t)pixman_image_get_stride(image) *
+			pixman_image_get_height(image);
+	}
+	trace_image(state->trace, image, bytes, geometry, scale);
+}
+
+/**
+ * Open a new file next to path, moved over it by finish_output_file() once
+ * complete, so that a failed capture leaves an existing file alone. Anything
+ * else than a regular file, like a pipe, is opened as is, and *temp_path is
+ * set to NULL. Returns -1 on error.
+ */
+static int open_output_file(const char *path, char **temp_path) {
+	*temp_path = NULL;
+	struct stat st;
+	bool exists = stat(path, &st) == 0;
+	if (exists && !S_ISREG(st.st_mode)) {
+		int fd = open(path, O_WRONLY | O_TRUNC | O_CLOEXEC);
+		if (fd < 0) {
+			fprintf(stderr, "Failed to open file '%s' for writing: %s\n",
+				path, strerror(errno));
+		}
+		return fd;
+	}
+
+	size_t len = strlen(path) + 32;
+	char *temp = malloc(len);
+	if (temp == NULL) {
+		fprintf(stderr, "allocation failed\n");
+		return -1;
+	}
+	for (int i = 0; i < 100; i++) {
+		snprintf(temp, len, "%s.%ld-%d.tmp", path, (long)getpid(), i);
+		int fd = open(temp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+		if (fd < 0 && errno == EEXIST) {
+			continue;
+		} else if (fd < 0) {
+			break;
+		}
+		// Replacing a file keeps its permissions
+		if (exists) {
+			fchmod(fd, st.st_mode & 07777);
+		}
+		*temp_path = temp;
+		return fd;
+	}
+	fprintf(stderr, "Failed to open file '%s' for writing: %s\n",
+		path, strerror(errno));
+	free(temp);
+	return -1;
+}
+
+/**
+ * Move the file opened by open_output_file() in place if ok, remove it
+ * otherwise. Frees temp_path, and returns false if it wasn't moved.
+ */
+static bool finish_output_file(const char *path, char *temp_path, bool ok) {
+	if (temp_path == NULL) {
+		return ok;
+	}
+	if (ok && rename(temp_path, path) != 0) {
+		fprintf(stderr, "Failed to rename '%s' to '%s': %s\n",
+			temp_path, path, strerror(errno));
+		ok = false;
+	}
+	if (!ok) {
+		unlink(temp_path);
+	}
+	free(temp_path);
+	return ok;
+}
+
+/**
+ * open_output_file() as a stream. Returns NULL on error.
+ */
+static FILE *open_output_stream(const char *path, char **temp_path) {
+	int fd = open_output_file(path, temp_path);
+	if (fd < 0) {
+		return NULL;
+	}
+	FILE *file = fdopen(fd, "w");
+	if (file == NULL) {
+		fprintf(stderr, "Failed to open file '%s' for writing: %s\n",
+			path, strerror(errno));
+		close(fd);
+		finish_output_file(path, *temp_path, false);
+		*temp_path = NULL;
+	}
+	return file;
+}
+
+/**
+ * Make path another name of target, replacing whatever path was only once
+ * the link exists. Returns false if the filesystem can't link them.
+ */
+static bool link_output_file(const char *target, const char *path) {
+	size_t len = strlen(path) + 32;
+	char *temp = malloc(len);
+	if (temp == NULL) {
+		fprintf(stderr, "allocation failed\n");
+		return false;
+	}
+	snprintf(temp, len, "%s.%ld.tmp", path, (long)getpid());
+	unlink(temp);
+	bool ok = link(target, temp) == 0 && rename(temp, path) == 0;
+	// rename() leaves both names alone if they're links to the same file
+	unlink(temp);
+	free(temp);
+	return ok;
+}
+
+static int write_image_file(struct grim_state *state, pixman_image_t *image,
+		struct grim_options *opts, const char *path) {
+	char *temp_path;
+	FILE *file = open_output_stream(path, &temp_path);
+	if (!file) {
+		return -1;
+	}
+
+	int ret = write_image(state, image, opts, file, NULL);
+	if (fclose(file) != 0 && ret == 0) {
+		fprintf(stderr, "Failed to write file '%s': %s\n", path,
+			strerror(errno));
+		ret = -1;
+	}
+	if (!finish_output_file(path, temp_path, ret == 0)) {
+		ret = -1;
 	}
-	if (ret == -1) {
-		// Error messages will be printed at the source
+	return ret;
+}
+
+struct variant_level {
+	struct grim_state *state;
+	struct grim_variant *variant;
+	// The image's options, with the variant's format
+	struct grim_options opts;
+	double scale;
+	int32_t width, height;
+	pixman_image_t *image;
+
+	pthread_t thread;
+	bool started;
+	int ret;
+};
+
+struct variant_pyramid {
+	struct variant_level *levels;
+	size_t n_levels;
+	bool ok;
+};
+
+static int compare_variant_scales(const void *a, const void *b) {
+	const struct variant_level *level_a = a, *level_b = b;
+	if (level_a->scale != level_b->scale) {
+		return level_a->scale < level_b->scale ? 1 : -1;
+	}
+	return 0;
+}
+
+static void *run_variant_thread(void *data) {
+	struct variant_level *level = data;
+	const char *path = level->variant->path;
+	char *temp_path;
+	FILE *file = open_output_stream(path, &temp_path);
+	if (file == NULL) {
+		level->ret = -1;
+		return NULL;
+	}
+
+	// Not traced, --timings is about the image itself
+	level->ret = encode_image(level->state, level->image, &level->opts,
+		file, NULL);
+	if (fclose(file) != 0 && level->ret == 0) {
+		fprintf(stderr, "Failed to write file '%s': %s\n", path,
+			strerror(errno));
+		level->ret = -1;
+	}
+	if (!finish_output_file(path, temp_path, level->ret == 0)) {
+		level->ret = -1;
+	}
+	return NULL;
+}
+
+/**
+ * Derive the variants of the image from the largest to the smallest, each
+ * from the previous one, and encode each of them on a thread of its own as
+ * soon as it's ready.
+ */
+static void start_variants(struct variant_pyramid *pyramid,
+		struct grim_state *state, struct grim_options *opts,
+		pixman_image_t *image) {
+	*pyramid = (struct variant_pyramid){ .ok = true };
+	if (opts->n_variants == 0) {
+		return;
+	}
+	pyramid->levels = calloc(opts->n_variants, sizeof(*pyramid->levels));
+	if (pyramid->levels == NULL) {
+		fprintf(stderr, "failed to allocate variants\n");
+		pyramid->ok = false;
+		return;
+	}
+	pyramid->n_levels = opts->n_variants;
+
+	int32_t width = pixman_image_get_width(image);
+	int32_t height = pixman_image_get_height(image);
+	for (size_t i = 0; i < pyramid->n_levels; i++) {
+		struct variant_level *level = &pyramid->levels[i];
+		struct grim_variant *variant = &opts->variants[i];
+		double scale = variant->scale > 0 ? variant->scale : 1;
+		if (variant->width > 0) {
+			scale = fmin(scale, (double)variant->width / width);
+		}
+		if (variant->height > 0) {
+			scale = fmin(scale, (double)variant->height / height);
+		}
+
+		*level = (struct variant_level){
+			.state = state,
+			.variant = variant,
+			.opts = *opts,
+			.scale = scale,
+			.width = fmax(1, round(width * scale)),
+			.height = fmax(1, round(height * scale)),
+		};
+		if (variant->has_filetype) {
+			level->opts.filetype = variant->filetype;
+		}
+		if (variant->has_jpeg_quality) {
+			level->opts.jpeg_quality = variant->jpeg_quality;
+		}
+		if (variant->has_png_level) {
+			level->opts.png_level = variant->png_level;
+		}
+	}
+	qsort(pyramid->levels, pyramid->n_levels, sizeof(*pyramid->levels),
+		compare_variant_scales);
+
+	pixman_image_t *source = image;
+	for (size_t i = 0; i < pyramid->n_levels; i++) {
+		struct variant_level *level = &pyramid->levels[i];
+		level->image = render_downscaled(state, source, level->width,
+			level->height);
+		if (level->image == NULL) {
+			pyramid->ok = false;
+			return;
+		}
+		source = level->image;
+
+		level->started = pthread_create(&level->thread, NULL,
+			run_variant_thread, level) == 0;
+		if (!level->started) {
+			run_variant_thread(level);
+		}
+	}
+}
+
+/**
+ * Wait for the variants to be written. Returns false if any of them failed.
+ */
+static bool finish_variants(struct variant_pyramid *pyramid) {
+	bool ok = pyramid->ok;
+	for (size_t i = 0; i < pyramid->n_levels; i++) {
+		struct variant_level *level = &pyramid->levels[i];
+		if (level->started) {
+			pthread_join(level->thread, NULL);
+		}
+		if (level->image != NULL) {
+			ok = ok && level->ret == 0;
+			pixman_image_unref(level->image);
+		}
+	}
+	free(pyramid->levels);
+	return ok;
+}
+
+struct encode_thread {
+	pthread_t thread;
+	struct grim_state *state;
+	struct grim_options *opts;
+	FILE *file;
+	struct grim_render_job *job;
+	int ret;
+};
+
+static void *run_encode_thread(void *data) {
+	struct encode_thread *encode = data;
+	// Waits for the buffers to be known
+	pixman_image_t *image = get_render_job_image(encode->job);
+	encode->ret = write_image(encode->state, image, encode->opts,
+		encode->file, encode->job);
+	return NULL;
+}
+
+/**
+ * Take a screenshot and write it to file. With several outputs, each of them
+ * is composited as soon as its frame is ready, and the encoder starts on the
+ * top rows of the image while the bottom ones are still being captured.
+ */
+static int write_capture(struct grim_state *state, struct grim_options *opts,
+		FILE *file) {
+	struct grim_trace *trace = state->trace;
+	trace_phase_start(trace, GRIM_TRACE_CAPTURE);
+	double scale;
+	size_t n_pending = start_capture(state, opts, &scale);
+	if (n_pending == 0) {
+		return -1;
+	}
+
+	struct grim_box geometry;
+	struct grim_render_job *job = NULL;
+	if (!opts->use_win) {
+		get_capture_geometry(state, opts, &geometry);
+		trace_phase_start(trace, GRIM_TRACE_RENDER);
+		job = start_render_job(state, &geometry, scale);
+	}
+	if (job == NULL) {
+		if (!wait_capture(state, n_pending)) {
+			return -1;
+		}
+		trace_phase_end(trace, GRIM_TRACE_CAPTURE);
+		get_capture_geometry(state, opts, &geometry);
+		trace_phase_start(trace, GRIM_TRACE_RENDER);
+		pixman_image_t *image = render(state, &geometry, scale);
+		trace_phase_end(trace, GRIM_TRACE_RENDER);
+		if (image == NULL) {
+			return -1;
+		}
+		trace_render_image(state, image, &geometry, scale);
+		struct variant_pyramid pyramid;
+		start_variants(&pyramid, state, opts, image);
+		int ret = write_image(state, image, opts, file, NULL);
+		if (!finish_variants(&pyramid)) {
+			ret = -1;
+		}
+		pixman_image_unref(image);
+		return ret;
+	}
+
+	struct encode_thread encode = {
+		.state = state,
+		.opts = opts,
+		.file = file,
+		.job = job,
+		.ret = -1,
+	};
+	bool encoding = pthread_create(&encode.thread, NULL, run_encode_thread,
+		&encode) == 0;
+
+	state->render_job = job;
+	bool ok = wait_capture(state, n_pending);
+	trace_phase_end(trace, GRIM_TRACE_CAPTURE);
+	state->render_job = NULL;
+	ok = finish_render_job(job) && ok;
+	trace_phase_end(trace, GRIM_TRACE_RENDER);
+	struct variant_pyramid pyramid = { .ok = true };
+	if (ok) {
+		trace_render_image(state, get_render_job_image(job), &geometry,
+			scale);
+		start_variants(&pyramid, state, opts, get_render_job_image(job));
+	}
+
+	if (encoding) {
+		pthread_join(encode.thread, NULL);
+	} else if (ok) {
+		encode.ret = write_image(state, get_render_job_image(job), opts,
+			file, NULL);
+	}
+	ok = finish_variants(&pyramid) && ok;
+	destroy_render_job(job);
+	return ok ? encode.ret : -1;
+}
+
+/**
+ * Write the --timings report, once the image is written.
+ */
+static void report_timings(struct grim_state *state,
+		struct grim_options *opts) {
+	if (state->trace == NULL) {
+		return;
+	}
+
+	FILE *stream = stderr;
+	if (opts->timings_path != NULL) {
+		stream = fopen(opts->timings_path, "w");
+		if (stream == NULL) {
+			fprintf(stderr, "Failed to open file '%s' for writing: %s\n",
+				opts->timings_path, strerror(errno));
+			return;
+		}
+	}
+	write_trace(state->trace, state, stream);
+	if (stream != stderr && fclose(stream) != 0) {
+		fprintf(stderr, "Failed to write file '%s': %s\n",
+			opts->timings_path, strerror(errno));
+	}
+}
+
+static int handle_daemon_request(struct grim_state *state, int argc,
+		char *argv[], FILE *in, FILE *out) {
+	struct grim_options opts;
+	if (!parse_options(&opts, argc, argv, in) || opts.help || opts.daemon) {
+		finish_options(&opts);
+		return EXIT_FAILURE;
+	}
+	if (is_window_batch(&opts)) {
+		fprintf(stderr, "the daemon can't capture several windows\n");
+		finish_options(&opts);
 		return EXIT_FAILURE;
 	}
+	if (opts.n_variants > 0) {
+		// It couldn't write them where the client expects them
+		fprintf(stderr, "the daemon can't write variants\n");
+		finish_options(&opts);
+		return EXIT_FAILURE;
+	}
+	if (opts.timings) {
+		state->trace = create_trace();
+	}
+
+	int ret = EXIT_FAILURE;
+	// Error messages will be printed at the source
+	if (write_capture(state, &opts, out) == 0) {
+		trace_phase_start(state->trace, GRIM_TRACE_CLOSE);
+		if (fflush(out) == 0) {
+			ret = EXIT_SUCCESS;
+		}
+		trace_phase_end(state->trace, GRIM_TRACE_CLOSE);
+	}
+
+	// Printed on the client's stderr, see run_daemon()
+	report_timings(state, &opts);
+	destroy_trace(state->trace);
+	state->trace = NULL;
+	reset_capture(state);
+	finish_options(&opts);
+	return ret;
+}
+
+static char *get_output_filepath(struct grim_options *opts) {
+	if (opts->output_filename != NULL) {
+		return strdup(opts->output_filename);
+	}
+
+	char filename[64];
+	if (!default_filename(filename, sizeof(filename), opts->filetype)) {
+		fprintf(stderr, "failed to generate default filename\n");
+		return NULL;
+	}
+
+	char *output_dir = get_output_dir();
+	int len = snprintf(NULL, 0, "%s/%s", output_dir, filename);
+	if (len < 0) {
+		perror("snprintf failed");
+		free(output_dir);
+		return NULL;
+	}
+	char *output_filepath = malloc(len + 1);
+	snprintf(output_filepath, len + 1, "%s/%s", output_dir, filename);
+	free(output_dir);
+	return output_filepath;
+}
+
+static bool is_stdout(struct grim_options *opts) {
+	return opts->output_filename != NULL &&
+		strcmp(opts->output_filename, "-") == 0;
+}
+
+/**
+ * Hand the request over to a daemon. Returns -1 if no daemon is listening.
+ */
+static int run_client(struct grim_options *opts, int argc, char *argv[]) {
+	char *socket_path = opts->socket_path != NULL ?
+		strdup(opts->socket_path) : get_daemon_socket_path();
+	if (socket_path == NULL) {
+		return -1;
+	}
+
+	char *output_filepath = NULL, *temp_path = NULL;
+	int fd = STDOUT_FILENO;
+	if (!is_stdout(opts)) {
+		output_filepath = get_output_filepath(opts);
+		if (output_filepath == NULL) {
+			free(socket_path);
+			return EXIT_FAILURE;
+		}
+		fd = open_output_file(output_filepath, &temp_path);
+		if (fd < 0) {
+			free(output_filepath);
+			free(socket_path);
+			return EXIT_FAILURE;
+		}
+	}
 
-	if (strcmp(output_filename, "-") != 0) {
-		fclose(file);
+	int ret = send_daemon_request(socket_path, argc, argv, fd);
+	if (output_filepath != NULL) {
+		if (close(fd) != 0 && ret == EXIT_SUCCESS) {
+			fprintf(stderr, "Failed to write file '%s': %s\n",
+				output_filepath, strerror(errno));
+			ret = EXIT_FAILURE;
+		}
+		if (!finish_output_file(output_filepath, temp_path,
+				ret == EXIT_SUCCESS) && ret == EXIT_SUCCESS) {
+			ret = EXIT_FAILURE;
+		}
 	}
 
 	free(output_filepath);
-	pixman_image_unref(image);
+	free(socket_path);
+	return ret;
+}
+
+static int run_daemon_mode(struct grim_options *opts) {
+	char *socket_path = opts->socket_path != NULL ?
+		strdup(opts->socket_path) : get_daemon_socket_path();
+	if (socket_path == NULL) {
+		fprintf(stderr, "failed to find a path for the daemon socket\n");
+		return EXIT_FAILURE;
+	}
+
+	struct grim_state state;
+	int ret = EXIT_FAILURE;
+	if (connect_state(&state, false, opts->shm_mode, opts->dmabuf,
+			opts->n_threads, NULL)) {
+		ret = run_daemon(&state, socket_path, handle_daemon_request);
+	}
+
+	finish_state(&state);
+	free(socket_path);
+	return ret;
+}
+
+static volatile sig_atomic_t interval_stopped = 0;
+
+static void handle_interval_signal(int sig) {
+	interval_stopped = 1;
+}
+
+/**
+ * Process compositor events until the deadline passes. Returns false if the
+ * connection to the compositor is lost.
+ */
+static bool dispatch_until(struct wl_display *display,
+		const struct timespec *deadline) {
+	while (!interval_stopped) {
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		int64_t timeout_ns = (int64_t)(deadline->tv_sec - now.tv_sec) *
+			1000000000 + (deadline->tv_nsec - now.tv_nsec);
+		if (timeout_ns <= 0) {
+			return true;
+		}
+
+		int timeout_ms = (timeout_ns + 999999) / 1000000;
+		if (dispatch_events(display, timeout_ms) < 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/**
+ * Path of the n-th screenshot of an interval capture: the number goes right
+ * before the extension, if any.
+ */
+static char *get_sequence_path(const char *path, unsigned int n) {
+	const char *base = strrchr(path, '/');
+	base = base != NULL ? base + 1 : path;
+	const char *ext = strrchr(base, '.');
+	if (ext == NULL || ext == base) {
+		ext = base + strlen(base);
+	}
+
+	int stem_len = ext - path;
+	int len = snprintf(NULL, 0, "%.*s-%05u%s", stem_len, path, n, ext);
+	char *sequence_path = malloc(len + 1);
+	if (sequence_path == NULL) {
+		return NULL;
+	}
+	snprintf(sequence_path, len + 1, "%.*s-%05u%s", stem_len, path, n, ext);
+	return sequence_path;
+}
 
+/**
+ * Forget about the windows which couldn't be captured, for instance because
+ * they were closed in the meantime. Returns the number of windows left.
+ */
+static size_t drop_failed_windows(struct grim_state *state) {
+	size_t n = 0;
 	struct grim_output *output;
-	struct grim_output *output_tmp;
-	wl_list_for_each_safe(output, output_tmp, &state.outputs, link) {
-		wl_list_remove(&output->link);
-		free(output->name);
-		if (output->screencopy_frame != NULL) {
-			zwlr_screencopy_frame_v1_destroy(output->screencopy_frame);
+	wl_list_for_each(output, &state->outputs, link) {
+		if (output->toplevel_export_frame != NULL) {
+			hyprland_toplevel_export_frame_v1_destroy(
+				output->toplevel_export_frame);
+			output->toplevel_export_frame = NULL;
+			release_buffer(output->buffer);
+			output->buffer = NULL;
+		} else if (output->buffer != NULL) {
+			++n;
 		}
-		destroy_buffer(output->buffer);
-		if (output->xdg_output != NULL) {
-			zxdg_output_v1_destroy(output->xdg_output);
+	}
+	return n;
+}
+
+static int compare_window_heights(const void *a, const void *b) {
+	const struct grim_output *output_a = *(struct grim_output *const *)a;
+	const struct grim_output *output_b = *(struct grim_output *const *)b;
+	// Tallest first
+	return output_b->logical_geometry.height -
+		output_a->logical_geometry.height;
+}
+
+/**
+ * Lay the captured windows out next to each other, so that each of them can
+ * be rendered on its own or all of them at once. They are put on shelves
+ * about as wide as the result is tall, tallest first. Returns the region of
+ * the layout they cover.
+ */
+static bool layout_windows(struct grim_state *state, size_t n_windows,
+		struct grim_box *extents) {
+	struct grim_output **windows = calloc(n_windows, sizeof(*windows));
+	if (windows == NULL) {
+		return false;
+	}
+
+	size_t n = 0;
+	double area = 0;
+	int32_t row_width = 0;
+	struct grim_output *output;
+	wl_list_for_each(output, &state->outputs, link) {
+		if (output->buffer == NULL) {
+			continue;
+		}
+		struct grim_box *box = &output->logical_geometry;
+		windows[n++] = output;
+		area += (double)box->width * box->height;
+		if (box->width > row_width) {
+			row_width = box->width;
+		}
+	}
+	if (sqrt(area) > row_width) {
+		row_width = ceil(sqrt(area));
+	}
+	qsort(windows, n, sizeof(*windows), compare_window_heights);
+
+	*extents = (struct grim_box){0};
+	int32_t x = 0, y = 0, row_height = 0;
+	for (size_t i = 0; i < n; i++) {
+		struct grim_box *box = &windows[i]->logical_geometry;
+		if (x > 0 && x + box->width > row_width) {
+			x = 0;
+			y += row_height;
+			row_height = 0;
 		}
+		box->x = x;
+		box->y = y;
+		windows[i]->capture_geometry = *box;
+		extend_box(extents, box);
+
+		x += box->width;
+		if (box->height > row_height) {
+			row_height = box->height;
+		}
+	}
+
+	free(windows);
+	return true;
+}
+
+/**
+ * Write where each window ended up in the atlas, in image pixels.
+ */
+static bool write_atlas_index(struct grim_state *state,
+		struct grim_options *opts, struct grim_box *extents, double scale) {
+	char *temp_path;
+	FILE *file = open_output_stream(opts->atlas_path, &temp_path);
+	if (file == NULL) {
+		return false;
+	}
+
+	fprintf(file, "{\n  \"width\": %d, \"height\": %d,\n  \"windows\": [",
+		(int)(extents->width * scale), (int)(extents->height * scale));
+	size_t index = 0;
+	bool first = true;
+	struct grim_output *output;
+	wl_list_for_each(output, &state->outputs, link) {
 		if (output->wl_output != NULL) {
-			wl_output_release(output->wl_output);
+			continue;
+		}
+		size_t window_index = index++;
+		if (output->buffer == NULL) {
+			continue;
+		}
+
+		struct grim_box *box = &output->logical_geometry;
+		fprintf(file, "%s\n    {\"index\": %zu, \"x\": %d, \"y\": %d, "
+			"\"width\": %d, \"height\": %d", first ? "" : ",",
+			window_index, (int)((box->x - extents->x) * scale),
+			(int)((box->y - extents->y) * scale), (int)(box->width * scale),
+			(int)(box->height * scale));
+		if (output->toplevel != NULL) {
+			fprintf(file, ", \"app_id\": ");
+			write_json_string(file, output->toplevel->app_id);
+			fprintf(file, ", \"title\": ");
+			write_json_string(file, output->toplevel->title);
+		} else if (!opts->use_toplevels) {
+			fprintf(file, ", \"address\": \"0x%" PRIx32 "\"",
+				output->window_handle);
 		}
-		free(output);
+		fprintf(file, "}");
+		first = false;
 	}
-	if (use_win) {
-		hyprland_toplevel_export_manager_v1_destroy(state.toplevel_export_manager);
-	} else {
-		zwlr_screencopy_manager_v1_destroy(state.screencopy_manager);
+	fprintf(file, "\n  ]\n}\n");
+
+	bool ok = true;
+	if (fclose(file) != 0) {
+		fprintf(stderr, "Failed to write file '%s': %s\n",
+			opts->atlas_path, strerror(errno));
+		ok = false;
+	}
+	return finish_output_file(opts->atlas_path, temp_path, ok);
+}
+
+/**
+ * Capture several windows over the same connection, all of their frames
+ * being requested at once. Each of them is written to its own file, numbered
+ * in the order of -w or of the toplevels, or with --atlas all of them to a
+ * single image. Windows which can't be captured are left out.
+ */
+static int write_windows(struct grim_state *state, struct grim_options *opts,
+		const char *output_filepath) {
+	struct grim_trace *trace = state->trace;
+	trace_phase_start(trace, GRIM_TRACE_CAPTURE);
+	double scale;
+	size_t n_pending = start_capture(state, opts, &scale);
+	if (n_pending == 0) {
+		return EXIT_FAILURE;
+	}
+	// A single window is written like any other screenshot
+	bool numbered = opts->atlas_path == NULL && n_pending > 1;
+	if (numbered && is_stdout(opts)) {
+		fprintf(stderr, "several windows can only be written to standard "
+			"output with --atlas\n");
+		return EXIT_FAILURE;
+	}
+	bool done = false;
+	while (!done && dispatch_events(state->display, -1) != -1) {
+		done = (state->n_done + state->n_failed == n_pending);
+	}
+	trace_phase_end(trace, GRIM_TRACE_CAPTURE);
+
+	size_t n_windows = done ? drop_failed_windows(state) : 0;
+	struct grim_box extents;
+	if (n_windows == 0 || !layout_windows(state, n_windows, &extents)) {
+		fprintf(stderr, "failed to screenshoot any window\n");
+		return EXIT_FAILURE;
+	}
+
+	if (opts->atlas_path != NULL) {
+		trace_phase_start(trace, GRIM_TRACE_RENDER);
+		pixman_image_t *image = render(state, &extents, scale);
+		trace_phase_end(trace, GRIM_TRACE_RENDER);
+		if (image == NULL) {
+			return EXIT_FAILURE;
+		}
+		trace_render_image(state, image, &extents, scale);
+
+		int ret;
+		if (is_stdout(opts)) {
+			ret = write_image(state, image, opts, stdout, NULL) == 0 &&
+				fflush(stdout) == 0 ? 0 : -1;
+		} else {
+			ret = write_image_file(state, image, opts, output_filepath);
+		}
+		pixman_image_unref(image);
+		if (ret != 0 || !write_atlas_index(state, opts, &extents, scale)) {
+			return EXIT_FAILURE;
+		}
+		return EXIT_SUCCESS;
 	}
-	if (state.xdg_output_manager != NULL) {
-		zxdg_output_manager_v1_destroy(state.xdg_output_manager);
+
+	unsigned int index = 0;
+	struct grim_output *output;
+	wl_list_for_each(output, &state->outputs, link) {
+		unsigned int window_index = index++;
+		if (output->buffer == NULL) {
+			continue;
+		}
+
+		pixman_image_t *image = render(state, &output->logical_geometry,
+			scale);
+		if (image == NULL) {
+			return EXIT_FAILURE;
+		}
+		int ret;
+		if (!numbered && is_stdout(opts)) {
+			ret = write_image(state, image, opts, stdout, NULL) == 0 &&
+				fflush(stdout) == 0 ? 0 : -1;
+		} else {
+			char *path = numbered ?
+				get_sequence_path(output_filepath, window_index) :
+				strdup(output_filepath);
+			ret = path != NULL ?
+				write_image_file(state, image, opts, path) : -1;
+			free(path);
+		}
+		pixman_image_unref(image);
+		if (ret != 0) {
+			return EXIT_FAILURE;
+		}
 	}
-	wl_shm_destroy(state.shm);
-	wl_registry_destroy(state.registry);
-	wl_display_disconnect(state.display);
-	free(geometry);
-	free(geometry_output);
 	return EXIT_SUCCESS;
 }
+
+static size_t count_captured_outputs(struct grim_state *state) {
+	size_t n = 0;
+	struct grim_output *output;
+	wl_list_for_each(output, &state->outputs, link) {
+		if (output->buffer != NULL) {
+			++n;
+		}
+	}
+	return n;
+}
+
+/**
+ * Capture the outputs whose frame is still carried over again, without
+ * waiting for damage, so that none of the buffers changes while the image is
+ * rendered from scratch.
+ */
+static bool refresh_pending_frames(struct grim_state *state,
+		struct grim_options *opts) {
+	size_t n_pending = state->n_done;
+	state->use_damage = false;
+	struct grim_output *output;
+	wl_list_for_each(output, &state->outputs, link) {
+		if (output->buffer == NULL || output->screencopy_frame == NULL) {
+			continue;
+		}
+		zwlr_screencopy_frame_v1_destroy(output->screencopy_frame);
+		output->screencopy_frame = NULL;
+		if (output->buffer->wl_buffer == NULL) {
+			// Still being imported, start over
+			release_buffer(output->buffer);
+			output->buffer = NULL;
+		}
+		request_frame(output, opts);
+		++n_pending;
+	}
+	bool ok = n_pending == state->n_done || wait_capture(state, n_pending);
+	state->use_damage = true;
+	return ok;
+}
+
+/**
+ * Take a screenshot every opts->interval seconds. Frames are copied only once
+ * the compositor reports damage, and only the tiles of the image touched by
+ * it are redrawn. Screenshots identical to the previous one are hard links
+ * to it, or skipped when writing to stdout.
+ */
+static int run_interval(struct grim_state *state, struct grim_options *opts,
+		const char *output_filepath) {
+	struct sigaction sa = { .sa_handler = handle_interval_signal };
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	struct timespec deadline;
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	int64_t interval_ns = opts->interval * 1000000000;
+
+	// The image is kept up to date while the buffers are written to
+	state->copy_image = true;
+
+	struct grim_box geometry;
+	double scale;
+	pixman_image_t *image = capture(state, opts, &geometry, &scale);
+	if (image == NULL) {
+		return EXIT_FAILURE;
+	}
+	size_t n_captured = count_captured_outputs(state);
+	state->use_damage = true;
+
+	int ret = EXIT_SUCCESS;
+	char *prev_path = NULL;
+	for (unsigned int n = 0; opts->count == 0 || n < opts->count; n++) {
+		bool changed = true;
+		if (n > 0) {
+			int64_t nsec = deadline.tv_nsec + interval_ns;
+			deadline.tv_sec += nsec / 1000000000;
+			deadline.tv_nsec = nsec % 1000000000;
+
+			// The image is a copy, so buffers are only read while it's
+			// brought up to date
+			trim_buffer_pool(state->buffer_pool);
+
+			struct grim_output *output;
+			wl_list_for_each(output, &state->outputs, link) {
+				// Frames still waiting for damage are carried over
+				if (output->buffer != NULL && output->screencopy_frame == NULL) {
+					request_frame(output, opts);
+				}
+			}
+
+			if (!dispatch_until(state->display, &deadline) ||
+					state->n_failed > 0) {
+				fprintf(stderr, "failed to screenshoot all outputs\n");
+				ret = EXIT_FAILURE;
+				break;
+			}
+			if (interval_stopped) {
+				break;
+			}
+
+			struct grim_box new_geometry;
+			get_capture_geometry(state, opts, &new_geometry);
+			size_t new_n_captured = count_captured_outputs(state);
+			// An opaque image can't take translucent pixels, see render()
+			bool opaque =
+				pixman_image_get_format(image) == PIXMAN_x8r8g8b8;
+			if (new_geometry.x != geometry.x || new_geometry.y != geometry.y ||
+					new_geometry.width != geometry.width ||
+					new_geometry.height != geometry.height ||
+					new_n_captured != n_captured ||
+					opaque != is_render_opaque(state, &new_geometry, scale)) {
+				// The layout changed under us, start over
+				pixman_image_unref(image);
+				image = NULL;
+				if (!refresh_pending_frames(state, opts)) {
+					ret = EXIT_FAILURE;
+					break;
+				}
+				get_capture_geometry(state, opts, &geometry);
+				n_captured = count_captured_outputs(state);
+				image = render(state, &geometry, scale);
+				if (image == NULL) {
+					ret = EXIT_FAILURE;
+					break;
+				}
+			} else {
+				int n_dirty = render_damage(state, &geometry, scale, image);
+				if (n_dirty < 0) {
+					ret = EXIT_FAILURE;
+					break;
+				}
+				changed = n_dirty > 0;
+			}
+		}
+
+		if (is_stdout(opts)) {
+			if (changed && (write_image(state, image, opts, stdout,
+					NULL) != 0 || fflush(stdout) != 0)) {
+				ret = EXIT_FAILURE;
+				break;
+			}
+			continue;
+		}
+
+		char *path = get_sequence_path(output_filepath, n);
+		if (path == NULL) {
+			ret = EXIT_FAILURE;
+			break;
+		}
+		bool linked = !changed && prev_path != NULL &&
+			link_output_file(prev_path, path);
+		// Filesystems without hard links get a copy
+		if (!linked && write_image_file(state, image, opts, path) != 0) {
+			free(path);
+			ret = EXIT_FAILURE;
+			break;
+		}
+		free(prev_path);
+		prev_path = path;
+	}
+
+	free(prev_path);
+	if (image != NULL) {
+		pixman_image_unref(image);
+	}
+	return ret;
+}
+
+int main(int argc, char *argv[]) {
+	struct grim_options opts;
+	// Leave stdin alone until we know whether a daemon will read it
+	if (!parse_options(&opts, argc, argv, NULL)) {
+		finish_options(&opts);
+		return EXIT_FAILURE;
+	}
+	if (opts.help) {
+		printf("%s", usage);
+		finish_options(&opts);
+		return EXIT_SUCCESS;
+	}
+
+	if (opts.daemon) {
+		int ret = run_daemon_mode(&opts);
+		finish_options(&opts);
+		return ret;
+	}
+
+	// The daemon only writes a single image
+	if (opts.client && !is_window_batch(&opts) && opts.n_variants == 0) {
+		int ret = run_client(&opts, argc, argv);
+		if (ret >= 0) {
+			finish_options(&opts);
+			return ret;
+		}
+		// No daemon around, capture the screenshot ourselves
+	}
+
+	if (opts.geometry_stdin) {
+		finish_options(&opts);
+		if (!parse_options(&opts, argc, argv, stdin)) {
+			finish_options(&opts);
+			return EXIT_FAILURE;
+		}
+	}
+
+	char *output_filepath = get_output_filepath(&opts);
+	if (output_filepath == NULL) {
+		finish_options(&opts);
+		return EXIT_FAILURE;
+	}
+
+	struct grim_trace *trace = opts.timings ? create_trace() : NULL;
+	struct grim_state state;
+	if (!connect_state(&state, opts.use_win, opts.shm_mode, opts.dmabuf,
+			opts.n_threads, trace)) {
+		return EXIT_FAILURE;
+	}
+
+	if (opts.interval > 0) {
+		int ret = run_interval(&state, &opts, output_filepath);
+		free(output_filepath);
+		reset_capture(&state);
+		finish_state(&state);
+		finish_options(&opts);
+		return ret;
+	}
+
+	// Nothing is captured after this one
+	state.final_capture = true;
+
+	if (is_window_batch(&opts)) {
+		int ret = write_windows(&state, &opts, output_filepath);
+		report_timings(&state, &opts);
+		free(output_filepath);
+		reset_capture(&state);
+		finish_state(&state);
+		destroy_trace(trace);
+		finish_options(&opts);
+		return ret;
+	}
+
+	// Opened upfront, since encoding may start before the capture is over.
+	// The file only replaces output_filepath once complete.
+	FILE *file = stdout;
+	char *temp_path = NULL;
+	if (!is_stdout(&opts)) {
+		file = open_output_stream(output_filepath, &temp_path);
+		if (file == NULL) {
+			return EXIT_FAILURE;
+		}
+	}
+
+	// Error messages will be printed at the source
+	int ret = write_capture(&state, &opts, file) == 0 ?
+		EXIT_SUCCESS : EXIT_FAILURE;
+
+	trace_phase_start(trace, GRIM_TRACE_CLOSE);
+	if (!is_stdout(&opts)) {
+		if (fclose(file) != 0 && ret == EXIT_SUCCESS) {
+			fprintf(stderr, "Failed to write file '%s': %s\n",
+				output_filepath, strerror(errno));
+			ret = EXIT_FAILURE;
+		}
+		if (!finish_output_file(output_filepath, temp_path,
+				ret == EXIT_SUCCESS)) {
+			ret = EXIT_FAILURE;
+		}
+	} else if (trace != NULL) {
+		fflush(stdout);
+	}
+	trace_phase_end(trace, GRIM_TRACE_CLOSE);
+
+	report_timings(&state, &opts);
+	free(output_filepath);
+	reset_capture(&state);
+	finish_state(&state);
+	destroy_trace(trace);
+	finish_options(&opts);
+	return ret;
+}
@@ -69,3 +69,61 @@ void guess_output_logical_geometry(struct grim_output *output) {
 		&output->logical_geometry.height);
 	output->logical_scale = output->scale;
 }
+
+bool get_output_capture_region(struct grim_output *output,
+		struct grim_box *geometry, double scale, struct grim_box *region) {
+	struct grim_box *logical = &output->logical_geometry;
+	if (is_empty_box(logical) || output->logical_scale <= 0) {
+		return false;
+	}
+
+	// Region edges need to land on whole buffer pixels, otherwise the
+	// compositor rounds them and the result no longer lines up with a full
+	// capture. Find the smallest logical step that maps to whole pixels.
+	int32_t step = 0;
+	for (int32_t i = 1; i <= 8; i++) {
+		double pixels = i * output->logical_scale;
+		if (fabs(pixels - round(pixels)) < 1e-6) {
+			step = i;
+			break;
+		}
+	}
+	if (step == 0) {
+		return false;
+	}
+
+	// Keep enough pixels around the requested region for the filter used by
+	// render() to sample the same neighbours as it would in a full capture
+	double ratio = scale / output->logical_scale;
+	double support = ratio < 0.75 ? ceil(2 / ratio) + 1 : 1;
+	int32_t margin = ceil(support / output->logical_scale) + 1;
+
+	int32_t x1 = fmax(geometry->x - margin, logical->x) - logical->x;
+	int32_t y1 = fmax(geometry->y - margin, logical->y) - logical->y;
+	int32_t x2 = fmin(geometry->x + geometry->width + margin,
+		logical->x + logical->width) - logical->x;
+	int32_t y2 = fmin(geometry->y + geometry->height + margin,
+		logical->y + logical->height) - logical->y;
+	if (x1 >= x2 || y1 >= y2) {
+		return false;
+	}
+
+	x1 = x1 / step * step;
+	y1 = y1 / step * step;
+	x2 = fmin((x2 + step - 1) / step * step, logical->width);
+	y2 = fmin((y2 + step - 1) / step * step, logical->height);
+
+	if (x1 == 0 && y1 == 0 &&
+			x2 == logical->width && y2 == logical->height) {
+		// Nothing to gain over capturing the whole output
+		return false;
+	}
+
+	*region = (struct grim_box) {
+		.x = logical->x + x1,
+		.y = logical->y + y1,
+		.width = x2 - x1,
+		.height = y2 - y1,
+	};
+	return true;
+}
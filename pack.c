@@ -0,0 +1,205 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "pack.h"
+
+// The vector versions read pixels as bytes, in memory order
+#if GRIM_LITTLE_ENDIAN && defined(__x86_64__)
+#define PACK_X86 1
+#include <immintrin.h>
+#else
+#define PACK_X86 0
+#endif
+#if GRIM_LITTLE_ENDIAN && defined(__aarch64__)
+#define PACK_NEON 1
+#include <arm_neon.h>
+#else
+#define PACK_NEON 0
+#endif
+
+static pthread_once_t pack_once = PTHREAD_ONCE_INIT;
+// Supported by the CPU, from the slowest to the fastest
+static struct grim_pack_impl pack_impls[3];
+static size_t n_pack_impls;
+static grim_pack_row_func pack_row_impl;
+// (0xff << 16) / a, to unpremultiply without dividing
+static uint32_t unpremultiply_table[256];
+
+static void pack_row_scalar(uint8_t *restrict row_out,
+		const uint32_t *restrict row_in, size_t width, bool fully_opaque) {
+	for (size_t x = 0; x < width; x++) {
+		uint8_t b = (row_in[x] >>  0) & 0xff;
+		uint8_t g = (row_in[x] >>  8) & 0xff;
+		uint8_t r = (row_in[x] >> 16) & 0xff;
+		uint8_t a = (row_in[x] >> 24) & 0xff;
+
+		// Unpremultiply pixels, if necessary. In practice, few images
+		// made by grim will have many pixels with fractional alpha
+		if (!fully_opaque && (a != 0 && a != 255)) {
+			uint32_t inv = unpremultiply_table[a];
+			uint32_t sr = r * inv;
+			r = sr > (0xff << 16) ? 0xff : (sr >> 16);
+			uint32_t sg = g * inv;
+			g = sg > (0xff << 16) ? 0xff : (sg >> 16);
+			uint32_t sb = b * inv;
+			b = sb > (0xff << 16) ? 0xff : (sb >> 16);
+		}
+
+		*row_out++ = r;
+		*row_out++ = g;
+		*row_out++ = b;
+		if (!fully_opaque) {
+			*row_out++ = a;
+		}
+	}
+}
+
+/*
+ * The vector versions only swizzle bytes. Blocks of pixels with fractional
+ * alpha, which need to be unpremultiplied, go through pack_row_scalar().
+ */
+
+#if PACK_X86
+__attribute__((target("sse4.1")))
+static void pack_row_sse41(uint8_t *restrict row_out,
+		const uint32_t *restrict row_in, size_t width, bool fully_opaque) {
+	size_t x = 0;
+	if (fully_opaque) {
+		const __m128i shuffle = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8,
+			14, 13, 12, -1, -1, -1, -1);
+		for (; x + 4 <= width; x += 4) {
+			__m128i v = _mm_loadu_si128((const __m128i *)(row_in + x));
+			v = _mm_shuffle_epi8(v, shuffle);
+			uint8_t *out = row_out + 3 * x;
+			_mm_storel_epi64((__m128i *)out, v);
+			uint32_t last = _mm_extract_epi32(v, 2);
+			memcpy(out + 8, &last, sizeof(last));
+		}
+	} else {
+		const __m128i shuffle = _mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7,
+			10, 9, 8, 11, 14, 13, 12, 15);
+		const __m128i alpha_mask = _mm_set1_epi32(0xff000000);
+		for (; x + 4 <= width; x += 4) {
+			__m128i v = _mm_loadu_si128((const __m128i *)(row_in + x));
+			__m128i alpha = _mm_and_si128(v, alpha_mask);
+			__m128i plain = _mm_or_si128(_mm_cmpeq_epi32(alpha, alpha_mask),
+				_mm_cmpeq_epi32(alpha, _mm_setzero_si128()));
+			if (!_mm_test_all_ones(plain)) {
+				pack_row_scalar(row_out + 4 * x, row_in + x, 4, false);
+				continue;
+			}
+			_mm_storeu_si128((__m128i *)(row_out + 4 * x),
+				_mm_shuffle_epi8(v, shuffle));
+		}
+	}
+	pack_row_scalar(row_out + (fully_opaque ? 3 : 4) * x, row_in + x,
+		width - x, fully_opaque);
+}
+
+__attribute__((target("avx2")))
+static void pack_row_avx2(uint8_t *restrict row_out,
+		const uint32_t *restrict row_in, size_t width, bool fully_opaque) {
+	size_t x = 0;
+	if (fully_opaque) {
+		const __m256i shuffle = _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8,
+			14, 13, 12, -1, -1, -1, -1,
+			2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+		// Moves the 12 bytes of the upper lane right after the lower ones
+		const __m256i compact = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7);
+		for (; x + 8 <= width; x += 8) {
+			__m256i v = _mm256_loadu_si256((const __m256i *)(row_in + x));
+			v = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(v, shuffle),
+				compact);
+			uint8_t *out = row_out + 3 * x;
+			_mm_storeu_si128((__m128i *)out, _mm256_castsi256_si128(v));
+			_mm_storel_epi64((__m128i *)(out + 16),
+				_mm256_extracti128_si256(v, 1));
+		}
+	} else {
+		const __m256i shuffle = _mm256_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7,
+			10, 9, 8, 11, 14, 13, 12, 15,
+			2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+		const __m256i alpha_mask = _mm256_set1_epi32(0xff000000);
+		for (; x + 8 <= width; x += 8) {
+			__m256i v = _mm256_loadu_si256((const __m256i *)(row_in + x));
+			__m256i alpha = _mm256_and_si256(v, alpha_mask);
+			__m256i plain = _mm256_or_si256(
+				_mm256_cmpeq_epi32(alpha, alpha_mask),
+				_mm256_cmpeq_epi32(alpha, _mm256_setzero_si256()));
+			if (_mm256_movemask_epi8(plain) != -1) {
+				pack_row_scalar(row_out + 4 * x, row_in + x, 8, false);
+				continue;
+			}
+			_mm256_storeu_si256((__m256i *)(row_out + 4 * x),
+				_mm256_shuffle_epi8(v, shuffle));
+		}
+	}
+	pack_row_scalar(row_out + (fully_opaque ? 3 : 4) * x, row_in + x,
+		width - x, fully_opaque);
+}
+#endif
+
+#if PACK_NEON
+static void pack_row_neon(uint8_t *restrict row_out,
+		const uint32_t *restrict row_in, size_t width, bool fully_opaque) {
+	size_t x = 0;
+	for (; x + 16 <= width; x += 16) {
+		// Split into B, G, R and A planes
+		uint8x16x4_t v = vld4q_u8((const uint8_t *)(row_in + x));
+		if (fully_opaque) {
+			uint8x16x3_t rgb = {{ v.val[2], v.val[1], v.val[0] }};
+			vst3q_u8(row_out + 3 * x, rgb);
+			continue;
+		}
+
+		uint8x16_t plain = vorrq_u8(vceqq_u8(v.val[3], vdupq_n_u8(0)),
+			vceqq_u8(v.val[3], vdupq_n_u8(0xff)));
+		if (vminvq_u8(plain) != 0xff) {
+			pack_row_scalar(row_out + 4 * x, row_in + x, 16, false);
+			continue;
+		}
+		uint8x16x4_t rgba = {{ v.val[2], v.val[1], v.val[0], v.val[3] }};
+		vst4q_u8(row_out + 4 * x, rgba);
+	}
+	pack_row_scalar(row_out + (fully_opaque ? 3 : 4) * x, row_in + x,
+		width - x, fully_opaque);
+}
+#endif
+
+static void init_pack(void) {
+	for (int a = 1; a < 256; a++) {
+		unpremultiply_table[a] = (0xff << 16) / a;
+	}
+
+	pack_impls[n_pack_impls++] =
+		(struct grim_pack_impl){ "scalar", pack_row_scalar };
+#if PACK_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse4.1")) {
+		pack_impls[n_pack_impls++] =
+			(struct grim_pack_impl){ "sse4.1", pack_row_sse41 };
+	}
+	if (__builtin_cpu_supports("avx2")) {
+		pack_impls[n_pack_impls++] =
+			(struct grim_pack_impl){ "avx2", pack_row_avx2 };
+	}
+#elif PACK_NEON
+	pack_impls[n_pack_impls++] =
+		(struct grim_pack_impl){ "neon", pack_row_neon };
+#endif
+	pack_row_impl = pack_impls[n_pack_impls - 1].pack_row;
+}
+
+void pack_row32(uint8_t *restrict row_out, const uint32_t *restrict row_in,
+		size_t width, bool fully_opaque) {
+	pthread_once(&pack_once, init_pack);
+	pack_row_impl(row_out, row_in, width, fully_opaque);
+}
+
+const struct grim_pack_impl *get_pack_impls(size_t *n_impls) {
+	pthread_once(&pack_once, init_pack);
+	*n_impls = n_pack_impls;
+	return pack_impls;
+}
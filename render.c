@@ -1,5 +1,6 @@
 #include <assert.h>
 #include <math.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -8,6 +9,8 @@
 #include "buffer.h"
 #include "output-layout.h"
 #include "render.h"
+#include "resample.h"
+#include "thread.h"
 
 #include "wlr-screencopy-unstable-v1-protocol.h"
 #include "hyprland-toplevel-export-v1-protocol.h"
@@ -132,11 +135,604 @@ static void compute_composite_region(const struct pixman_f_transform *out2com,
 	};
 }
 
+/**
+ * Compute the transformation sending a pixel of the output's buffer to one in
+ * the common image.
+ */
+static void get_output_transform(struct grim_output *output,
+		struct grim_box *geometry, double scale,
+		struct pixman_f_transform *out2com) {
+	struct grim_state *state = output->state;
+	struct grim_buffer *buffer = output->buffer;
+
+	// The buffer may only cover part of the output, see
+	// get_output_capture_region()
+	int32_t output_x = output->capture_geometry.x - geometry->x;
+	int32_t output_y = output->capture_geometry.y - geometry->y;
+	int32_t output_width = output->capture_geometry.width;
+	int32_t output_height = output->capture_geometry.height;
+
+	int32_t raw_output_width = buffer->width;
+	int32_t raw_output_height = buffer->height;
+	apply_output_transform(output->transform,
+		&raw_output_width, &raw_output_height);
+
+	int output_flipped_x = get_output_flipped(output->transform);
+	int output_flipped_y = output->screencopy_frame_flags &
+		(state->use_win
+			? HYPRLAND_TOPLEVEL_EXPORT_FRAME_V1_FLAGS_Y_INVERT
+			: ZWLR_SCREENCOPY_FRAME_V1_FLAGS_Y_INVERT)
+		? -1 : 1;
+
+	pixman_f_transform_init_identity(out2com);
+	pixman_f_transform_translate(out2com, NULL,
+		-(double)buffer->width / 2,
+		-(double)buffer->height / 2);
+	pixman_f_transform_scale(out2com, NULL,
+		(double)output_width / raw_output_width,
+		(double)output_height * output_flipped_y / raw_output_height);
+	pixman_f_transform_rotate(out2com, NULL,
+		round(cos(get_output_rotation(output->transform))),
+		round(sin(get_output_rotation(output->transform))));
+	pixman_f_transform_scale(out2com, NULL, output_flipped_x, 1);
+	pixman_f_transform_translate(out2com, NULL,
+		(double)output_width / 2,
+		(double)output_height / 2);
+	pixman_f_transform_translate(out2com, NULL, output_x, output_y);
+	pixman_f_transform_scale(out2com, NULL, scale, scale);
+}
+
+static bool is_captured(struct grim_output *output) {
+	// Frames are destroyed once ready, see main.c
+	return output->buffer != NULL || output->screencopy_frame != NULL;
+}
+
+/**
+ * Whether the compositor may be writing to the output's buffer, which is the
+ * case for frames carried over from one tick to the next by run_interval().
+ */
+static bool is_frame_pending(struct grim_output *output) {
+	return output->buffer != NULL && output->screencopy_frame != NULL;
+}
+
+static bool is_overlapping(struct grim_state *state,
+		struct grim_output *output) {
+	struct grim_output *other_output;
+	wl_list_for_each(other_output, &state->outputs, link) {
+		if (!is_captured(other_output)) {
+			continue;
+		}
+		if (output != other_output && intersect_box(&output->logical_geometry,
+				&other_output->logical_geometry)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * Work out where the output lands in the common image, and how it gets
+ * there. out2com sends a pixel of the output's buffer to a pixel of the
+ * common image, relative to the corner of composite_dest.
+ */
+static void get_composite_method(struct grim_output *output,
+		struct grim_box *geometry, double scale, bool overlapping,
+		struct pixman_f_transform *out2com, struct grim_box *composite_dest,
+		pixman_filter_t *filter, pixman_op_t *op) {
+	struct grim_buffer *buffer = output->buffer;
+	get_output_transform(output, geometry, scale, out2com);
+
+	bool grid_aligned;
+	compute_composite_region(out2com, buffer->width,
+		buffer->height, composite_dest, &grid_aligned);
+
+	pixman_f_transform_translate(out2com, NULL,
+		-composite_dest->x, -composite_dest->y);
+
+	double x_scale = fmax(fabs(out2com->m[0][0]), fabs(out2com->m[0][1]));
+	double y_scale = fmax(fabs(out2com->m[1][0]), fabs(out2com->m[1][1]));
+	// Bilinear scaling is relatively fast and gives decent results for
+	// upscaling and light downscaling
+	*filter = (x_scale >= 0.75 && y_scale >= 0.75) ?
+		PIXMAN_FILTER_BILINEAR : PIXMAN_FILTER_SEPARABLE_CONVOLUTION;
+
+	/* OP_SRC copies the image instead of blending it, and is much
+	 * faster, but this a) is incorrect in the weird case where
+	 * logical outputs overlap and are partially transparent b)
+	 * can draw the edge between two outputs incorrectly if that
+	 * edge is not exactly grid aligned in the common image */
+	*op = (grid_aligned && !overlapping) ? PIXMAN_OP_SRC : PIXMAN_OP_OVER;
+}
+
+/**
+ * Check whether the resampler can take over from the separable convolution
+ * filter of pixman, and if so, how the axes of the common image map to the
+ * buffer's. transposed is set when they are swapped by a rotation. Overlapping
+ * and misaligned outputs are blended by pixman.
+ */
+static bool get_resample_axes(struct grim_output *output,
+		const struct pixman_f_transform *out2com,
+		const struct grim_box *composite_dest, pixman_filter_t filter,
+		pixman_op_t op, struct grim_resample_axis *x_axis,
+		struct grim_resample_axis *y_axis, bool *transposed) {
+	struct grim_buffer *buffer = output->buffer;
+	pixman_format_code_t pixman_fmt = get_pixman_format(buffer->format);
+	if (filter != PIXMAN_FILTER_SEPARABLE_CONVOLUTION ||
+			op != PIXMAN_OP_SRC || (pixman_fmt != PIXMAN_a8r8g8b8 &&
+			pixman_fmt != PIXMAN_x8r8g8b8)) {
+		return false;
+	}
+
+	// Output transforms are made of quarter turns and flips
+	const double (*m)[3] = out2com->m;
+	if (m[0][1] == 0 && m[1][0] == 0) {
+		*transposed = false;
+	} else if (m[0][0] == 0 && m[1][1] == 0) {
+		*transposed = true;
+	} else {
+		return false;
+	}
+
+	enum grim_resample_filter resample_filter =
+		output->state->resample_filter;
+	*x_axis = (struct grim_resample_axis){
+		.filter = resample_filter,
+		.src_size = *transposed ? buffer->height : buffer->width,
+		.dst_size = composite_dest->width,
+		.scale = *transposed ? m[0][1] : m[0][0],
+		.offset = m[0][2],
+	};
+	*y_axis = (struct grim_resample_axis){
+		.filter = resample_filter,
+		.src_size = *transposed ? buffer->width : buffer->height,
+		.dst_size = composite_dest->height,
+		.scale = *transposed ? m[1][0] : m[1][1],
+		.offset = m[1][2],
+	};
+	return true;
+}
+
+void get_render_output_method(struct grim_state *state,
+		struct grim_output *output, struct grim_box *geometry, double scale,
+		pixman_filter_t *filter, pixman_op_t *op, bool *resampled) {
+	struct pixman_f_transform out2com;
+	struct grim_box composite_dest;
+	get_composite_method(output, geometry, scale,
+		is_overlapping(state, output), &out2com, &composite_dest, filter, op);
+
+	struct grim_resample_axis x_axis, y_axis;
+	bool transposed;
+	*resampled = get_resample_axes(output, &out2com, &composite_dest, *filter,
+		*op, &x_axis, &y_axis, &transposed);
+}
+
+/**
+ * Resample the output's buffer into the part of composite_dest inside clip,
+ * see get_resample_axes().
+ */
+static bool resample_output(struct grim_output *output,
+		const struct grim_resample_axis *x_axis,
+		const struct grim_resample_axis *y_axis, bool transposed,
+		struct grim_box *composite_dest, pixman_image_t *common_image,
+		pixman_region32_t *clip) {
+	struct grim_state *state = output->state;
+	struct grim_buffer *buffer = output->buffer;
+	struct grim_resample_weights *x_weights =
+		get_resample_weights(state->resample_cache, x_axis);
+	struct grim_resample_weights *y_weights =
+		get_resample_weights(state->resample_cache, y_axis);
+	bool ok = x_weights != NULL && y_weights != NULL;
+
+	struct grim_resample_src src = {
+		.data = buffer->data,
+		.x_step = transposed ? buffer->stride : 4,
+		.y_step = transposed ? 4 : buffer->stride,
+		.opaque = get_pixman_format(buffer->format) == PIXMAN_x8r8g8b8,
+	};
+
+	pixman_region32_t region;
+	pixman_region32_init_rect(&region, composite_dest->x, composite_dest->y,
+		composite_dest->width, composite_dest->height);
+	pixman_region32_intersect_rect(&region, &region, 0, 0,
+		pixman_image_get_width(common_image),
+		pixman_image_get_height(common_image));
+	if (clip != NULL) {
+		pixman_region32_intersect(&region, &region, clip);
+	}
+
+	unsigned char *data = (unsigned char *)pixman_image_get_data(common_image);
+	int stride = pixman_image_get_stride(common_image);
+	int n_rects = 0;
+	pixman_box32_t *rects = pixman_region32_rectangles(&region, &n_rects);
+	for (int i = 0; ok && i < n_rects; i++) {
+		pixman_box32_t *rect = &rects[i];
+		uint32_t *dst = (uint32_t *)(data + (size_t)rect->y1 * stride) +
+			rect->x1;
+		ok = resample_image(&src, x_weights, y_weights, dst, stride,
+			rect->x1 - composite_dest->x, rect->y1 - composite_dest->y,
+			rect->x2 - rect->x1, rect->y2 - rect->y1);
+	}
+	pixman_region32_fini(&region);
+
+	release_resample_weights(state->resample_cache, x_weights);
+	release_resample_weights(state->resample_cache, y_weights);
+	if (!ok) {
+		fprintf(stderr, "failed to resample output\n");
+	}
+	return ok;
+}
+
+/**
+ * Composite one output onto common_image. Only the pixels inside clip, which
+ * must also be the clip region of common_image, are touched. Safe to call
+ * from several threads on different images.
+ */
+static bool composite_output(struct grim_output *output,
+		struct grim_box *geometry, double scale, pixman_image_t *common_image,
+		pixman_region32_t *clip, bool overlapping) {
+	struct grim_buffer *buffer = output->buffer;
+	pixman_format_code_t pixman_fmt = get_pixman_format(buffer->format);
+	if (!pixman_fmt) {
+		fprintf(stderr, "unsupported format %d = 0x%08x\n",
+			buffer->format, buffer->format);
+		return false;
+	}
+
+	// The transformation `out2com` will send a pixel in the output_image
+	// to one in the common_image
+	struct pixman_f_transform out2com;
+	struct grim_box composite_dest;
+	pixman_filter_t filter;
+	pixman_op_t op;
+	get_composite_method(output, geometry, scale, overlapping, &out2com,
+		&composite_dest, &filter, &op);
+
+	struct grim_resample_axis x_axis, y_axis;
+	bool transposed;
+	if (get_resample_axes(output, &out2com, &composite_dest, filter, op,
+			&x_axis, &y_axis, &transposed)) {
+		return resample_output(output, &x_axis, &y_axis, transposed,
+			&composite_dest, common_image, clip);
+	}
+
+	pixman_image_t *output_image = pixman_image_create_bits(
+		pixman_fmt, buffer->width, buffer->height,
+		buffer->data, buffer->stride);
+	if (!output_image) {
+		fprintf(stderr, "Failed to create image\n");
+		return false;
+	}
+
+	struct pixman_f_transform com2out;
+	pixman_f_transform_invert(&com2out, &out2com);
+	struct pixman_transform c2o_fixedpt;
+	pixman_transform_from_pixman_f_transform(&c2o_fixedpt, &com2out);
+	pixman_image_set_transform(output_image, &c2o_fixedpt);
+
+	if (filter == PIXMAN_FILTER_BILINEAR) {
+		pixman_image_set_filter(output_image,
+			PIXMAN_FILTER_BILINEAR, NULL, 0);
+	} else {
+		// When downscaling, convolve the output_image so that each
+		// pixel in the common_image collects colors from a region
+		// of size roughly 1/x_scale*1/y_scale in the output_image
+		double x_scale = fmax(fabs(out2com.m[0][0]), fabs(out2com.m[0][1]));
+		double y_scale = fmax(fabs(out2com.m[1][0]), fabs(out2com.m[1][1]));
+		int n_values = 0;
+		pixman_fixed_t *conv = pixman_filter_create_separable_convolution(
+			&n_values,
+			pixman_double_to_fixed(fmax(1., 1. / x_scale)),
+			pixman_double_to_fixed(fmax(1., 1. / y_scale)),
+			PIXMAN_KERNEL_IMPULSE, PIXMAN_KERNEL_IMPULSE,
+			PIXMAN_KERNEL_LANCZOS2, PIXMAN_KERNEL_LANCZOS2,
+			2, 2);
+		pixman_image_set_filter(output_image,
+			PIXMAN_FILTER_SEPARABLE_CONVOLUTION, conv, n_values);
+		free(conv);
+	}
+
+	pixman_image_composite32(op, output_image, NULL, common_image,
+		0, 0, 0, 0, composite_dest.x, composite_dest.y,
+		composite_dest.width, composite_dest.height);
+
+	pixman_image_unref(output_image);
+	return true;
+}
+
+/**
+ * Composite every captured output onto common_image, see composite_output().
+ */
+static bool composite_outputs(struct grim_state *state,
+		struct grim_box *geometry, double scale, pixman_image_t *common_image,
+		pixman_region32_t *clip) {
+	struct grim_output *output;
+	wl_list_for_each(output, &state->outputs, link) {
+		// Left out of clip by render_damage()
+		if (output->buffer == NULL || is_frame_pending(output)) {
+			continue;
+		}
+		if (!composite_output(output, geometry, scale, common_image, clip,
+				is_overlapping(state, output))) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Bands per thread, so that threads finishing early can pick up more work
+#define BANDS_PER_THREAD 4
+#define MIN_BAND_HEIGHT 32
+
+struct composite_band {
+	struct grim_state *state;
+	struct grim_box *geometry;
+	double scale;
+	pixman_image_t *common_image;
+	pixman_region32_t *clip;
+	bool clear;
+
+	int32_t y, height;
+	bool ok;
+};
+
+static void composite_band(void *data) {
+	struct composite_band *band = data;
+	pixman_image_t *common_image = band->common_image;
+	int common_width = pixman_image_get_width(common_image);
+
+	// Each thread needs its own image to set a clip region on
+	pixman_image_t *band_image = pixman_image_create_bits(
+		pixman_image_get_format(common_image), common_width,
+		pixman_image_get_height(common_image),
+		pixman_image_get_data(common_image),
+		pixman_image_get_stride(common_image));
+	if (band_image == NULL) {
+		fprintf(stderr, "Failed to create image\n");
+		band->ok = false;
+		return;
+	}
+
+	pixman_region32_t clip;
+	pixman_region32_init_rect(&clip, 0, band->y, common_width, band->height);
+	if (band->clip != NULL) {
+		pixman_region32_intersect(&clip, &clip, band->clip);
+	}
+
+	band->ok = true;
+	if (pixman_region32_not_empty(&clip)) {
+		if (band->clear) {
+			int n_rects = 0;
+			pixman_box32_t *rects = pixman_region32_rectangles(&clip, &n_rects);
+			pixman_color_t clear = {0};
+			pixman_image_fill_boxes(PIXMAN_OP_CLEAR, band_image, &clear,
+				n_rects, rects);
+		}
+
+		pixman_image_set_clip_region32(band_image, &clip);
+		band->ok = composite_outputs(band->state, band->geometry, band->scale,
+			band_image, &clip);
+	}
+
+	pixman_region32_fini(&clip);
+	pixman_image_unref(band_image);
+}
+
+/**
+ * Composite the outputs onto common_image, restricted to clip if not NULL,
+ * using all threads of the pool. The image is split into horizontal bands,
+ * each of them composited from every output crossing it. Bands don't share
+ * any pixel and every pixel is computed the same way as it would be by a
+ * single composite, so the result doesn't depend on the number of threads.
+ */
+static bool composite_outputs_parallel(struct grim_state *state,
+		struct grim_box *geometry, double scale, pixman_image_t *common_image,
+		pixman_region32_t *clip, bool clear) {
+	// Report unsupported formats once rather than from every band
+	struct grim_output *output;
+	wl_list_for_each(output, &state->outputs, link) {
+		if (output->buffer != NULL &&
+				!get_pixman_format(output->buffer->format)) {
+			fprintf(stderr, "unsupported format %d = 0x%08x\n",
+				output->buffer->format, output->buffer->format);
+			return false;
+		}
+	}
+
+	int common_height = pixman_image_get_height(common_image);
+	int n_bands = get_thread_pool_size(state->thread_pool) * BANDS_PER_THREAD;
+	if (n_bands > common_height / MIN_BAND_HEIGHT) {
+		n_bands = common_height / MIN_BAND_HEIGHT;
+	}
+	if (n_bands < 1) {
+		n_bands = 1;
+	}
+
+	struct composite_band *bands = calloc(n_bands, sizeof(*bands));
+	if (bands == NULL) {
+		fprintf(stderr, "failed to allocate bands\n");
+		return false;
+	}
+	struct grim_task_group group;
+	init_task_group(&group, state->thread_pool);
+	for (int i = 0; i < n_bands; i++) {
+		int32_t y1 = (int64_t)common_height * i / n_bands;
+		int32_t y2 = (int64_t)common_height * (i + 1) / n_bands;
+		bands[i] = (struct composite_band){
+			.state = state,
+			.geometry = geometry,
+			.scale = scale,
+			.common_image = common_image,
+			.clip = clip,
+			.clear = clear,
+			.y = y1,
+			.height = y2 - y1,
+		};
+		task_group_add(&group, composite_band, &bands[i]);
+	}
+	finish_task_group(&group);
+
+	bool ok = true;
+	for (int i = 0; i < n_bands; i++) {
+		ok = ok && bands[i].ok;
+	}
+	free(bands);
+	return ok;
+}
+
+/**
+ * Check whether the pixels of the output's buffer land exactly on pixels of
+ * the common image, and if so, where the top-left one does.
+ */
+static bool get_output_offset(struct grim_output *output,
+		struct grim_box *geometry, double scale, int32_t *x, int32_t *y) {
+	struct pixman_f_transform out2com;
+	get_output_transform(output, geometry, scale, &out2com);
+	double tx = round(out2com.m[0][2]);
+	double ty = round(out2com.m[1][2]);
+	if (fabs(out2com.m[0][0] - 1) > 1e-9 || fabs(out2com.m[1][1] - 1) > 1e-9 ||
+			out2com.m[0][1] != 0 || out2com.m[1][0] != 0 ||
+			fabs(out2com.m[0][2] - tx) > 1e-9 ||
+			fabs(out2com.m[1][2] - ty) > 1e-9) {
+		return false;
+	}
+	*x = tx;
+	*y = ty;
+	return true;
+}
+
+/**
+ * Add the part of the common image which the output is known to make opaque
+ * to the covered region. Returns false if the output may leave translucent
+ * pixels behind: its buffer has an alpha channel, or it is scaled or
+ * rotated, in which case its edges are blended with their surroundings.
+ */
+static bool add_opaque_area(struct grim_output *output,
+		struct grim_box *geometry, double scale, pixman_region32_t *covered) {
+	struct grim_buffer *buffer = output->buffer;
+	pixman_format_code_t pixman_fmt = get_pixman_format(buffer->format);
+	if (!pixman_fmt || PIXMAN_FORMAT_A(pixman_fmt) != 0) {
+		return false;
+	}
+
+	int32_t x, y;
+	if (!get_output_offset(output, geometry, scale, &x, &y)) {
+		return false;
+	}
+	pixman_region32_union_rect(covered, covered, x, y,
+		buffer->width, buffer->height);
+	return true;
+}
+
+static bool is_area_covered(pixman_region32_t *covered, int common_width,
+		int common_height) {
+	pixman_box32_t image_box = { 0, 0, common_width, common_height };
+	return pixman_region32_contains_rectangle(covered, &image_box) ==
+		PIXMAN_REGION_IN;
+}
+
+bool is_render_opaque(struct grim_state *state, struct grim_box *geometry,
+		double scale) {
+	pixman_region32_t covered;
+	pixman_region32_init(&covered);
+	bool opaque = true;
+	struct grim_output *output;
+	wl_list_for_each(output, &state->outputs, link) {
+		if (output->buffer == NULL) {
+			continue;
+		}
+		if (!add_opaque_area(output, geometry, scale, &covered)) {
+			opaque = false;
+			break;
+		}
+	}
+	opaque = opaque && is_area_covered(&covered,
+		geometry->width * scale, geometry->height * scale);
+	pixman_region32_fini(&covered);
+	return opaque;
+}
+
+static void clear_damage(struct grim_state *state) {
+	struct grim_output *output;
+	wl_list_for_each(output, &state->outputs, link) {
+		pixman_region32_clear(&output->damage);
+	}
+}
+
+/**
+ * When the image is nothing more than a part of a single buffer, wrap that
+ * buffer instead of compositing a copy of it. Returns NULL otherwise.
+ */
+static pixman_image_t *wrap_output_buffer(struct grim_state *state,
+		struct grim_box *geometry, double scale, int common_width,
+		int common_height) {
+	struct grim_output *output = NULL;
+	struct grim_output *iter;
+	wl_list_for_each(iter, &state->outputs, link) {
+		// Batches of windows are laid out next to each other, and
+		// written one at a time
+		if (iter->buffer == NULL ||
+				!intersect_box(&iter->capture_geometry, geometry)) {
+			continue;
+		}
+		if (output != NULL) {
+			return NULL;
+		}
+		output = iter;
+	}
+	if (output == NULL || output->transform != WL_OUTPUT_TRANSFORM_NORMAL) {
+		return NULL;
+	}
+
+	uint32_t y_invert = state->use_win
+		? HYPRLAND_TOPLEVEL_EXPORT_FRAME_V1_FLAGS_Y_INVERT
+		: ZWLR_SCREENCOPY_FRAME_V1_FLAGS_Y_INVERT;
+	if (output->screencopy_frame_flags & y_invert) {
+		return NULL;
+	}
+
+	// The encoders only take these
+	struct grim_buffer *buffer = output->buffer;
+	pixman_format_code_t pixman_fmt = get_pixman_format(buffer->format);
+	if (pixman_fmt != PIXMAN_a8r8g8b8 && pixman_fmt != PIXMAN_x8r8g8b8) {
+		return NULL;
+	}
+
+	int32_t x, y;
+	if (!get_output_offset(output, geometry, scale, &x, &y)) {
+		return NULL;
+	}
+	x = -x;
+	y = -y;
+	if (x < 0 || y < 0 || x + common_width > buffer->width ||
+			y + common_height > buffer->height) {
+		return NULL;
+	}
+
+	unsigned char *data = (unsigned char *)buffer->data +
+		(size_t)y * buffer->stride + (size_t)x * 4;
+	return pixman_image_create_bits(pixman_fmt, common_width, common_height,
+		(uint32_t *)data, buffer->stride);
+}
+
 pixman_image_t *render(struct grim_state *state, struct grim_box *geometry,
 		double scale) {
 	int common_width = geometry->width * scale;
 	int common_height = geometry->height * scale;
-	pixman_image_t *common_image = pixman_image_create_bits(PIXMAN_a8r8g8b8,
+
+	if (!state->copy_image) {
+		pixman_image_t *image = wrap_output_buffer(state, geometry, scale,
+			common_width, common_height);
+		if (image != NULL) {
+			clear_damage(state);
+			return image;
+		}
+	}
+
+	// Encoders can skip the alpha channel of an x8r8g8b8 image altogether
+	pixman_format_code_t common_fmt =
+		is_render_opaque(state, geometry, scale) ?
+		PIXMAN_x8r8g8b8 : PIXMAN_a8r8g8b8;
+	pixman_image_t *common_image = pixman_image_create_bits(common_fmt,
 		common_width, common_height, NULL, 0);
 	if (!common_image) {
 		fprintf(stderr, "failed to create image with size: %d x %d\n",
@@ -144,123 +740,642 @@ pixman_image_t *render(struct grim_state *state, struct grim_box *geometry,
 		return NULL;
 	}
 
+	if (!composite_outputs_parallel(state, geometry, scale, common_image,
+			NULL, false)) {
+		pixman_image_unref(common_image);
+		return NULL;
+	}
+
+	// Everything is up to date
+	clear_damage(state);
+	return common_image;
+}
+
+struct downscale_band {
+	const struct grim_resample_src *src;
+	const struct grim_resample_weights *x_weights, *y_weights;
+	pixman_image_t *dst;
+
+	int32_t y, height;
+	bool ok;
+};
+
+static void downscale_band(void *data) {
+	struct downscale_band *band = data;
+	int stride = pixman_image_get_stride(band->dst);
+	unsigned char *dst = (unsigned char *)pixman_image_get_data(band->dst) +
+		(size_t)band->y * stride;
+	band->ok = resample_image(band->src, band->x_weights, band->y_weights,
+		(uint32_t *)dst, stride, 0, band->y, pixman_image_get_width(band->dst),
+		band->height);
+}
+
+pixman_image_t *render_downscaled(struct grim_state *state,
+		pixman_image_t *image, int32_t width, int32_t height) {
+	int32_t image_width = pixman_image_get_width(image);
+	int32_t image_height = pixman_image_get_height(image);
+	assert(width <= image_width && height <= image_height);
+	if (width == image_width && height == image_height) {
+		return pixman_image_ref(image);
+	}
+
+	pixman_format_code_t format = pixman_image_get_format(image);
+	pixman_image_t *scaled = pixman_image_create_bits(format, width, height,
+		NULL, 0);
+	if (scaled == NULL) {
+		fprintf(stderr, "failed to create image with size: %d x %d\n",
+			width, height);
+		return NULL;
+	}
+
+	struct grim_resample_axis x_axis = {
+		.filter = state->resample_filter,
+		.src_size = image_width,
+		.dst_size = width,
+		.scale = (double)width / image_width,
+	};
+	struct grim_resample_axis y_axis = {
+		.filter = state->resample_filter,
+		.src_size = image_height,
+		.dst_size = height,
+		.scale = (double)height / image_height,
+	};
+	struct grim_resample_weights *x_weights =
+		get_resample_weights(state->resample_cache, &x_axis);
+	struct grim_resample_weights *y_weights =
+		get_resample_weights(state->resample_cache, &y_axis);
+	struct grim_resample_src src = {
+		.data = (const unsigned char *)pixman_image_get_data(image),
+		.x_step = 4,
+		.y_step = pixman_image_get_stride(image),
+		.opaque = format == PIXMAN_x8r8g8b8,
+	};
+
+	int n_bands = get_thread_pool_size(state->thread_pool) * BANDS_PER_THREAD;
+	if (n_bands > height / MIN_BAND_HEIGHT) {
+		n_bands = height / MIN_BAND_HEIGHT;
+	}
+	if (n_bands < 1) {
+		n_bands = 1;
+	}
+	struct downscale_band *bands = calloc(n_bands, sizeof(*bands));
+	bool ok = x_weights != NULL && y_weights != NULL && bands != NULL;
+	struct grim_task_group group;
+	init_task_group(&group, state->thread_pool);
+	for (int i = 0; ok && i < n_bands; i++) {
+		int32_t y1 = (int64_t)height * i / n_bands;
+		int32_t y2 = (int64_t)height * (i + 1) / n_bands;
+		bands[i] = (struct downscale_band){
+			.src = &src,
+			.x_weights = x_weights,
+			.y_weights = y_weights,
+			.dst = scaled,
+			.y = y1,
+			.height = y2 - y1,
+		};
+		task_group_add(&group, downscale_band, &bands[i]);
+	}
+	finish_task_group(&group);
+	for (int i = 0; ok && i < n_bands; i++) {
+		ok = bands[i].ok;
+	}
+	free(bands);
+	release_resample_weights(state->resample_cache, x_weights);
+	release_resample_weights(state->resample_cache, y_weights);
+	if (!ok) {
+		fprintf(stderr, "failed to resample image\n");
+		pixman_image_unref(scaled);
+		return NULL;
+	}
+	return scaled;
+}
+
+/**
+ * Get the part of the common image which the output draws to.
+ */
+static void get_output_area(struct grim_output *output,
+		struct grim_box *geometry, double scale, struct grim_box *area) {
+	struct pixman_f_transform out2com;
+	get_output_transform(output, geometry, scale, &out2com);
+	bool grid_aligned;
+	compute_composite_region(&out2com, output->buffer->width,
+		output->buffer->height, area, &grid_aligned);
+}
+
+/**
+ * Mark the tiles of the common image touched by the damaged part of an
+ * output's buffer. Returns true if any of it lands in pending.
+ */
+static bool mark_damaged_tiles(struct grim_output *output,
+		struct grim_box *geometry, double scale, uint8_t *tiles,
+		int tiles_width, int tiles_height, pixman_region32_t *pending) {
+	struct pixman_f_transform out2com;
+	get_output_transform(output, geometry, scale, &out2com);
+
+	// Resampling spreads a buffer pixel over its neighbours in the common
+	// image, account for the filter support
+	double x_scale = fmax(fabs(out2com.m[0][0]), fabs(out2com.m[0][1]));
+	double y_scale = fmax(fabs(out2com.m[1][0]), fabs(out2com.m[1][1]));
+	int margin = (int)ceil(fmax(x_scale, y_scale)) + 2;
+
+	struct grim_box area;
+	get_output_area(output, geometry, scale, &area);
+	bool touches_pending = false;
+	int n_rects = 0;
+	pixman_box32_t *rects = pixman_region32_rectangles(&output->damage,
+		&n_rects);
+	for (int i = 0; i < n_rects; i++) {
+		struct pixman_f_transform rect2com, translate;
+		pixman_f_transform_init_translate(&translate,
+			rects[i].x1, rects[i].y1);
+		pixman_f_transform_multiply(&rect2com, &out2com, &translate);
+
+		struct grim_box dest;
+		bool grid_aligned;
+		compute_composite_region(&rect2com, rects[i].x2 - rects[i].x1,
+			rects[i].y2 - rects[i].y1, &dest, &grid_aligned);
+
+		pixman_box32_t box = {
+			dest.x - margin, dest.y - margin,
+			dest.x + dest.width + margin, dest.y + dest.height + margin,
+		};
+		// Nothing is drawn outside of the output's area
+		pixman_box32_t drawn = {
+			box.x1 > area.x ? box.x1 : area.x,
+			box.y1 > area.y ? box.y1 : area.y,
+			box.x2 < area.x + area.width ? box.x2 : area.x + area.width,
+			box.y2 < area.y + area.height ? box.y2 : area.y + area.height,
+		};
+		if (drawn.x1 < drawn.x2 && drawn.y1 < drawn.y2 &&
+				pixman_region32_contains_rectangle(pending, &drawn) !=
+				PIXMAN_REGION_OUT) {
+			touches_pending = true;
+		}
+
+		int x1 = box.x1 / RENDER_TILE_SIZE;
+		int y1 = box.y1 / RENDER_TILE_SIZE;
+		int x2 = box.x2 / RENDER_TILE_SIZE;
+		int y2 = box.y2 / RENDER_TILE_SIZE;
+		x1 = x1 < 0 ? 0 : x1;
+		y1 = y1 < 0 ? 0 : y1;
+		x2 = x2 >= tiles_width ? tiles_width - 1 : x2;
+		y2 = y2 >= tiles_height ? tiles_height - 1 : y2;
+		for (int y = y1; y <= y2; y++) {
+			for (int x = x1; x <= x2; x++) {
+				tiles[y * tiles_width + x] = 1;
+			}
+		}
+	}
+	return touches_pending;
+}
+
+int render_damage(struct grim_state *state, struct grim_box *geometry,
+		double scale, pixman_image_t *common_image) {
+	int common_width = pixman_image_get_width(common_image);
+	int common_height = pixman_image_get_height(common_image);
+	int tiles_width = (common_width + RENDER_TILE_SIZE - 1) / RENDER_TILE_SIZE;
+	int tiles_height = (common_height + RENDER_TILE_SIZE - 1) / RENDER_TILE_SIZE;
+	uint8_t *tiles = calloc((size_t)tiles_width * tiles_height, 1);
+	if (tiles == NULL) {
+		fprintf(stderr, "failed to allocate tile map\n");
+		return -1;
+	}
+
+	// The compositor may be writing to the buffers of pending frames, so
+	// their part of the image keeps its previous pixels until they're ready
+	pixman_region32_t pending;
+	pixman_region32_init(&pending);
 	struct grim_output *output;
 	wl_list_for_each(output, &state->outputs, link) {
-		struct grim_buffer *buffer = output->buffer;
-		if (buffer == NULL) {
+		if (is_frame_pending(output)) {
+			struct grim_box area;
+			get_output_area(output, geometry, scale, &area);
+			pixman_region32_union_rect(&pending, &pending, area.x, area.y,
+				area.width, area.height);
+		}
+	}
+
+	wl_list_for_each(output, &state->outputs, link) {
+		if (output->buffer == NULL || is_frame_pending(output) ||
+				!pixman_region32_not_empty(&output->damage)) {
 			continue;
 		}
+		// Damage drawn over a pending frame is kept for later
+		if (!mark_damaged_tiles(output, geometry, scale, tiles,
+				tiles_width, tiles_height, &pending)) {
+			pixman_region32_clear(&output->damage);
+		}
+	}
 
-		pixman_format_code_t pixman_fmt = get_pixman_format(buffer->format);
-		if (!pixman_fmt) {
-			fprintf(stderr, "unsupported format %d = 0x%08x\n",
-				buffer->format, buffer->format);
-			return NULL;
+	// Tiles entirely left to pending frames don't change
+	for (int y = 0; y < tiles_height; y++) {
+		for (int x = 0; x < tiles_width; x++) {
+			pixman_box32_t box = {
+				x * RENDER_TILE_SIZE, y * RENDER_TILE_SIZE,
+				(x + 1) * RENDER_TILE_SIZE, (y + 1) * RENDER_TILE_SIZE,
+			};
+			if (tiles[y * tiles_width + x] &&
+					pixman_region32_contains_rectangle(&pending, &box) ==
+					PIXMAN_REGION_IN) {
+				tiles[y * tiles_width + x] = 0;
+			}
 		}
+	}
 
-		int32_t output_x = output->logical_geometry.x - geometry->x;
-		int32_t output_y = output->logical_geometry.y - geometry->y;
-		int32_t output_width = output->logical_geometry.width;
-		int32_t output_height = output->logical_geometry.height;
-
-		int32_t raw_output_width = output->geometry.width;
-		int32_t raw_output_height = output->geometry.height;
-		apply_output_transform(output->transform,
-			&raw_output_width, &raw_output_height);
-
-		int output_flipped_x = get_output_flipped(output->transform);
-		int output_flipped_y = output->screencopy_frame_flags &
-			(state->use_win
-				? HYPRLAND_TOPLEVEL_EXPORT_FRAME_V1_FLAGS_Y_INVERT
-				: ZWLR_SCREENCOPY_FRAME_V1_FLAGS_Y_INVERT)
-			? -1 : 1;
-
-		pixman_image_t *output_image = pixman_image_create_bits(
-			pixman_fmt, buffer->width, buffer->height,
-			buffer->data, buffer->stride);
-		if (!output_image) {
-			fprintf(stderr, "Failed to create image\n");
-			return NULL;
+	// Merge each row of dirty tiles into as few rectangles as possible
+	int n_dirty = 0;
+	pixman_region32_t dirty;
+	pixman_region32_init(&dirty);
+	for (int y = 0; y < tiles_height; y++) {
+		int x = 0;
+		while (x < tiles_width) {
+			if (!tiles[y * tiles_width + x]) {
+				x++;
+				continue;
+			}
+			int start = x;
+			while (x < tiles_width && tiles[y * tiles_width + x]) {
+				x++;
+			}
+			n_dirty += x - start;
+			pixman_region32_union_rect(&dirty, &dirty,
+				start * RENDER_TILE_SIZE, y * RENDER_TILE_SIZE,
+				(x - start) * RENDER_TILE_SIZE, RENDER_TILE_SIZE);
 		}
+	}
+	free(tiles);
+	pixman_region32_intersect_rect(&dirty, &dirty, 0, 0,
+		common_width, common_height);
+	pixman_region32_subtract(&dirty, &dirty, &pending);
+	pixman_region32_fini(&pending);
 
-		// The transformation `out2com` will send a pixel in the output_image
-		// to one in the common_image
-		struct pixman_f_transform out2com;
-		pixman_f_transform_init_identity(&out2com);
-		pixman_f_transform_translate(&out2com, NULL,
-			-(double)output->geometry.width / 2,
-			-(double)output->geometry.height / 2);
-		pixman_f_transform_scale(&out2com, NULL,
-			(double)output_width / raw_output_width,
-			(double)output_height * output_flipped_y / raw_output_height);
-		pixman_f_transform_rotate(&out2com, NULL,
-			round(cos(get_output_rotation(output->transform))),
-			round(sin(get_output_rotation(output->transform))));
-		pixman_f_transform_scale(&out2com, NULL, output_flipped_x, 1);
-		pixman_f_transform_translate(&out2com, NULL,
-			(double)output_width / 2,
-			(double)output_height / 2);
-		pixman_f_transform_translate(&out2com, NULL, output_x, output_y);
-		pixman_f_transform_scale(&out2com, NULL, scale, scale);
-
-		struct grim_box composite_dest;
-		bool grid_aligned;
-		compute_composite_region(&out2com, buffer->width,
-			buffer->height, &composite_dest, &grid_aligned);
+	bool ok = true;
+	if (n_dirty > 0) {
+		// Outputs may be blended, start over from a blank slate
+		ok = composite_outputs_parallel(state, geometry, scale, common_image,
+			&dirty, true);
+	}
 
-		pixman_f_transform_translate(&out2com, NULL,
-			-composite_dest.x, -composite_dest.y);
+	pixman_region32_fini(&dirty);
+	return ok ? n_dirty : -1;
+}
 
-		struct pixman_f_transform com2out;
-		pixman_f_transform_invert(&com2out, &out2com);
-		struct pixman_transform c2o_fixedpt;
-		pixman_transform_from_pixman_f_transform(&c2o_fixedpt, &com2out);
-		pixman_image_set_transform(output_image, &c2o_fixedpt);
+// Tiles of the image composited as a whole by the pipelined renderer
+#define JOB_TILE_WIDTH 256
+#define JOB_TILE_HEIGHT 64
 
-		double x_scale = fmax(fabs(out2com.m[0][0]), fabs(out2com.m[0][1]));
-		double y_scale = fmax(fabs(out2com.m[1][0]), fabs(out2com.m[1][1]));
-		if (x_scale >= 0.75 && y_scale >= 0.75) {
-			// Bilinear scaling is relatively fast and gives decent
-			// results for upscaling and light downscaling
-			pixman_image_set_filter(output_image,
-				PIXMAN_FILTER_BILINEAR, NULL, 0);
-		} else {
-			// When downscaling, convolve the output_image so that each
-			// pixel in the common_image collects colors from a region
-			// of size roughly 1/x_scale*1/y_scale in the output_image
-			int n_values = 0;
-			pixman_fixed_t *conv = pixman_filter_create_separable_convolution(
-				&n_values,
-				pixman_double_to_fixed(fmax(1., 1. / x_scale)),
-				pixman_double_to_fixed(fmax(1., 1. / y_scale)),
-				PIXMAN_KERNEL_IMPULSE, PIXMAN_KERNEL_IMPULSE,
-				PIXMAN_KERNEL_LANCZOS2, PIXMAN_KERNEL_LANCZOS2,
-				2, 2);
-			pixman_image_set_filter(output_image,
-				PIXMAN_FILTER_SEPARABLE_CONVOLUTION, conv, n_values);
-			free(conv);
+struct render_job_output {
+	struct grim_output *output;
+	bool overlapping;
+	bool buffer_known;
+	// Range of tiles which may be touched by the output
+	int tile_x1, tile_y1, tile_x2, tile_y2;
+};
+
+struct render_job_tile {
+	struct grim_render_job *job;
+	int x, y;
+	size_t n_waiting; // outputs whose frame isn't ready yet
+	// Ready, but held back until all buffers are known, see
+	// render_job_output_buffer()
+	bool deferred;
+};
+
+struct grim_render_job {
+	struct grim_state *state;
+	struct grim_box geometry;
+	double scale;
+	pixman_image_t *image;
+	// Handed to the encoder, see get_render_job_image()
+	pixman_image_t *encode_image;
+
+	struct render_job_output *outputs;
+	size_t n_outputs;
+	size_t n_unknown_buffers;
+
+	struct render_job_tile *tiles;
+	int tiles_width, tiles_height;
+	// Compositing of the tiles whose outputs are ready
+	struct grim_task_group tile_tasks;
+
+	pthread_mutex_t lock;
+	// Rows became final, a buffer became known, or the job finished
+	pthread_cond_t rows_cond;
+	int *row_tiles_left; // per row of tiles
+	int final_tile_rows;
+	bool failed, finished;
+};
+
+static void render_job_tile(void *data) {
+	struct render_job_tile *tile = data;
+	struct grim_render_job *job = tile->job;
+	pixman_image_t *image = job->image;
+
+	pixman_image_t *tile_image = pixman_image_create_bits(
+		pixman_image_get_format(image), pixman_image_get_width(image),
+		pixman_image_get_height(image), pixman_image_get_data(image),
+		pixman_image_get_stride(image));
+	bool ok = tile_image != NULL;
+	if (ok) {
+		pixman_region32_t clip;
+		pixman_region32_init_rect(&clip, tile->x * JOB_TILE_WIDTH,
+			tile->y * JOB_TILE_HEIGHT, JOB_TILE_WIDTH, JOB_TILE_HEIGHT);
+		pixman_image_set_clip_region32(tile_image, &clip);
+
+		// In list order, like composite_outputs()
+		for (size_t i = 0; ok && i < job->n_outputs; i++) {
+			struct render_job_output *job_output = &job->outputs[i];
+			if (job_output->output == NULL) {
+				continue;
+			}
+			if (tile->x < job_output->tile_x1 || tile->x >= job_output->tile_x2 ||
+					tile->y < job_output->tile_y1 ||
+					tile->y >= job_output->tile_y2) {
+				continue;
+			}
+			ok = composite_output(job_output->output, &job->geometry,
+				job->scale, tile_image, &clip, job_output->overlapping);
 		}
+		pixman_region32_fini(&clip);
+		pixman_image_unref(tile_image);
+	}
 
-		bool overlapping = false;
-		struct grim_output *other_output;
-		wl_list_for_each(other_output, &state->outputs, link) {
-			if (output != other_output && intersect_box(&output->logical_geometry,
-					&other_output->logical_geometry)) {
-				overlapping = true;
+	pthread_mutex_lock(&job->lock);
+	job->failed = job->failed || !ok;
+	--job->row_tiles_left[tile->y];
+	while (job->final_tile_rows < job->tiles_height &&
+			job->row_tiles_left[job->final_tile_rows] == 0) {
+		++job->final_tile_rows;
+	}
+	pthread_cond_broadcast(&job->rows_cond);
+	pthread_mutex_unlock(&job->lock);
+}
+
+void destroy_render_job(struct grim_render_job *job) {
+	if (job == NULL) {
+		return;
+	}
+	finish_task_group(&job->tile_tasks);
+	pthread_cond_destroy(&job->rows_cond);
+	pthread_mutex_destroy(&job->lock);
+	if (job->encode_image != NULL) {
+		pixman_image_unref(job->encode_image);
+	}
+	if (job->image != NULL) {
+		pixman_image_unref(job->image);
+	}
+	free(job->outputs);
+	free(job->tiles);
+	free(job->row_tiles_left);
+	free(job);
+}
+
+struct grim_render_job *start_render_job(struct grim_state *state,
+		struct grim_box *geometry, double scale) {
+	// A single output is better served by render(), which may not need to
+	// composite anything
+	size_t n_outputs = 0;
+	struct grim_output *output;
+	wl_list_for_each(output, &state->outputs, link) {
+		if (is_captured(output)) {
+			++n_outputs;
+		}
+	}
+	if (n_outputs < 2 || state->use_win) {
+		return NULL;
+	}
+
+	struct grim_render_job *job = calloc(1, sizeof(*job));
+	if (job == NULL) {
+		return NULL;
+	}
+	pthread_mutex_init(&job->lock, NULL);
+	pthread_cond_init(&job->rows_cond, NULL);
+	init_task_group(&job->tile_tasks, state->thread_pool);
+	job->n_unknown_buffers = n_outputs;
+	job->state = state;
+	job->geometry = *geometry;
+	job->scale = scale;
+
+	int common_width = geometry->width * scale;
+	int common_height = geometry->height * scale;
+	job->image = pixman_image_create_bits(PIXMAN_a8r8g8b8,
+		common_width, common_height, NULL, 0);
+	job->tiles_width = (common_width + JOB_TILE_WIDTH - 1) / JOB_TILE_WIDTH;
+	job->tiles_height = (common_height + JOB_TILE_HEIGHT - 1) / JOB_TILE_HEIGHT;
+	size_t n_tiles = (size_t)job->tiles_width * job->tiles_height;
+	job->outputs = calloc(n_outputs, sizeof(*job->outputs));
+	job->tiles = calloc(n_tiles, sizeof(*job->tiles));
+	job->row_tiles_left = calloc(job->tiles_height, sizeof(int));
+	if (job->image == NULL || job->outputs == NULL || job->tiles == NULL ||
+			job->row_tiles_left == NULL) {
+		destroy_render_job(job);
+		return NULL;
+	}
+
+	for (int y = 0; y < job->tiles_height; y++) {
+		for (int x = 0; x < job->tiles_width; x++) {
+			job->tiles[y * job->tiles_width + x] =
+				(struct render_job_tile){ .job = job, .x = x, .y = y };
+		}
+		job->row_tiles_left[y] = job->tiles_width;
+	}
+
+	wl_list_for_each(output, &state->outputs, link) {
+		if (!is_captured(output)) {
+			continue;
+		}
+
+		// Buffers may not be known yet, but they end up covering the capture
+		// geometry. Leave a pixel of slack for rounding.
+		struct grim_box *box = &output->capture_geometry;
+		int x1 = floor((box->x - geometry->x) * scale) - 1;
+		int y1 = floor((box->y - geometry->y) * scale) - 1;
+		int x2 = ceil((box->x + box->width - geometry->x) * scale) + 1;
+		int y2 = ceil((box->y + box->height - geometry->y) * scale) + 1;
+		x1 = x1 < 0 ? 0 : x1;
+		y1 = y1 < 0 ? 0 : y1;
+		x2 = x2 > common_width ? common_width : x2;
+		y2 = y2 > common_height ? common_height : y2;
+
+		struct render_job_output *job_output = &job->outputs[job->n_outputs++];
+		*job_output = (struct render_job_output){
+			.output = output,
+			.overlapping = is_overlapping(state, output),
+			.tile_x1 = x1 / JOB_TILE_WIDTH,
+			.tile_y1 = y1 / JOB_TILE_HEIGHT,
+			.tile_x2 = x1 < x2 ? (x2 + JOB_TILE_WIDTH - 1) / JOB_TILE_WIDTH : 0,
+			.tile_y2 = y1 < y2 ? (y2 + JOB_TILE_HEIGHT - 1) / JOB_TILE_HEIGHT : 0,
+		};
+		for (int y = job_output->tile_y1; y < job_output->tile_y2; y++) {
+			for (int x = job_output->tile_x1; x < job_output->tile_x2; x++) {
+				++job->tiles[y * job->tiles_width + x].n_waiting;
 			}
 		}
-		/* OP_SRC copies the image instead of blending it, and is much
-		 * faster, but this a) is incorrect in the weird case where
-		 * logical outputs overlap and are partially transparent b)
-		 * can draw the edge between two outputs incorrectly if that
-		 * edge is not exactly grid aligned in the common image */
-		pixman_op_t op = (grid_aligned && !overlapping) ? PIXMAN_OP_SRC : PIXMAN_OP_OVER;
-		pixman_image_composite32(op, output_image, NULL, common_image,
-			0, 0, 0, 0, composite_dest.x, composite_dest.y,
-			composite_dest.width, composite_dest.height);
+	}
 
-		pixman_image_unref(output_image);
+	// Tiles outside of all outputs are final already
+	pthread_mutex_lock(&job->lock);
+	for (int y = 0; y < job->tiles_height; y++) {
+		for (int x = 0; x < job->tiles_width; x++) {
+			if (job->tiles[y * job->tiles_width + x].n_waiting == 0) {
+				--job->row_tiles_left[y];
+			}
+		}
+	}
+	while (job->final_tile_rows < job->tiles_height &&
+			job->row_tiles_left[job->final_tile_rows] == 0) {
+		++job->final_tile_rows;
 	}
+	pthread_mutex_unlock(&job->lock);
 
-	return common_image;
+	return job;
+}
+
+void render_job_output_ready(struct grim_render_job *job,
+		struct grim_output *output) {
+	for (size_t i = 0; i < job->n_outputs; i++) {
+		struct render_job_output *job_output = &job->outputs[i];
+		if (job_output->output != output) {
+			continue;
+		}
+
+		for (int y = job_output->tile_y1; y < job_output->tile_y2; y++) {
+			for (int x = job_output->tile_x1; x < job_output->tile_x2; x++) {
+				// Only touched by this thread, like n_unknown_buffers
+				struct render_job_tile *tile =
+					&job->tiles[y * job->tiles_width + x];
+				if (--tile->n_waiting > 0) {
+					continue;
+				}
+				if (job->n_unknown_buffers > 0) {
+					tile->deferred = true;
+				} else {
+					task_group_add(&job->tile_tasks, render_job_tile,
+						tile);
+				}
+			}
+		}
+		return;
+	}
+}
+
+void render_job_output_buffer(struct grim_render_job *job,
+		struct grim_output *output) {
+	pthread_mutex_lock(&job->lock);
+	for (size_t i = 0; i < job->n_outputs; i++) {
+		struct render_job_output *job_output = &job->outputs[i];
+		if (job_output->output == output && !job_output->buffer_known) {
+			job_output->buffer_known = true;
+			--job->n_unknown_buffers;
+			pthread_cond_broadcast(&job->rows_cond);
+		}
+	}
+	size_t n_unknown_buffers = job->n_unknown_buffers;
+	pthread_mutex_unlock(&job->lock);
+
+	// Setting up a buffer may grow the pool, which moves the data of all
+	// other buffers, so tiles only start once no buffer is left to set up
+	if (n_unknown_buffers > 0) {
+		return;
+	}
+	size_t n_tiles = (size_t)job->tiles_width * job->tiles_height;
+	for (size_t i = 0; i < n_tiles; i++) {
+		struct render_job_tile *tile = &job->tiles[i];
+		if (tile->deferred) {
+			tile->deferred = false;
+			task_group_add(&job->tile_tasks, render_job_tile, tile);
+		}
+	}
+}
+
+void render_job_remove_output(struct grim_render_job *job,
+		struct grim_output *output) {
+	// Let compositing which may still use the output finish
+	task_group_wait(&job->tile_tasks);
+
+	pthread_mutex_lock(&job->lock);
+	for (size_t i = 0; i < job->n_outputs; i++) {
+		if (job->outputs[i].output == output) {
+			job->outputs[i].output = NULL;
+			job->failed = true;
+		}
+	}
+	pthread_mutex_unlock(&job->lock);
+}
+
+// Called with the lock held, once all buffers are known
+static bool is_render_job_opaque(struct grim_render_job *job) {
+	if (job->failed) {
+		return false;
+	}
+
+	pixman_region32_t covered;
+	pixman_region32_init(&covered);
+	bool opaque = true;
+	for (size_t i = 0; opaque && i < job->n_outputs; i++) {
+		struct grim_output *output = job->outputs[i].output;
+		opaque = output != NULL &&
+			add_opaque_area(output, &job->geometry, job->scale, &covered);
+	}
+	opaque = opaque && is_area_covered(&covered,
+		pixman_image_get_width(job->image),
+		pixman_image_get_height(job->image));
+	pixman_region32_fini(&covered);
+	return opaque;
+}
+
+pixman_image_t *get_render_job_image(struct grim_render_job *job) {
+	pthread_mutex_lock(&job->lock);
+	while (!job->finished && job->n_unknown_buffers > 0) {
+		pthread_cond_wait(&job->rows_cond, &job->lock);
+	}
+	if (job->encode_image == NULL) {
+		// Compositing doesn't depend on the format of the image it draws
+		// on as long as the result is opaque
+		if (job->n_unknown_buffers == 0 && is_render_job_opaque(job)) {
+			job->encode_image = pixman_image_create_bits(PIXMAN_x8r8g8b8,
+				pixman_image_get_width(job->image),
+				pixman_image_get_height(job->image),
+				pixman_image_get_data(job->image),
+				pixman_image_get_stride(job->image));
+		}
+		if (job->encode_image == NULL) {
+			job->encode_image = pixman_image_ref(job->image);
+		}
+	}
+	pixman_image_t *image = job->encode_image;
+	pthread_mutex_unlock(&job->lock);
+	return image;
+}
+
+bool wait_render_job_rows(struct grim_render_job *job, int32_t y) {
+	if (job == NULL) {
+		return true;
+	}
+
+	int tile_rows = (y + JOB_TILE_HEIGHT - 1) / JOB_TILE_HEIGHT;
+	pthread_mutex_lock(&job->lock);
+	while (!job->finished && job->final_tile_rows < tile_rows) {
+		pthread_cond_wait(&job->rows_cond, &job->lock);
+	}
+	bool ok = !job->failed && job->final_tile_rows >= tile_rows;
+	pthread_mutex_unlock(&job->lock);
+	return ok;
+}
+
+bool finish_render_job(struct grim_render_job *job) {
+	task_group_wait(&job->tile_tasks);
+
+	pthread_mutex_lock(&job->lock);
+	// Tiles still waiting for a frame which never came won't be composited
+	bool ok = !job->failed && job->final_tile_rows == job->tiles_height;
+	job->finished = true;
+	pthread_cond_broadcast(&job->rows_cond);
+	pthread_mutex_unlock(&job->lock);
+
+	if (ok) {
+		clear_damage(job->state);
+	}
+	return ok;
 }
@@ -0,0 +1,881 @@
+#include <assert.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "resample.h"
+
+// Like pack.c, the vector versions are only built for little-endian machines
+#if GRIM_LITTLE_ENDIAN && defined(__x86_64__)
+#define RESAMPLE_X86 1
+#include <immintrin.h>
+#else
+#define RESAMPLE_X86 0
+#endif
+#if GRIM_LITTLE_ENDIAN && defined(__aarch64__)
+#define RESAMPLE_NEON 1
+#include <arm_neon.h>
+#else
+#define RESAMPLE_NEON 0
+#endif
+
+// Pixels are handled as 4 bytes in memory order, whatever the channels. Only
+// the position of alpha matters.
+#define ALPHA_BYTE (GRIM_LITTLE_ENDIAN ? 3 : 0)
+
+#define RESAMPLE_PI 3.14159265358979323846
+#define RESAMPLE_CACHE_SIZE 16
+// Largest box averaged with integer sums, see resample_box()
+#define RESAMPLE_MAX_BOX_SIZE 64
+// Rows of the destination resampled from the same horizontally filtered
+// source rows, to bound the memory used by a call
+#define RESAMPLE_STRIP_HEIGHT 32
+
+static const char *filter_names[] = {
+	[GRIM_RESAMPLE_NEAREST] = "nearest",
+	[GRIM_RESAMPLE_BOX] = "box",
+	[GRIM_RESAMPLE_BILINEAR] = "bilinear",
+	[GRIM_RESAMPLE_LANCZOS] = "lanczos",
+};
+
+const char *get_resample_filter_name(enum grim_resample_filter filter) {
+	return filter_names[filter];
+}
+
+bool parse_resample_filter(const char *str,
+		enum grim_resample_filter *filter) {
+	for (size_t i = 0; i < sizeof(filter_names) / sizeof(filter_names[0]);
+			i++) {
+		if (strcmp(str, filter_names[i]) == 0) {
+			*filter = i;
+			return true;
+		}
+	}
+	return false;
+}
+
+struct grim_resample_weights {
+	struct grim_resample_axis axis;
+	// Same number of taps for every destination pixel, padded with zeros
+	int n_taps;
+	// Side of the box averaged by each destination pixel when it lies right
+	// on source pixels, 0 otherwise
+	int box_size;
+	int32_t *starts; // first source pixel, per destination pixel
+	// n_taps per destination pixel, summing to 1, each of them repeated for
+	// the 4 bytes of a pixel
+	float *values;
+
+	// Only touched with the cache locked
+	bool cached;
+	int refs;
+	uint64_t last_used;
+};
+
+struct grim_resample_cache {
+	pthread_mutex_t lock;
+	struct grim_resample_weights *entries[RESAMPLE_CACHE_SIZE];
+	uint64_t clock;
+};
+
+/**
+ * Radius of the filter, in destination pixels.
+ */
+static double get_filter_support(enum grim_resample_filter filter) {
+	switch (filter) {
+	case GRIM_RESAMPLE_NEAREST:
+	case GRIM_RESAMPLE_BOX:
+		return 0.5;
+	case GRIM_RESAMPLE_BILINEAR:
+		return 1;
+	case GRIM_RESAMPLE_LANCZOS:
+		return 2;
+	}
+	abort();
+}
+
+static double eval_filter(enum grim_resample_filter filter, double x) {
+	x = fabs(x);
+	switch (filter) {
+	case GRIM_RESAMPLE_NEAREST:
+	case GRIM_RESAMPLE_BOX:
+		abort(); // see compute_pixel_taps()
+	case GRIM_RESAMPLE_BILINEAR:
+		return x < 1 ? 1 - x : 0;
+	case GRIM_RESAMPLE_LANCZOS:
+		if (x < 1e-8) {
+			return 1;
+		} else if (x >= 2) {
+			return 0;
+		}
+		// Like PIXMAN_KERNEL_LANCZOS2
+		double px = RESAMPLE_PI * x;
+		return 2 * sin(px) * sin(px / 2) / (px * px);
+	}
+	abort();
+}
+
+/**
+ * Work out the source pixels first..last under destination pixel d. When
+ * taps isn't NULL, also store their unnormalized weights.
+ */
+static void compute_pixel_taps(const struct grim_resample_axis *axis,
+		int32_t d, int32_t *first, int32_t *last, double *taps) {
+	// Continuous source coordinate of the center of the pixel
+	double center = (d + 0.5 - axis->offset) / axis->scale;
+	// Filters are stretched over the source when downscaling only
+	double filter_scale = fmin(fabs(axis->scale), 1);
+	double radius = get_filter_support(axis->filter) / filter_scale;
+
+	switch (axis->filter) {
+	case GRIM_RESAMPLE_NEAREST:
+		*first = *last = floor(center);
+		if (taps != NULL) {
+			taps[0] = 1;
+		}
+		return;
+	case GRIM_RESAMPLE_BOX: {
+		// Weighted by the part of each pixel covered by the box
+		double lo = center - radius, hi = center + radius;
+		*first = floor(lo);
+		*last = ceil(hi) - 1;
+		if (*last < *first) {
+			*last = *first;
+		}
+		for (int32_t j = *first; taps != NULL && j <= *last; j++) {
+			taps[j - *first] = fmax(0, fmin(hi, j + 1) - fmax(lo, j));
+		}
+		return;
+	}
+	case GRIM_RESAMPLE_BILINEAR:
+	case GRIM_RESAMPLE_LANCZOS:
+		*first = ceil(center - radius - 0.5);
+		*last = floor(center + radius - 0.5);
+		if (*last < *first) {
+			*first = *last = floor(center);
+		}
+		for (int32_t j = *first; taps != NULL && j <= *last; j++) {
+			taps[j - *first] = eval_filter(axis->filter,
+				(j + 0.5 - center) * filter_scale);
+		}
+		return;
+	}
+	abort();
+}
+
+/**
+ * Check whether every destination pixel averages a box of whole source
+ * pixels, all of them inside the source.
+ */
+static int get_box_size(const struct grim_resample_axis *axis) {
+	if (axis->filter != GRIM_RESAMPLE_BOX) {
+		return 0;
+	}
+	double ratio = 1 / fabs(axis->scale);
+	double size = round(ratio);
+	if (size < 1 || size > RESAMPLE_MAX_BOX_SIZE ||
+			fabs(ratio - size) > 1e-9) {
+		return 0;
+	}
+	for (int32_t d = 0; d < axis->dst_size; d++) {
+		double center = (d + 0.5 - axis->offset) / axis->scale;
+		double lo = center - size / 2;
+		if (fabs(lo - round(lo)) > 1e-6 || round(lo) < 0 ||
+				round(lo) + size > axis->src_size) {
+			return 0;
+		}
+	}
+	return size;
+}
+
+static void destroy_weights(struct grim_resample_weights *weights) {
+	if (weights == NULL) {
+		return;
+	}
+	free(weights->starts);
+	free(weights->values);
+	free(weights);
+}
+
+static struct grim_resample_weights *create_weights(
+		const struct grim_resample_axis *axis) {
+	assert(axis->src_size > 0 && axis->dst_size > 0 && axis->scale != 0);
+
+	int n_taps = 1;
+	for (int32_t d = 0; d < axis->dst_size; d++) {
+		int32_t first, last;
+		compute_pixel_taps(axis, d, &first, &last, NULL);
+		if (last - first + 1 > n_taps) {
+			n_taps = last - first + 1;
+		}
+	}
+	// Taps falling outside of the source are moved onto its edges, which
+	// fit in a smaller window when the source is small
+	int window = n_taps < axis->src_size ? n_taps : axis->src_size;
+
+	struct grim_resample_weights *weights = calloc(1, sizeof(*weights));
+	double *taps = calloc(n_taps, sizeof(*taps));
+	if (weights == NULL || taps == NULL) {
+		free(weights);
+		free(taps);
+		return NULL;
+	}
+	weights->axis = *axis;
+	weights->n_taps = window;
+	weights->starts = calloc(axis->dst_size, sizeof(*weights->starts));
+	weights->values = calloc((size_t)axis->dst_size * window * 4,
+		sizeof(*weights->values));
+	if (weights->starts == NULL || weights->values == NULL) {
+		destroy_weights(weights);
+		free(taps);
+		return NULL;
+	}
+
+	for (int32_t d = 0; d < axis->dst_size; d++) {
+		int32_t first, last;
+		compute_pixel_taps(axis, d, &first, &last, taps);
+
+		int32_t start = first;
+		if (start > axis->src_size - window) {
+			start = axis->src_size - window;
+		}
+		if (start < 0) {
+			start = 0;
+		}
+		weights->starts[d] = start;
+
+		float *values = &weights->values[(size_t)d * window * 4];
+		double sum = 0;
+		for (int32_t j = first; j <= last; j++) {
+			sum += taps[j - first];
+		}
+		for (int32_t j = first; j <= last; j++) {
+			if (sum == 0 && j > first) {
+				break;
+			}
+			int32_t edge = j < 0 ? 0 :
+				j >= axis->src_size ? axis->src_size - 1 : j;
+			// Falls back to the first pixel if the weights cancel out
+			values[4 * (edge - start)] += sum != 0 ? taps[j - first] / sum : 1;
+		}
+		for (int k = 0; k < window; k++) {
+			for (int c = 1; c < 4; c++) {
+				values[4 * k + c] = values[4 * k];
+			}
+		}
+	}
+	free(taps);
+
+	weights->box_size = get_box_size(axis);
+	if (weights->box_size > 0) {
+		// Same boxes as above, without the rounding of the weights
+		for (int32_t d = 0; d < axis->dst_size; d++) {
+			double center = (d + 0.5 - axis->offset) / axis->scale;
+			weights->starts[d] = round(center - weights->box_size / 2.0);
+		}
+	}
+	return weights;
+}
+
+struct grim_resample_cache *create_resample_cache(void) {
+	struct grim_resample_cache *cache = calloc(1, sizeof(*cache));
+	if (cache == NULL) {
+		return NULL;
+	}
+	pthread_mutex_init(&cache->lock, NULL);
+	return cache;
+}
+
+void destroy_resample_cache(struct grim_resample_cache *cache) {
+	if (cache == NULL) {
+		return;
+	}
+	for (int i = 0; i < RESAMPLE_CACHE_SIZE; i++) {
+		assert(cache->entries[i] == NULL || cache->entries[i]->refs == 0);
+		destroy_weights(cache->entries[i]);
+	}
+	pthread_mutex_destroy(&cache->lock);
+	free(cache);
+}
+
+static bool is_same_axis(const struct grim_resample_axis *a,
+		const struct grim_resample_axis *b) {
+	return a->filter == b->filter && a->src_size == b->src_size &&
+		a->dst_size == b->dst_size && a->scale == b->scale &&
+		a->offset == b->offset;
+}
+
+struct grim_resample_weights *get_resample_weights(
+		struct grim_resample_cache *cache,
+		const struct grim_resample_axis *axis) {
+	if (cache == NULL) {
+		return create_weights(axis);
+	}
+
+	// Weights are computed with the lock held, so that the bands of an
+	// image starting together don't all compute them
+	pthread_mutex_lock(&cache->lock);
+	struct grim_resample_weights *weights = NULL;
+	for (int i = 0; i < RESAMPLE_CACHE_SIZE; i++) {
+		if (cache->entries[i] != NULL &&
+				is_same_axis(&cache->entries[i]->axis, axis)) {
+			weights = cache->entries[i];
+			break;
+		}
+	}
+
+	if (weights == NULL) {
+		weights = create_weights(axis);
+		// Replace the least recently used weights which aren't in use
+		int slot = -1;
+		for (int i = 0; weights != NULL && i < RESAMPLE_CACHE_SIZE; i++) {
+			struct grim_resample_weights *entry = cache->entries[i];
+			if (entry == NULL) {
+				slot = i;
+				break;
+			}
+			if (entry->refs == 0 && (slot < 0 ||
+					entry->last_used < cache->entries[slot]->last_used)) {
+				slot = i;
+			}
+		}
+		if (slot >= 0) {
+			destroy_weights(cache->entries[slot]);
+			cache->entries[slot] = weights;
+			weights->cached = true;
+		}
+	}
+
+	if (weights != NULL && weights->cached) {
+		++weights->refs;
+		weights->last_used = ++cache->clock;
+	}
+	pthread_mutex_unlock(&cache->lock);
+	return weights;
+}
+
+void release_resample_weights(struct grim_resample_cache *cache,
+		struct grim_resample_weights *weights) {
+	if (weights == NULL) {
+		return;
+	}
+	// Set once and for all before the weights are handed out
+	if (!weights->cached) {
+		destroy_weights(weights);
+		return;
+	}
+	pthread_mutex_lock(&cache->lock);
+	--weights->refs;
+	pthread_mutex_unlock(&cache->lock);
+}
+
+/*
+ * Rows are first filtered horizontally into floats, 4 per pixel, then the
+ * rows of the destination are accumulated from them and stored. Boxes are
+ * summed up by columns, then across. All passes handle the 4 bytes of a
+ * pixel alike.
+ */
+
+typedef void (*filter_row_func)(float *restrict row_out,
+	const unsigned char *restrict line, ptrdiff_t step,
+	const int32_t *restrict starts, const float *restrict values,
+	int n_taps, size_t width);
+typedef void (*accumulate_row_func)(float *restrict sum,
+	const float *restrict row, float weight, size_t n);
+typedef void (*store_row_func)(unsigned char *restrict row_out,
+	const float *restrict sum, size_t width, bool opaque);
+typedef void (*sum_columns_func)(uint32_t *restrict columns,
+	const unsigned char *restrict line, ptrdiff_t step, size_t n_columns);
+typedef void (*store_boxes_func)(unsigned char *restrict row_out,
+	const uint32_t *restrict columns, const int32_t *restrict starts,
+	int32_t first, int size, uint32_t n, size_t width, bool opaque);
+
+static pthread_once_t resample_once = PTHREAD_ONCE_INIT;
+static filter_row_func filter_row_impl;
+static accumulate_row_func accumulate_row_impl;
+static store_row_func store_row_impl;
+static sum_columns_func sum_columns_impl;
+static store_boxes_func store_boxes_impl;
+
+static void filter_row_scalar(float *restrict row_out,
+		const unsigned char *restrict line, ptrdiff_t step,
+		const int32_t *restrict starts, const float *restrict values,
+		int n_taps, size_t width) {
+	for (size_t x = 0; x < width; x++) {
+		const unsigned char *pixel = line + starts[x] * step;
+		const float *weights = values + 4 * x * n_taps;
+		float sum[4] = {0};
+		for (int k = 0; k < n_taps; k++) {
+			for (int c = 0; c < 4; c++) {
+				sum[c] += weights[4 * k + c] * pixel[k * step + c];
+			}
+		}
+		memcpy(&row_out[4 * x], sum, sizeof(sum));
+	}
+}
+
+static void accumulate_row_scalar(float *restrict sum,
+		const float *restrict row, float weight, size_t n) {
+	for (size_t i = 0; i < n; i++) {
+		sum[i] += weight * row[i];
+	}
+}
+
+/**
+ * Round, clamp, and make up for the alpha byte of opaque sources and for
+ * filters overshooting alpha.
+ */
+static void store_row_scalar(unsigned char *restrict row_out,
+		const float *restrict sum, size_t width, bool opaque) {
+	for (size_t x = 0; x < width; x++) {
+		unsigned char *pixel = &row_out[4 * x];
+		for (int c = 0; c < 4; c++) {
+			float v = sum[4 * x + c] + 0.5f;
+			pixel[c] = v <= 0 ? 0 : v >= 255 ? 255 : (unsigned char)v;
+		}
+		if (opaque) {
+			pixel[ALPHA_BYTE] = 0xff;
+			continue;
+		}
+		// Premultiplied colors can't exceed alpha
+		unsigned char alpha = pixel[ALPHA_BYTE];
+		for (int c = 0; c < 4; c++) {
+			pixel[c] = pixel[c] > alpha ? alpha : pixel[c];
+		}
+	}
+}
+
+static void sum_columns_scalar(uint32_t *restrict columns,
+		const unsigned char *restrict line, ptrdiff_t step, size_t n_columns) {
+	for (size_t x = 0; x < n_columns; x++) {
+		for (int c = 0; c < 4; c++) {
+			columns[4 * x + c] += line[x * step + c];
+		}
+	}
+}
+
+/**
+ * Divide the sums of the boxes starting at each of starts by n, the number of
+ * pixels in a box. Dividing by multiplying with a reciprocal is exact for
+ * boxes of up to 64 x 64 pixels.
+ */
+static void store_boxes_scalar(unsigned char *restrict row_out,
+		const uint32_t *restrict columns, const int32_t *restrict starts,
+		int32_t first, int size, uint32_t n, size_t width, bool opaque) {
+	uint64_t reciprocal = ((UINT64_C(1) << 32) + n - 1) / n;
+	for (size_t x = 0; x < width; x++) {
+		const uint32_t *box = &columns[4 * (starts[x] - first)];
+		for (int c = 0; c < 4; c++) {
+			uint32_t total = n / 2;
+			for (int k = 0; k < size; k++) {
+				total += box[4 * k + c];
+			}
+			row_out[4 * x + c] = (total * reciprocal) >> 32;
+		}
+		// Averages of premultiplied pixels don't overshoot alpha
+		if (opaque) {
+			row_out[4 * x + ALPHA_BYTE] = 0xff;
+		}
+	}
+}
+
+#if RESAMPLE_X86
+__attribute__((target("sse4.1")))
+static inline __m128 load_pixel_sse41(const unsigned char *pixel) {
+	int32_t bytes;
+	memcpy(&bytes, pixel, sizeof(bytes));
+	return _mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(bytes)));
+}
+
+__attribute__((target("sse4.1")))
+static void filter_row_sse41(float *restrict row_out,
+		const unsigned char *restrict line, ptrdiff_t step,
+		const int32_t *restrict starts, const float *restrict values,
+		int n_taps, size_t width) {
+	for (size_t x = 0; x < width; x++) {
+		const unsigned char *pixel = line + starts[x] * step;
+		const float *weights = values + 4 * x * n_taps;
+		__m128 sum = _mm_setzero_ps();
+		for (int k = 0; k < n_taps; k++) {
+			sum = _mm_add_ps(sum, _mm_mul_ps(load_pixel_sse41(pixel + k * step),
+				_mm_loadu_ps(weights + 4 * k)));
+		}
+		_mm_storeu_ps(&row_out[4 * x], sum);
+	}
+}
+
+__attribute__((target("sse4.1")))
+static void accumulate_row_sse41(float *restrict sum,
+		const float *restrict row, float weight, size_t n) {
+	const __m128 w = _mm_set1_ps(weight);
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m128 v = _mm_mul_ps(_mm_loadu_ps(row + i), w);
+		_mm_storeu_ps(sum + i, _mm_add_ps(_mm_loadu_ps(sum + i), v));
+	}
+	accumulate_row_scalar(sum + i, row + i, weight, n - i);
+}
+
+__attribute__((target("sse4.1")))
+static void store_row_sse41(unsigned char *restrict row_out,
+		const float *restrict sum, size_t width, bool opaque) {
+	const __m128 half = _mm_set1_ps(0.5f);
+	const __m128i alpha_mask = _mm_set1_epi32(0xffu << (8 * ALPHA_BYTE));
+	const __m128i spread_alpha = _mm_setr_epi8(
+		ALPHA_BYTE, ALPHA_BYTE, ALPHA_BYTE, ALPHA_BYTE,
+		ALPHA_BYTE + 4, ALPHA_BYTE + 4, ALPHA_BYTE + 4, ALPHA_BYTE + 4,
+		ALPHA_BYTE + 8, ALPHA_BYTE + 8, ALPHA_BYTE + 8, ALPHA_BYTE + 8,
+		ALPHA_BYTE + 12, ALPHA_BYTE + 12, ALPHA_BYTE + 12, ALPHA_BYTE + 12);
+	size_t x = 0;
+	for (; x + 4 <= width; x += 4) {
+		const float *in = &sum[4 * x];
+		// Truncating after adding one half rounds, and packing clamps
+		__m128i a = _mm_cvttps_epi32(_mm_add_ps(_mm_loadu_ps(in), half));
+		__m128i b = _mm_cvttps_epi32(_mm_add_ps(_mm_loadu_ps(in + 4), half));
+		__m128i c = _mm_cvttps_epi32(_mm_add_ps(_mm_loadu_ps(in + 8), half));
+		__m128i d = _mm_cvttps_epi32(_mm_add_ps(_mm_loadu_ps(in + 12), half));
+		__m128i v = _mm_packus_epi16(_mm_packus_epi32(a, b),
+			_mm_packus_epi32(c, d));
+		if (opaque) {
+			v = _mm_or_si128(v, alpha_mask);
+		} else {
+			v = _mm_min_epu8(v, _mm_shuffle_epi8(v, spread_alpha));
+		}
+		_mm_storeu_si128((__m128i *)&row_out[4 * x], v);
+	}
+	store_row_scalar(row_out + 4 * x, sum + 4 * x, width - x, opaque);
+}
+
+__attribute__((target("sse4.1")))
+static void sum_columns_sse41(uint32_t *restrict columns,
+		const unsigned char *restrict line, ptrdiff_t step, size_t n_columns) {
+	if (step != 4) {
+		sum_columns_scalar(columns, line, step, n_columns);
+		return;
+	}
+	for (size_t x = 0; x < n_columns; x++) {
+		int32_t bytes;
+		memcpy(&bytes, line + 4 * x, sizeof(bytes));
+		__m128i *column = (__m128i *)(columns + 4 * x);
+		_mm_storeu_si128(column, _mm_add_epi32(_mm_loadu_si128(column),
+			_mm_cvtepu8_epi32(_mm_cvtsi32_si128(bytes))));
+	}
+}
+
+__attribute__((target("sse4.1")))
+static void store_boxes_sse41(unsigned char *restrict row_out,
+		const uint32_t *restrict columns, const int32_t *restrict starts,
+		int32_t first, int size, uint32_t n, size_t width, bool opaque) {
+	if (n == 1) {
+		// The reciprocal doesn't fit in 32 bits
+		store_boxes_scalar(row_out, columns, starts, first, size, n, width,
+			opaque);
+		return;
+	}
+	const __m128i half = _mm_set1_epi32(n / 2);
+	const __m128i reciprocal =
+		_mm_set1_epi32(((UINT64_C(1) << 32) + n - 1) / n);
+	const uint32_t alpha = opaque ? 0xffu << (8 * ALPHA_BYTE) : 0;
+	for (size_t x = 0; x < width; x++) {
+		const uint32_t *box = &columns[4 * (starts[x] - first)];
+		__m128i total = half;
+		for (int k = 0; k < size; k++) {
+			total = _mm_add_epi32(total,
+				_mm_loadu_si128((const __m128i *)(box + 4 * k)));
+		}
+		// High halves of the 64-bit products, for even and odd lanes
+		__m128i even = _mm_srli_epi64(_mm_mul_epu32(total, reciprocal), 32);
+		__m128i odd = _mm_mul_epu32(_mm_srli_epi64(total, 32), reciprocal);
+		__m128i v = _mm_blend_epi16(even, odd, 0xcc);
+		v = _mm_packus_epi16(_mm_packus_epi32(v, v), v);
+		uint32_t pixel = (uint32_t)_mm_cvtsi128_si32(v) | alpha;
+		memcpy(&row_out[4 * x], &pixel, sizeof(pixel));
+	}
+}
+
+/**
+ * Two taps at a time when pixels are contiguous, one per lane.
+ */
+__attribute__((target("avx2,fma")))
+static void filter_row_avx2(float *restrict row_out,
+		const unsigned char *restrict line, ptrdiff_t step,
+		const int32_t *restrict starts, const float *restrict values,
+		int n_taps, size_t width) {
+	if (step != 4) {
+		filter_row_sse41(row_out, line, step, starts, values, n_taps, width);
+		return;
+	}
+	for (size_t x = 0; x < width; x++) {
+		const unsigned char *pixel = line + 4 * starts[x];
+		const float *weights = values + 4 * x * n_taps;
+		__m256 sum2 = _mm256_setzero_ps();
+		int k = 0;
+		for (; k + 2 <= n_taps; k += 2) {
+			__m256 v = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(
+				_mm_loadl_epi64((const __m128i *)(pixel + 4 * k))));
+			sum2 = _mm256_fmadd_ps(v, _mm256_loadu_ps(weights + 4 * k), sum2);
+		}
+		__m128 sum = _mm_add_ps(_mm256_castps256_ps128(sum2),
+			_mm256_extractf128_ps(sum2, 1));
+		if (k < n_taps) {
+			sum = _mm_fmadd_ps(load_pixel_sse41(pixel + 4 * k),
+				_mm_loadu_ps(weights + 4 * k), sum);
+		}
+		_mm_storeu_ps(&row_out[4 * x], sum);
+	}
+}
+
+__attribute__((target("avx2,fma")))
+static void accumulate_row_avx2(float *restrict sum,
+		const float *restrict row, float weight, size_t n) {
+	const __m256 w = _mm256_set1_ps(weight);
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		_mm256_storeu_ps(sum + i, _mm256_fmadd_ps(_mm256_loadu_ps(row + i), w,
+			_mm256_loadu_ps(sum + i)));
+	}
+	accumulate_row_scalar(sum + i, row + i, weight, n - i);
+}
+
+__attribute__((target("avx2")))
+static void sum_columns_avx2(uint32_t *restrict columns,
+		const unsigned char *restrict line, ptrdiff_t step, size_t n_columns) {
+	if (step != 4) {
+		sum_columns_scalar(columns, line, step, n_columns);
+		return;
+	}
+	size_t x = 0;
+	for (; x + 2 <= n_columns; x += 2) {
+		__m256i *column = (__m256i *)(columns + 4 * x);
+		__m256i v = _mm256_cvtepu8_epi32(
+			_mm_loadl_epi64((const __m128i *)(line + 4 * x)));
+		_mm256_storeu_si256(column,
+			_mm256_add_epi32(_mm256_loadu_si256(column), v));
+	}
+	sum_columns_scalar(columns + 4 * x, line + 4 * x, step, n_columns - x);
+}
+#endif
+
+#if RESAMPLE_NEON
+static void filter_row_neon(float *restrict row_out,
+		const unsigned char *restrict line, ptrdiff_t step,
+		const int32_t *restrict starts, const float *restrict values,
+		int n_taps, size_t width) {
+	for (size_t x = 0; x < width; x++) {
+		const unsigned char *pixel = line + starts[x] * step;
+		const float *weights = values + 4 * x * n_taps;
+		float32x4_t sum = vdupq_n_f32(0);
+		for (int k = 0; k < n_taps; k++) {
+			uint32_t bytes;
+			memcpy(&bytes, pixel + k * step, sizeof(bytes));
+			uint16x8_t wide = vmovl_u8(vreinterpret_u8_u32(vdup_n_u32(bytes)));
+			float32x4_t v = vcvtq_f32_u32(vmovl_u16(vget_low_u16(wide)));
+			sum = vmlaq_f32(sum, v, vld1q_f32(weights + 4 * k));
+		}
+		vst1q_f32(&row_out[4 * x], sum);
+	}
+}
+
+static void accumulate_row_neon(float *restrict sum,
+		const float *restrict row, float weight, size_t n) {
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		vst1q_f32(sum + i, vmlaq_n_f32(vld1q_f32(sum + i),
+			vld1q_f32(row + i), weight));
+	}
+	accumulate_row_scalar(sum + i, row + i, weight, n - i);
+}
+
+static void store_row_neon(unsigned char *restrict row_out,
+		const float *restrict sum, size_t width, bool opaque) {
+	const float32x4_t half = vdupq_n_f32(0.5f);
+	size_t x = 0;
+	for (; x + 2 <= width; x += 2) {
+		const float *in = &sum[4 * x];
+		// Conversions and narrowing saturate
+		uint32x4_t a = vcvtq_u32_f32(vaddq_f32(vld1q_f32(in), half));
+		uint32x4_t b = vcvtq_u32_f32(vaddq_f32(vld1q_f32(in + 4), half));
+		uint8x8_t v = vqmovn_u16(vcombine_u16(vqmovn_u32(a), vqmovn_u32(b)));
+		uint32x2_t pixels = vreinterpret_u32_u8(v);
+		uint32x2_t alpha = vshr_n_u32(pixels, 8 * ALPHA_BYTE);
+		alpha = vand_u32(alpha, vdup_n_u32(0xff));
+		if (opaque) {
+			pixels = vorr_u32(pixels, vdup_n_u32(0xffu << (8 * ALPHA_BYTE)));
+		} else {
+			uint8x8_t spread = vreinterpret_u8_u32(
+				vmul_u32(alpha, vdup_n_u32(0x01010101)));
+			pixels = vreinterpret_u32_u8(vmin_u8(v, spread));
+		}
+		vst1_u8(&row_out[4 * x], vreinterpret_u8_u32(pixels));
+	}
+	store_row_scalar(row_out + 4 * x, sum + 4 * x, width - x, opaque);
+}
+
+static void sum_columns_neon(uint32_t *restrict columns,
+		const unsigned char *restrict line, ptrdiff_t step, size_t n_columns) {
+	if (step != 4) {
+		sum_columns_scalar(columns, line, step, n_columns);
+		return;
+	}
+	size_t x = 0;
+	for (; x + 2 <= n_columns; x += 2) {
+		uint32_t *column = columns + 4 * x;
+		uint16x8_t v = vmovl_u8(vld1_u8(line + 4 * x));
+		vst1q_u32(column, vaddw_u16(vld1q_u32(column), vget_low_u16(v)));
+		vst1q_u32(column + 4,
+			vaddw_u16(vld1q_u32(column + 4), vget_high_u16(v)));
+	}
+	sum_columns_scalar(columns + 4 * x, line + 4 * x, step, n_columns - x);
+}
+#endif
+
+static void init_resample(void) {
+	filter_row_impl = filter_row_scalar;
+	accumulate_row_impl = accumulate_row_scalar;
+	store_row_impl = store_row_scalar;
+	sum_columns_impl = sum_columns_scalar;
+	store_boxes_impl = store_boxes_scalar;
+#if RESAMPLE_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse4.1")) {
+		filter_row_impl = filter_row_sse41;
+		accumulate_row_impl = accumulate_row_sse41;
+		store_row_impl = store_row_sse41;
+		sum_columns_impl = sum_columns_sse41;
+		store_boxes_impl = store_boxes_sse41;
+	}
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+		filter_row_impl = filter_row_avx2;
+		accumulate_row_impl = accumulate_row_avx2;
+		sum_columns_impl = sum_columns_avx2;
+	}
+#elif RESAMPLE_NEON
+	filter_row_impl = filter_row_neon;
+	accumulate_row_impl = accumulate_row_neon;
+	store_row_impl = store_row_neon;
+	sum_columns_impl = sum_columns_neon;
+#endif
+}
+
+static bool resample_filtered(const struct grim_resample_src *src,
+		const struct grim_resample_weights *x_weights,
+		const struct grim_resample_weights *y_weights, uint32_t *dst,
+		int dst_stride, int32_t x, int32_t y, int32_t width, int32_t height) {
+	size_t row_size = 4 * (size_t)width;
+	int y_taps = y_weights->n_taps;
+	const int32_t *x_starts = x_weights->starts + x;
+	const float *x_values =
+		x_weights->values + (size_t)x * x_weights->n_taps * 4;
+
+	float *sum = malloc(row_size * sizeof(*sum));
+	float *rows = NULL;
+	size_t rows_cap = 0;
+	bool ok = sum != NULL;
+	for (int32_t strip = 0; ok && strip < height;
+			strip += RESAMPLE_STRIP_HEIGHT) {
+		int32_t strip_height = height - strip < RESAMPLE_STRIP_HEIGHT ?
+			height - strip : RESAMPLE_STRIP_HEIGHT;
+
+		// Source rows read by the strip, in either order when flipped
+		int32_t first = INT32_MAX, end = 0;
+		for (int32_t j = 0; j < strip_height; j++) {
+			int32_t start = y_weights->starts[y + strip + j];
+			first = start < first ? start : first;
+			end = start + y_taps > end ? start + y_taps : end;
+		}
+		size_t n_rows = end - first;
+		if (n_rows * row_size > rows_cap) {
+			free(rows);
+			rows_cap = n_rows * row_size;
+			rows = malloc(rows_cap * sizeof(*rows));
+			if (rows == NULL) {
+				ok = false;
+				break;
+			}
+		}
+		for (size_t r = 0; r < n_rows; r++) {
+			filter_row_impl(rows + r * row_size,
+				src->data + (first + r) * src->y_step, src->x_step,
+				x_starts, x_values, x_weights->n_taps, width);
+		}
+
+		for (int32_t j = 0; j < strip_height; j++) {
+			int32_t d = y + strip + j;
+			const float *weights = y_weights->values + (size_t)d * y_taps * 4;
+			const float *row = rows +
+				(y_weights->starts[d] - first) * row_size;
+			memset(sum, 0, row_size * sizeof(*sum));
+			for (int k = 0; k < y_taps; k++) {
+				if (weights[4 * k] != 0) {
+					accumulate_row_impl(sum, row + k * row_size,
+						weights[4 * k], row_size);
+				}
+			}
+			store_row_impl((unsigned char *)dst +
+				(size_t)(strip + j) * dst_stride, sum, width, src->opaque);
+		}
+	}
+	free(rows);
+	free(sum);
+	return ok;
+}
+
+/**
+ * Average boxes of whole source pixels, with integer sums: the result is
+ * exact, and rounded once.
+ */
+static bool resample_box(const struct grim_resample_src *src,
+		const struct grim_resample_weights *x_weights,
+		const struct grim_resample_weights *y_weights, uint32_t *dst,
+		int dst_stride, int32_t x, int32_t y, int32_t width, int32_t height) {
+	int x_size = x_weights->box_size, y_size = y_weights->box_size;
+	const int32_t *x_starts = x_weights->starts + x;
+
+	// Source columns read, in either order when flipped
+	int32_t first = INT32_MAX, end = 0;
+	for (int32_t i = 0; i < width; i++) {
+		first = x_starts[i] < first ? x_starts[i] : first;
+		end = x_starts[i] + x_size > end ? x_starts[i] + x_size : end;
+	}
+	size_t n_columns = end - first;
+	uint32_t *columns = malloc(4 * n_columns * sizeof(*columns));
+	if (columns == NULL) {
+		return false;
+	}
+
+	for (int32_t j = 0; j < height; j++) {
+		memset(columns, 0, 4 * n_columns * sizeof(*columns));
+		int32_t start = y_weights->starts[y + j];
+		for (int32_t r = start; r < start + y_size; r++) {
+			sum_columns_impl(columns,
+				src->data + r * src->y_step + first * src->x_step,
+				src->x_step, n_columns);
+		}
+		store_boxes_impl((unsigned char *)dst + (size_t)j * dst_stride,
+			columns, x_starts, first, x_size, x_size * y_size, width,
+			src->opaque);
+	}
+	free(columns);
+	return true;
+}
+
+bool resample_image(const struct grim_resample_src *src,
+		const struct grim_resample_weights *x_weights,
+		const struct grim_resample_weights *y_weights, uint32_t *dst,
+		int dst_stride, int32_t x, int32_t y, int32_t width, int32_t height) {
+	assert(x >= 0 && x + width <= x_weights->axis.dst_size);
+	assert(y >= 0 && y + height <= y_weights->axis.dst_size);
+	if (width <= 0 || height <= 0) {
+		return true;
+	}
+	pthread_once(&resample_once, init_resample);
+	if (x_weights->box_size > 0 && y_weights->box_size > 0) {
+		return resample_box(src, x_weights, y_weights, dst, dst_stride,
+			x, y, width, height);
+	}
+	return resample_filtered(src, x_weights, y_weights, dst, dst_stride,
+		x, y, width, height);
+}
@@ -0,0 +1,158 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pack.h"
+
+// Bytes checked past the end of each packed row, which must be left alone
+#define CANARY_SIZE 64
+#define CANARY 0xa5
+#define MAX_WIDTH 300
+#define N_RANDOM_ROWS 20000
+
+/**
+ * The division-based code pack_row32() used to run, which every
+ * implementation must match.
+ */
+static void pack_row_reference(uint8_t *row_out, const uint32_t *row_in,
+		size_t width, bool fully_opaque) {
+	for (size_t x = 0; x < width; x++) {
+		uint8_t b = (row_in[x] >>  0) & 0xff;
+		uint8_t g = (row_in[x] >>  8) & 0xff;
+		uint8_t r = (row_in[x] >> 16) & 0xff;
+		uint8_t a = (row_in[x] >> 24) & 0xff;
+
+		if (!fully_opaque && (a != 0 && a != 255)) {
+			uint32_t inv = (0xff << 16) / a;
+			uint32_t sr = r * inv;
+			r = sr > (0xff << 16) ? 0xff : (sr >> 16);
+			uint32_t sg = g * inv;
+			g = sg > (0xff << 16) ? 0xff : (sg >> 16);
+			uint32_t sb = b * inv;
+			b = sb > (0xff << 16) ? 0xff : (sb >> 16);
+		}
+
+		*row_out++ = r;
+		*row_out++ = g;
+		*row_out++ = b;
+		if (!fully_opaque) {
+			*row_out++ = a;
+		}
+	}
+}
+
+static uint32_t next_random(uint64_t *state) {
+	// xorshift64*
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return (*state * 0x2545f4914f6cdd1dull) >> 32;
+}
+
+/**
+ * Pack the row with impl into a buffer offset by out_offset bytes, and check
+ * it against the reference.
+ */
+static bool check_row(const struct grim_pack_impl *impl,
+		const uint32_t *row_in, size_t width, bool fully_opaque,
+		size_t out_offset) {
+	static uint8_t expected[MAX_WIDTH * 4];
+	static uint8_t buffer[64 + MAX_WIDTH * 4 + CANARY_SIZE];
+	size_t len = width * (fully_opaque ? 3 : 4);
+	pack_row_reference(expected, row_in, width, fully_opaque);
+
+	uint8_t *out = buffer + out_offset;
+	memset(buffer, CANARY, sizeof(buffer));
+	impl->pack_row(out, row_in, width, fully_opaque);
+
+	for (size_t i = 0; i < len; i++) {
+		if (out[i] == expected[i]) {
+			continue;
+		}
+		size_t x = i / (fully_opaque ? 3 : 4);
+		fprintf(stderr, "%s, %s: pixel %zu of %zu is 0x%08x, byte %zu "
+			"is %u instead of %u\n", impl->name,
+			fully_opaque ? "rgb" : "rgba", x, width, row_in[x], i, out[i],
+			expected[i]);
+		return false;
+	}
+	for (size_t i = 0; i < out_offset; i++) {
+		if (buffer[i] != CANARY) {
+			fprintf(stderr, "%s: wrote before the row\n", impl->name);
+			return false;
+		}
+	}
+	for (size_t i = len; i < len + CANARY_SIZE; i++) {
+		if (out[i] != CANARY) {
+			fprintf(stderr, "%s: wrote past the end of a row of %zu "
+				"pixels\n", impl->name, width);
+			return false;
+		}
+	}
+	return true;
+}
+
+/**
+ * Every channel takes every value under every alpha, including values above
+ * alpha, which aren't valid premultiplied colors and saturate.
+ */
+static bool check_sweep(const struct grim_pack_impl *impl) {
+	uint32_t row[256];
+	for (uint32_t a = 0; a < 256; a++) {
+		for (uint32_t c = 0; c < 256; c++) {
+			uint32_t r = c, g = (c * 7 + 1) & 0xff, b = 255 - c;
+			row[c] = a << 24 | r << 16 | g << 8 | b;
+		}
+		for (int mode = 0; mode < 2; mode++) {
+			if (!check_row(impl, row, 256, mode == 0, 0)) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+/**
+ * Rows of odd widths and alignments, where fractional alpha is rare enough
+ * for the vector code to see whole blocks without it.
+ */
+static bool check_random(const struct grim_pack_impl *impl) {
+	uint64_t state = 0x9e3779b97f4a7c15ull;
+	static uint32_t data[MAX_WIDTH + 8];
+	for (int i = 0; i < N_RANDOM_ROWS; i++) {
+		size_t width = next_random(&state) % (MAX_WIDTH + 1);
+		size_t in_offset = next_random(&state) % 8;
+		size_t out_offset = next_random(&state) % 64;
+		uint32_t translucent_rate = next_random(&state) % 4;
+		for (size_t x = 0; x < width; x++) {
+			uint32_t pixel = next_random(&state);
+			uint32_t kind = next_random(&state) % 64;
+			if (kind >= translucent_rate) {
+				pixel = (kind % 2 == 0 ? 0xff000000 : 0) |
+					(pixel & 0x00ffffff);
+			}
+			data[in_offset + x] = pixel;
+		}
+		for (int mode = 0; mode < 2; mode++) {
+			if (!check_row(impl, data + in_offset, width, mode == 0,
+					out_offset)) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+int main(int argc, char *argv[]) {
+	size_t n_impls;
+	const struct grim_pack_impl *impls = get_pack_impls(&n_impls);
+	bool ok = true;
+	for (size_t i = 0; i < n_impls; i++) {
+		bool impl_ok = check_sweep(&impls[i]) && check_random(&impls[i]);
+		printf("%s: %s\n", impls[i].name, impl_ok ? "ok" : "FAILED");
+		ok = ok && impl_ok;
+	}
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
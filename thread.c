@@ -0,0 +1,182 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "thread.h"
+
+struct grim_task {
+	grim_task_func func; // NULL once picked up out of order
+	void *data;
+	struct grim_task_group *group;
+};
+
+struct grim_thread_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t task_cond; // a task was queued, or the pool is stopping
+
+	// Tasks before next have been picked up, and so have those after it
+	// without a func. tasks[next] is always waiting.
+	struct grim_task *tasks;
+	size_t n_tasks, next, cap;
+	bool stopping;
+
+	pthread_t *threads;
+	int n_threads; // not counting the thread owning the pool
+};
+
+// Called with the lock held, returns with the lock held
+static void run_task(struct grim_thread_pool *pool, size_t i) {
+	struct grim_task task = pool->tasks[i];
+	pool->tasks[i].func = NULL;
+	while (pool->next < pool->n_tasks &&
+			pool->tasks[pool->next].func == NULL) {
+		++pool->next;
+	}
+	if (pool->next == pool->n_tasks) {
+		pool->n_tasks = pool->next = 0;
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	task.func(task.data);
+
+	pthread_mutex_lock(&pool->lock);
+	if (--task.group->n_pending == 0) {
+		pthread_cond_broadcast(&task.group->done_cond);
+	}
+}
+
+static void *run_worker(void *data) {
+	struct grim_thread_pool *pool = data;
+
+	pthread_mutex_lock(&pool->lock);
+	while (true) {
+		while (!pool->stopping && pool->next == pool->n_tasks) {
+			pthread_cond_wait(&pool->task_cond, &pool->lock);
+		}
+		if (pool->next == pool->n_tasks) {
+			break;
+		}
+		run_task(pool, pool->next);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+int get_default_thread_count(void) {
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? n : 1;
+}
+
+struct grim_thread_pool *create_thread_pool(int n_threads) {
+	struct grim_thread_pool *pool = calloc(1, sizeof(*pool));
+	if (pool == NULL) {
+		return NULL;
+	}
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->task_cond, NULL);
+
+	if (n_threads > 1) {
+		pool->threads = calloc(n_threads - 1, sizeof(pthread_t));
+		if (pool->threads == NULL) {
+			destroy_thread_pool(pool);
+			return NULL;
+		}
+	}
+	for (int i = 0; i < n_threads - 1; i++) {
+		if (pthread_create(&pool->threads[i], NULL, run_worker, pool) != 0) {
+			// Make do with what we have
+			fprintf(stderr, "failed to start worker thread\n");
+			break;
+		}
+		++pool->n_threads;
+	}
+
+	return pool;
+}
+
+void destroy_thread_pool(struct grim_thread_pool *pool) {
+	if (pool == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	pool->stopping = true;
+	pthread_cond_broadcast(&pool->task_cond);
+	pthread_mutex_unlock(&pool->lock);
+	for (int i = 0; i < pool->n_threads; i++) {
+		pthread_join(pool->threads[i], NULL);
+	}
+
+	pthread_cond_destroy(&pool->task_cond);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->threads);
+	free(pool->tasks);
+	free(pool);
+}
+
+int get_thread_pool_size(struct grim_thread_pool *pool) {
+	return pool->n_threads + 1;
+}
+
+void init_task_group(struct grim_task_group *group,
+		struct grim_thread_pool *pool) {
+	*group = (struct grim_task_group){ .pool = pool };
+	pthread_cond_init(&group->done_cond, NULL);
+}
+
+void finish_task_group(struct grim_task_group *group) {
+	task_group_wait(group);
+	pthread_cond_destroy(&group->done_cond);
+}
+
+void task_group_add(struct grim_task_group *group, grim_task_func func,
+		void *data) {
+	struct grim_thread_pool *pool = group->pool;
+	pthread_mutex_lock(&pool->lock);
+	if (pool->n_tasks == pool->cap && pool->next > 0) {
+		// Reuse the room of the tasks picked up already
+		memmove(pool->tasks, &pool->tasks[pool->next],
+			(pool->n_tasks - pool->next) * sizeof(*pool->tasks));
+		pool->n_tasks -= pool->next;
+		pool->next = 0;
+	}
+	if (pool->n_tasks == pool->cap) {
+		size_t cap = pool->cap ? pool->cap * 2 : 16;
+		struct grim_task *tasks = realloc(pool->tasks, cap * sizeof(*tasks));
+		if (tasks == NULL) {
+			// Can't queue it, run it right away
+			pthread_mutex_unlock(&pool->lock);
+			func(data);
+			return;
+		}
+		pool->tasks = tasks;
+		pool->cap = cap;
+	}
+	pool->tasks[pool->n_tasks++] = (struct grim_task){ func, data, group };
+	++group->n_pending;
+	pthread_cond_signal(&pool->task_cond);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void task_group_wait(struct grim_task_group *group) {
+	struct grim_thread_pool *pool = group->pool;
+	pthread_mutex_lock(&pool->lock);
+	while (group->n_pending > 0) {
+		// Only help with the group's own tasks, so that waiting doesn't
+		// depend on other batches sharing the pool
+		size_t i = pool->next;
+		while (i < pool->n_tasks && (pool->tasks[i].func == NULL ||
+				pool->tasks[i].group != group)) {
+			++i;
+		}
+		if (i < pool->n_tasks) {
+			run_task(pool, i);
+		} else {
+			pthread_cond_wait(&group->done_cond, &pool->lock);
+		}
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
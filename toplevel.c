@@ -0,0 +1,148 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "toplevel.h"
+
+#include "wlr-foreign-toplevel-management-unstable-v1-protocol.h"
+
+static void destroy_toplevel(struct grim_toplevel *toplevel) {
+	// Windows already being captured are told by their frame
+	struct grim_output *output;
+	wl_list_for_each(output, &toplevel->state->outputs, link) {
+		if (output->toplevel == toplevel) {
+			output->toplevel = NULL;
+		}
+	}
+
+	wl_list_remove(&toplevel->link);
+	zwlr_foreign_toplevel_handle_v1_destroy(toplevel->handle);
+	free(toplevel->title);
+	free(toplevel->app_id);
+	free(toplevel);
+}
+
+static void toplevel_handle_title(void *data,
+		struct zwlr_foreign_toplevel_handle_v1 *handle, const char *title) {
+	struct grim_toplevel *toplevel = data;
+	free(toplevel->title);
+	toplevel->title = strdup(title);
+}
+
+static void toplevel_handle_app_id(void *data,
+		struct zwlr_foreign_toplevel_handle_v1 *handle, const char *app_id) {
+	struct grim_toplevel *toplevel = data;
+	free(toplevel->app_id);
+	toplevel->app_id = strdup(app_id);
+}
+
+static void toplevel_handle_output_enter(void *data,
+		struct zwlr_foreign_toplevel_handle_v1 *handle,
+		struct wl_output *output) {
+	// No-op
+}
+
+static void toplevel_handle_output_leave(void *data,
+		struct zwlr_foreign_toplevel_handle_v1 *handle,
+		struct wl_output *output) {
+	// No-op
+}
+
+static void toplevel_handle_state(void *data,
+		struct zwlr_foreign_toplevel_handle_v1 *handle,
+		struct wl_array *state) {
+	struct grim_toplevel *toplevel = data;
+	toplevel->activated = false;
+	uint32_t *entry;
+	wl_array_for_each(entry, state) {
+		if (*entry == ZWLR_FOREIGN_TOPLEVEL_HANDLE_V1_STATE_ACTIVATED) {
+			toplevel->activated = true;
+		}
+	}
+}
+
+static void toplevel_handle_done(void *data,
+		struct zwlr_foreign_toplevel_handle_v1 *handle) {
+	// No-op
+}
+
+static void toplevel_handle_closed(void *data,
+		struct zwlr_foreign_toplevel_handle_v1 *handle) {
+	destroy_toplevel(data);
+}
+
+static void toplevel_handle_parent(void *data,
+		struct zwlr_foreign_toplevel_handle_v1 *handle,
+		struct zwlr_foreign_toplevel_handle_v1 *parent) {
+	// No-op
+}
+
+static const struct zwlr_foreign_toplevel_handle_v1_listener toplevel_listener = {
+	.title = toplevel_handle_title,
+	.app_id = toplevel_handle_app_id,
+	.output_enter = toplevel_handle_output_enter,
+	.output_leave = toplevel_handle_output_leave,
+	.state = toplevel_handle_state,
+	.done = toplevel_handle_done,
+	.closed = toplevel_handle_closed,
+	.parent = toplevel_handle_parent,
+};
+
+static void toplevel_manager_handle_toplevel(void *data,
+		struct zwlr_foreign_toplevel_manager_v1 *manager,
+		struct zwlr_foreign_toplevel_handle_v1 *handle) {
+	struct grim_state *state = data;
+	struct grim_toplevel *toplevel = calloc(1, sizeof(*toplevel));
+	if (toplevel == NULL) {
+		zwlr_foreign_toplevel_handle_v1_destroy(handle);
+		return;
+	}
+	toplevel->state = state;
+	toplevel->handle = handle;
+	zwlr_foreign_toplevel_handle_v1_add_listener(handle, &toplevel_listener,
+		toplevel);
+	// Keep the compositor's order
+	wl_list_insert(state->toplevels.prev, &toplevel->link);
+}
+
+static void toplevel_manager_handle_finished(void *data,
+		struct zwlr_foreign_toplevel_manager_v1 *manager) {
+	struct grim_state *state = data;
+	zwlr_foreign_toplevel_manager_v1_destroy(manager);
+	state->toplevel_manager = NULL;
+}
+
+static const struct zwlr_foreign_toplevel_manager_v1_listener toplevel_manager_listener = {
+	.toplevel = toplevel_manager_handle_toplevel,
+	.finished = toplevel_manager_handle_finished,
+};
+
+bool init_toplevels(struct grim_state *state) {
+	if (state->toplevel_manager != NULL) {
+		return true;
+	}
+	if (state->toplevel_manager_name == 0) {
+		return false;
+	}
+
+	uint32_t version = state->toplevel_manager_version;
+	state->toplevel_manager = wl_registry_bind(state->registry,
+		state->toplevel_manager_name, &zwlr_foreign_toplevel_manager_v1_interface,
+		version > 3 ? 3 : version);
+	zwlr_foreign_toplevel_manager_v1_add_listener(state->toplevel_manager,
+		&toplevel_manager_listener, state);
+	// Toplevels are announced right away, along with their details
+	return wl_display_roundtrip(state->display) >= 0;
+}
+
+void finish_toplevels(struct grim_state *state) {
+	struct grim_toplevel *toplevel;
+	struct grim_toplevel *toplevel_tmp;
+	wl_list_for_each_safe(toplevel, toplevel_tmp, &state->toplevels, link) {
+		destroy_toplevel(toplevel);
+	}
+	if (state->toplevel_manager != NULL) {
+		zwlr_foreign_toplevel_manager_v1_stop(state->toplevel_manager);
+		zwlr_foreign_toplevel_manager_v1_destroy(state->toplevel_manager);
+		state->toplevel_manager = NULL;
+	}
+}
@@ -0,0 +1,310 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#include "buffer.h"
+#include "json.h"
+#include "render.h"
+#include "trace.h"
+
+struct trace_frame {
+	struct grim_output *output;
+	double times[GRIM_TRACE_N_FRAME_EVENTS];
+};
+
+struct grim_trace {
+	struct timespec start;
+	// Times in ms since start, or -1 if it didn't happen
+	double phase_start[GRIM_TRACE_N_PHASES];
+	double phase_end[GRIM_TRACE_N_PHASES];
+
+	struct trace_frame *frames;
+	size_t n_frames, frames_cap;
+
+	int32_t image_width, image_height;
+	bool image_opaque;
+	size_t image_bytes;
+	struct grim_box geometry;
+	double scale;
+
+	const char *filetype;
+	long long bytes_written;
+};
+
+static const char *phase_names[GRIM_TRACE_N_PHASES] = {
+	[GRIM_TRACE_CONNECT] = "connect",
+	[GRIM_TRACE_REGISTRY] = "registry",
+	[GRIM_TRACE_XDG_OUTPUT] = "xdg_output",
+	[GRIM_TRACE_CAPTURE] = "capture",
+	[GRIM_TRACE_RENDER] = "render",
+	[GRIM_TRACE_ENCODE] = "encode",
+	[GRIM_TRACE_CLOSE] = "close",
+};
+
+static const char *frame_event_names[GRIM_TRACE_N_FRAME_EVENTS] = {
+	[GRIM_TRACE_FRAME_REQUEST] = "request_ms",
+	[GRIM_TRACE_FRAME_BUFFER] = "buffer_ms",
+	[GRIM_TRACE_FRAME_COPY] = "copy_ms",
+	[GRIM_TRACE_FRAME_READY] = "ready_ms",
+};
+
+static double get_trace_time(struct grim_trace *trace) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - trace->start.tv_sec) * 1000.0 +
+		(now.tv_nsec - trace->start.tv_nsec) / 1000000.0;
+}
+
+struct grim_trace *create_trace(void) {
+	struct grim_trace *trace = calloc(1, sizeof(*trace));
+	if (trace == NULL) {
+		return NULL;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &trace->start);
+	for (int i = 0; i < GRIM_TRACE_N_PHASES; i++) {
+		trace->phase_start[i] = -1;
+		trace->phase_end[i] = -1;
+	}
+	trace->bytes_written = -1;
+	return trace;
+}
+
+void destroy_trace(struct grim_trace *trace) {
+	if (trace == NULL) {
+		return;
+	}
+	free(trace->frames);
+	free(trace);
+}
+
+void trace_phase_start(struct grim_trace *trace, enum grim_trace_phase phase) {
+	if (trace != NULL) {
+		trace->phase_start[phase] = get_trace_time(trace);
+	}
+}
+
+void trace_phase_end(struct grim_trace *trace, enum grim_trace_phase phase) {
+	if (trace != NULL) {
+		trace->phase_end[phase] = get_trace_time(trace);
+	}
+}
+
+static struct trace_frame *get_trace_frame(struct grim_trace *trace,
+		struct grim_output *output, bool create) {
+	for (size_t i = 0; i < trace->n_frames; i++) {
+		if (trace->frames[i].output == output) {
+			return &trace->frames[i];
+		}
+	}
+	if (!create) {
+		return NULL;
+	}
+
+	if (trace->n_frames == trace->frames_cap) {
+		size_t cap = trace->frames_cap > 0 ? 2 * trace->frames_cap : 4;
+		struct trace_frame *frames =
+			realloc(trace->frames, cap * sizeof(*frames));
+		if (frames == NULL) {
+			return NULL;
+		}
+		trace->frames = frames;
+		trace->frames_cap = cap;
+	}
+	struct trace_frame *frame = &trace->frames[trace->n_frames++];
+	frame->output = output;
+	for (int i = 0; i < GRIM_TRACE_N_FRAME_EVENTS; i++) {
+		frame->times[i] = -1;
+	}
+	return frame;
+}
+
+void trace_frame_event(struct grim_trace *trace, struct grim_output *output,
+		enum grim_trace_frame_event event) {
+	if (trace == NULL) {
+		return;
+	}
+	struct trace_frame *frame = get_trace_frame(trace, output,
+		event == GRIM_TRACE_FRAME_REQUEST);
+	if (frame != NULL) {
+		frame->times[event] = get_trace_time(trace);
+	}
+}
+
+void trace_image(struct grim_trace *trace, pixman_image_t *image,
+		size_t bytes_allocated, struct grim_box *geometry, double scale) {
+	if (trace == NULL) {
+		return;
+	}
+	trace->image_width = pixman_image_get_width(image);
+	trace->image_height = pixman_image_get_height(image);
+	trace->image_opaque = pixman_image_get_format(image) == PIXMAN_x8r8g8b8;
+	trace->image_bytes = bytes_allocated;
+	trace->geometry = *geometry;
+	trace->scale = scale;
+}
+
+void trace_encoded(struct grim_trace *trace, const char *filetype,
+		long long bytes_written) {
+	if (trace == NULL) {
+		return;
+	}
+	trace->filetype = filetype;
+	trace->bytes_written = bytes_written;
+}
+
+static void write_json_time(FILE *stream, const char *key, double ms) {
+	if (ms < 0) {
+		fprintf(stream, "\"%s\": null", key);
+	} else {
+		fprintf(stream, "\"%s\": %.3f", key, ms);
+	}
+}
+
+static const char *get_filter_name(pixman_filter_t filter) {
+	switch (filter) {
+	case PIXMAN_FILTER_BILINEAR:
+		return "bilinear";
+	case PIXMAN_FILTER_SEPARABLE_CONVOLUTION:
+		return "separable_convolution";
+	default:
+		return "other";
+	}
+}
+
+static const char *get_op_name(pixman_op_t op) {
+	switch (op) {
+	case PIXMAN_OP_SRC:
+		return "src";
+	case PIXMAN_OP_OVER:
+		return "over";
+	default:
+		return "other";
+	}
+}
+
+static void write_trace_output(struct grim_trace *trace,
+		struct grim_state *state, struct trace_frame *frame, FILE *stream) {
+	struct grim_output *output = frame->output;
+	fprintf(stream, "    {\"name\": ");
+	write_json_string(stream, output->name);
+	for (int i = 0; i < GRIM_TRACE_N_FRAME_EVENTS; i++) {
+		fprintf(stream, ", ");
+		write_json_time(stream, frame_event_names[i], frame->times[i]);
+	}
+	double copy = frame->times[GRIM_TRACE_FRAME_COPY];
+	double ready = frame->times[GRIM_TRACE_FRAME_READY];
+	fprintf(stream, ", ");
+	write_json_time(stream, "copy_to_ready_ms",
+		copy >= 0 && ready >= 0 ? ready - copy : -1);
+
+	struct grim_buffer *buffer = output->buffer;
+	if (buffer != NULL) {
+		fprintf(stream, ", \"width\": %d, \"height\": %d, "
+			"\"shm_bytes\": %zu, \"dmabuf\": %s", buffer->width,
+			buffer->height, buffer->size, buffer->dmabuf ? "true" : "false");
+	}
+	// Images wrapping a capture buffer aren't resampled at all
+	if (buffer != NULL && trace->image_bytes > 0) {
+		pixman_filter_t filter;
+		pixman_op_t op;
+		bool resampled;
+		get_render_output_method(state, output, &trace->geometry,
+			trace->scale, &filter, &op, &resampled);
+		fprintf(stream, ", \"filter\": \"%s\", \"op\": \"%s\"",
+			resampled ? get_resample_filter_name(state->resample_filter) :
+			get_filter_name(filter), get_op_name(op));
+	}
+	fprintf(stream, "}");
+}
+
+void write_trace(struct grim_trace *trace, struct grim_state *state,
+		FILE *stream) {
+	if (trace == NULL) {
+		return;
+	}
+	double now = get_trace_time(trace);
+
+	fprintf(stream, "{\n  \"phases\": {");
+	bool first = true;
+	for (int i = 0; i < GRIM_TRACE_N_PHASES; i++) {
+		double start = trace->phase_start[i];
+		double end = trace->phase_end[i];
+		if (start < 0 || end < 0) {
+			continue;
+		}
+		fprintf(stream, "%s\n    \"%s\": {", first ? "" : ",",
+			phase_names[i]);
+		write_json_time(stream, "start_ms", start);
+		fprintf(stream, ", ");
+		write_json_time(stream, "end_ms", end);
+		fprintf(stream, ", ");
+		write_json_time(stream, "ms", end - start);
+		fprintf(stream, "}");
+		first = false;
+	}
+	fprintf(stream, "\n  },\n  \"outputs\": [");
+
+	first = true;
+	struct grim_output *output;
+	wl_list_for_each(output, &state->outputs, link) {
+		struct trace_frame *frame = get_trace_frame(trace, output, false);
+		if (frame == NULL) {
+			continue;
+		}
+		fprintf(stream, "%s\n", first ? "" : ",");
+		write_trace_output(trace, state, frame, stream);
+		first = false;
+	}
+	fprintf(stream, "\n  ],\n");
+
+	struct grim_buffer_pool *pool = state->buffer_pool;
+	fprintf(stream, "  \"memory\": {\"shm_bytes\": %zu, "
+		"\"image_bytes\": %zu", pool != NULL ? pool->size : 0,
+		trace->image_bytes);
+	// Counted over the life of the pool, which spans requests in a daemon
+	if (pool != NULL) {
+		fprintf(stream, ", \"buffer_hits\": %zu, \"buffer_misses\": %zu",
+			pool->hits, pool->misses);
+	}
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) == 0) {
+		fprintf(stream, ", \"max_rss_kb\": %ld, \"user_ms\": %.3f, "
+			"\"system_ms\": %.3f", usage.ru_maxrss,
+			usage.ru_utime.tv_sec * 1000.0 + usage.ru_utime.tv_usec / 1000.0,
+			usage.ru_stime.tv_sec * 1000.0 + usage.ru_stime.tv_usec / 1000.0);
+	}
+	fprintf(stream, "},\n");
+
+	fprintf(stream, "  \"image\": {\"width\": %d, \"height\": %d, "
+		"\"opaque\": %s, \"scale\": %g},\n", trace->image_width,
+		trace->image_height, trace->image_opaque ? "true" : "false",
+		trace->scale);
+
+	double encode_ms = -1;
+	if (trace->phase_start[GRIM_TRACE_ENCODE] >= 0 &&
+			trace->phase_end[GRIM_TRACE_ENCODE] >= 0) {
+		encode_ms = trace->phase_end[GRIM_TRACE_ENCODE] -
+			trace->phase_start[GRIM_TRACE_ENCODE];
+	}
+	fprintf(stream, "  \"encoder\": {\"filetype\": ");
+	write_json_string(stream, trace->filetype);
+	fprintf(stream, ", ");
+	write_json_time(stream, "ms", encode_ms);
+	if (trace->bytes_written >= 0) {
+		fprintf(stream, ", \"bytes_written\": %lld", trace->bytes_written);
+	} else {
+		fprintf(stream, ", \"bytes_written\": null");
+	}
+	if (encode_ms > 0) {
+		double pixels = (double)trace->image_width * trace->image_height;
+		fprintf(stream, ", \"megapixels_per_s\": %.3f",
+			pixels / 1000.0 / encode_ms);
+	}
+	fprintf(stream, "},\n");
+
+	fprintf(stream, "  ");
+	write_json_time(stream, "total_ms", now);
+	fprintf(stream, "\n}\n");
+}
@@ -3,61 +3,359 @@
  * @license This code is free software. Do whatever you like to do with it.
  */
 
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <assert.h>
+#include <stdbool.h>
 #include <fcntl.h>
 #include <limits.h>
 #include <unistd.h>
 #include <jpeglib.h>
 
+#include "thread.h"
 #include "write_jpg.h"
 
-int write_to_jpeg_stream(pixman_image_t *image, FILE *stream, int quality) {
-	pixman_format_code_t format = pixman_image_get_format(image);
-	assert(format == PIXMAN_a8r8g8b8 || format == PIXMAN_x8r8g8b8);
+// Compressed data is written out in chunks of this size
+#define JPEG_BUFFER_SIZE (256 * 1024)
+// With several threads, the image is compressed in strips of about this many
+// pixels, each on its own thread
+#define JPEG_STRIP_PIXELS (512 * 1024)
+// Strips compressed before being written out, per thread
+#define JPEG_STRIPS_PER_THREAD 2
+
+struct stream_dest {
+	struct jpeg_destination_mgr pub;
+	FILE *stream;
+	JOCTET *buffer;
+	bool failed;
+};
+
+static void flush_stream_dest(struct stream_dest *dest, size_t len) {
+	if (dest->failed) {
+		return;
+	}
+	size_t written = fwrite(dest->buffer, 1, len, dest->stream);
+	if (written < len) {
+		fprintf(stderr, "Failed to write jpg; only %zu of %zu bytes written\n",
+			written, len);
+		dest->failed = true;
+	}
+}
+
+static void init_stream_dest(j_compress_ptr cinfo) {
+	struct stream_dest *dest = (struct stream_dest *)cinfo->dest;
+	dest->pub.next_output_byte = dest->buffer;
+	dest->pub.free_in_buffer = JPEG_BUFFER_SIZE;
+}
+
+static boolean empty_stream_dest(j_compress_ptr cinfo) {
+	// Once writing failed, keep throwing data away until the end
+	struct stream_dest *dest = (struct stream_dest *)cinfo->dest;
+	flush_stream_dest(dest, JPEG_BUFFER_SIZE);
+	dest->pub.next_output_byte = dest->buffer;
+	dest->pub.free_in_buffer = JPEG_BUFFER_SIZE;
+	return TRUE;
+}
+
+static void term_stream_dest(j_compress_ptr cinfo) {
+	struct stream_dest *dest = (struct stream_dest *)cinfo->dest;
+	flush_stream_dest(dest, JPEG_BUFFER_SIZE - dest->pub.free_in_buffer);
+}
+
+struct jpeg_params {
+	const unsigned char *data;
+	int width, height, stride;
+	pixman_format_code_t format;
+	int quality;
+	enum grim_jpeg_dct dct;
+	enum grim_jpeg_subsampling subsampling;
+};
+
+static void set_jpeg_params(struct jpeg_compress_struct *cinfo,
+		const struct jpeg_params *params, int height) {
+	cinfo->image_width = params->width;
+	cinfo->image_height = height;
+	if (params->format == PIXMAN_a8r8g8b8) {
+		cinfo->in_color_space = JCS_EXT_BGRA;
+	} else {
+		cinfo->in_color_space = JCS_EXT_BGRX;
+	}
+	cinfo->input_components = 4;
+
+	jpeg_set_defaults(cinfo);
+	jpeg_set_quality(cinfo, params->quality, TRUE);
+
+	switch (params->dct) {
+	case GRIM_JPEG_DCT_ISLOW:
+		cinfo->dct_method = JDCT_ISLOW;
+		break;
+	case GRIM_JPEG_DCT_IFAST:
+		cinfo->dct_method = JDCT_IFAST;
+		break;
+	case GRIM_JPEG_DCT_FLOAT:
+		cinfo->dct_method = JDCT_FLOAT;
+		break;
+	}
+
+	// Luma sampling factors, chroma is always sampled once per MCU
+	int h_samp = 2, v_samp = 2;
+	switch (params->subsampling) {
+	case GRIM_JPEG_SUBSAMPLING_420:
+		break;
+	case GRIM_JPEG_SUBSAMPLING_422:
+		v_samp = 1;
+		break;
+	case GRIM_JPEG_SUBSAMPLING_444:
+		h_samp = v_samp = 1;
+		break;
+	}
+	cinfo->comp_info[0].h_samp_factor = h_samp;
+	cinfo->comp_info[0].v_samp_factor = v_samp;
+	for (int i = 1; i < cinfo->num_components; i++) {
+		cinfo->comp_info[i].h_samp_factor = 1;
+		cinfo->comp_info[i].v_samp_factor = 1;
+	}
+}
+
+static int write_jpeg_serial(const struct jpeg_params *params, FILE *stream,
+		struct grim_render_job *job) {
+	struct stream_dest dest = {
+		.pub = {
+			.init_destination = init_stream_dest,
+			.empty_output_buffer = empty_stream_dest,
+			.term_destination = term_stream_dest,
+		},
+		.stream = stream,
+		.buffer = malloc(JPEG_BUFFER_SIZE),
+	};
+	if (dest.buffer == NULL) {
+		fprintf(stderr, "failed to allocate jpeg buffer\n");
+		return -1;
+	}
 
 	struct jpeg_compress_struct cinfo;
 	struct jpeg_error_mgr jerr;
-	JSAMPROW row_pointer[1];
 	cinfo.err = jpeg_std_error(&jerr);
 	jpeg_create_compress(&cinfo);
+	cinfo.dest = &dest.pub;
+	set_jpeg_params(&cinfo, params, params->height);
 
-	unsigned char *data = NULL;
-	unsigned long len = 0;
-	jpeg_mem_dest(&cinfo, &data, &len);
-	cinfo.image_width = pixman_image_get_width(image);
-	cinfo.image_height = pixman_image_get_height(image);
-	if (format == PIXMAN_a8r8g8b8) {
-		cinfo.in_color_space = JCS_EXT_BGRA;
-	} else {
-		cinfo.in_color_space = JCS_EXT_BGRX;
+	jpeg_start_compress(&cinfo, TRUE);
+
+	bool rendered = true;
+	while (cinfo.next_scanline < cinfo.image_height) {
+		// Rows may still be rendered, see render.h
+		if (!wait_render_job_rows(job, cinfo.next_scanline + 1)) {
+			rendered = false;
+			break;
+		}
+		JSAMPROW row = (JSAMPROW)(params->data +
+			(size_t)cinfo.next_scanline * params->stride);
+		(void) jpeg_write_scanlines(&cinfo, &row, 1);
+	}
+
+	if (rendered) {
+		jpeg_finish_compress(&cinfo);
 	}
-	cinfo.input_components = 4;
+	jpeg_destroy_compress(&cinfo);
+	free(dest.buffer);
+	return rendered && !dest.failed ? 0 : -1;
+}
 
-	jpeg_set_defaults(&cinfo);
-	jpeg_set_quality(&cinfo, quality, TRUE);
+struct jpeg_strip {
+	const struct jpeg_params *params;
+	int y1, y2;
+	unsigned int restart_interval;
 
-	jpeg_start_compress(&cinfo, TRUE);
+	unsigned char *out;
+	unsigned long out_len;
+};
 
+static void compress_strip(void *data) {
+	struct jpeg_strip *strip = data;
+	const struct jpeg_params *params = strip->params;
+
+	struct jpeg_compress_struct cinfo;
+	struct jpeg_error_mgr jerr;
+	cinfo.err = jpeg_std_error(&jerr);
+	jpeg_create_compress(&cinfo);
+	jpeg_mem_dest(&cinfo, &strip->out, &strip->out_len);
+	set_jpeg_params(&cinfo, params, strip->y2 - strip->y1);
+	// The strip is a single restart interval
+	cinfo.restart_interval = strip->restart_interval;
+
+	jpeg_start_compress(&cinfo, TRUE);
 	while (cinfo.next_scanline < cinfo.image_height) {
-		row_pointer[0] = (unsigned char *)pixman_image_get_data(image)
-			+ (cinfo.next_scanline * pixman_image_get_stride(image));
-		(void) jpeg_write_scanlines(&cinfo, row_pointer, 1);
+		JSAMPROW row = (JSAMPROW)(params->data +
+			(size_t)(strip->y1 + cinfo.next_scanline) * params->stride);
+		(void) jpeg_write_scanlines(&cinfo, &row, 1);
 	}
-
 	jpeg_finish_compress(&cinfo);
 	jpeg_destroy_compress(&cinfo);
+}
+
+/**
+ * Find where the entropy-coded data of a JPEG file made by libjpeg starts,
+ * and the offset of its frame height. Returns false if that can't be found.
+ */
+static bool parse_jpeg_headers(const unsigned char *data, size_t len,
+		size_t *scan_offset, size_t *height_offset) {
+	*height_offset = 0;
+	size_t pos = 2; // after SOI
+	while (pos + 4 <= len && data[pos] == 0xff) {
+		uint8_t marker = data[pos + 1];
+		size_t segment_len = (data[pos + 2] << 8) | data[pos + 3];
+		if (marker >= 0xc0 && marker <= 0xc2) {
+			// SOFn: length, precision, height
+			*height_offset = pos + 5;
+		}
+		pos += 2 + segment_len;
+		if (marker == 0xda) {
+			// SOS
+			*scan_offset = pos;
+			return *height_offset != 0 && pos + 2 <= len;
+		}
+	}
+	return false;
+}
 
+static bool write_strip_data(FILE *stream, const void *data, size_t len) {
 	size_t written = fwrite(data, 1, len, stream);
 	if (written < len) {
-		free(data);
-		fprintf(stderr, "Failed to write jpg; only %zu of %lu bytes written\n",
+		fprintf(stderr, "Failed to write jpg; only %zu of %zu bytes written\n",
 			written, len);
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Write a strip compressed on its own. The first strip provides the headers,
+ * with the height of the whole image. The strips are restart intervals of
+ * the image, so the entropy-coded data of the others follows, after a
+ * restart marker.
+ */
+static bool write_strip(FILE *stream, struct jpeg_strip *strip, int index,
+		bool last) {
+	size_t scan_offset, height_offset;
+	if (!parse_jpeg_headers(strip->out, strip->out_len, &scan_offset,
+			&height_offset)) {
+		fprintf(stderr, "failed to parse jpeg strip\n");
+		return false;
+	}
+	// Leave the EOI marker out
+	size_t scan_len = strip->out_len - 2 - scan_offset;
+
+	if (index == 0) {
+		int height = strip->params->height;
+		strip->out[height_offset] = height >> 8;
+		strip->out[height_offset + 1] = height & 0xff;
+		if (!write_strip_data(stream, strip->out, scan_offset)) {
+			return false;
+		}
+	} else {
+		unsigned char rst[2] = { 0xff, JPEG_RST0 + (index - 1) % 8 };
+		if (!write_strip_data(stream, rst, sizeof(rst))) {
+			return false;
+		}
+	}
+	if (!write_strip_data(stream, strip->out + scan_offset, scan_len)) {
+		return false;
+	}
+	if (last) {
+		unsigned char eoi[2] = { 0xff, JPEG_EOI };
+		return write_strip_data(stream, eoi, sizeof(eoi));
+	}
+	return true;
+}
+
+static int write_jpeg_strips(struct jpeg_strip *strips, int n_strips,
+		FILE *stream,
+		struct grim_thread_pool *pool, struct grim_render_job *job) {
+	// Bound the memory used by compressed strips waiting to be written
+	int batch_size = get_thread_pool_size(pool) * JPEG_STRIPS_PER_THREAD;
+	bool ok = true;
+	struct grim_task_group group;
+	init_task_group(&group, pool);
+	for (int start = 0; ok && start < n_strips; start += batch_size) {
+		int end = start + batch_size;
+		if (end > n_strips) {
+			end = n_strips;
+		}
+
+		int n_queued = start;
+		for (; n_queued < end; n_queued++) {
+			if (!wait_render_job_rows(job, strips[n_queued].y2)) {
+				ok = false;
+				break;
+			}
+			task_group_add(&group, compress_strip, &strips[n_queued]);
+		}
+		task_group_wait(&group);
+
+		for (int i = start; i < n_queued; i++) {
+			ok = ok && write_strip(stream, &strips[i], i, i == n_strips - 1);
+			free(strips[i].out);
+			strips[i].out = NULL;
+		}
+	}
+	finish_task_group(&group);
+	return ok ? 0 : -1;
+}
+
+int write_to_jpeg_stream(pixman_image_t *image, FILE *stream, int quality,
+		enum grim_jpeg_dct dct, enum grim_jpeg_subsampling subsampling,
+		struct grim_thread_pool *pool, struct grim_render_job *job) {
+	pixman_format_code_t format = pixman_image_get_format(image);
+	assert(format == PIXMAN_a8r8g8b8 || format == PIXMAN_x8r8g8b8);
+
+	struct jpeg_params params = {
+		.data = (const unsigned char *)pixman_image_get_data(image),
+		.width = pixman_image_get_width(image),
+		.height = pixman_image_get_height(image),
+		.stride = pixman_image_get_stride(image),
+		.format = format,
+		.quality = quality,
+		.dct = dct,
+		.subsampling = subsampling,
+	};
+
+	// Strips are made of whole MCU rows, and each of them must be a single
+	// restart interval, whose length in MCUs is limited to 16 bits
+	int mcu_width = subsampling == GRIM_JPEG_SUBSAMPLING_444 ? 8 : 16;
+	int mcu_height = subsampling == GRIM_JPEG_SUBSAMPLING_420 ? 16 : 8;
+	int mcus_per_row = (params.width + mcu_width - 1) / mcu_width;
+	int strip_mcu_rows = JPEG_STRIP_PIXELS / ((size_t)params.width * mcu_height);
+	if (strip_mcu_rows > 65535 / mcus_per_row) {
+		strip_mcu_rows = 65535 / mcus_per_row;
+	}
+	if (strip_mcu_rows < 1) {
+		strip_mcu_rows = 1;
+	}
+	int strip_height = strip_mcu_rows * mcu_height;
+	int n_strips = (params.height + strip_height - 1) / strip_height;
+	if (get_thread_pool_size(pool) == 1 || n_strips < 2) {
+		return write_jpeg_serial(&params, stream, job);
+	}
+
+	struct jpeg_strip *strips = calloc(n_strips, sizeof(*strips));
+	if (strips == NULL) {
+		fprintf(stderr, "failed to allocate jpeg strips\n");
 		return -1;
 	}
-	free(data);
-	return 0;
+	for (int i = 0; i < n_strips; i++) {
+		strips[i] = (struct jpeg_strip){
+			.params = &params,
+			.y1 = i * strip_height,
+			.y2 = i == n_strips - 1 ? params.height : (i + 1) * strip_height,
+			.restart_interval = strip_mcu_rows * mcus_per_row,
+		};
+	}
+	int ret = write_jpeg_strips(strips, n_strips, stream, pool, job);
+	free(strips);
+	return ret;
 }
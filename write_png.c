@@ -3,40 +3,417 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
 
+#include "pack.h"
+#include "thread.h"
 #include "write_png.h"
 
-static void pack_row32(uint8_t *restrict row_out, const uint32_t *restrict row_in,
-		size_t width, bool fully_opaque) {
-	for (size_t x = 0; x < width; x++) {
-		uint8_t b = (row_in[x] >>  0) & 0xff;
-		uint8_t g = (row_in[x] >>  8) & 0xff;
-		uint8_t r = (row_in[x] >> 16) & 0xff;
-		uint8_t a = (row_in[x] >> 24) & 0xff;
-
-		// Unpremultiply pixels, if necessary. In practice, few images
-		// made by grim will have many pixels with fractional alpha
-		if (!fully_opaque && (a != 0 && a != 255)) {
-			uint32_t inv = (0xff << 16) / a;
-			uint32_t sr = r * inv;
-			r = sr > (0xff << 16) ? 0xff : (sr >> 16);
-			uint32_t sg = g * inv;
-			g = sg > (0xff << 16) ? 0xff : (sg >> 16);
-			uint32_t sb = b * inv;
-			b = sb > (0xff << 16) ? 0xff : (sb >> 16);
-		}
-
-		*row_out++ = r;
-		*row_out++ = g;
-		*row_out++ = b;
-		if (!fully_opaque) {
-			*row_out++ = a;
+// With several threads, rows are filtered and compressed in strips holding
+// about this many bytes, each on its own thread
+#define PNG_STRIP_SIZE (256 * 1024)
+// The deflate window, primed with the end of the previous strip
+#define DEFLATE_DICT_SIZE 32768
+
+enum row_filter {
+	ROW_FILTER_NONE,
+	ROW_FILTER_UP,
+	ROW_FILTER_ALL,
+};
+
+struct png_settings {
+	int zlib_level;
+	int strategy;
+	enum row_filter filter;
+};
+
+static struct png_settings get_png_settings(int comp_level) {
+	if (comp_level == GRIM_PNG_LEVEL_FAST) {
+		// Screenshots are mostly flat areas and repeated rows, which the
+		// Up filter and run-length matches catch for a fraction of the cost
+		// of the filter heuristic and of searching for longer matches
+		return (struct png_settings){ 1, Z_RLE, ROW_FILTER_UP };
+	}
+	// If the level is zero (no compression), filtering will be unnecessary.
+	// Otherwise, use the same strategy as libpng picks for filtered rows
+	if (comp_level == 0) {
+		return (struct png_settings){ 0, Z_DEFAULT_STRATEGY, ROW_FILTER_NONE };
+	}
+	return (struct png_settings){ comp_level, Z_FILTERED, ROW_FILTER_ALL };
+}
+
+static uint8_t paeth_predictor(uint8_t a, uint8_t b, uint8_t c) {
+	int p = a + b - c;
+	int pa = abs(p - a);
+	int pb = abs(p - b);
+	int pc = abs(p - c);
+	if (pa <= pb && pa <= pc) {
+		return a;
+	}
+	return pb <= pc ? b : c;
+}
+
+/**
+ * Filter a packed row. With ROW_FILTER_ALL, each filter is tried like libpng
+ * does with PNG_ALL_FILTERS, and the one with the smallest sum of absolute
+ * values wins. out receives the filter type followed by len filtered bytes,
+ * scratch must hold len bytes.
+ */
+static void filter_row(uint8_t *restrict out, uint8_t *restrict scratch,
+		const uint8_t *restrict row, const uint8_t *restrict prev,
+		size_t len, size_t bpp, enum row_filter filter) {
+	if (filter == ROW_FILTER_UP) {
+		out[0] = PNG_FILTER_VALUE_UP;
+		for (size_t i = 0; i < len; i++) {
+			out[i + 1] = row[i] - prev[i];
+		}
+		return;
+	}
+
+	out[0] = PNG_FILTER_VALUE_NONE;
+	memcpy(out + 1, row, len);
+	if (filter == ROW_FILTER_NONE) {
+		return;
+	}
+
+	uint64_t best_sum = 0;
+	for (size_t i = 0; i < len; i++) {
+		best_sum += abs((int8_t)row[i]);
+	}
+	for (uint8_t type = PNG_FILTER_VALUE_SUB; type <= PNG_FILTER_VALUE_PAETH;
+			type++) {
+		// The first pixel has no left neighbour
+		for (size_t i = 0; i < bpp; i++) {
+			uint8_t pred = 0;
+			if (type == PNG_FILTER_VALUE_UP || type == PNG_FILTER_VALUE_PAETH) {
+				pred = prev[i];
+			} else if (type == PNG_FILTER_VALUE_AVG) {
+				pred = prev[i] / 2;
+			}
+			scratch[i] = row[i] - pred;
+		}
+
+		uint64_t sum = 0;
+		switch (type) {
+		case PNG_FILTER_VALUE_SUB:
+			for (size_t i = bpp; i < len; i++) {
+				scratch[i] = row[i] - row[i - bpp];
+				sum += abs((int8_t)scratch[i]);
+			}
+			break;
+		case PNG_FILTER_VALUE_UP:
+			for (size_t i = bpp; i < len; i++) {
+				scratch[i] = row[i] - prev[i];
+				sum += abs((int8_t)scratch[i]);
+			}
+			break;
+		case PNG_FILTER_VALUE_AVG:
+			for (size_t i = bpp; i < len; i++) {
+				scratch[i] = row[i] - (row[i - bpp] + prev[i]) / 2;
+				sum += abs((int8_t)scratch[i]);
+			}
+			break;
+		default:
+			for (size_t i = bpp; i < len; i++) {
+				scratch[i] = row[i] -
+					paeth_predictor(row[i - bpp], prev[i], prev[i - bpp]);
+				sum += abs((int8_t)scratch[i]);
+			}
+			break;
+		}
+		for (size_t i = 0; i < bpp; i++) {
+			sum += abs((int8_t)scratch[i]);
+		}
+		if (sum < best_sum) {
+			best_sum = sum;
+			out[0] = type;
+			memcpy(out + 1, scratch, len);
+		}
+	}
+}
+
+struct png_strip {
+	const unsigned char *data;
+	int width, stride;
+	bool fully_opaque;
+	struct png_settings settings;
+	int y1, y2;
+	bool last;
+
+	// Raw deflate data ending on a byte boundary, and the Adler-32 of the
+	// filtered rows it holds
+	uint8_t *out;
+	size_t out_len, out_cap;
+	uLong adler;
+	bool failed;
+};
+
+static bool deflate_strip(struct png_strip *strip, z_stream *zs, int flush) {
+	while (true) {
+		if (strip->out_len == strip->out_cap) {
+			size_t cap = strip->out_cap * 2;
+			uint8_t *out = realloc(strip->out, cap);
+			if (out == NULL) {
+				return false;
+			}
+			strip->out = out;
+			strip->out_cap = cap;
+		}
+		zs->next_out = strip->out + strip->out_len;
+		zs->avail_out = strip->out_cap - strip->out_len;
+		int ret = deflate(zs, flush);
+		strip->out_len = strip->out_cap - zs->avail_out;
+		if (ret == Z_STREAM_ERROR) {
+			return false;
+		}
+
+		if (flush == Z_FINISH ? ret == Z_STREAM_END :
+				zs->avail_in == 0 && zs->avail_out != 0) {
+			return true;
+		}
+	}
+}
+
+static void compress_strip(void *data) {
+	struct png_strip *strip = data;
+	size_t bpp = strip->fully_opaque ? 3 : 4;
+	size_t len = (size_t)strip->width * bpp;
+	enum row_filter filter = strip->settings.filter;
+
+	// The stream continues from the previous strip, whose last rows are
+	// filtered again to be used as dictionary
+	int dict_rows = (DEFLATE_DICT_SIZE + len) / (len + 1);
+	int y0 = strip->y1 - dict_rows;
+	if (y0 < 0) {
+		y0 = 0;
+	}
+
+	uint8_t *prev = calloc(len, 1);
+	uint8_t *cur = malloc(len);
+	uint8_t *scratch = malloc(len);
+	uint8_t *dict = malloc((size_t)(strip->y1 - y0) * (len + 1) + 1);
+	uint8_t *filtered = malloc(len + 1);
+	z_stream zs = {0};
+	bool zs_ready = false;
+	if (prev == NULL || cur == NULL || scratch == NULL || dict == NULL ||
+			filtered == NULL) {
+		goto error;
+	}
+	if (deflateInit2(&zs, strip->settings.zlib_level, Z_DEFLATED, -MAX_WBITS,
+			8, strip->settings.strategy) != Z_OK) {
+		goto error;
+	}
+	zs_ready = true;
+
+	size_t in_len = (size_t)(strip->y2 - strip->y1) * (len + 1);
+	strip->out_cap = deflateBound(&zs, in_len) + 16;
+	strip->out = malloc(strip->out_cap);
+	if (strip->out == NULL) {
+		goto error;
+	}
+
+	if (y0 > 0) {
+		pack_row32(prev, (const uint32_t *)(strip->data +
+			(size_t)(y0 - 1) * strip->stride), strip->width,
+			strip->fully_opaque);
+	}
+	size_t dict_len = 0;
+	for (int y = y0; y < strip->y1; y++) {
+		pack_row32(cur, (const uint32_t *)(strip->data +
+			(size_t)y * strip->stride), strip->width, strip->fully_opaque);
+		filter_row(dict + dict_len, scratch, cur, prev, len, bpp, filter);
+		dict_len += len + 1;
+		uint8_t *tmp = prev;
+		prev = cur;
+		cur = tmp;
+	}
+	if (dict_len > DEFLATE_DICT_SIZE) {
+		memmove(dict, dict + dict_len - DEFLATE_DICT_SIZE, DEFLATE_DICT_SIZE);
+		dict_len = DEFLATE_DICT_SIZE;
+	}
+	if (dict_len > 0 && deflateSetDictionary(&zs, dict, dict_len) != Z_OK) {
+		goto error;
+	}
+
+	strip->adler = adler32(0, NULL, 0);
+	for (int y = strip->y1; y < strip->y2; y++) {
+		pack_row32(cur, (const uint32_t *)(strip->data +
+			(size_t)y * strip->stride), strip->width, strip->fully_opaque);
+		filter_row(filtered, scratch, cur, prev, len, bpp, filter);
+		strip->adler = adler32(strip->adler, filtered, len + 1);
+
+		// Strips other than the last end with an empty stored block, so
+		// that the next one starts on a byte boundary
+		int flush = Z_NO_FLUSH;
+		if (y == strip->y2 - 1) {
+			flush = strip->last ? Z_FINISH : Z_SYNC_FLUSH;
+		}
+		zs.next_in = filtered;
+		zs.avail_in = len + 1;
+		if (!deflate_strip(strip, &zs, flush)) {
+			goto error;
+		}
+
+		uint8_t *tmp = prev;
+		prev = cur;
+		cur = tmp;
+	}
+	goto cleanup;
+
+error:
+	strip->failed = true;
+cleanup:
+	if (zs_ready) {
+		deflateEnd(&zs);
+	}
+	free(prev);
+	free(cur);
+	free(scratch);
+	free(dict);
+	free(filtered);
+}
+
+/**
+ * Write the IDAT chunks of the image, compressed in parallel strips which are
+ * joined into a single zlib stream.
+ */
+static bool write_png_strips(png_struct *png, struct png_strip *strips,
+		int n_strips, struct grim_thread_pool *pool,
+		struct grim_render_job *job) {
+	bool ok = true;
+	struct grim_task_group group;
+	init_task_group(&group, pool);
+	int n_queued = 0;
+	for (; n_queued < n_strips; n_queued++) {
+		if (!wait_render_job_rows(job, strips[n_queued].y2)) {
+			ok = false;
+			break;
+		}
+		task_group_add(&group, compress_strip, &strips[n_queued]);
+	}
+	finish_task_group(&group);
+	for (int i = 0; ok && i < n_queued; i++) {
+		if (strips[i].failed) {
+			fprintf(stderr, "failed to compress png data\n");
+			ok = false;
 		}
 	}
+	if (!ok) {
+		return false;
+	}
+
+	// Same header as zlib would write, see deflate.c
+	int level = strips[0].settings.zlib_level;
+	uint8_t level_flags = level < 2 ? 0 : level < 6 ? 1 : level == 6 ? 2 : 3;
+	if (strips[0].settings.strategy >= Z_HUFFMAN_ONLY) {
+		level_flags = 0;
+	}
+	uint8_t header[2] = { 0x78, level_flags << 6 };
+	header[1] += 31 - ((header[0] << 8) + header[1]) % 31;
+
+	uLong adler = adler32(0, NULL, 0);
+	for (int i = 0; i < n_strips; i++) {
+		struct png_strip *strip = &strips[i];
+		size_t in_len = (size_t)(strip->y2 - strip->y1) *
+			((size_t)strip->width * (strip->fully_opaque ? 3 : 4) + 1);
+		adler = adler32_combine(adler, strip->adler, in_len);
+
+		size_t chunk_len = strip->out_len;
+		if (i == 0) {
+			chunk_len += sizeof(header);
+		}
+		if (strip->last) {
+			chunk_len += 4;
+		}
+		png_write_chunk_start(png, (png_const_bytep)"IDAT", chunk_len);
+		if (i == 0) {
+			png_write_chunk_data(png, header, sizeof(header));
+		}
+		png_write_chunk_data(png, strip->out, strip->out_len);
+		if (strip->last) {
+			uint8_t trailer[4] = {
+				adler >> 24, adler >> 16, adler >> 8, adler,
+			};
+			png_write_chunk_data(png, trailer, sizeof(trailer));
+		}
+		png_write_chunk_end(png);
+	}
+	png_write_chunk(png, (png_const_bytep)"IEND", NULL, 0);
+	return true;
+}
+
+struct png_writer {
+	FILE *stream;
+	const unsigned char *data;
+	int width, height, stride;
+	bool fully_opaque;
+	struct png_settings settings;
+	// Rows go through libpng when there are no strips
+	uint8_t *tmp_row;
+	struct png_strip *strips;
+	int n_strips;
+	struct grim_thread_pool *pool;
+	struct grim_render_job *job;
+};
+
+/**
+ * Write the whole file. Kept apart from write_to_png_stream() so that libpng
+ * can longjmp() back here without clobbering any of its variables.
+ */
+static int write_png(png_struct *png, png_info *info,
+		const struct png_writer *writer) {
+#ifdef PNG_SETJMP_SUPPORTED
+	if (setjmp(png_jmpbuf(png))) {
+		fprintf(stderr, "failed to write png\n");
+		return -1;
+	}
+#endif
+
+	png_init_io(png, writer->stream);
+
+	int color_type = writer->fully_opaque ?
+		PNG_COLOR_TYPE_RGB : PNG_COLOR_TYPE_RGBA;
+	png_set_IHDR(png, info, writer->width, writer->height, 8, color_type,
+		PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+	png_write_info(png, info);
+
+	if (writer->strips) {
+		return write_png_strips(png, writer->strips, writer->n_strips,
+			writer->pool, writer->job) ? 0 : -1;
+	}
+
+	png_set_compression_level(png, writer->settings.zlib_level);
+	png_set_compression_strategy(png, writer->settings.strategy);
+	switch (writer->settings.filter) {
+	case ROW_FILTER_NONE:
+		png_set_filter(png, 0, PNG_NO_FILTERS);
+		break;
+	case ROW_FILTER_UP:
+		png_set_filter(png, 0, PNG_FILTER_UP);
+		break;
+	case ROW_FILTER_ALL:
+		png_set_filter(png, 0, PNG_ALL_FILTERS);
+		break;
+	}
+
+	for (int y = 0; y < writer->height; y++) {
+		if (!wait_render_job_rows(writer->job, y + 1)) {
+			return -1;
+		}
+		const uint32_t *row =
+			(const uint32_t *)(writer->data + y * writer->stride);
+		pack_row32(writer->tmp_row, row, writer->width, writer->fully_opaque);
+		png_write_row(png, writer->tmp_row);
+	}
+
+	png_write_end(png, NULL);
+	return 0;
 }
 
 int write_to_png_stream(pixman_image_t *image, FILE *stream,
-		int comp_level) {
+		int comp_level, struct grim_thread_pool *pool,
+		struct grim_render_job *job) {
 	pixman_format_code_t format = pixman_image_get_format(image);
 	assert(format == PIXMAN_a8r8g8b8 || format == PIXMAN_x8r8g8b8);
 
@@ -45,24 +422,60 @@ int write_to_png_stream(pixman_image_t *image, FILE *stream,
 	int stride = pixman_image_get_stride(image);
 	const unsigned char *data = (unsigned char *)pixman_image_get_data(image);
 
+	// render() makes the image x8r8g8b8 when it knows it to be opaque.
+	// Otherwise, look for a translucent pixel, a whole row at a time.
 	bool fully_opaque = true;
 	if (format == PIXMAN_a8r8g8b8) {
-		for (int y = 0; y < height; y++) {
+		for (int y = 0; fully_opaque && y < height; y++) {
+			// Rows may still be rendered, see render.h
+			if (!wait_render_job_rows(job, y + 1)) {
+				return -1;
+			}
 			const uint32_t *row = (const uint32_t *)(data + y * stride);
+			uint32_t alpha = 0xff000000;
 			for (int x = 0; x < width; x++) {
-				if ((row[x] >> 24) != 0xff) {
-					fully_opaque = false;
-				}
+				alpha &= row[x];
 			}
+			fully_opaque = alpha == 0xff000000;
 		}
 	}
-	int color_type = fully_opaque ? PNG_COLOR_TYPE_RGB : PNG_COLOR_TYPE_RGBA;
-	int bit_depth = 8;
+	struct png_settings settings = get_png_settings(comp_level);
+	size_t row_len = (size_t)width * (fully_opaque ? 3 : 4) + 1;
+	int strip_height = PNG_STRIP_SIZE / row_len;
+	if (strip_height < 1) {
+		strip_height = 1;
+	}
+	int n_strips = (height + strip_height - 1) / strip_height;
+	if (get_thread_pool_size(pool) == 1) {
+		n_strips = 1;
+	}
 
-	uint8_t *tmp_row = calloc(width, 4);
-	if (!tmp_row) {
-		fprintf(stderr, "failed to allocate temp row\n");
-		return -1;
+	uint8_t *tmp_row = NULL;
+	struct png_strip *strips = NULL;
+	if (n_strips > 1) {
+		strips = calloc(n_strips, sizeof(*strips));
+		if (!strips) {
+			fprintf(stderr, "failed to allocate png strips\n");
+			return -1;
+		}
+		for (int i = 0; i < n_strips; i++) {
+			strips[i] = (struct png_strip){
+				.data = data,
+				.width = width,
+				.stride = stride,
+				.fully_opaque = fully_opaque,
+				.settings = settings,
+				.y1 = i * strip_height,
+				.y2 = i == n_strips - 1 ? height : (i + 1) * strip_height,
+				.last = i == n_strips - 1,
+			};
+		}
+	} else {
+		tmp_row = calloc(width, 4);
+		if (!tmp_row) {
+			fprintf(stderr, "failed to allocate temp row\n");
+			return -1;
+		}
 	}
 
 	int ret = 0;
@@ -81,35 +494,21 @@ int write_to_png_stream(pixman_image_t *image, FILE *stream,
 		goto cleanup;
 	}
 
-#ifdef PNG_SETJMP_SUPPORTED
-	if (setjmp(png_jmpbuf(png))) {
-		fprintf(stderr, "failed to write png\n");
-		ret = -1;
-		goto cleanup;
-	}
-#endif
-
-	png_init_io(png, stream);
-
-	png_set_IHDR(png, info, width, height, bit_depth, color_type,
-		PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
-	png_write_info(png, info);
-
-	// If the level is zero (no compression), filtering will be unnecessary
-	png_set_compression_level(png, comp_level);
-	if (comp_level == 0) {
-		png_set_filter(png, 0, PNG_NO_FILTERS);
-	} else {
-		png_set_filter(png, 0, PNG_ALL_FILTERS);
-	}
-
-	for (int y = 0; y < height; y++) {
-		const uint32_t *row = (const uint32_t *)(data + y * stride);
-		pack_row32(tmp_row, row, width, fully_opaque);
-		png_write_row(png, tmp_row);
-	}
-
-	png_write_end(png, NULL);
+	struct png_writer writer = {
+		.stream = stream,
+		.data = data,
+		.width = width,
+		.height = height,
+		.stride = stride,
+		.fully_opaque = fully_opaque,
+		.settings = settings,
+		.tmp_row = tmp_row,
+		.strips = strips,
+		.n_strips = n_strips,
+		.pool = pool,
+		.job = job,
+	};
+	ret = write_png(png, info, &writer);
 
 cleanup:
 	if (info) {
@@ -118,6 +517,12 @@ cleanup:
 	if (png) {
 		png_destroy_write_struct(&png, NULL);
 	}
+	if (strips) {
+		for (int i = 0; i < n_strips; i++) {
+			free(strips[i].out);
+		}
+		free(strips);
+	}
 	free(tmp_row);
 	return ret;
 }
@@ -1,6 +1,7 @@
 #include <assert.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -9,9 +10,24 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "pack.h"
 #include "write_ppm.h"
 
-int write_to_ppm_stream(pixman_image_t *image, FILE *stream) {
+// Rows are packed into a buffer of about this size before being written
+#define PPM_CHUNK_SIZE (256 * 1024)
+
+static bool write_chunk(FILE *stream, const unsigned char *data, size_t len) {
+	size_t written = fwrite(data, 1, len, stream);
+	if (written < len) {
+		fprintf(stderr, "Failed to write ppm; only %zu of %zu bytes written\n",
+			written, len);
+		return false;
+	}
+	return true;
+}
+
+int write_to_ppm_stream(pixman_image_t *image, FILE *stream,
+		struct grim_render_job *job) {
 	// 256 bytes ought to be enough for everyone
 	char header[256];
 
@@ -21,36 +37,50 @@ int write_to_ppm_stream(pixman_image_t *image, FILE *stream) {
 	int header_len = snprintf(header, sizeof(header), "P6\n%d %d\n255\n", width, height);
 	assert(header_len <= (int)sizeof(header));
 
-	size_t len = header_len + width * height * 3;
-	unsigned char *data = malloc(len);
-	unsigned char *buffer = data;
-
-	// We _do_not_ include the null byte
-	memcpy(buffer, header, header_len);
-	buffer += header_len;
-
 	pixman_format_code_t format = pixman_image_get_format(image);
 	assert(format == PIXMAN_a8r8g8b8 || format == PIXMAN_x8r8g8b8);
 
-	// Both formats are native-endian 32-bit ints
-	uint32_t *pixels = pixman_image_get_data(image);
-	for (int y = 0; y < height; y++) {
-		for (int x = 0; x < width; x++) {
-			uint32_t p = *pixels++;
-			// RGB order
-			*buffer++ = (p >> 16) & 0xff;
-			*buffer++ = (p >>  8) & 0xff;
-			*buffer++ = (p >>  0) & 0xff;
-		}
+	// Whole rows at a time, however wide they are
+	size_t row_len = (size_t)width * 3;
+	size_t chunk_size = row_len > PPM_CHUNK_SIZE ? row_len : PPM_CHUNK_SIZE;
+	unsigned char *chunk = malloc(chunk_size);
+	if (chunk == NULL) {
+		fprintf(stderr, "failed to allocate ppm buffer\n");
+		return -1;
 	}
 
-	size_t written = fwrite(data, 1, len, stream);
-	if (written < len) {
-		free(data);
-		fprintf(stderr, "Failed to write ppm; only %zu of %zu bytes written\n",
-			written, len);
+	// We _do_not_ include the null byte
+	if (!write_chunk(stream, (unsigned char *)header, header_len)) {
+		free(chunk);
 		return -1;
 	}
-	free(data);
-	return 0;
+
+	// Both formats are native-endian 32-bit ints. Rows may be padded when
+	// the image wraps a capture buffer, see render()
+	const unsigned char *pixels =
+		(const unsigned char *)pixman_image_get_data(image);
+	int stride = pixman_image_get_stride(image);
+	size_t len = 0;
+	for (int y = 0; y < height; y++) {
+		// Rows may still be rendered, see render.h
+		if (!wait_render_job_rows(job, y + 1)) {
+			free(chunk);
+			return -1;
+		}
+		if (len + row_len > chunk_size) {
+			if (!write_chunk(stream, chunk, len)) {
+				free(chunk);
+				return -1;
+			}
+			len = 0;
+		}
+		const uint32_t *row = (const uint32_t *)(pixels + (size_t)y * stride);
+		// RGB order, alpha is dropped
+		pack_row32(chunk + len, row, width, true);
+		len += row_len;
+	}
+
+	bool ok = write_chunk(stream, chunk, len);
+	free(chunk);
+	return ok ? 0 : -1;
 }
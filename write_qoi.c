@@ -0,0 +1,374 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pack.h"
+#include "thread.h"
+#include "write_qoi.h"
+
+/*
+ * Encoder for the Quite OK Image format, see <https://qoiformat.org/>.
+ */
+
+#define QOI_OP_INDEX 0x00
+#define QOI_OP_DIFF 0x40
+#define QOI_OP_LUMA 0x80
+#define QOI_OP_RUN 0xc0
+#define QOI_OP_RGB 0xfe
+#define QOI_OP_RGBA 0xff
+
+#define QOI_HEADER_SIZE 14
+#define QOI_MAX_RUN 62
+// Largest chunk, QOI_OP_RGBA
+#define QOI_MAX_PIXEL_SIZE 5
+
+// Encoded rows are written out in chunks of about this size
+#define QOI_CHUNK_SIZE (256 * 1024)
+// With several threads, the image is encoded in strips of about this many
+// pixels, each on its own thread
+#define QOI_STRIP_PIXELS (512 * 1024)
+// Strips encoded before being written out, per thread
+#define QOI_STRIPS_PER_THREAD 2
+
+static const uint8_t qoi_end_marker[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+
+struct qoi_state {
+	// Previously seen pixels, as R, G, B, A from the low byte up
+	uint32_t index[64];
+	// Bitmask of the index entries which are the same as the decoder's
+	uint64_t known;
+	uint32_t prev;
+	int run;
+};
+
+static uint32_t qoi_pixel(uint8_t r, uint8_t g, uint8_t b, uint8_t a) {
+	return (uint32_t)r | (uint32_t)g << 8 | (uint32_t)b << 16 |
+		(uint32_t)a << 24;
+}
+
+/**
+ * Initialize the state to encode pixels following prev. At the start of the
+ * image, the decoder's index is all zeroes, otherwise it is left unknown.
+ */
+static void init_qoi_state(struct qoi_state *state, uint32_t prev, bool start) {
+	memset(state->index, 0, sizeof(state->index));
+	state->known = start ? UINT64_MAX : 0;
+	state->prev = prev;
+	state->run = 0;
+}
+
+static uint8_t *flush_run(struct qoi_state *state, uint8_t *out) {
+	if (state->run > 0) {
+		*out++ = QOI_OP_RUN | (state->run - 1);
+		state->run = 0;
+	}
+	return out;
+}
+
+/**
+ * Encode a row of RGB or RGBA bytes, made by pack_row32(). Writes at most
+ * width * QOI_MAX_PIXEL_SIZE bytes, and returns the end of the output.
+ */
+static inline uint8_t *encode_row(struct qoi_state *state, uint8_t *out,
+		const uint8_t *row, size_t width, int channels) {
+	uint32_t prev = state->prev;
+	int run = state->run;
+	for (size_t x = 0; x < width; x++, row += channels) {
+		uint8_t r = row[0], g = row[1], b = row[2];
+		uint8_t a = channels == 4 ? row[3] : 0xff;
+		uint32_t px = qoi_pixel(r, g, b, a);
+
+		if (px == prev) {
+			run++;
+			if (run == QOI_MAX_RUN) {
+				*out++ = QOI_OP_RUN | (run - 1);
+				run = 0;
+			}
+			continue;
+		}
+		if (run > 0) {
+			*out++ = QOI_OP_RUN | (run - 1);
+			run = 0;
+		}
+
+		int hash = (r * 3 + g * 5 + b * 7 + a * 11) % 64;
+		uint64_t bit = (uint64_t)1 << hash;
+		if ((state->known & bit) && state->index[hash] == px) {
+			*out++ = QOI_OP_INDEX | hash;
+			prev = px;
+			continue;
+		}
+		state->index[hash] = px;
+		state->known |= bit;
+
+		uint8_t prev_a = prev >> 24;
+		if (a != prev_a) {
+			*out++ = QOI_OP_RGBA;
+			*out++ = r;
+			*out++ = g;
+			*out++ = b;
+			*out++ = a;
+			prev = px;
+			continue;
+		}
+
+		int8_t vr = (int8_t)(r - (uint8_t)prev);
+		int8_t vg = (int8_t)(g - (uint8_t)(prev >> 8));
+		int8_t vb = (int8_t)(b - (uint8_t)(prev >> 16));
+		int8_t vg_r = vr - vg;
+		int8_t vg_b = vb - vg;
+		if (vr >= -2 && vr <= 1 && vg >= -2 && vg <= 1 &&
+				vb >= -2 && vb <= 1) {
+			*out++ = QOI_OP_DIFF | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2);
+		} else if (vg_r >= -8 && vg_r <= 7 && vg >= -32 && vg <= 31 &&
+				vg_b >= -8 && vg_b <= 7) {
+			*out++ = QOI_OP_LUMA | (vg + 32);
+			*out++ = (vg_r + 8) << 4 | (vg_b + 8);
+		} else {
+			*out++ = QOI_OP_RGB;
+			*out++ = r;
+			*out++ = g;
+			*out++ = b;
+		}
+		prev = px;
+	}
+	state->prev = prev;
+	state->run = run;
+	return out;
+}
+
+struct qoi_image {
+	const unsigned char *data;
+	int width, height, stride;
+	bool fully_opaque;
+};
+
+static uint8_t *encode_image_row(struct qoi_state *state, uint8_t *out,
+		uint8_t *packed, const struct qoi_image *image, int y) {
+	const uint32_t *row =
+		(const uint32_t *)(image->data + (size_t)y * image->stride);
+	pack_row32(packed, row, image->width, image->fully_opaque);
+	// Separate calls, so that the channel count is a constant in each
+	if (image->fully_opaque) {
+		return encode_row(state, out, packed, image->width, 3);
+	}
+	return encode_row(state, out, packed, image->width, 4);
+}
+
+static bool write_data(FILE *stream, const uint8_t *data, size_t len) {
+	size_t written = fwrite(data, 1, len, stream);
+	if (written < len) {
+		fprintf(stderr, "Failed to write qoi; only %zu of %zu bytes written\n",
+			written, len);
+		return false;
+	}
+	return true;
+}
+
+static int write_qoi_serial(const struct qoi_image *image, FILE *stream,
+		struct grim_render_job *job) {
+	// A run carried over from the previous row ends with a byte of its own
+	size_t max_row_len = (size_t)image->width * QOI_MAX_PIXEL_SIZE + 1;
+	size_t max_end_len = 1 + sizeof(qoi_end_marker);
+	size_t chunk_size = QOI_CHUNK_SIZE;
+	if (chunk_size < max_row_len + max_end_len) {
+		chunk_size = max_row_len + max_end_len;
+	}
+	uint8_t *chunk = malloc(chunk_size);
+	uint8_t *packed = malloc((size_t)image->width * 4);
+	if (chunk == NULL || packed == NULL) {
+		fprintf(stderr, "failed to allocate qoi buffers\n");
+		free(chunk);
+		free(packed);
+		return -1;
+	}
+
+	struct qoi_state state;
+	init_qoi_state(&state, qoi_pixel(0, 0, 0, 0xff), true);
+	uint8_t *out = chunk;
+	bool ok = true;
+	for (int y = 0; ok && y < image->height; y++) {
+		// Rows may still be rendered, see render.h
+		if (!wait_render_job_rows(job, y + 1)) {
+			ok = false;
+			break;
+		}
+		if ((size_t)(out - chunk) + max_row_len > chunk_size) {
+			ok = write_data(stream, chunk, out - chunk);
+			out = chunk;
+		}
+		out = encode_image_row(&state, out, packed, image, y);
+	}
+	if (ok && (size_t)(out - chunk) + max_end_len > chunk_size) {
+		ok = write_data(stream, chunk, out - chunk);
+		out = chunk;
+	}
+	if (ok) {
+		out = flush_run(&state, out);
+		memcpy(out, qoi_end_marker, sizeof(qoi_end_marker));
+		out += sizeof(qoi_end_marker);
+		ok = write_data(stream, chunk, out - chunk);
+	}
+
+	free(chunk);
+	free(packed);
+	return ok ? 0 : -1;
+}
+
+struct qoi_strip {
+	const struct qoi_image *image;
+	int y1, y2;
+
+	uint8_t *out;
+	size_t out_len;
+};
+
+static void encode_strip(void *data) {
+	struct qoi_strip *strip = data;
+	const struct qoi_image *image = strip->image;
+
+	size_t max_len = (size_t)(strip->y2 - strip->y1) * image->width *
+		QOI_MAX_PIXEL_SIZE + 1;
+	strip->out = malloc(max_len);
+	uint8_t *packed = malloc((size_t)image->width * 4);
+	if (strip->out == NULL || packed == NULL) {
+		free(strip->out);
+		strip->out = NULL;
+		free(packed);
+		return;
+	}
+
+	// The decoder's last pixel is known, but not the rest of its index
+	struct qoi_state state;
+	if (strip->y1 == 0) {
+		init_qoi_state(&state, qoi_pixel(0, 0, 0, 0xff), true);
+	} else {
+		const uint32_t *row = (const uint32_t *)(image->data +
+			(size_t)(strip->y1 - 1) * image->stride);
+		uint8_t last[4];
+		pack_row32(last, &row[image->width - 1], 1, image->fully_opaque);
+		init_qoi_state(&state, qoi_pixel(last[0], last[1], last[2],
+			image->fully_opaque ? 0xff : last[3]), false);
+	}
+
+	uint8_t *out = strip->out;
+	for (int y = strip->y1; y < strip->y2; y++) {
+		out = encode_image_row(&state, out, packed, image, y);
+	}
+	out = flush_run(&state, out);
+	strip->out_len = out - strip->out;
+	free(packed);
+}
+
+static int write_qoi_strips(struct qoi_strip *strips, int n_strips,
+		FILE *stream, struct grim_thread_pool *pool,
+		struct grim_render_job *job) {
+	// Bound the memory used by encoded strips waiting to be written
+	int batch_size = get_thread_pool_size(pool) * QOI_STRIPS_PER_THREAD;
+	bool ok = true;
+	struct grim_task_group group;
+	init_task_group(&group, pool);
+	for (int start = 0; ok && start < n_strips; start += batch_size) {
+		int end = start + batch_size;
+		if (end > n_strips) {
+			end = n_strips;
+		}
+
+		int n_queued = start;
+		for (; n_queued < end; n_queued++) {
+			if (!wait_render_job_rows(job, strips[n_queued].y2)) {
+				ok = false;
+				break;
+			}
+			task_group_add(&group, encode_strip, &strips[n_queued]);
+		}
+		task_group_wait(&group);
+
+		for (int i = start; i < n_queued; i++) {
+			if (ok && strips[i].out == NULL) {
+				fprintf(stderr, "failed to allocate qoi strip\n");
+				ok = false;
+			}
+			ok = ok && write_data(stream, strips[i].out, strips[i].out_len);
+			free(strips[i].out);
+			strips[i].out = NULL;
+		}
+	}
+	finish_task_group(&group);
+	return ok ? 0 : -1;
+}
+
+int write_to_qoi_stream(pixman_image_t *image, FILE *stream,
+		struct grim_thread_pool *pool, struct grim_render_job *job) {
+	pixman_format_code_t format = pixman_image_get_format(image);
+	assert(format == PIXMAN_a8r8g8b8 || format == PIXMAN_x8r8g8b8);
+
+	struct qoi_image qoi = {
+		.data = (const unsigned char *)pixman_image_get_data(image),
+		.width = pixman_image_get_width(image),
+		.height = pixman_image_get_height(image),
+		.stride = pixman_image_get_stride(image),
+		.fully_opaque = true,
+	};
+
+	// render() makes the image x8r8g8b8 when it knows it to be opaque.
+	// Otherwise, look for a translucent pixel, a whole row at a time.
+	if (format == PIXMAN_a8r8g8b8) {
+		for (int y = 0; qoi.fully_opaque && y < qoi.height; y++) {
+			// Rows may still be rendered, see render.h
+			if (!wait_render_job_rows(job, y + 1)) {
+				return -1;
+			}
+			const uint32_t *row =
+				(const uint32_t *)(qoi.data + (size_t)y * qoi.stride);
+			uint32_t alpha = 0xff000000;
+			for (int x = 0; x < qoi.width; x++) {
+				alpha &= row[x];
+			}
+			qoi.fully_opaque = alpha == 0xff000000;
+		}
+	}
+
+	uint8_t header[QOI_HEADER_SIZE] = {
+		'q', 'o', 'i', 'f',
+		qoi.width >> 24, qoi.width >> 16, qoi.width >> 8, qoi.width,
+		qoi.height >> 24, qoi.height >> 16, qoi.height >> 8, qoi.height,
+		qoi.fully_opaque ? 3 : 4,
+		0, // sRGB with linear alpha
+	};
+	if (!write_data(stream, header, sizeof(header))) {
+		return -1;
+	}
+
+	int strip_height = QOI_STRIP_PIXELS / (qoi.width > 0 ? qoi.width : 1);
+	if (strip_height < 1) {
+		strip_height = 1;
+	}
+	int n_strips = (qoi.height + strip_height - 1) / strip_height;
+	if (get_thread_pool_size(pool) == 1 || n_strips < 2) {
+		return write_qoi_serial(&qoi, stream, job);
+	}
+
+	struct qoi_strip *strips = calloc(n_strips, sizeof(*strips));
+	if (strips == NULL) {
+		fprintf(stderr, "failed to allocate qoi strips\n");
+		return -1;
+	}
+	for (int i = 0; i < n_strips; i++) {
+		strips[i] = (struct qoi_strip){
+			.image = &qoi,
+			.y1 = i * strip_height,
+			.y2 = i == n_strips - 1 ? qoi.height : (i + 1) * strip_height,
+		};
+	}
+	int ret = write_qoi_strips(strips, n_strips, stream, pool, job);
+	free(strips);
+	if (ret == 0 && !write_data(stream, qoi_end_marker,
+			sizeof(qoi_end_marker))) {
+		ret = -1;
+	}
+	return ret;
+}
@@ -0,0 +1,247 @@
+#define _GNU_SOURCE // vmsplice, copy_file_range
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <wayland-client.h>
+
+#include "buffer.h"
+#include "write_raw.h"
+
+// Rows are handed to the kernel in blocks of about this size
+#define RAW_BLOCK_SIZE (256 * 1024)
+// Separate pieces of memory in a block, at most
+#define RAW_MAX_IOV 64
+
+enum raw_method {
+	RAW_WRITE,
+	// Map the pages into the pipe, see vmsplice(2)
+	RAW_VMSPLICE,
+};
+
+struct raw_image {
+	const unsigned char *data;
+	int height;
+	// Bytes between rows in memory, and bytes per row in the file
+	size_t stride, row_len;
+};
+
+static uint32_t get_shm_format(pixman_format_code_t format) {
+#if GRIM_LITTLE_ENDIAN
+	return format == PIXMAN_a8r8g8b8 ?
+		WL_SHM_FORMAT_ARGB8888 : WL_SHM_FORMAT_XRGB8888;
+#else
+	return format == PIXMAN_a8r8g8b8 ?
+		WL_SHM_FORMAT_BGRA8888 : WL_SHM_FORMAT_BGRX8888;
+#endif
+}
+
+static void print_write_error(void) {
+	fprintf(stderr, "Failed to write raw image: %s\n", strerror(errno));
+}
+
+static bool write_all(int fd, const void *data, size_t len) {
+	const unsigned char *p = data;
+	while (len > 0) {
+		ssize_t n = write(fd, p, len);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		} else if (n < 0) {
+			print_write_error();
+			return false;
+		}
+		p += n;
+		len -= n;
+	}
+	return true;
+}
+
+static bool write_iov(int fd, struct iovec *iov, int n_iov,
+		enum raw_method *method) {
+	while (n_iov > 0) {
+		ssize_t n;
+#if HAVE_VMSPLICE
+		if (*method == RAW_VMSPLICE) {
+			n = vmsplice(fd, iov, n_iov, 0);
+			if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+				// Not a pipe after all, nothing was written
+				*method = RAW_WRITE;
+				continue;
+			}
+		} else
+#endif
+		{
+			n = writev(fd, iov, n_iov);
+		}
+		if (n < 0 && errno == EINTR) {
+			continue;
+		} else if (n < 0) {
+			print_write_error();
+			return false;
+		}
+
+		for (; n_iov > 0 && (size_t)n >= iov->iov_len; iov++, n_iov--) {
+			n -= iov->iov_len;
+		}
+		if (n_iov > 0) {
+			iov->iov_base = (unsigned char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	return true;
+}
+
+/**
+ * Write the rows, straight from the image's memory. Rows which are contiguous
+ * in the file and in memory are handed over together.
+ */
+static bool write_rows(int fd, const struct raw_image *raw,
+		enum raw_method method, struct grim_render_job *job) {
+	struct iovec iov[RAW_MAX_IOV];
+	int y = 0;
+	while (y < raw->height) {
+		int n_iov = 0;
+		size_t len = 0;
+		for (; y < raw->height && len < RAW_BLOCK_SIZE; y++) {
+			unsigned char *row = (unsigned char *)raw->data +
+				(size_t)y * raw->stride;
+			struct iovec *last = n_iov > 0 ? &iov[n_iov - 1] : NULL;
+			if (last != NULL &&
+					(unsigned char *)last->iov_base + last->iov_len == row) {
+				last->iov_len += raw->row_len;
+			} else if (n_iov < RAW_MAX_IOV) {
+				iov[n_iov++] = (struct iovec){
+					.iov_base = row,
+					.iov_len = raw->row_len,
+				};
+			} else {
+				break;
+			}
+			len += raw->row_len;
+		}
+
+		// Rows may still be rendered, see render.h
+		if (!wait_render_job_rows(job, y)) {
+			return false;
+		}
+		if (!write_iov(fd, iov, n_iov, &method)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+#if HAVE_COPY_FILE_RANGE
+/**
+ * Copy the rows from the file backing the capture buffer, within the kernel.
+ * Returns the number of bytes copied, which may fall short of len if the
+ * files don't support it.
+ */
+static ssize_t copy_rows(int fd, int shm_fd, off_t offset, size_t len) {
+	size_t copied = 0;
+	while (copied < len) {
+		ssize_t n = copy_file_range(shm_fd, &offset, fd, NULL, len - copied, 0);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		} else if (n < 0 && (errno == EXDEV || errno == EINVAL ||
+				errno == ENOSYS || errno == EOPNOTSUPP)) {
+			break;
+		} else if (n < 0) {
+			print_write_error();
+			return -1;
+		} else if (n == 0) {
+			break;
+		}
+		copied += n;
+	}
+	return copied;
+}
+#endif
+
+int write_to_raw_stream(pixman_image_t *image, FILE *stream,
+		struct grim_buffer_pool *buffer_pool, bool splice,
+		struct grim_render_job *job) {
+	pixman_format_code_t format = pixman_image_get_format(image);
+	assert(format == PIXMAN_a8r8g8b8 || format == PIXMAN_x8r8g8b8);
+
+	int width = pixman_image_get_width(image);
+	struct raw_image raw = {
+		.data = (const unsigned char *)pixman_image_get_data(image),
+		.height = pixman_image_get_height(image),
+		.stride = pixman_image_get_stride(image),
+		.row_len = (size_t)width * 4,
+	};
+
+	// An image wrapping a whole capture buffer keeps its stride. The rows of
+	// one wrapping part of a buffer are cut to size, so that nothing outside
+	// of the captured area ends up in the file.
+	struct grim_buffer *buffer = find_buffer(buffer_pool, raw.data);
+	if (buffer != NULL && raw.data == buffer->data &&
+			width == buffer->width) {
+		raw.row_len = raw.stride;
+	}
+
+	uint32_t fields[GRIM_RAW_HEADER_SIZE / 4] = {
+		[GRIM_RAW_FIELD_MAGIC] = GRIM_RAW_MAGIC,
+		[GRIM_RAW_FIELD_HEADER_SIZE] = GRIM_RAW_HEADER_SIZE,
+		[GRIM_RAW_FIELD_WIDTH] = width,
+		[GRIM_RAW_FIELD_HEIGHT] = raw.height,
+		[GRIM_RAW_FIELD_STRIDE] = raw.row_len,
+		[GRIM_RAW_FIELD_FORMAT] = get_shm_format(format),
+		[GRIM_RAW_FIELD_FLAGS] =
+			format == PIXMAN_a8r8g8b8 ? GRIM_RAW_PREMULTIPLIED : 0,
+	};
+	unsigned char header[GRIM_RAW_HEADER_SIZE];
+	for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+		header[4 * i + 0] = fields[i];
+		header[4 * i + 1] = fields[i] >> 8;
+		header[4 * i + 2] = fields[i] >> 16;
+		header[4 * i + 3] = fields[i] >> 24;
+	}
+
+	// Everything else bypasses the stream
+	if (fflush(stream) != 0) {
+		print_write_error();
+		return -1;
+	}
+	int fd = fileno(stream);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		print_write_error();
+		return -1;
+	}
+	if (!write_all(fd, header, sizeof(header))) {
+		return -1;
+	}
+
+	enum raw_method method = RAW_WRITE;
+	if (buffer != NULL && splice && S_ISFIFO(st.st_mode)) {
+		method = RAW_VMSPLICE;
+	}
+
+#if HAVE_COPY_FILE_RANGE
+	if (buffer != NULL && S_ISREG(st.st_mode) &&
+			raw.row_len == raw.stride) {
+		size_t len = raw.stride * raw.height;
+		off_t offset = buffer->offset + (raw.data -
+			(const unsigned char *)buffer->data);
+		int src_fd = buffer->dmabuf ? buffer->memfd : buffer_pool->fd;
+		ssize_t copied = copy_rows(fd, src_fd, offset, len);
+		if (copied < 0) {
+			return -1;
+		}
+		// Write what is left from the mapping instead
+		return write_all(fd, raw.data + copied, len - copied) ? 0 : -1;
+	}
+#endif
+
+	return write_rows(fd, &raw, method, job) ? 0 : -1;
+}